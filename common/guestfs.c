@@ -1,5 +1,6 @@
 #include "guestfs.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -144,6 +145,64 @@ err_created:
 	return NULL;
 }
 
+struct guestfs_pool_launch {
+	const char *image;
+	guestfs_h *guestfs;
+	pthread_t thread;
+	bool started;
+};
+
+static void *guestfs_pool_launch(void *arg) {
+	struct guestfs_pool_launch *launch = arg;
+	launch->guestfs = create_guestfs_mount_first_linux(launch->image, NULL);
+	return NULL;
+}
+
+// len handles to image, launched in parallel
+guestfs_h **create_guestfs_pool_mount_first_linux(const char *image, int len) {
+	struct guestfs_pool_launch *launches = calloc(len,
+		sizeof(struct guestfs_pool_launch));
+	guestfs_h **result = calloc(len, sizeof(guestfs_h *));
+	if (!launches || !result) {
+		free(launches);
+		free(result);
+		return NULL;
+	}
+	for (int i = 0; i < len; i++) {
+		launches[i].image = image;
+		launches[i].started = !pthread_create(&launches[i].thread, NULL,
+			guestfs_pool_launch, &launches[i]);
+		if (!launches[i].started) {
+			guestfs_pool_launch(&launches[i]);
+		}
+	}
+	bool failed = false;
+	for (int i = 0; i < len; i++) {
+		if (launches[i].started) {
+			pthread_join(launches[i].thread, NULL);
+		}
+		result[i] = launches[i].guestfs;
+		failed |= !result[i];
+	}
+	free(launches);
+	if (failed) {
+		destroy_guestfs_pool(result, len);
+		return NULL;
+	}
+	return result;
+}
+
+void destroy_guestfs_pool(guestfs_h **pool, int len) {
+	for (int i = 0; i < len; i++) {
+		if (pool[i]) {
+			guestfs_umount_all(pool[i]);
+			guestfs_shutdown(pool[i]);
+			guestfs_close(pool[i]);
+		}
+	}
+	free(pool);
+}
+
 guestfs_h *create_qcow2_btrfs_image(const char *path, size_t size) {
 	guestfs_h *guestfs = guestfs_create();
 	if (!guestfs) {
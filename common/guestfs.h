@@ -5,6 +5,8 @@
 
 guestfs_h *create_guestfs_mount_first_linux(const char *image,
 	char ***succeeded_mounts);
+guestfs_h **create_guestfs_pool_mount_first_linux(const char *image, int len);
+void destroy_guestfs_pool(guestfs_h **pool, int len);
 guestfs_h *create_qcow2_btrfs_image(const char *path, size_t size);
 
 #endif
@@ -1,13 +1,29 @@
 #ifndef ARCHIVE_UTILS_H
 #define ARCHIVE_UTILS_H
 
-#include <archive_entry.h>
+#include <stdint.h>
+#include <sys/types.h>
 
-struct archive *archive_from_fd_and_seek(int fd, const char *name,
-	struct archive_entry **entry);
+#define TAR_BLOCK_SIZE	512
+
+struct archive_blob {
+	off_t offset;
+	size_t size;
+};
+
+int archive_blob_lookup(int fd, const char *name, struct archive_blob *blob);
+
+// drop the index of fd, before it is closed
+void archive_blob_forget(int fd);
+
+ssize_t archive_blob_pread(int fd, const struct archive_blob *blob,
+	void *buf, size_t count, size_t offset);
 
 struct json_object *json_from_archive(int fd, const char *name);
 
 char *digest_to_name(const char *digest);
 
+// numeric field of a tar header, octal or base-256
+int64_t tar_parse_number(const char *field, size_t len);
+
 #endif
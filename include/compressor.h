@@ -1,11 +1,44 @@
 #ifndef COMPRESSOR_H
 #define COMPRESSOR_H
 
+#include <stddef.h>
+#include <sys/types.h>
+
 enum compression {
 	COMPRESSION_ZSTD,
 	COMPRESSION_GZIP,
+	// zstd with frames ended on compressor_end_frame
+	COMPRESSION_ZSTD_FRAMES,
 };
 
-int compress(int fd_in, int fd_out, enum compression compression, int level);
+struct compressor;
+
+// compressed output, returns len or -1 with errno set
+typedef ssize_t compressor_write_callback(void *client_data,
+	const void *buf, size_t len);
+
+/*
+ * Stream compressor with output passed to write_cb with client_data.
+ * zstd uses its own workers and gzip is compressed in blocks by threads
+ * workers, at least one. Output only depends on the input and level, not
+ * on threads.
+ */
+struct compressor *compressor_open(enum compression compression, int level,
+	int threads, void *client_data, compressor_write_callback *write_cb);
+
+int compressor_write(struct compressor *compressor, const void *buf, size_t len);
+
+/*
+ * COMPRESSION_ZSTD_FRAMES only: end the current frame, so that all input
+ * so far is output and the next input starts a new one.
+ */
+int compressor_end_frame(struct compressor *compressor);
+
+// flush and end the stream
+int compressor_close(struct compressor *compressor);
+
+const char *compressor_error_string(struct compressor *compressor);
+
+void compressor_free(struct compressor *compressor);
 
 #endif
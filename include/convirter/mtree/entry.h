@@ -2,14 +2,32 @@
 #define CVIRT_MTREE_ENTRY_H
 
 #include <sys/stat.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <guestfs.h>
 
+#include <convirter/oci-r/config.h>
 #include <convirter/oci-r/layer.h>
 
+/*
+ * Subset of struct stat kept in trees, members are named as in struct stat
+ * so st_mtime and friends work as usual.
+ */
+struct cvirt_mtree_stat {
+	mode_t st_mode;
+	uid_t st_uid;
+	gid_t st_gid;
+	uint32_t st_nlink; // links within the tree
+	off_t st_size;
+	dev_t st_rdev;
+	struct timespec st_atim;
+	struct timespec st_mtim;
+	struct timespec st_ctim;
+};
+
 struct cvirt_mtree_inode {
-	struct stat stat;
+	struct cvirt_mtree_stat stat;
 
 	struct cvirt_mtree_xattr *xattrs;
 	unsigned int xattrs_len;
@@ -37,14 +55,49 @@ struct cvirt_mtree_entry {
 enum cvirt_mtree_tree_flags {
 	CVIRT_MTREE_TREE_CHECKSUM = 1 << 0,
 	CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS = 1 << 1,
+	// allocate nodes from a tree-owned arena, freed at once on destroy
+	CVIRT_MTREE_TREE_ARENA = 1 << 2,
+	// with CVIRT_MTREE_TREE_CHECKSUM, hash files inside the appliance in bulk
+	CVIRT_MTREE_TREE_GUESTFS_CHECKSUM_IN_APPLIANCE = 1 << 3,
+	// list everything with one find0, then stat in large batches
+	CVIRT_MTREE_TREE_GUESTFS_BULK_SCAN = 1 << 4,
 };
 
 struct cvirt_mtree_entry *cvirt_mtree_tree_from_guestfs(guestfs_h *guestfs, uint32_t flags);
 
+/*
+ * Walk with len handles to read-only appliances of the same disk,
+ * mounted the same way, one thread each.
+ */
+struct cvirt_mtree_entry *cvirt_mtree_tree_from_guestfs_pool(guestfs_h **guestfs,
+	int len, uint32_t flags);
+
 struct cvirt_mtree_entry *cvirt_mtree_tree_from_oci_layer(struct cvirt_oci_r_layer *layer, uint32_t flags);
 
 int cvirt_mtree_tree_oci_apply_layer(struct cvirt_mtree_entry *root, struct cvirt_oci_r_layer *layer, uint32_t flags);
 
+void cvirt_mtree_tree_sort(struct cvirt_mtree_entry *tree);
+
+// whether children are sorted by name, with strcmp, throughout the tree
+bool cvirt_mtree_tree_is_sorted(struct cvirt_mtree_entry *tree);
+
+uint32_t cvirt_mtree_tree_get_flags(struct cvirt_mtree_entry *tree);
+
+/*
+ * Record the OCI image, by manifest digest and config, tree was built from,
+ * saved along with snapshots.
+ */
+void cvirt_mtree_tree_set_oci_source(struct cvirt_mtree_entry *tree,
+	const char *manifest_digest, struct cvirt_oci_r_config *config);
+
+// whether tree is recorded to be built from exactly this OCI image
+bool cvirt_mtree_tree_is_oci_source(struct cvirt_mtree_entry *tree,
+	const char *manifest_digest, struct cvirt_oci_r_config *config);
+
+int cvirt_mtree_tree_save(struct cvirt_mtree_entry *tree, int fd);
+
+struct cvirt_mtree_entry *cvirt_mtree_tree_load_mmap(const char *path);
+
 void cvirt_mtree_tree_destroy(struct cvirt_mtree_entry *entry);
 
 #endif
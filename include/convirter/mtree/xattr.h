@@ -10,6 +10,10 @@ struct cvirt_mtree_xattr {
 	uint8_t *value;
 };
 
+/*
+ * xattrs of trees are owned by the tree, their strings interned per tree,
+ * and released along with it. Kept for compatibility, does nothing.
+ */
 void cvirt_mtree_xattr_destroy(struct cvirt_mtree_xattr *xattr);
 
 #endif
@@ -13,4 +13,7 @@ const char *cvirt_oci_r_index_get_native_manifest_digest(
 
 void cvirt_oci_r_index_destroy(struct cvirt_oci_r_index *index);
 
+// close fd of an oci-archive, with what was cached about its blobs
+int cvirt_oci_r_archive_close(int fd);
+
 #endif
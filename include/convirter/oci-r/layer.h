@@ -14,6 +14,30 @@ struct cvirt_oci_r_layer *cvirt_oci_r_layer_from_archive_blob(int fd,
 
 struct archive *cvirt_oci_r_layer_get_libarchive(struct cvirt_oci_r_layer *layer);
 
+/*
+ * Decompress large layers with up to threads threads, 0 for one per online
+ * CPU, the default. The layer is rewound.
+ */
+int cvirt_oci_r_layer_set_threads(struct cvirt_oci_r_layer *layer,
+	int threads);
+
+/*
+ * Use the random-access index of the layer in dir, named after the layer
+ * digest. It is built by decompressing the layer once and saved there if
+ * missing or stale.
+ */
+int cvirt_oci_r_layer_use_index(struct cvirt_oci_r_layer *layer,
+	const char *dir);
+
+/*
+ * Reopen the archive with only the entries at path and below, decompressing
+ * from the index checkpoints before them instead of the whole layer. Needs
+ * an index, -ENOENT if path is not in the layer.
+ * cvirt_oci_r_layer_rewind goes back to the whole layer.
+ */
+int cvirt_oci_r_layer_open_path(struct cvirt_oci_r_layer *layer,
+	const char *path);
+
 int cvirt_oci_r_layer_rewind(struct cvirt_oci_r_layer *layer);
 
 void cvirt_oci_r_layer_destroy(struct cvirt_oci_r_layer *layer);
@@ -9,10 +9,16 @@ enum cvirt_oci_layer_compression {
 	CVIRT_OCI_LAYER_COMPRESSION_NONE,
 	CVIRT_OCI_LAYER_COMPRESSION_ZSTD,
 	CVIRT_OCI_LAYER_COMPRESSION_GZIP,
+	// zstd:chunked, a frame for each file content and a TOC
+	CVIRT_OCI_LAYER_COMPRESSION_ZSTD_CHUNKED,
 };
 
+/*
+ * With threads > 1, compress with that many threads, output stays the same
+ * as compressing with one.
+ */
 struct cvirt_oci_layer *cvirt_oci_layer_new(
-	enum cvirt_oci_layer_compression compression, int level);
+	enum cvirt_oci_layer_compression compression, int level, int threads);
 
 struct cvirt_oci_layer *cvirt_oci_layer_from_archive_blob(int fd,
 		const char *digest,
@@ -0,0 +1,53 @@
+#ifndef MTREE_ARENA_H
+#define MTREE_ARENA_H
+
+#include <stddef.h>
+
+struct mtree_arena_chunk {
+	struct mtree_arena_chunk *next;
+	size_t size;
+	size_t used;
+	_Alignas(16) char data[];
+};
+
+#define MTREE_ARENA_ALIGN	16
+// blocks up to this size are recycled by exact (aligned) size
+#define MTREE_ARENA_SMALL_MAX	4096
+// above that, only power-of-two sizes are, like doubling arrays
+#define MTREE_ARENA_CLASSES	(MTREE_ARENA_SMALL_MAX / MTREE_ARENA_ALIGN + 48)
+
+/*
+ * Bump allocator owning all memory of a tree, freed at once with
+ * mtree_arena_destroy. Allocations are zeroed, like calloc.
+ *
+ * Blocks given back with mtree_arena_free, including the old block of a
+ * moving mtree_arena_realloc, go to a free list of their size class and
+ * are handed out again to allocations of the same class. Memory is never
+ * returned to the system before mtree_arena_destroy, and blocks of sizes
+ * without a class (large, not a power of two) stay unused until then. This
+ * keeps whited-out or redeclared nodes and outgrown children arrays from
+ * piling up across layers, without per-block headers.
+ */
+struct mtree_arena {
+	struct mtree_arena_chunk *chunks;
+	// last allocation, can be grown in place
+	void *last;
+	size_t last_size;
+	void *free[MTREE_ARENA_CLASSES];
+};
+
+struct mtree_arena *mtree_arena_new(void);
+
+void *mtree_arena_alloc(struct mtree_arena *arena, size_t size);
+
+void *mtree_arena_realloc(struct mtree_arena *arena, void *ptr,
+	size_t old_size, size_t size);
+
+// size must be the one the block was allocated or last reallocated with
+void mtree_arena_free(struct mtree_arena *arena, void *ptr, size_t size);
+
+char *mtree_arena_strndup(struct mtree_arena *arena, const char *s, size_t n);
+
+void mtree_arena_destroy(struct mtree_arena *arena);
+
+#endif
@@ -1,23 +1,189 @@
 #ifndef MTREE_ENTRY_H
 #define MTREE_ENTRY_H
 
-#include "list.h"
+#include "mtree/arena.h"
+#include "mtree/intern.h"
 
+#include <convirter/mtree/entry.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <gcrypt.h>
 
 #define MTREE_ENTRY_GUESTFS_BUF_LEN	(4000 * 1024)
 
+/*
+ * Name index of a large directory while applying a layer, see find_child.
+ * Children removed meanwhile are left as holes with a NULL name, their slots
+ * act as tombstones, and are compacted once the layer is applied.
+ */
+struct mtree_children_index {
+	const struct cvirt_mtree_inode *inode; // NULL for empty slot
+	unsigned int *slots; // child index + 1, 0 for empty, NULL if dropped
+	unsigned int capacity;
+	unsigned int holes;
+};
+
+/*
+ * Layer application in progress, see apply_layer.
+ * Entries declared by the layer are kept by name pointer: every entry has a
+ * name of its own, and entries created while applying are declared right
+ * away, so a freed name handed out again belongs to a declared entry too.
+ */
+struct mtree_apply {
+	const char **declared; // open addressing, NULL for empty slot
+	size_t declared_capacity;
+	size_t declared_len;
+	// by directory inode, freed along with the rest once applied
+	struct mtree_children_index *indices;
+	size_t indices_capacity;
+	size_t indices_len;
+};
+
+/*
+ * Trees are handed out as pointers to their root entry,
+ * root must stay the first member.
+ */
+struct mtree_tree {
+	struct cvirt_mtree_entry root;
+	struct mtree_arena *arena; // NULL if nodes are malloc-ed
+	// xattr names, and values up to MTREE_XATTR_INTERN_VALUE_MAX
+	struct mtree_intern xattr_strings;
+	uint32_t flags;
+	struct mtree_apply *apply; // NULL unless applying a layer
+	bool sorted; // since the last cvirt_mtree_tree_sort
+	// snapshot backing names, targets and xattrs of a loaded tree
+	void *map;
+	size_t map_len;
+	// nodes of a loaded snapshot, in one block, never recycled
+	void *nodes;
+	size_t nodes_len;
+	// OCI image the tree was built from, NULL if unknown
+	char *source_manifest;
+	char **source_diff_ids;
+	int source_diff_ids_len;
+};
+
+// tree owning a root entry, as handed out by the public API
+static inline struct mtree_tree *mtree_tree_of(struct cvirt_mtree_entry *root) {
+	return (struct mtree_tree *)((char *)root -
+		offsetof(struct mtree_tree, root));
+}
+
+#define MTREE_XATTR_INTERN_VALUE_MAX	256
+
+/*
+ * inode with links still to be seen while walking guestfs
+ *
+ * btrfs subvolumes get anonymous st_dev numbered in the order they are
+ * reached, which differ between appliances of a pool. Those are keyed by
+ * their subvolume root path instead, interned so the pointer is the key.
+ */
+struct io_entry_guestfs_hardlink {
+	const char *subvolume; // NULL unless st_dev is anonymous
+	dev_t dev; // 0 if subvolume is set
+	ino_t ino;
+	struct cvirt_mtree_inode *inode; // NULL for empty slot
+};
+
+// open-addressing table keyed by (subvolume, dev, ino)
+struct io_entry_guestfs_hardlinks {
+	struct io_entry_guestfs_hardlink *slots;
+	size_t capacity;
+	size_t len;
+};
+
 struct io_entry_oci_checksum_ctx {
 	gcry_md_hd_t gcrypt_handle;
 };
 
+struct io_entry_guestfs_pool;
+
 struct io_entry_guestfs_ctx {
-	struct cvirt_list *hardlink_inodes;
-	struct cvirt_list *btrfs_uuids;
+	struct mtree_tree *tree;
+	struct io_entry_guestfs_hardlinks hardlink_inodes;
+	struct mtree_intern btrfs_uuids;
+	// btrfs subvolume root paths, see struct io_entry_guestfs_hardlink
+	struct mtree_intern btrfs_subvolumes;
+	/*
+	 * with BTRFS_SKIP_SNAPSHOTS, subvolume roots reached but not yet
+	 * decided on, see guestfs_walk_subvolumes
+	 */
+	struct io_entry_guestfs_task *subvolumes;
+	size_t subvolumes_len;
+	size_t subvolumes_capacity;
+	// snapshot roots left out with BTRFS_SKIP_SNAPSHOTS, absolute paths
+	char **snapshots;
+	size_t snapshots_len;
+	size_t snapshots_capacity;
+	gcry_md_hd_t gcrypt_handle;
+	uint32_t flags;
+	struct io_entry_guestfs_pool *pool; // NULL when walking a single handle
+	/*
+	 * guards tree, hardlink_inodes, btrfs_uuids, btrfs_subvolumes and
+	 * subvolumes while walking a pool
+	 */
+	pthread_mutex_t lock;
+};
+
+// directory still to be walked
+struct io_entry_guestfs_task {
+	struct cvirt_mtree_entry *entry;
+	char *path;
+	const char *subvolume; // root path of the btrfs subvolume it is in
+};
+
+/*
+ * Owner pushes and pops at the tail, depth-first,
+ * idle walkers steal from the head, closer to the root.
+ * Guarded by the pool lock, which idle walkers wait on.
+ */
+struct io_entry_guestfs_deque {
+	struct io_entry_guestfs_task *tasks;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+};
+
+struct io_entry_guestfs_walker {
+	struct io_entry_guestfs_ctx *ctx;
+	guestfs_h *guestfs;
 	gcry_md_hd_t gcrypt_handle;
 	uint32_t flags;
+	struct io_entry_guestfs_deque *deque; // NULL when walking recursively
+	int id;
+	pthread_t thread;
+};
+
+#define MTREE_ENTRY_GUESTFS_BULK_BATCH_LEN	2048
+#define MTREE_ENTRY_GUESTFS_BULK_BATCH_BYTES	(512 * 1024)
+
+// paths from find0 waiting for their stats, relative to /
+struct io_entry_guestfs_bulk_batch {
+	char *names[MTREE_ENTRY_GUESTFS_BULK_BATCH_LEN + 1];
+	struct {
+		struct cvirt_mtree_inode *parent;
+		unsigned int idx;
+	} items[MTREE_ENTRY_GUESTFS_BULK_BATCH_LEN];
+	int len;
+	size_t bytes;
+	// skipped btrfs snapshot roots, decided before the bulk pass
+	char **subvolumes;
+	size_t subvolumes_len;
+	size_t subvolumes_capacity;
+};
+
+struct io_entry_guestfs_pool {
+	struct io_entry_guestfs_walker *walkers;
+	struct io_entry_guestfs_deque *deques;
+	int len;
+	pthread_mutex_t lock; // also guards deques
+	pthread_cond_t cond;
+	size_t pending; // tasks queued or being walked
 };
 
 #endif
@@ -0,0 +1,36 @@
+#ifndef MTREE_INTERN_H
+#define MTREE_INTERN_H
+
+#include "mtree/arena.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct mtree_intern_slot {
+	uint8_t *data;
+	size_t len;
+	uint32_t hash;
+};
+
+/*
+ * Per-tree set of byte strings, so repeated xattr names and short values
+ * are stored once. Stored copies are NUL-terminated and live until
+ * mtree_intern_fini.
+ */
+struct mtree_intern {
+	struct mtree_intern_slot *slots;
+	size_t capacity;
+	size_t len;
+	struct mtree_arena *arena; // storage, NULL for malloc
+};
+
+void mtree_intern_init(struct mtree_intern *intern, struct mtree_arena *arena);
+
+uint8_t *mtree_intern(struct mtree_intern *intern, const void *data, size_t len);
+
+uint8_t *mtree_intern_lookup(struct mtree_intern *intern, const void *data,
+	size_t len);
+
+void mtree_intern_fini(struct mtree_intern *intern);
+
+#endif
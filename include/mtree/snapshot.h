@@ -0,0 +1,82 @@
+#ifndef MTREE_SNAPSHOT_H
+#define MTREE_SNAPSHOT_H
+
+#include <stdint.h>
+
+/*
+ * On-disk mtree, native byte order:
+ *
+ * header, inode table, xattr table, entry table, string table
+ *
+ * Entries of a directory are a contiguous range of the entry table,
+ * entry 0 is the root. Names, symlink targets, xattr names and values
+ * are offsets into the string table, each followed by a NUL.
+ *
+ * The OCI image the tree was built from, if known, is recorded as its
+ * manifest digest, followed by its diff_ids, as consecutive strings.
+ */
+#define MTREE_SNAPSHOT_MAGIC		"CVMTREE"
+#define MTREE_SNAPSHOT_VERSION		2
+#define MTREE_SNAPSHOT_BYTE_ORDER	0x01020304
+
+#define MTREE_SNAPSHOT_INODE_SORTED	(1 << 0)
+
+#define MTREE_SNAPSHOT_NO_SOURCE	UINT64_MAX
+
+struct mtree_snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t flags; // enum cvirt_mtree_tree_flags the tree was built with
+	uint32_t reserved;
+	uint64_t inodes_offset;
+	uint64_t inodes_count;
+	uint64_t xattrs_offset;
+	uint64_t xattrs_count;
+	uint64_t entries_offset;
+	uint64_t entries_count;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+	uint64_t source_offset; // MTREE_SNAPSHOT_NO_SOURCE if unknown
+	uint64_t source_diff_ids_count;
+};
+
+struct mtree_snapshot_inode {
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t nlink;
+	int64_t size;
+	uint64_t rdev;
+	int64_t atime_sec;
+	int64_t mtime_sec;
+	int64_t ctime_sec;
+	uint32_t atime_nsec;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint32_t inode_flags;
+	uint64_t xattrs_start;
+	uint32_t xattrs_len;
+	uint32_t reserved;
+	union {
+		uint8_t sha256sum[32]; // S_IFREG
+		struct { // S_IFDIR
+			uint64_t children_start;
+			uint64_t children_len;
+		};
+		uint64_t target_offset; // S_IFLNK
+	};
+};
+
+struct mtree_snapshot_xattr {
+	uint64_t name_offset;
+	uint64_t value_offset;
+	uint64_t len;
+};
+
+struct mtree_snapshot_entry {
+	uint64_t name_offset;
+	uint64_t inode;
+};
+
+#endif
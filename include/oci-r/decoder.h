@@ -0,0 +1,28 @@
+#ifndef OCI_R_DECODER_H
+#define OCI_R_DECODER_H
+
+#include "convirter/oci-r/layer.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Decompresses a whole in-memory blob on background threads, output is
+ * read in order. zstd frames and gzip members are decoded in parallel
+ * when the blob has more than one, otherwise decoding is only moved off
+ * the reading thread.
+ */
+struct layer_decoder;
+
+struct layer_decoder *layer_decoder_new(const void *src, size_t len,
+	enum cvirt_oci_r_layer_compression compression, int threads);
+
+/*
+ * Next decoded bytes, valid until the next call, 0 at end or negative
+ * errno on failure.
+ */
+ssize_t layer_decoder_read(struct layer_decoder *decoder, const void **buf);
+
+void layer_decoder_destroy(struct layer_decoder *decoder);
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef OCI_R_LAYER_INDEX_H
+#define OCI_R_LAYER_INDEX_H
+
+#include "convirter/oci-r/layer.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * On-disk random-access index of a layer blob, native byte order:
+ *
+ * header, checkpoint table, entry table, window area, string table
+ *
+ * Checkpoints are sorted by out_offset, decompression may restart at any
+ * of them. For gzip, these are deflate block boundaries, with the bits of
+ * the byte before in_offset still to be fed and the deflate-compressed
+ * 32 KiB window preceding it. For zstd, these are frame starts. Layers
+ * without compression have no checkpoints.
+ *
+ * Entries are sorted by path, with leading "./" and trailing "/" removed,
+ * and cover the uncompressed tar range of the entry, extension headers
+ * and padding included.
+ */
+#define LAYER_INDEX_MAGIC	"CVLINDX"
+#define LAYER_INDEX_VERSION	1
+#define LAYER_INDEX_BYTE_ORDER	0x01020304
+
+// uncompressed distance between gzip checkpoints
+#define LAYER_INDEX_SPAN	(8 * 1024 * 1024)
+#define LAYER_INDEX_WINDOW	32768
+
+struct layer_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t compression; // enum cvirt_oci_r_layer_compression
+	uint32_t reserved;
+	uint64_t blob_size;
+	uint64_t tar_size; // up to the end-of-archive marker
+	uint64_t checkpoints_offset;
+	uint64_t checkpoints_count;
+	uint64_t entries_offset;
+	uint64_t entries_count;
+	uint64_t windows_offset;
+	uint64_t windows_size;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+};
+
+enum layer_index_checkpoint_type {
+	// a gzip member or a zstd frame starts at in_offset
+	LAYER_INDEX_CHECKPOINT_STREAM,
+	// a deflate block starts within the byte before in_offset
+	LAYER_INDEX_CHECKPOINT_BLOCK,
+};
+
+struct layer_index_checkpoint {
+	uint64_t in_offset;
+	uint64_t out_offset;
+	uint64_t window_offset;
+	uint32_t window_len;
+	uint8_t type;
+	uint8_t bits;
+	uint16_t reserved;
+};
+
+struct layer_index_entry {
+	uint64_t path_offset;
+	uint64_t header_offset;
+	uint64_t end_offset;
+};
+
+struct layer_index;
+
+/*
+ * Map the index at path, NULL if missing or not matching layer.
+ */
+struct layer_index *layer_index_load(const char *path,
+	const struct cvirt_oci_r_layer *layer);
+
+/*
+ * Decompress the whole layer once and write its index to fd.
+ */
+int layer_index_build(const struct cvirt_oci_r_layer *layer, int fd);
+
+void layer_index_destroy(struct layer_index *index);
+
+/*
+ * Serves a tar stream of the entries at path and below, decompressing
+ * only from the checkpoints before them. NULL if there is no such entry.
+ */
+struct layer_index_reader;
+
+struct layer_index_reader *layer_index_reader_new(
+	const struct cvirt_oci_r_layer *layer, const struct layer_index *index,
+	const char *path);
+
+/*
+ * Next bytes, valid until the next call, 0 at end or negative errno on
+ * failure.
+ */
+ssize_t layer_index_reader_read(struct layer_index_reader *reader,
+	const void **buf);
+
+void layer_index_reader_destroy(struct layer_index_reader *reader);
+
+#endif
@@ -1,15 +1,34 @@
 #ifndef OCI_R_LAYER_H
 #define OCI_R_LAYER_H
 
-#define BUFSZ	(4 * 1024)
+#include "archive-utils.h"
+
+// read window for layers that cannot be mapped
+#define BUFSZ	(1024 * 1024)
+// mapped layers from this size on are decompressed with a layer_decoder
+#define DECODER_MIN_SIZE	(16 * 1024 * 1024)
 
 struct cvirt_oci_r_layer {
-	struct archive *image_archive;
 	struct archive *layer_archive;
-	char buf[BUFSZ];
 	int fd;
-	char *name;
+	struct archive_blob blob;
+	size_t pos;
 	enum cvirt_oci_r_layer_compression compression;
+
+	// whole blob mapped, with map_offset being the blob start within map
+	void *map;
+	size_t map_len;
+	size_t map_offset;
+
+	char *buf;
+
+	struct layer_decoder *decoder;
+	int decoder_threads; // 0 for one per online CPU
+
+	char *digest;
+	struct layer_index *index;
+	// entries of a path only, from cvirt_oci_r_layer_open_path
+	struct layer_index_reader *index_reader;
 };
 
 #endif
@@ -1,6 +1,8 @@
 #ifndef OCI_BLOB_H
 #define OCI_BLOB_H
 
+#include "archive-utils.h"
+
 #include <stdbool.h>
 #include <json-c/json_tokener.h>
 
@@ -16,7 +18,10 @@ struct cvirt_oci_blob {
 	union {
 		char *path;
 		const char *content;
-		struct archive *from_archive;
+		struct {
+			int from_fd;
+			struct archive_blob from_blob;
+		};
 	};
 
 	size_t size;
@@ -29,6 +34,9 @@ struct cvirt_oci_blob {
 		char *sha256;
 		char *digest;
 	};
+
+	// owned reference, NULL if none
+	struct json_object *annotations;
 };
 
 struct json_object *descriptor_from_oci_blob(struct cvirt_oci_blob *blob);
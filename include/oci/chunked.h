@@ -0,0 +1,41 @@
+#ifndef OCI_CHUNKED_H
+#define OCI_CHUNKED_H
+
+#include "compressor.h"
+
+#include <stddef.h>
+
+/*
+ * zstd:chunked layers: contents of regular files are zstd frames of their
+ * own, followed by a skippable frame with a TOC locating them and a footer
+ * skippable frame locating the TOC. Decompressors skip both, so it is
+ * still a tar+zstd layer.
+ */
+#define CHUNKED_MANIFEST_CHECKSUM_ANNOTATION \
+	"io.github.containers.zstd-chunked.manifest-checksum"
+#define CHUNKED_MANIFEST_POSITION_ANNOTATION \
+	"io.github.containers.zstd-chunked.manifest-position"
+
+struct chunked_writer;
+
+/*
+ * Follows the tar stream on its way to compressor, a COMPRESSION_ZSTD_FRAMES
+ * one, with blob_size being the compressed size so far.
+ */
+struct chunked_writer *chunked_writer_new(struct compressor *compressor,
+	int level, const size_t *blob_size);
+
+int chunked_writer_write(struct chunked_writer *writer, const void *buf,
+	size_t len);
+
+/*
+ * Append the TOC and footer with write_cb after the compressor is closed.
+ * checksum and position are set to values of the annotations.
+ */
+int chunked_writer_close(struct chunked_writer *writer,
+	compressor_write_callback *write_cb, void *client_data,
+	char **checksum, char **position);
+
+void chunked_writer_free(struct chunked_writer *writer);
+
+#endif
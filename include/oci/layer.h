@@ -2,9 +2,12 @@
 #define OCI_LAYER_H
 
 #include "convirter/oci/layer.h"
+#include "archive-utils.h"
 
 #include <stddef.h>
 
+#include <gcrypt.h>
+
 struct cvirt_oci_layer {
 	const char *media_type;
 
@@ -16,16 +19,25 @@ struct cvirt_oci_layer {
 		struct {
 			enum cvirt_oci_layer_compression compression;
 			int compression_level;
-			char *tmp_filename;
-			char *compressed_filename;
+			char *tmp_filename; // compressed blob
 			int fd;
 			struct archive *archive;
+			// tar stream goes through, NULL if uncompressed
+			struct compressor *compressor;
+			// ahead of compressor for zstd:chunked
+			struct chunked_writer *chunked;
+			char *chunked_checksum;
+			char *chunked_position;
+			gcry_md_hd_t diff_id_hash;
+			gcry_md_hd_t blob_hash;
+			size_t blob_size;
 			char *diff_id_sha256;
+			char *blob_sha256;
 		}; // NEW_LAYER
 		struct {
 			char *digest;
-			struct archive *from_archive;
-			size_t size;
+			int from_fd;
+			struct archive_blob from_blob;
 			char *diff_id;
 		}; // EXISTING_BLOB_FROM_ARCHIVE
 	};
@@ -2,9 +2,13 @@
 #define SHA256_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 char *sha256sum_from_file(const char *path);
 
 char *sha256sum_from_mem(const char *buf, size_t sz);
 
+// hex string of a finished 32-byte digest
+char *sha256sum_to_hex(const uint8_t *digest);
+
 #endif
@@ -1,58 +1,351 @@
-#include <archive.h>
-#include <archive_entry.h>
+#include "archive-utils.h"
+#include "xmem.h"
+
 #include <errno.h>
 #include <json_tokener.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-struct archive *archive_from_fd_and_seek(int fd, const char *name,
-		struct archive_entry **entry) {
-	struct archive *res = archive_read_new();
-	if (!res) {
-		goto err;
-	}
-	archive_read_support_format_tar(res);
-	int ret;
-	ret = archive_read_open_fd(res, fd, 4096);
-	if (ret != ARCHIVE_OK) {
-		goto err;
-	}
-	struct archive_entry *mentry;
-	while (archive_read_next_header(res, &mentry) == ARCHIVE_OK) {
-		if (!strcmp(archive_entry_pathname(mentry), name)) {
-			if (entry) {
-				*entry = mentry;
+/*
+ * Blobs of an oci-archive are located by scanning tar headers once per
+ * opened archive, entries are then read directly with pread.
+ * Index is keyed by fd, and invalidated if fd now refers to another file.
+ * Indices are shared by all threads, and dropped by archive_blob_forget
+ * when the archive gets closed.
+ */
+struct blob_index_entry {
+	char *name;
+	struct archive_blob blob;
+};
+
+struct blob_index {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtim;
+
+	struct blob_index_entry *entries;
+	size_t entries_len;
+
+	struct blob_index *next;
+};
+
+static struct blob_index *blob_indices = NULL;
+static pthread_mutex_t blob_indices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int pread_full(int fd, void *buf, size_t count, off_t offset) {
+	size_t done = 0;
+	while (done < count) {
+		ssize_t res = pread(fd, (char *)buf + done, count - done,
+			offset + done);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		} else if (res == 0) {
+			return -EIO;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+int64_t tar_parse_number(const char *field, size_t len) {
+	int64_t res = 0;
+	if (field[0] & 0x80) { // base-256
+		res = field[0] & 0x3f;
+		for (size_t i = 1; i < len; i++) {
+			res = (res << 8) | (uint8_t)field[i];
+		}
+		return res;
+	}
+	size_t i = 0;
+	while (i < len && (field[i] == ' ' || field[i] == '\0')) {
+		i++;
+	}
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+		res = res * 8 + field[i] - '0';
+	}
+	return res;
+}
+
+static bool tar_block_is_zero(const char *block) {
+	for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+		if (block[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// only path and size matters for locating blobs
+static void tar_parse_pax(const char *data, size_t len, char **path,
+		int64_t *size) {
+	size_t pos = 0;
+	while (pos < len) {
+		char *end;
+		long record_len = strtol(&data[pos], &end, 10);
+		if (record_len <= 0 || pos + record_len > len || *end != ' ') {
+			return;
+		}
+		const char *key = end + 1;
+		const char *record_end = &data[pos + record_len - 1]; // '\n'
+		const char *eq = memchr(key, '=', record_end - key);
+		if (eq) {
+			if (eq - key == 4 && !strncmp(key, "path", 4)) {
+				free(*path);
+				*path = cvirt_xstrndup(eq + 1, record_end - eq - 1);
+			} else if (eq - key == 4 && !strncmp(key, "size", 4)) {
+				*size = strtoll(eq + 1, NULL, 10);
 			}
-			return res;
 		}
+		pos += record_len;
+	}
+}
+
+static int blob_index_entry_cmp(const void *a, const void *b) {
+	const struct blob_index_entry *ae = a, *be = b;
+	int res = strcmp(ae->name, be->name);
+	if (res) {
+		return res;
 	}
+	return (ae->blob.offset > be->blob.offset) -
+		(ae->blob.offset < be->blob.offset);
+}
+
+static void blob_index_clear(struct blob_index *index) {
+	for (size_t i = 0; i < index->entries_len; i++) {
+		free(index->entries[i].name);
+	}
+	free(index->entries);
+	index->entries = NULL;
+	index->entries_len = 0;
+}
+
+static int blob_index_build(struct blob_index *index) {
+	size_t capacity = 0;
+	off_t pos = 0;
+	char *long_name = NULL, *pax_path = NULL;
+	int64_t pax_size = -1;
+	char header[TAR_BLOCK_SIZE];
+	int res;
+
+	while (pos + TAR_BLOCK_SIZE <= index->size) {
+		res = pread_full(index->fd, header, TAR_BLOCK_SIZE, pos);
+		if (res < 0) {
+			goto err;
+		}
+		if (tar_block_is_zero(header)) {
+			break;
+		}
+		pos += TAR_BLOCK_SIZE;
+
+		int64_t size = tar_parse_number(&header[124], 12);
+		if (pax_size >= 0) {
+			size = pax_size;
+		}
+		char type = header[156];
+		off_t data_offset = pos;
+		pos += (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+
+		if (type == 'x' || type == 'L') {
+			char *data = cvirt_xmalloc(size + 1);
+			res = pread_full(index->fd, data, size, data_offset);
+			if (res < 0) {
+				free(data);
+				goto err;
+			}
+			data[size] = '\0';
+			if (type == 'L') {
+				free(long_name);
+				long_name = data;
+			} else {
+				tar_parse_pax(data, size, &pax_path, &pax_size);
+				free(data);
+			}
+			continue;
+		}
+
+		if (type == '0' || type == '\0' || type == '7') {
+			char *name;
+			if (pax_path) {
+				name = pax_path;
+				pax_path = NULL;
+			} else if (long_name) {
+				name = long_name;
+				long_name = NULL;
+			} else if (!memcmp(&header[257], "ustar\0", 6) && header[345]) {
+				name = cvirt_xcalloc(155 + 1 + 100 + 1, sizeof(char));
+				strncpy(name, &header[345], 155);
+				strcat(name, "/");
+				strncat(name, header, 100);
+			} else {
+				name = cvirt_xstrndup(header, 100);
+			}
+
+			if (name[0] == '.' && name[1] == '/') {
+				memmove(name, &name[2], strlen(name) - 1);
+			}
+
+			if (index->entries_len == capacity) {
+				capacity = capacity ? capacity * 2 : 16;
+				index->entries = cvirt_xrealloc(index->entries,
+					capacity * sizeof(struct blob_index_entry));
+			}
+			index->entries[index->entries_len].name = name;
+			index->entries[index->entries_len].blob.offset = data_offset;
+			index->entries[index->entries_len].blob.size = size;
+			index->entries_len++;
+		}
+
+		free(long_name);
+		long_name = NULL;
+		free(pax_path);
+		pax_path = NULL;
+		pax_size = -1;
+	}
+	free(long_name);
+	free(pax_path);
+
+	qsort(index->entries, index->entries_len,
+		sizeof(struct blob_index_entry), blob_index_entry_cmp);
+	// later entries in tar replace earlier ones
+	size_t out = 0;
+	for (size_t i = 0; i < index->entries_len; i++) {
+		if (i + 1 < index->entries_len &&
+				!strcmp(index->entries[i].name, index->entries[i + 1].name)) {
+			free(index->entries[i].name);
+			continue;
+		}
+		index->entries[out++] = index->entries[i];
+	}
+	index->entries_len = out;
+	return 0;
 err:
-	archive_read_free(res);
-	return NULL;
+	free(long_name);
+	free(pax_path);
+	blob_index_clear(index);
+	return res;
+}
+
+// called with blob_indices_lock held
+static struct blob_index *blob_index_get(int fd) {
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		return NULL;
+	}
+
+	struct blob_index *index = blob_indices;
+	while (index && index->fd != fd) {
+		index = index->next;
+	}
+	if (index && index->dev == st.st_dev && index->ino == st.st_ino &&
+			index->size == st.st_size &&
+			index->mtim.tv_sec == st.st_mtim.tv_sec &&
+			index->mtim.tv_nsec == st.st_mtim.tv_nsec) {
+		return index;
+	}
+
+	if (index) { // fd reused, or file changed
+		blob_index_clear(index);
+	} else {
+		index = cvirt_xcalloc(1, sizeof(struct blob_index));
+		index->fd = fd;
+		index->next = blob_indices;
+		blob_indices = index;
+	}
+	index->dev = st.st_dev;
+	index->ino = st.st_ino;
+	index->size = st.st_size;
+	index->mtim = st.st_mtim;
+	if (blob_index_build(index) < 0) {
+		// force rebuild on next lookup
+		index->size = -1;
+		return NULL;
+	}
+	return index;
+}
+
+int archive_blob_lookup(int fd, const char *name, struct archive_blob *blob) {
+	int res = -ENOENT;
+	pthread_mutex_lock(&blob_indices_lock);
+	struct blob_index *index = blob_index_get(fd);
+	if (!index) {
+		res = -EIO;
+		goto out;
+	}
+	size_t lo = 0, hi = index->entries_len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(name, index->entries[mid].name);
+		if (!cmp) {
+			*blob = index->entries[mid].blob;
+			res = 0;
+			break;
+		} else if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+out:
+	pthread_mutex_unlock(&blob_indices_lock);
+	return res;
+}
+
+void archive_blob_forget(int fd) {
+	pthread_mutex_lock(&blob_indices_lock);
+	struct blob_index **prev = &blob_indices;
+	while (*prev && (*prev)->fd != fd) {
+		prev = &(*prev)->next;
+	}
+	struct blob_index *index = *prev;
+	if (index) {
+		*prev = index->next;
+		blob_index_clear(index);
+		free(index);
+	}
+	pthread_mutex_unlock(&blob_indices_lock);
+}
+
+ssize_t archive_blob_pread(int fd, const struct archive_blob *blob,
+		void *buf, size_t count, size_t offset) {
+	if (offset >= blob->size) {
+		return 0;
+	}
+	if (count > blob->size - offset) {
+		count = blob->size - offset;
+	}
+	ssize_t res;
+	do {
+		res = pread(fd, buf, count, blob->offset + offset);
+	} while (res < 0 && errno == EINTR);
+	return res < 0 ? -errno : res;
 }
 
 struct json_object *json_from_archive(int fd, const char *name) {
 	struct json_object *res = NULL;
-	struct archive_entry *entry = NULL;
-	char *json_str = NULL;
-	struct archive *archive = archive_from_fd_and_seek(fd, name, &entry);
-	if (!archive) {
-		goto out;
+	struct archive_blob blob;
+	if (archive_blob_lookup(fd, name, &blob) < 0) {
+		return NULL;
 	}
-	int sz = archive_entry_size(entry);
-	json_str = calloc(sz + 1, sizeof(char));
+	char *json_str = calloc(blob.size + 1, sizeof(char));
 	if (!json_str) {
-		goto out;
+		return NULL;
 	}
-	int read = archive_read_data(archive, json_str, sz);
-	if (read != sz) {
+	if (pread_full(fd, json_str, blob.size, blob.offset) < 0) {
 		goto out;
 	}
 	res = json_tokener_parse(json_str);
 out:
 	free(json_str);
-	archive_read_free(archive);
 	return res;
 }
 
@@ -1,90 +1,479 @@
 #include "compressor.h"
 
-#include <archive.h>
-#include <archive_entry.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-int compress(int fd_in, int fd_out, enum compression compression, int level) {
-	struct archive *compressor = archive_write_new();
-	if (!compressor) {
+#include <zlib.h>
+#include <zstd.h>
+
+// as pigz
+#define GZIP_BLOCK_SIZE		(128 * 1024)
+#define GZIP_BLOCKS_PER_THREAD	4
+#define GZIP_WINDOW_SIZE	(32 * 1024)
+
+struct gzip_block {
+	const uint8_t *in;
+	size_t in_len;
+	// tail of previous input, keeps the ratio close to a single stream
+	const uint8_t *dict;
+	size_t dict_len;
+	bool last;
+
+	uint8_t *out;
+	size_t out_len;
+	size_t out_capacity;
+	uint32_t crc;
+	int res;
+};
+
+/*
+ * Input split into blocks, compressed by the workers in any order while
+ * the previous batch is written out.
+ */
+struct gzip_batch {
+	uint8_t *in; // blocks_len * GZIP_BLOCK_SIZE
+	size_t in_len;
+	// tail of input before this batch
+	uint8_t dict[GZIP_WINDOW_SIZE];
+	struct gzip_block *blocks;
+	int len;
+	int next; // next block for a worker
+	int done;
+	bool submitted;
+	uint64_t seq; // submission order
+};
+
+struct compressor {
+	void *client_data;
+	compressor_write_callback *write_cb;
+	char error[128];
+
+	struct { // zstd, with frame control for COMPRESSION_ZSTD_FRAMES
+		ZSTD_CCtx *zstd;
+		uint8_t *zstd_out;
+		size_t zstd_out_len;
+		bool frames;
+		bool frame_open;
+	};
+
+	struct { // block-parallel gzip
+		int level;
+		int blocks_len;
+		// one taking input, the other compressing or being written
+		struct gzip_batch batches[2];
+		int filling;
+		uint64_t seq;
+		uint8_t dict[GZIP_WINDOW_SIZE];
+		size_t dict_len;
+		uint32_t crc;
+		uint32_t isize;
+		bool header_written;
+
+		pthread_t *workers;
+		int workers_len;
+		pthread_mutex_t lock;
+		pthread_cond_t work_cond; // blocks submitted, or stopping
+		pthread_cond_t done_cond; // a batch got compressed
+		bool stop;
+	};
+};
+
+static void *gzip_worker_run(void *arg);
+
+static int gzip_compressor_open(struct compressor *compressor, int level,
+		int threads) {
+	compressor->level = level ? level : Z_DEFAULT_COMPRESSION;
+	compressor->blocks_len = threads * GZIP_BLOCKS_PER_THREAD;
+	for (int i = 0; i < 2; i++) {
+		struct gzip_batch *batch = &compressor->batches[i];
+		batch->in = malloc((size_t)compressor->blocks_len * GZIP_BLOCK_SIZE);
+		batch->blocks = calloc(compressor->blocks_len, sizeof(struct gzip_block));
+		if (!batch->in || !batch->blocks) {
+			return -1;
+		}
+	}
+	pthread_mutex_init(&compressor->lock, NULL);
+	pthread_cond_init(&compressor->work_cond, NULL);
+	pthread_cond_init(&compressor->done_cond, NULL);
+	compressor->workers = calloc(threads, sizeof(pthread_t));
+	if (!compressor->workers) {
+		return -1;
+	}
+	for (; compressor->workers_len < threads; compressor->workers_len++) {
+		if (pthread_create(&compressor->workers[compressor->workers_len], NULL,
+				gzip_worker_run, compressor)) {
+			break;
+		}
+	}
+	// output does not depend on how many, as long as there is one
+	return compressor->workers_len ? 0 : -1;
+}
+
+static int zstd_compressor_open(struct compressor *compressor, int level,
+		int threads) {
+	compressor->zstd = ZSTD_createCCtx();
+	compressor->zstd_out_len = ZSTD_CStreamOutSize();
+	compressor->zstd_out = malloc(compressor->zstd_out_len);
+	if (!compressor->zstd || !compressor->zstd_out) {
+		return -1;
+	}
+	if (level != 0) {
+		size_t res = ZSTD_CCtx_setParameter(compressor->zstd,
+			ZSTD_c_compressionLevel, level);
+		if (ZSTD_isError(res)) {
+			fprintf(stderr, "compress: set level: %s\n",
+				ZSTD_getErrorName(res));
+			return -1;
+		}
+	}
+	// any count of workers gives the same output, unlike none
+	size_t res = ZSTD_CCtx_setParameter(compressor->zstd,
+		ZSTD_c_nbWorkers, threads);
+	if (ZSTD_isError(res)) {
+		fprintf(stderr, "compress: set threads: %s\n",
+			ZSTD_getErrorName(res));
 		return -1;
 	}
-	int res = archive_write_set_format_raw(compressor);
+	return 0;
+}
+
+struct compressor *compressor_open(enum compression compression, int level,
+		int threads, void *client_data, compressor_write_callback *write_cb) {
+	struct compressor *compressor = calloc(1, sizeof(struct compressor));
+	if (!compressor) {
+		return NULL;
+	}
+	compressor->client_data = client_data;
+	compressor->write_cb = write_cb;
+
+	threads = threads > 1 ? threads : 1;
+	int res;
+	if (compression == COMPRESSION_GZIP) {
+		res = gzip_compressor_open(compressor, level, threads);
+	} else {
+		compressor->frames = compression == COMPRESSION_ZSTD_FRAMES;
+		res = zstd_compressor_open(compressor, level, threads);
+	}
 	if (res < 0) {
-		archive_write_free(compressor);
-		return res;
+		compressor_free(compressor);
+		return NULL;
 	}
+	return compressor;
+}
 
-	const char *filter_str = NULL;
-	switch (compression) {
-	case COMPRESSION_ZSTD:
-		filter_str = "zstd";
-		res = archive_write_add_filter_zstd(compressor);
+static int output(struct compressor *compressor, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	while (len) {
+		ssize_t res = compressor->write_cb(compressor->client_data, p, len);
 		if (res < 0) {
-			archive_write_free(compressor);
-			return res;
+			snprintf(compressor->error, sizeof(compressor->error),
+				"write: %s", strerror(errno));
+			return -1;
 		}
-		break;
-	case COMPRESSION_GZIP:
-		filter_str = "gzip";
-		res = archive_write_add_filter_gzip(compressor);
-		if (res < 0) {
-			archive_write_free(compressor);
-			return res;
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+// raw deflate of one block, ending byte-aligned so blocks concatenate
+static void gzip_block_compress(struct gzip_block *block, z_stream *strm) {
+	block->crc = crc32(0, block->in, block->in_len);
+	block->out_len = 0;
+	size_t bound = deflateBound(strm, block->in_len) + 16;
+	if (block->out_capacity < bound) {
+		free(block->out);
+		block->out = malloc(bound);
+		if (!block->out) {
+			block->out_capacity = 0;
+			block->res = Z_MEM_ERROR;
+			return;
 		}
-		break;
+		block->out_capacity = bound;
 	}
-	if (level != 0) {
-		char level_str[12];
-		sprintf(level_str, "%d", level);
-		res = archive_write_set_filter_option(compressor,
-			filter_str, "compression-level" , level_str);
-		if (res < 0) {
-			fprintf(stderr, "compress: set level: %s\n", archive_error_string(compressor));
-			archive_write_free(compressor);
-			return res;
+	block->res = deflateReset(strm);
+	if (block->res == Z_OK && block->dict_len) {
+		block->res = deflateSetDictionary(strm, block->dict, block->dict_len);
+	}
+	if (block->res != Z_OK) {
+		return;
+	}
+	strm->next_in = (uint8_t *)block->in;
+	strm->avail_in = block->in_len;
+	strm->next_out = block->out;
+	strm->avail_out = block->out_capacity;
+	block->res = deflate(strm, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+	block->out_len = block->out_capacity - strm->avail_out;
+	if (block->res == Z_STREAM_END ||
+			(block->res == Z_OK && !strm->avail_in && strm->avail_out)) {
+		block->res = Z_OK;
+	} else if (block->res == Z_OK) {
+		block->res = Z_BUF_ERROR;
+	}
+}
+
+// oldest submitted batch with blocks left, called with lock held
+static struct gzip_batch *gzip_next_batch(struct compressor *compressor) {
+	struct gzip_batch *res = NULL;
+	for (int i = 0; i < 2; i++) {
+		struct gzip_batch *batch = &compressor->batches[i];
+		if (batch->submitted && batch->next < batch->len &&
+				(!res || batch->seq < res->seq)) {
+			res = batch;
 		}
 	}
+	return res;
+}
 
-	res = archive_write_open_fd(compressor, fd_out);
-	if (res < 0) {
-		archive_write_free(compressor);
-		return res;
+static void *gzip_worker_run(void *arg) {
+	struct compressor *compressor = arg;
+	z_stream strm = {0};
+	int res = deflateInit2(&strm, compressor->level, Z_DEFLATED, -15, 8,
+		Z_DEFAULT_STRATEGY);
+	pthread_mutex_lock(&compressor->lock);
+	while (true) {
+		struct gzip_batch *batch = gzip_next_batch(compressor);
+		if (!batch) {
+			if (compressor->stop) {
+				break;
+			}
+			pthread_cond_wait(&compressor->work_cond, &compressor->lock);
+			continue;
+		}
+		struct gzip_block *block = &batch->blocks[batch->next++];
+		pthread_mutex_unlock(&compressor->lock);
+		if (res == Z_OK) {
+			gzip_block_compress(block, &strm);
+		} else {
+			block->res = res;
+		}
+		pthread_mutex_lock(&compressor->lock);
+		if (++batch->done == batch->len) {
+			pthread_cond_broadcast(&compressor->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&compressor->lock);
+	if (res == Z_OK) {
+		deflateEnd(&strm);
+	}
+	return NULL;
+}
+
+// split the filling batch into blocks and hand it to the workers
+static void gzip_submit(struct compressor *compressor, bool last) {
+	struct gzip_batch *batch = &compressor->batches[compressor->filling];
+	memcpy(batch->dict, compressor->dict, GZIP_WINDOW_SIZE);
+	int len = 0;
+	for (size_t offset = 0; offset < batch->in_len || (last && !len);
+			offset += GZIP_BLOCK_SIZE) {
+		struct gzip_block *block = &batch->blocks[len];
+		block->in = &batch->in[offset];
+		block->in_len = batch->in_len - offset > GZIP_BLOCK_SIZE ?
+			GZIP_BLOCK_SIZE : batch->in_len - offset;
+		if (len) {
+			size_t prev_len = batch->blocks[len - 1].in_len;
+			block->dict_len = prev_len > GZIP_WINDOW_SIZE ? GZIP_WINDOW_SIZE : prev_len;
+			block->dict = block->in - block->dict_len;
+		} else {
+			block->dict = &batch->dict[GZIP_WINDOW_SIZE - compressor->dict_len];
+			block->dict_len = compressor->dict_len;
+		}
+		block->last = false;
+		len++;
+	}
+	if (last) {
+		batch->blocks[len - 1].last = true;
 	}
 
-	// dummy entry required by raw writer
-	struct archive_entry *entry = archive_entry_new();
-	if (!entry) {
-		archive_write_free(compressor);
+	// the window for the first block of the next batch
+	size_t keep = batch->in_len > GZIP_WINDOW_SIZE ?
+		GZIP_WINDOW_SIZE : batch->in_len;
+	memmove(compressor->dict, &compressor->dict[keep], GZIP_WINDOW_SIZE - keep);
+	memcpy(&compressor->dict[GZIP_WINDOW_SIZE - keep],
+		&batch->in[batch->in_len - keep], keep);
+	compressor->dict_len = compressor->dict_len + keep > GZIP_WINDOW_SIZE ?
+		GZIP_WINDOW_SIZE : compressor->dict_len + keep;
+
+	pthread_mutex_lock(&compressor->lock);
+	batch->len = len;
+	batch->next = 0;
+	batch->done = 0;
+	batch->submitted = true;
+	batch->seq = compressor->seq++;
+	pthread_cond_broadcast(&compressor->work_cond);
+	pthread_mutex_unlock(&compressor->lock);
+}
+
+// wait for a submitted batch, then write it in order
+static int gzip_write_batch(struct compressor *compressor,
+		struct gzip_batch *batch) {
+	pthread_mutex_lock(&compressor->lock);
+	while (batch->done < batch->len) {
+		pthread_cond_wait(&compressor->done_cond, &compressor->lock);
+	}
+	batch->submitted = false;
+	pthread_mutex_unlock(&compressor->lock);
+
+	int res = 0;
+	for (int i = 0; i < batch->len && !res; i++) {
+		struct gzip_block *block = &batch->blocks[i];
+		if (block->res != Z_OK) {
+			snprintf(compressor->error, sizeof(compressor->error),
+				"deflate: %d", block->res);
+			res = -1;
+			break;
+		}
+		res = output(compressor, block->out, block->out_len);
+		compressor->crc = crc32_combine(compressor->crc, block->crc, block->in_len);
+		compressor->isize += block->in_len;
+	}
+	batch->in_len = 0;
+	return res;
+}
+
+/*
+ * Submit buffered input, and write the previous batch while it is
+ * compressed. Input goes on into the batch just written.
+ */
+static int gzip_flush(struct compressor *compressor, bool last) {
+	if (!compressor->header_written) {
+		// no name, no mtime, unix
+		static const uint8_t header[10] = {
+			0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3,
+		};
+		if (output(compressor, header, sizeof(header)) < 0) {
+			return -1;
+		}
+		compressor->header_written = true;
+	}
+
+	struct gzip_batch *batch = &compressor->batches[compressor->filling];
+	struct gzip_batch *prev = &compressor->batches[!compressor->filling];
+	gzip_submit(compressor, last);
+	if (prev->submitted && gzip_write_batch(compressor, prev) < 0) {
 		return -1;
 	}
-	archive_entry_set_filetype(entry, AE_IFREG);
-	archive_write_header(compressor, entry);
-	archive_entry_free(entry);
+	compressor->filling = !compressor->filling;
+	if (!last) {
+		return 0;
+	}
 
-	char *buf = calloc(1 * 1024 * 1024, sizeof(char));
-	if (!buf) {
-		archive_write_free(compressor);
+	if (gzip_write_batch(compressor, batch) < 0) {
 		return -1;
 	}
+	uint8_t trailer[8];
+	for (int i = 0; i < 4; i++) {
+		trailer[i] = compressor->crc >> (i * 8);
+		trailer[i + 4] = compressor->isize >> (i * 8);
+	}
+	return output(compressor, trailer, sizeof(trailer));
+}
 
-	while ((res = read(fd_in, buf, 1 * 1024 * 1024))) {
-		if (res == -1) {
-			archive_write_free(compressor);
+static int zstd_compress(struct compressor *compressor, const void *buf,
+		size_t len, ZSTD_EndDirective end) {
+	ZSTD_inBuffer in = {buf, len, 0};
+	size_t left;
+	do {
+		ZSTD_outBuffer out = {compressor->zstd_out, compressor->zstd_out_len, 0};
+		left = ZSTD_compressStream2(compressor->zstd, &out, &in, end);
+		if (ZSTD_isError(left)) {
+			snprintf(compressor->error, sizeof(compressor->error),
+				"zstd: %s", ZSTD_getErrorName(left));
 			return -1;
 		}
-		res = archive_write_data(compressor, buf, res);
-		if (res < 0) {
-			fprintf(stderr, "archive_write_data: %s\n", archive_error_string(compressor));
-			archive_write_free(compressor);
-			free(buf);
-			return res;
+		if (output(compressor, out.dst, out.pos) < 0) {
+			return -1;
 		}
-	}
+	} while (end == ZSTD_e_continue ? in.pos < in.size : left != 0);
+	return 0;
+}
 
-	archive_write_close(compressor);
-	archive_write_free(compressor);
-	free(buf);
+int compressor_write(struct compressor *compressor, const void *buf, size_t len) {
+	if (compressor->zstd) {
+		if (!len) {
+			return 0;
+		}
+		compressor->frame_open = true;
+		return zstd_compress(compressor, buf, len, ZSTD_e_continue);
+	}
+	size_t capacity = (size_t)compressor->blocks_len * GZIP_BLOCK_SIZE;
+	const uint8_t *p = buf;
+	while (len) {
+		struct gzip_batch *batch = &compressor->batches[compressor->filling];
+		size_t n = capacity - batch->in_len;
+		n = n > len ? len : n;
+		memcpy(&batch->in[batch->in_len], p, n);
+		batch->in_len += n;
+		p += n;
+		len -= n;
+		// keep the last batch for close, it ends the deflate stream
+		if (len && batch->in_len == capacity &&
+				gzip_flush(compressor, false) < 0) {
+			return -1;
+		}
+	}
 	return 0;
 }
+
+int compressor_end_frame(struct compressor *compressor) {
+	if (!compressor->zstd) {
+		snprintf(compressor->error, sizeof(compressor->error),
+			"frames not supported");
+		return -1;
+	}
+	// no empty frames between ends
+	if (!compressor->frame_open) {
+		return 0;
+	}
+	compressor->frame_open = false;
+	return zstd_compress(compressor, NULL, 0, ZSTD_e_end);
+}
+
+int compressor_close(struct compressor *compressor) {
+	if (compressor->zstd) {
+		// a single frame even without input
+		if (!compressor->frames) {
+			compressor->frame_open = true;
+		}
+		return compressor_end_frame(compressor);
+	}
+	return gzip_flush(compressor, true);
+}
+
+const char *compressor_error_string(struct compressor *compressor) {
+	return compressor->error;
+}
+
+void compressor_free(struct compressor *compressor) {
+	if (compressor->workers) {
+		pthread_mutex_lock(&compressor->lock);
+		compressor->stop = true;
+		pthread_cond_broadcast(&compressor->work_cond);
+		pthread_mutex_unlock(&compressor->lock);
+		for (int i = 0; i < compressor->workers_len; i++) {
+			pthread_join(compressor->workers[i], NULL);
+		}
+		free(compressor->workers);
+		pthread_mutex_destroy(&compressor->lock);
+		pthread_cond_destroy(&compressor->work_cond);
+		pthread_cond_destroy(&compressor->done_cond);
+	}
+	for (int i = 0; i < 2; i++) {
+		struct gzip_batch *batch = &compressor->batches[i];
+		if (batch->blocks) {
+			for (int j = 0; j < compressor->blocks_len; j++) {
+				free(batch->blocks[j].out);
+			}
+		}
+		free(batch->blocks);
+		free(batch->in);
+	}
+	ZSTD_freeCCtx(compressor->zstd);
+	free(compressor->zstd_out);
+	free(compressor);
+}
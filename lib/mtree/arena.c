@@ -0,0 +1,132 @@
+#include "mtree/arena.h"
+#include "xmem.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE	(1024 * 1024)
+#define ARENA_ALIGN	MTREE_ARENA_ALIGN
+
+struct mtree_arena *mtree_arena_new(void) {
+	return cvirt_xcalloc(1, sizeof(struct mtree_arena));
+}
+
+static struct mtree_arena_chunk *arena_chunk_new(struct mtree_arena *arena,
+		size_t size) {
+	struct mtree_arena_chunk *chunk = cvirt_xmalloc(
+		sizeof(struct mtree_arena_chunk) + size);
+	chunk->size = size;
+	chunk->used = 0;
+	if (arena->chunks && size > ARENA_CHUNK_SIZE / 4) {
+		// dedicated chunk, keep bumping in current one
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+	} else {
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	return chunk;
+}
+
+static size_t arena_aligned(size_t size) {
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+// free list of an aligned size, -1 if blocks of it are not recycled
+static int arena_class(size_t aligned) {
+	if (!aligned) {
+		return -1;
+	} else if (aligned <= MTREE_ARENA_SMALL_MAX) {
+		return aligned / ARENA_ALIGN - 1;
+	} else if (aligned & (aligned - 1)) {
+		return -1;
+	}
+	int class = MTREE_ARENA_SMALL_MAX / ARENA_ALIGN - 1 +
+		__builtin_ctzl(aligned) - __builtin_ctzl(MTREE_ARENA_SMALL_MAX);
+	return class < MTREE_ARENA_CLASSES ? class : -1;
+}
+
+void *mtree_arena_alloc(struct mtree_arena *arena, size_t size) {
+	size_t aligned = arena_aligned(size);
+	int class = arena_class(aligned);
+	if (class >= 0 && arena->free[class]) {
+		void *res = arena->free[class];
+		arena->free[class] = *(void **)res;
+		memset(res, 0, size);
+		return res;
+	}
+
+	struct mtree_arena_chunk *chunk = arena->chunks;
+	if (!chunk || chunk->size - chunk->used < aligned) {
+		chunk = arena_chunk_new(arena, aligned > ARENA_CHUNK_SIZE / 4 ?
+			aligned : ARENA_CHUNK_SIZE);
+	}
+	void *res = &chunk->data[chunk->used];
+	chunk->used += aligned;
+	memset(res, 0, size);
+	if (chunk == arena->chunks) {
+		arena->last = res;
+		arena->last_size = aligned;
+	}
+	return res;
+}
+
+void *mtree_arena_realloc(struct mtree_arena *arena, void *ptr,
+		size_t old_size, size_t size) {
+	if (!ptr) {
+		return mtree_arena_alloc(arena, size);
+	}
+	if (size <= old_size) {
+		return ptr;
+	}
+	struct mtree_arena_chunk *chunk = arena->chunks;
+	size_t aligned = arena_aligned(size);
+	if (ptr == arena->last &&
+			chunk->size - chunk->used + arena->last_size >= aligned) {
+		chunk->used += aligned - arena->last_size;
+		arena->last_size = aligned;
+		memset((char *)ptr + old_size, 0, size - old_size);
+		return ptr;
+	}
+	void *res = mtree_arena_alloc(arena, size);
+	memcpy(res, ptr, old_size);
+	mtree_arena_free(arena, ptr, old_size);
+	return res;
+}
+
+void mtree_arena_free(struct mtree_arena *arena, void *ptr, size_t size) {
+	if (!ptr) {
+		return;
+	}
+	size_t aligned = arena_aligned(size);
+	if (ptr == arena->last) {
+		arena->chunks->used -= arena->last_size;
+		arena->last = NULL;
+		arena->last_size = 0;
+		return;
+	}
+	int class = arena_class(aligned);
+	if (class < 0) {
+		// left unused until the arena is destroyed
+		return;
+	}
+	*(void **)ptr = arena->free[class];
+	arena->free[class] = ptr;
+}
+
+char *mtree_arena_strndup(struct mtree_arena *arena, const char *s, size_t n) {
+	size_t len = strnlen(s, n);
+	char *res = mtree_arena_alloc(arena, len + 1);
+	memcpy(res, s, len);
+	return res;
+}
+
+void mtree_arena_destroy(struct mtree_arena *arena) {
+	struct mtree_arena_chunk *chunk = arena->chunks;
+	while (chunk) {
+		struct mtree_arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(arena);
+}
@@ -1,33 +1,147 @@
 #include <convirter/mtree/entry.h>
 #include <convirter/mtree/xattr.h>
+#include <convirter/oci-r/config.h>
 #include <convirter/oci-r/layer.h>
 
 #include <assert.h>
 #include <libgen.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/sysmacros.h>
+#include <unistd.h>
 
 #include <archive.h>
 #include <archive_entry.h>
 
 #include "hex.h"
+#include "mtree/arena.h"
 #include "mtree/entry.h"
 #include "xmem.h"
 
+/*
+ * Tree memory, either from malloc or from the arena of the tree.
+ * Arena-backed trees recycle individual frees by size within the arena, and
+ * are released at once. Memory of a loaded snapshot is never recycled.
+ */
+static void *tree_calloc(struct mtree_tree *tree, size_t nmemb, size_t size) {
+	if (tree->arena) {
+		return mtree_arena_alloc(tree->arena, nmemb * size);
+	}
+	return cvirt_xcalloc(nmemb, size);
+}
+
+static bool tree_pinned(struct mtree_tree *tree, const void *ptr) {
+	const char *p = ptr;
+	const char *map = tree->map, *nodes = tree->nodes;
+	return (map && p >= map && p < map + tree->map_len) ||
+		(nodes && p >= nodes && p < nodes + tree->nodes_len);
+}
+
+static void *tree_realloc_array(struct mtree_tree *tree, void *ptr,
+		size_t old_nmemb, size_t nmemb, size_t size) {
+	if (tree->arena && tree_pinned(tree, ptr)) {
+		void *res = mtree_arena_alloc(tree->arena, nmemb * size);
+		memcpy(res, ptr, old_nmemb * size);
+		return res;
+	} else if (tree->arena) {
+		return mtree_arena_realloc(tree->arena, ptr, old_nmemb * size,
+			nmemb * size);
+	}
+	void *res = cvirt_xrealloc(ptr, nmemb * size);
+	if (nmemb > old_nmemb) {
+		memset((char *)res + old_nmemb * size, 0,
+			(nmemb - old_nmemb) * size);
+	}
+	return res;
+}
+
+static char *tree_strndup(struct mtree_tree *tree, const char *s, size_t n) {
+	if (tree->arena) {
+		return mtree_arena_strndup(tree->arena, s, n);
+	}
+	return cvirt_xstrndup(s, n);
+}
+
+static char *tree_strdup(struct mtree_tree *tree, const char *s) {
+	return tree_strndup(tree, s, strlen(s));
+}
+
+// take over a malloc-ed string
+static char *tree_adopt_str(struct mtree_tree *tree, char *s) {
+	if (tree->arena) {
+		char *res = tree_strdup(tree, s);
+		free(s);
+		return res;
+	}
+	return s;
+}
+
+// size as allocated, for the arena to recycle the block
+static void tree_free(struct mtree_tree *tree, void *ptr, size_t size) {
+	if (!tree->arena) {
+		free(ptr);
+	} else if (ptr && !tree_pinned(tree, ptr)) {
+		mtree_arena_free(tree->arena, ptr, size);
+	}
+}
+
+static void tree_free_str(struct mtree_tree *tree, char *s) {
+	if (s) {
+		tree_free(tree, s, strlen(s) + 1);
+	}
+}
+
+static void xattr_set(struct mtree_tree *tree, struct cvirt_mtree_xattr *xattr,
+		const char *name, const void *value, size_t len) {
+	xattr->name = (char *)mtree_intern(&tree->xattr_strings, name,
+		strlen(name));
+	if (len <= MTREE_XATTR_INTERN_VALUE_MAX) {
+		xattr->value = mtree_intern(&tree->xattr_strings, value, len);
+	} else {
+		xattr->value = tree_calloc(tree, len, sizeof(uint8_t));
+		memcpy(xattr->value, value, len);
+	}
+	xattr->len = len;
+}
+
+static void xattrs_release(struct mtree_tree *tree,
+		struct cvirt_mtree_inode *inode) {
+	for (int i = 0; i < inode->xattrs_len; i++) {
+		if (inode->xattrs[i].len > MTREE_XATTR_INTERN_VALUE_MAX) {
+			tree_free(tree, inode->xattrs[i].value,
+				inode->xattrs[i].len);
+		}
+	}
+	tree_free(tree, inode->xattrs,
+		inode->xattrs_capacity * sizeof(struct cvirt_mtree_xattr));
+	inode->xattrs = NULL;
+	inode->xattrs_len = 0;
+	inode->xattrs_capacity = 0;
+}
+
+static struct mtree_tree *tree_new(uint32_t flags) {
+	struct mtree_tree *tree = cvirt_xcalloc(1, sizeof(struct mtree_tree));
+	if (flags & CVIRT_MTREE_TREE_ARENA) {
+		tree->arena = mtree_arena_new();
+	}
+	mtree_intern_init(&tree->xattr_strings, tree->arena);
+	tree->flags = flags;
+	tree->root.name = tree_strdup(tree, "/");
+	tree->root.inode = tree_calloc(tree, 1, sizeof(struct cvirt_mtree_inode));
+	return tree;
+}
+
 static void copy_stat_from_guestfs_statns(struct cvirt_mtree_inode *inode,
 		struct guestfs_statns *statns) {
-	inode->stat.st_dev = statns->st_dev;
-	inode->stat.st_ino = statns->st_ino;
 	inode->stat.st_mode = statns->st_mode;
 	inode->stat.st_nlink = 1;
 	inode->stat.st_uid = statns->st_uid;
 	inode->stat.st_gid = statns->st_gid;
 	inode->stat.st_rdev = statns->st_rdev;
 	inode->stat.st_size = statns->st_size;
-	inode->stat.st_blksize = statns->st_blksize;
-	inode->stat.st_blocks = statns->st_blocks;
 	inode->stat.st_atim.tv_sec = statns->st_atime_sec;
 	inode->stat.st_atim.tv_nsec = statns->st_atime_nsec;
 	inode->stat.st_mtim.tv_sec = statns->st_mtime_sec;
@@ -36,41 +150,136 @@ static void copy_stat_from_guestfs_statns(struct cvirt_mtree_inode *inode,
 	inode->stat.st_ctim.tv_nsec = statns->st_ctime_nsec;
 }
 
-static void set_xattrs_from_guestfs_xattr_array(struct cvirt_mtree_inode *inode,
+static void set_xattrs_from_guestfs_xattr_array(struct mtree_tree *tree,
+		struct cvirt_mtree_inode *inode,
 		struct guestfs_xattr *xattrs, int count) {
 	if (!count) {
 		return;
 	}
-	inode->xattrs = calloc(count, sizeof(struct cvirt_mtree_xattr));
-	assert(inode->xattrs);
+	inode->xattrs = tree_calloc(tree, count, sizeof(struct cvirt_mtree_xattr));
 	inode->xattrs_capacity = count;
 	inode->xattrs_len = count;
 	for (int i = 0; i < count; i++) {
-		inode->xattrs[i].name = strdup(xattrs[i].attrname);
-		assert(inode->xattrs[i].name);
-		inode->xattrs[i].value = calloc(xattrs[i].attrval_len, sizeof(uint8_t));
-		assert(inode->xattrs[i].value);
-		memcpy(inode->xattrs[i].value, xattrs[i].attrval,
-			xattrs[i].attrval_len);
-		inode->xattrs[i].len = xattrs[i].attrval_len;
+		xattr_set(tree, &inode->xattrs[i], xattrs[i].attrname,
+			xattrs[i].attrval, xattrs[i].attrval_len);
 	}
 }
 
 static void checksum_from_guestfs(uint8_t *dest, guestfs_h *guestfs,
-		const char *path, size_t sz,
-		struct io_entry_guestfs_ctx *ctx) {
+		const char *path, size_t sz, gcry_md_hd_t gcrypt_handle) {
 	size_t offset = 0, read = 0;
 	while (sz > 0) {
 		char *buf = guestfs_pread(guestfs, path,
 			sz > MTREE_ENTRY_GUESTFS_BUF_LEN ?
 			MTREE_ENTRY_GUESTFS_BUF_LEN : sz, offset, &read);
-		gcry_md_write(ctx->gcrypt_handle, buf, read);
+		gcry_md_write(gcrypt_handle, buf, read);
 		free(buf);
 		sz -= read;
 		offset += read;
 	}
-	memcpy(dest, gcry_md_read(ctx->gcrypt_handle, 0), 32);
-	gcry_md_reset(ctx->gcrypt_handle);
+	memcpy(dest, gcry_md_read(gcrypt_handle, 0), 32);
+	gcry_md_reset(gcrypt_handle);
+}
+
+// no-op unless walking a pool
+static void ctx_lock(struct io_entry_guestfs_ctx *ctx) {
+	if (ctx->pool) {
+		pthread_mutex_lock(&ctx->lock);
+	}
+}
+
+static void ctx_unlock(struct io_entry_guestfs_ctx *ctx) {
+	if (ctx->pool) {
+		pthread_mutex_unlock(&ctx->lock);
+	}
+}
+
+// key of a link in subvolume, with st_dev and st_ino as seen by one appliance
+static struct io_entry_guestfs_hardlink hardlink_key(const char *subvolume,
+		dev_t dev, ino_t ino) {
+	struct io_entry_guestfs_hardlink key = { .dev = dev, .ino = ino };
+	if (!major(dev)) {
+		key.subvolume = subvolume;
+		key.dev = 0;
+	}
+	return key;
+}
+
+static size_t hardlink_slot(const struct io_entry_guestfs_hardlinks *table,
+		const struct io_entry_guestfs_hardlink *key) {
+	uint64_t hash = (uint64_t)key->ino * 0x9e3779b97f4a7c15ull ^
+		(uint64_t)key->dev ^ (uintptr_t)key->subvolume;
+	hash ^= hash >> 29;
+	return hash & (table->capacity - 1);
+}
+
+static struct io_entry_guestfs_hardlink *hardlink_find(
+		struct io_entry_guestfs_hardlinks *table,
+		const struct io_entry_guestfs_hardlink *key) {
+	if (!table->capacity) {
+		return NULL;
+	}
+	size_t mask = table->capacity - 1;
+	size_t slot = hardlink_slot(table, key);
+	while (table->slots[slot].inode) {
+		if (table->slots[slot].subvolume == key->subvolume &&
+				table->slots[slot].dev == key->dev &&
+				table->slots[slot].ino == key->ino) {
+			return &table->slots[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+static void hardlink_insert(struct io_entry_guestfs_hardlinks *table,
+		const struct io_entry_guestfs_hardlink *key,
+		struct cvirt_mtree_inode *inode) {
+	if ((table->len + 1) * 2 > table->capacity) {
+		struct io_entry_guestfs_hardlinks grown = {
+			.capacity = table->capacity ? table->capacity * 2 : 256,
+		};
+		grown.slots = cvirt_xcalloc(grown.capacity,
+			sizeof(struct io_entry_guestfs_hardlink));
+		for (size_t i = 0; i < table->capacity; i++) {
+			if (table->slots[i].inode) {
+				hardlink_insert(&grown, &table->slots[i],
+					table->slots[i].inode);
+			}
+		}
+		free(table->slots);
+		*table = grown;
+	}
+	size_t mask = table->capacity - 1;
+	size_t slot = hardlink_slot(table, key);
+	while (table->slots[slot].inode) {
+		slot = (slot + 1) & mask;
+	}
+	table->slots[slot] = *key;
+	table->slots[slot].inode = inode;
+	table->len++;
+}
+
+// backward-shift deletion, keeps probe chains intact without tombstones
+static void hardlink_remove(struct io_entry_guestfs_hardlinks *table,
+		struct io_entry_guestfs_hardlink *entry) {
+	size_t mask = table->capacity - 1;
+	size_t hole = entry - table->slots;
+	size_t slot = hole;
+	while (true) {
+		slot = (slot + 1) & mask;
+		if (!table->slots[slot].inode) {
+			break;
+		}
+		size_t home = hardlink_slot(table, &table->slots[slot]);
+		// move back unless home lies cyclically in (hole, slot]
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			table->slots[hole] = table->slots[slot];
+			hole = slot;
+		}
+	}
+	table->slots[hole].inode = NULL;
+	table->len--;
 }
 
 static bool is_btrfs_subvolume_seen(guestfs_h *guestfs, const char *path,
@@ -83,31 +292,23 @@ static bool is_btrfs_subvolume_seen(guestfs_h *guestfs, const char *path,
 		return false;
 	}
 	bool uuid_skip = false, parent_skip = false;
+	ctx_lock(ctx);
 	for (int key_idx = 0; btrfs_info[key_idx]; key_idx += 2) {
+		const char *uuid = btrfs_info[key_idx + 1];
 		if (!uuid_skip && !strcmp("UUID", btrfs_info[key_idx])) {
-			struct cvirt_list *ptr = ctx->btrfs_uuids;
-			while (ptr->next) {
-				ptr = ptr->next;
-				char *uuid = ptr->data;
-				if (!strcmp(btrfs_info[key_idx + 1], uuid)) {
-					uuid_skip = true;
-					break;
-				}
-			}
-			if (!uuid_skip) {
-				cvirt_list_append(ctx->btrfs_uuids, cvirt_xstrdup(btrfs_info[key_idx + 1]));
+			if (mtree_intern_lookup(&ctx->btrfs_uuids, uuid, strlen(uuid))) {
+				uuid_skip = true;
+			} else {
+				mtree_intern(&ctx->btrfs_uuids, uuid, strlen(uuid));
 			}
 		} else if (!parent_skip && !strcmp("Parent UUID", btrfs_info[key_idx])) {
-			struct cvirt_list *ptr = ctx->btrfs_uuids;
-			while (ptr->next) {
-				ptr = ptr->next;
-				char *uuid = ptr->data;
-				if (!strcmp(btrfs_info[key_idx + 1], uuid)) {
-					parent_skip = true;
-					break;
-				}
+			if (mtree_intern_lookup(&ctx->btrfs_uuids, uuid, strlen(uuid))) {
+				parent_skip = true;
 			}
 		}
+	}
+	ctx_unlock(ctx);
+	for (int key_idx = 0; btrfs_info[key_idx]; key_idx += 2) {
 		free(btrfs_info[key_idx]);
 		free(btrfs_info[key_idx + 1]);
 	}
@@ -115,9 +316,94 @@ static bool is_btrfs_subvolume_seen(guestfs_h *guestfs, const char *path,
 	return uuid_skip || parent_skip;
 }
 
+// called with ctx locked
+static void subvolume_defer(struct io_entry_guestfs_ctx *ctx,
+		struct cvirt_mtree_entry *entry, const char *path,
+		const char *subvolume) {
+	if (ctx->subvolumes_len == ctx->subvolumes_capacity) {
+		ctx->subvolumes_capacity = ctx->subvolumes_capacity ?
+			ctx->subvolumes_capacity * 2 : 16;
+		ctx->subvolumes = cvirt_xrealloc(ctx->subvolumes,
+			ctx->subvolumes_capacity * sizeof(struct io_entry_guestfs_task));
+	}
+	struct io_entry_guestfs_task *task = &ctx->subvolumes[ctx->subvolumes_len++];
+	task->entry = entry;
+	task->path = cvirt_xstrdup(path);
+	task->subvolume = subvolume;
+}
+
+static int path_depth(const char *path) {
+	int depth = 0;
+	for (; *path; path++) {
+		depth += *path == '/';
+	}
+	return depth;
+}
+
+// shallower first, then by name
+static int subvolume_cmp(const void *a, const void *b) {
+	const struct io_entry_guestfs_task *ta = a, *tb = b;
+	int da = path_depth(ta->path), db = path_depth(tb->path);
+	if (da != db) {
+		return da < db ? -1 : 1;
+	}
+	return strcmp(ta->path, tb->path);
+}
+
+// takes over path
+static void snapshot_skipped(struct io_entry_guestfs_ctx *ctx, char *path) {
+	// children of / are walked as //name
+	if (path[0] == '/' && path[1] == '/') {
+		memmove(path, &path[1], strlen(path));
+	}
+	if (ctx->snapshots_len == ctx->snapshots_capacity) {
+		ctx->snapshots_capacity = ctx->snapshots_capacity ?
+			ctx->snapshots_capacity * 2 : 8;
+		ctx->snapshots = realloc(ctx->snapshots,
+			ctx->snapshots_capacity * sizeof(char *));
+		assert(ctx->snapshots);
+	}
+	ctx->snapshots[ctx->snapshots_len++] = path;
+}
+
+/*
+ * Subvolume roots are not walked as they are reached but deferred until
+ * the walk settles, then decided on in a fixed order here, so which one of
+ * a subvolume and its snapshots is kept does not depend on walk order or
+ * timing. Returns those to walk next, with their count in len.
+ */
+static struct io_entry_guestfs_task *guestfs_walk_subvolumes(
+		guestfs_h *guestfs, struct io_entry_guestfs_ctx *ctx, size_t *len) {
+	struct io_entry_guestfs_task *tasks = ctx->subvolumes;
+	size_t tasks_len = ctx->subvolumes_len;
+	ctx->subvolumes = NULL;
+	ctx->subvolumes_len = 0;
+	ctx->subvolumes_capacity = 0;
+
+	qsort(tasks, tasks_len, sizeof(struct io_entry_guestfs_task),
+		subvolume_cmp);
+	size_t kept = 0;
+	for (size_t i = 0; i < tasks_len; i++) {
+		if (is_btrfs_subvolume_seen(guestfs, tasks[i].path, ctx)) {
+			snapshot_skipped(ctx, tasks[i].path);
+			continue;
+		}
+		tasks[kept++] = tasks[i];
+	}
+	*len = kept;
+	return tasks;
+}
+
+static void deque_push(struct io_entry_guestfs_walker *walker,
+		struct cvirt_mtree_entry *entry, const char *path,
+		const char *subvolume);
+
 static void guestfs_dir_fill_children(struct cvirt_mtree_entry *entry,
-		guestfs_h *guestfs, const char *path, uint32_t flags,
-		struct io_entry_guestfs_ctx *ctx) {
+		const char *path, const char *subvolume,
+		struct io_entry_guestfs_walker *walker) {
+	struct io_entry_guestfs_ctx *ctx = walker->ctx;
+	guestfs_h *guestfs = walker->guestfs;
+	uint32_t flags = walker->flags;
 	char **ls = guestfs_ls(guestfs, path);
 	if (!ls) {
 		return;
@@ -132,51 +418,51 @@ static void guestfs_dir_fill_children(struct cvirt_mtree_entry *entry,
 		max_length = (max_length > l) ? max_length : l;
 		i++;
 	}
-	struct cvirt_mtree_inode *inode = entry->inode;
-	inode->children = calloc(i, sizeof(struct cvirt_mtree_entry));
-	assert(inode->children);
-	inode->children_capacity = i;
-	inode->children_len = i;
 	struct guestfs_statns_list *stats = guestfs_lstatnslist(guestfs, path, ls);
 	assert(stats);
-	assert(stats->len == inode->children_len);
+	assert(stats->len == i);
 
 	struct guestfs_xattr_list *xattrs = guestfs_lxattrlist(guestfs, path, ls);
 	assert(xattrs);
 	int xattrs_idx = 0;
 
-	int common_len = strlen(path);
-	char *abs_path = calloc(common_len + 1 + max_length + 1, sizeof(char));
-	strcpy(abs_path, path);
-	strcat(abs_path, "/");
-	assert(abs_path);
+	// children that are neither extra links nor skipped, to be walked further
+	bool *walk = calloc(i, sizeof(bool));
+	assert(walk);
+
+	ctx_lock(ctx);
+	struct cvirt_mtree_inode *inode = entry->inode;
+	inode->children = tree_calloc(ctx->tree, i, sizeof(struct cvirt_mtree_entry));
+	inode->children_capacity = i;
+	inode->children_len = i;
 	for (int i = 0; i < inode->children_len; i++) {
-		inode->children[i].name = ls[i];
-		if (stats->val[i].st_nlink > 1) {
-			bool found = false;
-			struct cvirt_list *ptr = ctx->hardlink_inodes;
-			while (ptr->next) {
-				ptr = ptr->next;
-				struct cvirt_mtree_inode *target_inode = ptr->data;
-				if (target_inode->stat.st_dev == stats->val[i].st_dev &&
-						target_inode->stat.st_ino == stats->val[i].st_ino) {
-					inode->children[i].inode = target_inode;
-					target_inode->stat.st_nlink++;
-					if (target_inode->stat.st_nlink == stats->val[i].st_nlink) {
-						// last link, no longer a candidate
-						cvirt_list_remove(ctx->hardlink_inodes, ptr);
-					}
-					found = true;
-					break;
+		inode->children[i].name = tree_adopt_str(ctx->tree, ls[i]);
+		if (stats->val[i].st_nlink > 1 &&
+				!S_ISDIR(stats->val[i].st_mode)) {
+			struct io_entry_guestfs_hardlink key = hardlink_key(subvolume,
+				stats->val[i].st_dev, stats->val[i].st_ino);
+			struct io_entry_guestfs_hardlink *hardlink = hardlink_find(
+				&ctx->hardlink_inodes, &key);
+			if (hardlink) {
+				struct cvirt_mtree_inode *target_inode = hardlink->inode;
+				inode->children[i].inode = target_inode;
+				target_inode->stat.st_nlink++;
+				if (target_inode->stat.st_nlink == stats->val[i].st_nlink) {
+					// last link, no longer a candidate
+					hardlink_remove(&ctx->hardlink_inodes, hardlink);
 				}
-			}
-			if (found) {
+				// xattrs are per inode, already set on first link
+				assert(xattrs_idx < xattrs->len);
+				xattrs_idx += 1 + atoi(xattrs->val[xattrs_idx].attrval);
 				continue;
 			}
-			inode->children[i].inode = cvirt_xcalloc(1, sizeof(struct cvirt_mtree_inode));
-			cvirt_list_append(ctx->hardlink_inodes, inode->children[i].inode);
+			inode->children[i].inode = tree_calloc(ctx->tree, 1,
+				sizeof(struct cvirt_mtree_inode));
+			hardlink_insert(&ctx->hardlink_inodes, &key,
+				inode->children[i].inode);
 		} else {
-			inode->children[i].inode = cvirt_xcalloc(1, sizeof(struct cvirt_mtree_inode));
+			inode->children[i].inode = tree_calloc(ctx->tree, 1,
+				sizeof(struct cvirt_mtree_inode));
 		}
 		copy_stat_from_guestfs_statns(inode->children[i].inode, &stats->val[i]);
 		if (stats->val[i].st_ino == 2 && major(stats->val[i].st_dev) == 0 &&
@@ -202,62 +488,172 @@ static void guestfs_dir_fill_children(struct cvirt_mtree_entry *entry,
 			continue;
 		}
 
-		strcpy(&abs_path[common_len + 1], ls[i]);
-
 		assert(xattrs_idx < xattrs->len);
 		int l = atoi(xattrs->val[xattrs_idx].attrval);
 		xattrs_idx++;
-		set_xattrs_from_guestfs_xattr_array(inode->children[i].inode, &xattrs->val[xattrs_idx], l);
+		set_xattrs_from_guestfs_xattr_array(ctx->tree,
+			inode->children[i].inode, &xattrs->val[xattrs_idx], l);
 		xattrs_idx += l;
+		walk[i] = true;
+	}
+	ctx_unlock(ctx);
+	guestfs_free_xattr_list(xattrs);
 
-		if (S_ISDIR(inode->children[i].inode->stat.st_mode)) {
-			if ((flags & CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS) &&
-					stats->val[i].st_ino == 256 &&
-					major(stats->val[i].st_dev) == 0 &&
-					is_btrfs_subvolume_seen(guestfs, abs_path, ctx)) {
+	int common_len = strlen(path);
+	char *abs_path = calloc(common_len + 1 + max_length + 1, sizeof(char));
+	assert(abs_path);
+	strcpy(abs_path, path);
+	strcat(abs_path, "/");
+	for (int i = 0; i < inode->children_len; i++) {
+		if (!walk[i]) {
+			continue;
+		}
+		struct cvirt_mtree_entry *child = &inode->children[i];
+		strcpy(&abs_path[common_len + 1], child->name);
+
+		if (S_ISDIR(child->inode->stat.st_mode)) {
+			const char *child_subvolume = subvolume;
+			if (stats->val[i].st_ino == 256 &&
+					major(stats->val[i].st_dev) == 0) {
 				/*
 				 * inode number = 256 (BTRFS_FIRST_FREE_OBJECTID),
 				 * root of a subvolume
 				 */
-				continue;
+				ctx_lock(ctx);
+				child_subvolume = (char *)mtree_intern(&ctx->btrfs_subvolumes,
+					abs_path, strlen(abs_path));
+				if (flags & CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS) {
+					subvolume_defer(ctx, child, abs_path, child_subvolume);
+					ctx_unlock(ctx);
+					continue;
+				}
+				ctx_unlock(ctx);
 			}
-			guestfs_dir_fill_children(&inode->children[i], guestfs,
-				abs_path, flags, ctx);
-		} else if (S_ISLNK(inode->children[i].inode->stat.st_mode)) {
+			if (walker->deque) {
+				deque_push(walker, child, abs_path, child_subvolume);
+			} else {
+				guestfs_dir_fill_children(child, abs_path, child_subvolume,
+					walker);
+			}
+		} else if (S_ISLNK(child->inode->stat.st_mode)) {
 			char *link = guestfs_readlink(guestfs, abs_path);
 			assert(link);
-			inode->children[i].inode->target = link;
+			ctx_lock(ctx);
+			child->inode->target = tree_adopt_str(ctx->tree, link);
+			ctx_unlock(ctx);
 		} else if ((flags & CVIRT_MTREE_TREE_CHECKSUM) &&
-				S_ISREG(inode->children[i].inode->stat.st_mode)) {
-			checksum_from_guestfs(inode->children[i].inode->sha256sum,
-				guestfs, abs_path,
-				inode->children[i].inode->stat.st_size, ctx);
+				S_ISREG(child->inode->stat.st_mode)) {
+			checksum_from_guestfs(child->inode->sha256sum, guestfs,
+				abs_path, child->inode->stat.st_size,
+				walker->gcrypt_handle);
 		}
 	}
 	guestfs_free_statns_list(stats);
-	guestfs_free_xattr_list(xattrs);
+	free(walk);
 	free(abs_path);
 	free(ls);
 }
 
-struct cvirt_mtree_entry *cvirt_mtree_tree_from_guestfs(guestfs_h *guestfs, uint32_t flags) {
-	struct cvirt_mtree_entry *result = calloc(1, sizeof(struct cvirt_mtree_entry));
-	if (!result) {
-		return NULL;
+static void deque_push(struct io_entry_guestfs_walker *walker,
+		struct cvirt_mtree_entry *entry, const char *path,
+		const char *subvolume) {
+	struct io_entry_guestfs_deque *deque = walker->deque;
+	struct io_entry_guestfs_pool *pool = walker->ctx->pool;
+	char *task_path = cvirt_xstrdup(path);
+
+	pthread_mutex_lock(&pool->lock);
+	if (deque->tail == deque->capacity) {
+		if (deque->head) {
+			memmove(deque->tasks, &deque->tasks[deque->head],
+				(deque->tail - deque->head) *
+				sizeof(struct io_entry_guestfs_task));
+			deque->tail -= deque->head;
+			deque->head = 0;
+		} else {
+			deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+			deque->tasks = cvirt_xrealloc(deque->tasks, deque->capacity *
+				sizeof(struct io_entry_guestfs_task));
+		}
 	}
+	deque->tasks[deque->tail].entry = entry;
+	deque->tasks[deque->tail].path = task_path;
+	deque->tasks[deque->tail++].subvolume = subvolume;
+	pool->pending++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
 
-	struct io_entry_guestfs_ctx ctx = { .flags = flags };
-	ctx.hardlink_inodes = cvirt_list_new();
-	if (flags & CVIRT_MTREE_TREE_CHECKSUM) {
-		gcry_md_open(&ctx.gcrypt_handle, GCRY_MD_SHA256, 0);
+// called with pool locked
+static bool deque_take(struct io_entry_guestfs_deque *deque, bool own,
+		struct io_entry_guestfs_task *task) {
+	if (deque->head == deque->tail) {
+		return false;
+	}
+	*task = own ? deque->tasks[--deque->tail] : deque->tasks[deque->head++];
+	if (deque->head == deque->tail) {
+		deque->head = deque->tail = 0;
+	}
+	return true;
+}
+
+// own deque first, then steal from others, called with pool locked
+static bool walker_take(struct io_entry_guestfs_walker *walker,
+		struct io_entry_guestfs_task *task) {
+	struct io_entry_guestfs_pool *pool = walker->ctx->pool;
+	bool found = deque_take(walker->deque, true, task);
+	for (int i = 1; !found && i < pool->len; i++) {
+		found = deque_take(&pool->deques[(walker->id + i) % pool->len],
+			false, task);
 	}
-	if (flags & CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS) {
-		ctx.btrfs_uuids = cvirt_list_new();
+	return found;
+}
+
+static void *walker_run(void *arg) {
+	struct io_entry_guestfs_walker *walker = arg;
+	struct io_entry_guestfs_pool *pool = walker->ctx->pool;
+	struct io_entry_guestfs_task task;
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		bool found;
+		while (!(found = walker_take(walker, &task)) && pool->pending) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (!found) {
+			break;
+		}
+
+		guestfs_dir_fill_children(task.entry, task.path, task.subvolume,
+			walker);
+		free(task.path);
+
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->pending) {
+			pthread_cond_broadcast(&pool->cond);
+		}
+		pthread_mutex_unlock(&pool->lock);
 	}
+	return NULL;
+}
 
-	result->name = strdup("/");
-	assert(result->name);
-	result->inode = cvirt_xcalloc(1, sizeof(struct cvirt_mtree_inode));
+static void checksums_from_appliance(struct mtree_tree *tree,
+	guestfs_h *guestfs, struct io_entry_guestfs_ctx *ctx);
+
+static bool guestfs_bulk_scan(guestfs_h *guestfs,
+	struct io_entry_guestfs_ctx *ctx);
+
+static struct mtree_tree *guestfs_tree_new(guestfs_h *guestfs, uint32_t flags,
+		struct io_entry_guestfs_ctx *ctx) {
+	struct mtree_tree *tree = tree_new(flags);
+	struct cvirt_mtree_entry *result = &tree->root;
+
+	ctx->flags = flags;
+	ctx->tree = tree;
+	if (flags & CVIRT_MTREE_TREE_CHECKSUM) {
+		gcry_md_open(&ctx->gcrypt_handle, GCRY_MD_SHA256, 0);
+	}
+	mtree_intern_init(&ctx->btrfs_uuids, NULL);
+	mtree_intern_init(&ctx->btrfs_subvolumes, NULL);
 
 	struct guestfs_statns *stat = guestfs_lstatns(guestfs, "/");
 	assert(stat);
@@ -265,32 +661,157 @@ struct cvirt_mtree_entry *cvirt_mtree_tree_from_guestfs(guestfs_h *guestfs, uint
 	if ((flags & CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS) &&
 			stat->st_ino == 256 && major(stat->st_dev) == 0) {
 		// record subvolume uuid if btrfs
-		is_btrfs_subvolume_seen(guestfs, "/", &ctx);
+		is_btrfs_subvolume_seen(guestfs, "/", ctx);
 	}
 	guestfs_free_statns(stat);
 
 	struct guestfs_xattr_list *xattrs = guestfs_lgetxattrs(guestfs, "/");
 	assert(xattrs);
-	set_xattrs_from_guestfs_xattr_array(result->inode, xattrs->val, xattrs->len);
+	set_xattrs_from_guestfs_xattr_array(tree, result->inode, xattrs->val,
+		xattrs->len);
 	guestfs_free_xattr_list(xattrs);
+	return tree;
+}
+
+static void guestfs_tree_finish(guestfs_h *guestfs,
+		struct io_entry_guestfs_ctx *ctx) {
+	if ((ctx->flags & CVIRT_MTREE_TREE_GUESTFS_CHECKSUM_IN_APPLIANCE) &&
+			(ctx->flags & CVIRT_MTREE_TREE_CHECKSUM)) {
+		checksums_from_appliance(ctx->tree, guestfs, ctx);
+	}
 
-	guestfs_dir_fill_children(result, guestfs, "/", flags, &ctx);
+	free(ctx->hardlink_inodes.slots);
+	for (size_t i = 0; i < ctx->snapshots_len; i++) {
+		free(ctx->snapshots[i]);
+	}
+	free(ctx->snapshots);
+	if (ctx->flags & CVIRT_MTREE_TREE_CHECKSUM) {
+		gcry_md_close(ctx->gcrypt_handle);
+	}
+	mtree_intern_fini(&ctx->btrfs_uuids);
+	mtree_intern_fini(&ctx->btrfs_subvolumes);
+}
 
-	cvirt_list_destroy(ctx.hardlink_inodes);
-	if (flags & CVIRT_MTREE_TREE_CHECKSUM) {
-		gcry_md_close(ctx.gcrypt_handle);
+// checksums are left to checksums_from_appliance
+static uint32_t guestfs_walk_flags(uint32_t flags) {
+	if (flags & CVIRT_MTREE_TREE_GUESTFS_CHECKSUM_IN_APPLIANCE) {
+		return flags & ~CVIRT_MTREE_TREE_CHECKSUM;
+	}
+	return flags;
+}
+
+struct cvirt_mtree_entry *cvirt_mtree_tree_from_guestfs(guestfs_h *guestfs, uint32_t flags) {
+	struct io_entry_guestfs_ctx ctx = {0};
+	struct mtree_tree *tree = guestfs_tree_new(guestfs, flags, &ctx);
+
+	if (!(flags & CVIRT_MTREE_TREE_GUESTFS_BULK_SCAN) ||
+			!guestfs_bulk_scan(guestfs, &ctx)) {
+		struct io_entry_guestfs_walker walker = {
+			.ctx = &ctx,
+			.guestfs = guestfs,
+			.gcrypt_handle = ctx.gcrypt_handle,
+			.flags = guestfs_walk_flags(flags),
+		};
+		guestfs_dir_fill_children(&tree->root, "/",
+			(char *)mtree_intern(&ctx.btrfs_subvolumes, "/", 1), &walker);
+		while (ctx.subvolumes_len) {
+			size_t len;
+			struct io_entry_guestfs_task *tasks =
+				guestfs_walk_subvolumes(guestfs, &ctx, &len);
+			for (size_t i = 0; i < len; i++) {
+				guestfs_dir_fill_children(tasks[i].entry, tasks[i].path,
+					tasks[i].subvolume, &walker);
+				free(tasks[i].path);
+			}
+			free(tasks);
+		}
+	}
+
+	guestfs_tree_finish(guestfs, &ctx);
+	return &tree->root;
+}
+
+// until every queued directory is walked
+static void guestfs_pool_run(struct io_entry_guestfs_pool *pool) {
+	for (int i = 0; i < pool->len; i++) {
+		int res = pthread_create(&pool->walkers[i].thread, NULL, walker_run,
+			&pool->walkers[i]);
+		assert(!res);
+	}
+	for (int i = 0; i < pool->len; i++) {
+		pthread_join(pool->walkers[i].thread, NULL);
+	}
+}
+
+/*
+ * Subtrees are spread over handles with work-stealing, children of a
+ * directory are always filled by one walker so the layout is the same as
+ * walking a single handle. With BTRFS_SKIP_SNAPSHOTS, subvolumes reached
+ * are walked in rounds, see guestfs_walk_subvolumes.
+ */
+struct cvirt_mtree_entry *cvirt_mtree_tree_from_guestfs_pool(guestfs_h **guestfs,
+		int len, uint32_t flags) {
+	// a bulk scan is a single stream, extra handles would idle
+	if (len <= 1 || (flags & CVIRT_MTREE_TREE_GUESTFS_BULK_SCAN)) {
+		return cvirt_mtree_tree_from_guestfs(guestfs[0], flags);
+	}
+
+	struct io_entry_guestfs_ctx ctx = {0};
+	struct mtree_tree *tree = guestfs_tree_new(guestfs[0], flags, &ctx);
+
+	struct io_entry_guestfs_pool pool = {
+		.walkers = cvirt_xcalloc(len, sizeof(struct io_entry_guestfs_walker)),
+		.deques = cvirt_xcalloc(len, sizeof(struct io_entry_guestfs_deque)),
+		.len = len,
+	};
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	pthread_mutex_init(&ctx.lock, NULL);
+	ctx.pool = &pool;
+
+	uint32_t walk_flags = guestfs_walk_flags(flags);
+	for (int i = 0; i < len; i++) {
+		struct io_entry_guestfs_walker *walker = &pool.walkers[i];
+		walker->ctx = &ctx;
+		walker->guestfs = guestfs[i];
+		walker->flags = walk_flags;
+		walker->deque = &pool.deques[i];
+		walker->id = i;
+		if (walk_flags & CVIRT_MTREE_TREE_CHECKSUM) {
+			gcry_md_open(&walker->gcrypt_handle, GCRY_MD_SHA256, 0);
+		}
 	}
-	if (flags & CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS) {
-		struct cvirt_list *ptr = ctx.btrfs_uuids;
-		while (ptr->next) {
-			ptr = ptr->next;
-			char *uuid = ptr->data;
-			free(uuid);
+	deque_push(&pool.walkers[0], &tree->root, "/",
+		(char *)mtree_intern(&ctx.btrfs_subvolumes, "/", 1));
+	guestfs_pool_run(&pool);
+	while (ctx.subvolumes_len) {
+		size_t subvolumes_len;
+		struct io_entry_guestfs_task *tasks =
+			guestfs_walk_subvolumes(guestfs[0], &ctx, &subvolumes_len);
+		for (size_t i = 0; i < subvolumes_len; i++) {
+			deque_push(&pool.walkers[i % len], tasks[i].entry, tasks[i].path,
+				tasks[i].subvolume);
+			free(tasks[i].path);
 		}
-		cvirt_list_destroy(ctx.btrfs_uuids);
+		free(tasks);
+		guestfs_pool_run(&pool);
 	}
 
-	return result;
+	ctx.pool = NULL;
+	for (int i = 0; i < len; i++) {
+		if (walk_flags & CVIRT_MTREE_TREE_CHECKSUM) {
+			gcry_md_close(pool.walkers[i].gcrypt_handle);
+		}
+		free(pool.deques[i].tasks);
+	}
+	free(pool.walkers);
+	free(pool.deques);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&ctx.lock);
+
+	guestfs_tree_finish(guestfs[0], &ctx);
+	return &tree->root;
 }
 
 // normalize /foo ./foo foo foo/ ... -> foo
@@ -324,26 +845,202 @@ static int path_first_part_len(const char *path) {
 	return c;
 }
 
-static struct cvirt_mtree_entry *allocate_child(struct cvirt_mtree_inode *inode,
-		const char *name, int name_len) {
+#define CHILDREN_INDEX_THRESHOLD	16
+
+static uint32_t name_hash(const char *name, int name_len) {
+	uint32_t hash = 2166136261u; // FNV-1a
+	for (int i = 0; i < name_len; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Large directories get a name index while a layer is applied, kept in
+ * struct mtree_apply by inode and dropped when the directory goes away.
+ * Directories with an index never get below CHILDREN_INDEX_THRESHOLD.
+ */
+static size_t children_index_slot(const struct mtree_apply *apply,
+		const struct cvirt_mtree_inode *inode) {
+	uint64_t hash = (uintptr_t)inode * 0x9e3779b97f4a7c15ull;
+	return (hash >> 17) & (apply->indices_capacity - 1);
+}
+
+static struct mtree_children_index *children_index_find(
+		struct mtree_apply *apply, const struct cvirt_mtree_inode *inode) {
+	if (!apply->indices_capacity) {
+		return NULL;
+	}
+	size_t slot = children_index_slot(apply, inode);
+	while (apply->indices[slot].inode) {
+		if (apply->indices[slot].inode == inode) {
+			return &apply->indices[slot];
+		}
+		slot = (slot + 1) & (apply->indices_capacity - 1);
+	}
+	return NULL;
+}
+
+// existing or empty one, valid until the next call
+static struct mtree_children_index *children_index_get(
+		struct mtree_apply *apply, const struct cvirt_mtree_inode *inode) {
+	struct mtree_children_index *index = children_index_find(apply, inode);
+	if (index) {
+		return index;
+	}
+	if ((apply->indices_len + 1) * 2 > apply->indices_capacity) {
+		struct mtree_children_index *old = apply->indices;
+		size_t old_capacity = apply->indices_capacity;
+		apply->indices_capacity = old_capacity ? old_capacity * 2 : 64;
+		apply->indices = cvirt_xcalloc(apply->indices_capacity,
+			sizeof(struct mtree_children_index));
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (!old[i].inode) {
+				continue;
+			}
+			size_t slot = children_index_slot(apply, old[i].inode);
+			while (apply->indices[slot].inode) {
+				slot = (slot + 1) & (apply->indices_capacity - 1);
+			}
+			apply->indices[slot] = old[i];
+		}
+		free(old);
+	}
+	size_t slot = children_index_slot(apply, inode);
+	while (apply->indices[slot].inode) {
+		slot = (slot + 1) & (apply->indices_capacity - 1);
+	}
+	apply->indices[slot].inode = inode;
+	apply->indices_len++;
+	return &apply->indices[slot];
+}
+
+static struct mtree_children_index *children_index_of(struct mtree_tree *tree,
+		const struct cvirt_mtree_inode *inode) {
+	if (!tree->apply || inode->children_len < CHILDREN_INDEX_THRESHOLD) {
+		return NULL;
+	}
+	struct mtree_children_index *index = children_index_find(tree->apply,
+		inode);
+	return index && index->slots ? index : NULL;
+}
+
+// the key stays, so a later inode at the same address starts out without one
+static void children_index_drop(struct mtree_children_index *index) {
+	free(index->slots);
+	index->slots = NULL;
+	index->capacity = 0;
+	index->holes = 0;
+}
+
+static void children_index_insert(struct mtree_children_index *index,
+		const struct cvirt_mtree_inode *inode, unsigned int idx) {
+	const char *name = inode->children[idx].name;
+	unsigned int mask = index->capacity - 1;
+	unsigned int slot = name_hash(name, strlen(name)) & mask;
+	while (index->slots[slot]) {
+		slot = (slot + 1) & mask;
+	}
+	index->slots[slot] = idx + 1;
+}
+
+static void children_index_rehash(struct mtree_children_index *index,
+		const struct cvirt_mtree_inode *inode) {
+	memset(index->slots, 0, index->capacity * sizeof(unsigned int));
+	for (unsigned int i = 0; i < inode->children_len; i++) {
+		if (inode->children[i].name) {
+			children_index_insert(index, inode, i);
+		}
+	}
+}
+
+static void children_index_build(struct mtree_children_index *index,
+		const struct cvirt_mtree_inode *inode) {
+	unsigned int sz = 64;
+	while (sz < inode->children_capacity * 2) {
+		sz *= 2;
+	}
+	free(index->slots);
+	index->slots = cvirt_xcalloc(sz, sizeof(unsigned int));
+	index->capacity = sz;
+	children_index_rehash(index, inode);
+}
+
+static struct cvirt_mtree_entry *children_index_lookup(
+		const struct mtree_children_index *index,
+		struct cvirt_mtree_inode *inode, const char *name, int name_len) {
+	unsigned int mask = index->capacity - 1;
+	unsigned int slot = name_hash(name, name_len) & mask;
+	while (index->slots[slot]) {
+		struct cvirt_mtree_entry *child =
+			&inode->children[index->slots[slot] - 1];
+		if (child->name && !strncmp(child->name, name, name_len) &&
+				!child->name[name_len]) {
+			return child;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+// close the holes left by remove_child, keeping the order
+static void children_compact(struct cvirt_mtree_inode *inode) {
+	unsigned int kept = 0;
+	for (unsigned int i = 0; i < inode->children_len; i++) {
+		if (inode->children[i].name) {
+			inode->children[kept++] = inode->children[i];
+		}
+	}
+	inode->children_len = kept;
+}
+
+static struct cvirt_mtree_entry *allocate_child(struct mtree_tree *tree,
+		struct cvirt_mtree_inode *inode, const char *name, int name_len) {
+	struct mtree_children_index *index = children_index_of(tree, inode);
 	if (inode->children_len < inode->children_capacity) {
 		goto prepare_entry;
 	}
 
 	const unsigned int sz = inode->children ? inode->children_capacity * 2 : 8;
-	inode->children = realloc(inode->children, sz * sizeof(struct cvirt_mtree_entry));
-	memset(&inode->children[inode->children_capacity], 0, (sz - inode->children_capacity) * sizeof(struct cvirt_mtree_entry));
+	inode->children = tree_realloc_array(tree, inode->children,
+		inode->children_capacity, sz, sizeof(struct cvirt_mtree_entry));
 	inode->children_capacity = sz;
+	if (index) {
+		children_index_build(index, inode);
+	}
 
 prepare_entry:
-	inode->children[inode->children_len].name = strndup(name, name_len);
+	tree->sorted = false;
+	inode->children[inode->children_len].name = tree_strndup(tree, name, name_len);
 	inode->children[inode->children_len].inode = NULL;
-	assert(inode->children[inode->children_len].name);
+	if (index) {
+		children_index_insert(index, inode, inode->children_len);
+	}
 	return &inode->children[inode->children_len++];
 }
 
-static struct cvirt_mtree_entry *find_entry(struct cvirt_mtree_entry *entry,
-		const char *name, bool create) {
+static struct cvirt_mtree_entry *find_child(struct mtree_tree *tree,
+		struct cvirt_mtree_inode *inode, const char *name, int name_len) {
+	if (tree->apply && inode->children_len >= CHILDREN_INDEX_THRESHOLD) {
+		struct mtree_children_index *index = children_index_get(tree->apply,
+			inode);
+		if (!index->slots) {
+			children_index_build(index, inode);
+		}
+		return children_index_lookup(index, inode, name, name_len);
+	}
+	for (int i = 0; i < inode->children_len; i++) {
+		if (!strncmp(inode->children[i].name, name, name_len) &&
+				!inode->children[i].name[name_len]) {
+			return &inode->children[i];
+		}
+	}
+	return NULL;
+}
+
+static struct cvirt_mtree_entry *find_entry(struct mtree_tree *tree,
+		struct cvirt_mtree_entry *entry, const char *name, bool create) {
 	int first_part_len = path_first_part_len(name);
 	int name_len = strlen(name);
 	bool last = first_part_len == name_len;
@@ -353,23 +1050,20 @@ static struct cvirt_mtree_entry *find_entry(struct cvirt_mtree_entry *entry,
 	}
 
 	struct cvirt_mtree_inode *inode = entry->inode;
-	for (int i = 0; i < inode->children_len; i++) {
-		if (strlen(inode->children[i].name) == first_part_len &&
-				!strncmp(inode->children[i].name, name, first_part_len)) {
-			if (last) {
-				return &inode->children[i];
-			}
-			if (!S_ISDIR(inode->stat.st_mode)) {
-				// TODO try to follow symlinks?
-				assert("Parent is not a directory" == NULL);
-			}
-
-			struct cvirt_mtree_entry *res = find_entry(
-				&inode->children[i], &name[first_part_len + 1],
-				create);
-			if (res) {
-				return res;
-			}
+	struct cvirt_mtree_entry *child = find_child(tree, inode, name,
+		first_part_len);
+	if (child) {
+		if (last) {
+			return child;
+		}
+		if (!S_ISDIR(inode->stat.st_mode)) {
+			// TODO try to follow symlinks?
+			assert("Parent is not a directory" == NULL);
+		}
+		struct cvirt_mtree_entry *res = find_entry(tree, child,
+			&name[first_part_len + 1], create);
+		if (res) {
+			return res;
 		}
 	}
 
@@ -379,37 +1073,590 @@ static struct cvirt_mtree_entry *find_entry(struct cvirt_mtree_entry *entry,
 
 	// new entry
 	assert(last && "Missing parent directory entries.");
-	return allocate_child(inode, name, first_part_len);
+	return allocate_child(tree, inode, name, first_part_len);
 }
 
-static void copy_stat(struct stat *dest, const struct stat *src) {
-	dest->st_dev = src->st_dev;
-	dest->st_ino = src->st_ino;
-	dest->st_mode = src->st_mode;
-	dest->st_nlink = 1;
-	dest->st_uid = src->st_uid;
-	dest->st_gid = src->st_gid;
-	dest->st_rdev = src->st_rdev;
-	dest->st_size = src->st_size;
-	dest->st_blksize = src->st_blksize;
-	dest->st_blocks = src->st_blocks;
-	dest->st_atim.tv_sec = src->st_atim.tv_sec;
-	dest->st_atim.tv_nsec = src->st_atim.tv_nsec;
-	dest->st_mtim.tv_sec = src->st_mtim.tv_sec;
-	dest->st_mtim.tv_nsec = src->st_mtim.tv_nsec;
-	dest->st_ctim.tv_sec = src->st_ctim.tv_sec;
-	dest->st_ctim.tv_nsec = src->st_ctim.tv_nsec;
-}
+#define GUESTFS_OUT_FILE_TEMPLATE	"/cvirt-mtree-out-XXXXXX"
 
-static void set_xattr_from_libarchive(struct cvirt_mtree_inode *inode,
-		struct archive_entry *archive_entry) {
+// regular files without a digest yet still have the zeroed one
+static bool sha256sum_is_unset(const uint8_t *sum) {
+	for (int i = 0; i < 32; i++) {
+		if (sum[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// path relative to entry, without leading ./ or /
+static struct cvirt_mtree_entry *lookup_path(struct mtree_tree *tree,
+		struct cvirt_mtree_entry *entry, char *path) {
+	while (*path) {
+		if (!S_ISDIR(entry->inode->stat.st_mode)) {
+			return NULL;
+		}
+		int len = path_first_part_len(path);
+		char saved = path[len];
+		path[len] = '\0';
+		entry = find_entry(tree, entry, path, false);
+		path[len] = saved;
+		if (!entry) {
+			return NULL;
+		}
+		path += len;
+		while (*path == '/') {
+			path++;
+		}
+	}
+	return entry;
+}
+
+// line of sha256sum: "<hex>  ./path", escaped with leading \ if needed
+static void merge_checksums_line(struct mtree_tree *tree,
+		struct cvirt_mtree_entry *dir, char *line, ssize_t len) {
+	if (len && line[len - 1] == '\n') {
+		line[--len] = '\0';
+	}
+	bool escaped = line[0] == '\\';
+	if (escaped) {
+		line++;
+		len--;
+	}
+	if (len < 64 + 2 || line[64] != ' ') {
+		return;
+	}
+	char *path = &line[66];
+	if (escaped) {
+		char *src = path, *dst = path;
+		while (*src) {
+			if (src[0] == '\\' && src[1] == 'n') {
+				*dst++ = '\n';
+				src += 2;
+			} else if (src[0] == '\\' && src[1] == 'r') {
+				*dst++ = '\r';
+				src += 2;
+			} else if (src[0] == '\\' && src[1] == '\\') {
+				*dst++ = '\\';
+				src += 2;
+			} else {
+				*dst++ = *src++;
+			}
+		}
+		*dst = '\0';
+	}
+	if (path[0] == '.' && path[1] == '/') {
+		path += 2;
+	}
+	struct cvirt_mtree_entry *entry = lookup_path(tree, dir, path);
+	if (entry && S_ISREG(entry->inode->stat.st_mode)) {
+		hex_to_bin(entry->inode->sha256sum, line, 32);
+	}
+}
+
+// files checksums_out did not report, e.g. raced or unreadable names
+static void checksums_fill_missing(struct cvirt_mtree_entry *entry,
+		guestfs_h *guestfs, const char *path,
+		struct io_entry_guestfs_ctx *ctx) {
+	struct cvirt_mtree_inode *inode = entry->inode;
+	if (S_ISREG(inode->stat.st_mode)) {
+		if (sha256sum_is_unset(inode->sha256sum)) {
+			checksum_from_guestfs(inode->sha256sum, guestfs, path,
+				inode->stat.st_size, ctx->gcrypt_handle);
+		}
+		return;
+	} else if (!S_ISDIR(inode->stat.st_mode)) {
+		return;
+	}
+	int common_len = strlen(path);
+	for (int i = 0; i < inode->children_len; i++) {
+		char child_path[common_len + 1 + strlen(inode->children[i].name) + 1];
+		strcpy(child_path, path);
+		if (path[1]) {
+			strcat(child_path, "/");
+		}
+		strcat(child_path, inode->children[i].name);
+		checksums_fill_missing(&inode->children[i], guestfs, child_path, ctx);
+	}
+}
+
+// unlinked host file for *_out calls to write to, named by fd_path
+static int guestfs_out_file(char *fd_path, size_t len) {
+	const char *tmpdir = getenv("TMPDIR");
+	if (!tmpdir) {
+		tmpdir = "/tmp";
+	}
+	char tmp_filename[strlen(tmpdir) + strlen(GUESTFS_OUT_FILE_TEMPLATE) + 1];
+	strcpy(tmp_filename, tmpdir);
+	strcat(tmp_filename, GUESTFS_OUT_FILE_TEMPLATE);
+	int fd = mkstemp(tmp_filename);
+	if (fd < 0) {
+		return fd;
+	}
+	unlink(tmp_filename);
+	snprintf(fd_path, len, "/dev/fd/%d", fd);
+	return fd;
+}
+
+static void checksums_out_dir(struct mtree_tree *tree, guestfs_h *guestfs,
+		struct cvirt_mtree_entry *dir, const char *path) {
+	char fd_path[32];
+	int fd = guestfs_out_file(fd_path, sizeof(fd_path));
+	if (fd < 0) {
+		return;
+	}
+	if (guestfs_checksums_out(guestfs, "sha256", path, fd_path) < 0) {
+		fprintf(stderr, "checksums_out %s failed, hashing over pread\n", path);
+	} else if (lseek(fd, 0, SEEK_SET) == 0) {
+		FILE *sums = fdopen(fd, "r");
+		if (sums) {
+			fd = -1;
+			char *line = NULL;
+			size_t line_sz = 0;
+			ssize_t len;
+			while ((len = getline(&line, &line_sz, sums)) > 0) {
+				merge_checksums_line(tree, dir, line, len);
+			}
+			free(line);
+			fclose(sums);
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+// 1 if path is a skipped snapshot root, -1 if one is below it, 0 otherwise
+static int snapshot_match(struct io_entry_guestfs_ctx *ctx, const char *path) {
+	size_t len = strlen(path);
+	int res = 0;
+	for (size_t i = 0; i < ctx->snapshots_len; i++) {
+		const char *snapshot = ctx->snapshots[i];
+		if (!strcmp(snapshot, path)) {
+			return 1;
+		} else if (len == 1 || (!strncmp(snapshot, path, len) &&
+				snapshot[len] == '/')) {
+			res = -1;
+		}
+	}
+	return res;
+}
+
+/*
+ * checksums_out follows find into every subvolume, so go down to the
+ * largest subtrees without skipped snapshots. Files on the way are left
+ * to checksums_fill_missing.
+ */
+static void checksums_subtrees(struct mtree_tree *tree, guestfs_h *guestfs,
+		struct cvirt_mtree_entry *entry, const char *path,
+		struct io_entry_guestfs_ctx *ctx) {
+	int match = snapshot_match(ctx, path);
+	if (match > 0) {
+		return;
+	} else if (!match) {
+		checksums_out_dir(tree, guestfs, entry, path);
+		return;
+	}
+	struct cvirt_mtree_inode *inode = entry->inode;
+	int common_len = strlen(path);
+	for (int i = 0; i < inode->children_len; i++) {
+		if (!S_ISDIR(inode->children[i].inode->stat.st_mode)) {
+			continue;
+		}
+		char child_path[common_len + 1 + strlen(inode->children[i].name) + 1];
+		strcpy(child_path, path);
+		if (path[1]) {
+			strcat(child_path, "/");
+		}
+		strcat(child_path, inode->children[i].name);
+		checksums_subtrees(tree, guestfs, &inode->children[i], child_path, ctx);
+	}
+}
+
+/*
+ * Let the appliance hash everything with checksums_out, so only digests
+ * and paths cross the RPC channel instead of whole file contents.
+ */
+static void checksums_from_appliance(struct mtree_tree *tree,
+		guestfs_h *guestfs, struct io_entry_guestfs_ctx *ctx) {
+	checksums_subtrees(tree, guestfs, &tree->root, "/", ctx);
+	checksums_fill_missing(&tree->root, guestfs, "/", ctx);
+}
+
+static void entry_cleanup(struct mtree_tree *tree,
+	struct cvirt_mtree_entry *entry);
+
+static void inode_unref(struct mtree_tree *tree,
+	struct cvirt_mtree_inode *inode);
+
+static void bulk_batch_flush(struct io_entry_guestfs_bulk_batch *batch,
+		guestfs_h *guestfs, struct io_entry_guestfs_ctx *ctx) {
+	if (!batch->len) {
+		return;
+	}
+	batch->names[batch->len] = NULL;
+	struct guestfs_statns_list *stats = guestfs_lstatnslist(guestfs, "/",
+		batch->names);
+	assert(stats);
+	assert(stats->len == batch->len);
+	struct guestfs_xattr_list *xattrs = guestfs_lxattrlist(guestfs, "/",
+		batch->names);
+	assert(xattrs);
+	int xattrs_idx = 0;
+
+	char **links = calloc(batch->len + 1, sizeof(char *));
+	struct cvirt_mtree_inode **link_inodes = calloc(batch->len,
+		sizeof(struct cvirt_mtree_inode *));
+	assert(links && link_inodes);
+	int links_len = 0;
+
+	for (int i = 0; i < batch->len; i++) {
+		struct cvirt_mtree_entry *entry =
+			&batch->items[i].parent->children[batch->items[i].idx];
+		struct guestfs_statns *stat = &stats->val[i];
+		if (stat->st_nlink > 1 && !S_ISDIR(stat->st_mode)) {
+			// a single appliance, st_dev are consistent
+			struct io_entry_guestfs_hardlink key = {
+				.dev = stat->st_dev,
+				.ino = stat->st_ino,
+			};
+			struct io_entry_guestfs_hardlink *hardlink = hardlink_find(
+				&ctx->hardlink_inodes, &key);
+			if (hardlink) {
+				tree_free(ctx->tree, entry->inode,
+					sizeof(struct cvirt_mtree_inode));
+				entry->inode = hardlink->inode;
+				entry->inode->stat.st_nlink++;
+				if (entry->inode->stat.st_nlink == stat->st_nlink) {
+					// last link, no longer a candidate
+					hardlink_remove(&ctx->hardlink_inodes, hardlink);
+				}
+				// xattrs are per inode, already set on first link
+				assert(xattrs_idx < xattrs->len);
+				xattrs_idx += 1 + atoi(xattrs->val[xattrs_idx].attrval);
+				continue;
+			}
+			hardlink_insert(&ctx->hardlink_inodes, &key, entry->inode);
+		}
+		copy_stat_from_guestfs_statns(entry->inode, stat);
+		if (stat->st_ino == 2 && major(stat->st_dev) == 0 &&
+				stat->st_mode == (S_IFDIR | S_IRWXU |
+				S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) &&
+				stat->st_mtime_sec == stat->st_ctime_sec &&
+				stat->st_atime_sec == stat->st_mtime_sec &&
+				stat->st_mtime_nsec == stat->st_ctime_nsec &&
+				stat->st_atime_nsec == stat->st_mtime_nsec) {
+			// empty btrfs subvolume placeholder, see guestfs_dir_fill_children
+			memset(&entry->inode->stat.st_atim, 0, sizeof(struct timespec));
+			memset(&entry->inode->stat.st_mtim, 0, sizeof(struct timespec));
+			memset(&entry->inode->stat.st_ctim, 0, sizeof(struct timespec));
+			continue;
+		}
+
+		assert(xattrs_idx < xattrs->len);
+		int l = atoi(xattrs->val[xattrs_idx].attrval);
+		xattrs_idx++;
+		set_xattrs_from_guestfs_xattr_array(ctx->tree, entry->inode,
+			&xattrs->val[xattrs_idx], l);
+		xattrs_idx += l;
+
+		if (S_ISLNK(stat->st_mode)) {
+			links[links_len] = batch->names[i];
+			link_inodes[links_len++] = entry->inode;
+		}
+	}
+	guestfs_free_statns_list(stats);
+	guestfs_free_xattr_list(xattrs);
+
+	if (links_len) {
+		char **targets = guestfs_readlinklist(guestfs, "/", links);
+		assert(targets);
+		for (int i = 0; i < links_len; i++) {
+			assert(targets[i]);
+			link_inodes[i]->target = tree_adopt_str(ctx->tree, targets[i]);
+		}
+		free(targets);
+	}
+	free(links);
+	free(link_inodes);
+
+	for (int i = 0; i < batch->len; i++) {
+		free(batch->names[i]);
+	}
+	batch->len = 0;
+	batch->bytes = 0;
+}
+
+// order of a depth-first walk with children sorted by strcmp
+static int path_walk_cmp(const void *a, const void *b) {
+	const unsigned char *x = *(const unsigned char **)a;
+	const unsigned char *y = *(const unsigned char **)b;
+	while (*x && *x == *y) {
+		x++;
+		y++;
+	}
+	// subtree of a name comes before names it is a prefix of
+	int cx = *x == '/' ? 1 : *x, cy = *y == '/' ? 1 : *y;
+	return cx - cy;
+}
+
+// path as listed by find0, relative to /, NULL if it is / itself
+static char *bulk_listing_path(char *line) {
+	char *path = line;
+	if (path[0] == '.' && path[1] == '/') {
+		path += 2;
+	}
+	while (*path == '/') {
+		path++;
+	}
+	if (!*path || !strcmp(path, ".")) {
+		return NULL;
+	}
+	return path;
+}
+
+static void bulk_subvolumes_flush(struct io_entry_guestfs_bulk_batch *batch,
+		guestfs_h *guestfs) {
+	if (!batch->len) {
+		return;
+	}
+	batch->names[batch->len] = NULL;
+	struct guestfs_statns_list *stats = guestfs_lstatnslist(guestfs, "/",
+		batch->names);
+	assert(stats);
+	assert(stats->len == batch->len);
+	for (int i = 0; i < batch->len; i++) {
+		struct guestfs_statns *stat = &stats->val[i];
+		if (!S_ISDIR(stat->st_mode) || stat->st_ino != 256 ||
+				major(stat->st_dev) != 0) {
+			free(batch->names[i]);
+			continue;
+		}
+		if (batch->subvolumes_len == batch->subvolumes_capacity) {
+			batch->subvolumes_capacity = batch->subvolumes_capacity ?
+				batch->subvolumes_capacity * 2 : 16;
+			batch->subvolumes = cvirt_xrealloc(batch->subvolumes,
+				batch->subvolumes_capacity * sizeof(char *));
+		}
+		batch->subvolumes[batch->subvolumes_len++] = batch->names[i];
+	}
+	guestfs_free_statns_list(stats);
+	batch->len = 0;
+	batch->bytes = 0;
+}
+
+/*
+ * find0 cannot leave paths out, so decide on subvolume roots in a first
+ * pass over the listing, before the bulk pass stats, reads xattrs of and
+ * adds anything, which then passes over contents of skipped snapshots.
+ * find lists a directory right before its contents, only those with
+ * something listed below them are stat-ed here. Skipped roots are left in
+ * batch->subvolumes, sorted by path_walk_cmp, the order they are checked
+ * in as the recursive walk would.
+ */
+static void bulk_skip_btrfs_snapshots(struct io_entry_guestfs_bulk_batch *batch,
+		FILE *listing, guestfs_h *guestfs, struct io_entry_guestfs_ctx *ctx) {
+	char *line = NULL, *prev = NULL;
+	size_t line_sz = 0, prev_len = 0, prev_capacity = 0;
+	ssize_t read;
+	while ((read = getdelim(&line, &line_sz, '\0', listing)) > 0) {
+		char *path = bulk_listing_path(line);
+		if (!path) {
+			continue;
+		}
+		size_t len = strlen(path);
+		if (prev_len && len > prev_len && path[prev_len] == '/' &&
+				!strncmp(path, prev, prev_len)) {
+			batch->names[batch->len++] = cvirt_xstrndup(prev, prev_len);
+			batch->bytes += prev_len + 1;
+			if (batch->len == MTREE_ENTRY_GUESTFS_BULK_BATCH_LEN ||
+					batch->bytes >= MTREE_ENTRY_GUESTFS_BULK_BATCH_BYTES) {
+				bulk_subvolumes_flush(batch, guestfs);
+			}
+		}
+		if (len + 1 > prev_capacity) {
+			prev_capacity = len + 1;
+			prev = cvirt_xrealloc(prev, prev_capacity);
+		}
+		memcpy(prev, path, len + 1);
+		prev_len = len;
+	}
+	bulk_subvolumes_flush(batch, guestfs);
+	free(line);
+	free(prev);
+	rewind(listing);
+
+	qsort(batch->subvolumes, batch->subvolumes_len, sizeof(char *),
+		path_walk_cmp);
+	size_t kept = 0;
+	const char *skipped = NULL;
+	size_t skipped_len = 0;
+	for (size_t i = 0; i < batch->subvolumes_len; i++) {
+		char *path = batch->subvolumes[i];
+		if (skipped && !strncmp(path, skipped, skipped_len) &&
+				path[skipped_len] == '/') {
+			free(path);
+			continue;
+		}
+		char abs_path[strlen(path) + 2];
+		abs_path[0] = '/';
+		strcpy(&abs_path[1], path);
+		if (!is_btrfs_subvolume_seen(guestfs, abs_path, ctx)) {
+			free(path);
+			continue;
+		}
+		snapshot_skipped(ctx, cvirt_xstrdup(abs_path));
+		batch->subvolumes[kept++] = path;
+		skipped = path;
+		skipped_len = strlen(path);
+	}
+	batch->subvolumes_len = kept;
+}
+
+/*
+ * Rebuild the tree from one find0 listing, in find order parents come
+ * before children so a stack of the current directory chain is enough.
+ * False if listing failed and nothing was touched.
+ */
+static bool guestfs_bulk_scan(guestfs_h *guestfs,
+		struct io_entry_guestfs_ctx *ctx) {
+	char fd_path[32];
+	int fd = guestfs_out_file(fd_path, sizeof(fd_path));
+	if (fd < 0) {
+		return false;
+	}
+	FILE *listing = NULL;
+	if (guestfs_find0(guestfs, "/", fd_path) < 0 ||
+			lseek(fd, 0, SEEK_SET) != 0 || !(listing = fdopen(fd, "r"))) {
+		fprintf(stderr, "find0 failed, walking directories\n");
+		close(fd);
+		return false;
+	}
+
+	struct mtree_tree *tree = ctx->tree;
+	struct io_entry_guestfs_bulk_batch *batch = cvirt_xcalloc(1,
+		sizeof(struct io_entry_guestfs_bulk_batch));
+	if (ctx->flags & CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS) {
+		bulk_skip_btrfs_snapshots(batch, listing, guestfs, ctx);
+	}
+	const char *skipped = NULL; // contents of a skipped snapshot follow
+	size_t skipped_len = 0;
+	struct {
+		struct cvirt_mtree_inode *inode;
+		size_t len;
+	} *dirs = cvirt_xmalloc(16 * sizeof(*dirs));
+	size_t depth = 1, dirs_capacity = 16;
+	dirs[0].inode = tree->root.inode;
+	dirs[0].len = 0;
+	char *current = NULL; // path of dirs[depth - 1]
+	size_t current_capacity = 0;
+
+	char *line = NULL;
+	size_t line_sz = 0;
+	ssize_t read;
+	while ((read = getdelim(&line, &line_sz, '\0', listing)) > 0) {
+		char *path = bulk_listing_path(line);
+		if (!path) {
+			continue;
+		}
+		size_t len = strlen(path);
+		if (skipped) {
+			if (!strncmp(path, skipped, skipped_len) &&
+					path[skipped_len] == '/') {
+				continue;
+			}
+			skipped = NULL;
+		}
+		while (depth > 1 && (strncmp(path, current, dirs[depth - 1].len) ||
+				path[dirs[depth - 1].len] != '/')) {
+			depth--;
+		}
+		size_t name_offset = depth > 1 ? dirs[depth - 1].len + 1 : 0;
+		if (strchr(&path[name_offset], '/')) {
+			fprintf(stderr, "Skipping %s, parent not listed\n", path);
+			continue;
+		}
+
+		struct cvirt_mtree_inode *parent = dirs[depth - 1].inode;
+		struct cvirt_mtree_entry *child = allocate_child(tree, parent,
+			&path[name_offset], len - name_offset);
+		child->inode = tree_calloc(tree, 1, sizeof(struct cvirt_mtree_inode));
+
+		if (depth == dirs_capacity) {
+			dirs_capacity *= 2;
+			dirs = cvirt_xrealloc(dirs, dirs_capacity * sizeof(*dirs));
+		}
+		dirs[depth].inode = child->inode;
+		dirs[depth++].len = len;
+		if (len + 1 > current_capacity) {
+			current_capacity = len + 1;
+			current = cvirt_xrealloc(current, current_capacity);
+		}
+		memcpy(current, path, len + 1);
+
+		batch->names[batch->len] = cvirt_xstrndup(path, len);
+		batch->items[batch->len].parent = parent;
+		batch->items[batch->len++].idx = parent->children_len - 1;
+		batch->bytes += len + 1;
+		if (batch->len == MTREE_ENTRY_GUESTFS_BULK_BATCH_LEN ||
+				batch->bytes >= MTREE_ENTRY_GUESTFS_BULK_BATCH_BYTES) {
+			bulk_batch_flush(batch, guestfs, ctx);
+		}
+
+		if (batch->subvolumes_len) {
+			char **root = bsearch(&path, batch->subvolumes,
+				batch->subvolumes_len, sizeof(char *), path_walk_cmp);
+			if (root) {
+				// kept as an empty directory, like the walk does
+				skipped = *root;
+				skipped_len = len;
+			}
+		}
+	}
+	bulk_batch_flush(batch, guestfs, ctx);
+	free(line);
+	free(current);
+	free(dirs);
+	fclose(listing);
+
+	for (size_t i = 0; i < batch->subvolumes_len; i++) {
+		free(batch->subvolumes[i]);
+	}
+	free(batch->subvolumes);
+	free(batch);
+
+	// same layout as guestfs_ls gives
+	cvirt_mtree_tree_sort(&tree->root);
+
+	if ((ctx->flags & CVIRT_MTREE_TREE_CHECKSUM) &&
+			!(ctx->flags & CVIRT_MTREE_TREE_GUESTFS_CHECKSUM_IN_APPLIANCE)) {
+		checksums_fill_missing(&tree->root, guestfs, "/", ctx);
+	}
+	return true;
+}
+
+static void copy_stat(struct cvirt_mtree_stat *dest, const struct stat *src) {
+	dest->st_mode = src->st_mode;
+	dest->st_nlink = 1;
+	dest->st_uid = src->st_uid;
+	dest->st_gid = src->st_gid;
+	dest->st_rdev = src->st_rdev;
+	dest->st_size = src->st_size;
+	dest->st_atim.tv_sec = src->st_atim.tv_sec;
+	dest->st_atim.tv_nsec = src->st_atim.tv_nsec;
+	dest->st_mtim.tv_sec = src->st_mtim.tv_sec;
+	dest->st_mtim.tv_nsec = src->st_mtim.tv_nsec;
+	dest->st_ctim.tv_sec = src->st_ctim.tv_sec;
+	dest->st_ctim.tv_nsec = src->st_ctim.tv_nsec;
+}
+
+static void set_xattr_from_libarchive(struct mtree_tree *tree,
+		struct cvirt_mtree_inode *inode, struct archive_entry *archive_entry) {
 	int count = archive_entry_xattr_count(archive_entry);
 	if (!count) {
 		return;
 	}
 
-	inode->xattrs = calloc(count, sizeof(struct cvirt_mtree_xattr));
-	assert(inode->xattrs);
+	inode->xattrs = tree_calloc(tree, count, sizeof(struct cvirt_mtree_xattr));
 	inode->xattrs_len = count;
 	inode->xattrs_capacity = count;
 	archive_entry_xattr_reset(archive_entry);
@@ -420,12 +1667,7 @@ static void set_xattr_from_libarchive(struct cvirt_mtree_inode *inode,
 
 	for (int i = 0; i < count; i++) {
 		archive_entry_xattr_next(archive_entry, &name, &val, &sz);
-		inode->xattrs[i].name = strdup(name);
-		assert(inode->xattrs[i].name);
-		inode->xattrs[i].value = calloc(sz, sizeof(uint8_t));
-		assert(inode->xattrs[i].value);
-		memcpy(inode->xattrs[i].value, val, sz);
-		inode->xattrs[i].len = sz;
+		xattr_set(tree, &inode->xattrs[i], name, val, sz);
 	}
 }
 
@@ -455,8 +1697,173 @@ static void checksum_from_archive(uint8_t *dest, struct archive *archive,
 	gcry_md_reset(ctx->gcrypt_handle);
 }
 
-static int apply_layer_addition(struct cvirt_mtree_entry *root,
+static void remove_child(struct mtree_tree *tree,
+		struct cvirt_mtree_inode *inode, int i) {
+	struct mtree_children_index *index = children_index_of(tree, inode);
+	entry_cleanup(tree, &inode->children[i]);
+	if (index) {
+		// hole until the layer is applied, see struct mtree_children_index
+		inode->children[i].name = NULL;
+		inode->children[i].inode = NULL;
+		index->holes++;
+		return;
+	}
+	memmove(&inode->children[i], &inode->children[i + 1],
+		(inode->children_len - 1 - i) * sizeof(struct cvirt_mtree_entry));
+	inode->children_len--;
+}
+
+static size_t declared_slot(const struct mtree_apply *apply,
+		const char *name) {
+	uint64_t hash = (uintptr_t)name * 0x9e3779b97f4a7c15ull;
+	return (hash >> 17) & (apply->declared_capacity - 1);
+}
+
+static void declared_insert(struct mtree_apply *apply, const char *name) {
+	size_t slot = declared_slot(apply, name);
+	while (apply->declared[slot]) {
+		if (apply->declared[slot] == name) {
+			return;
+		}
+		slot = (slot + 1) & (apply->declared_capacity - 1);
+	}
+	apply->declared[slot] = name;
+	apply->declared_len++;
+}
+
+static void declare_entry(struct mtree_apply *apply,
+		const struct cvirt_mtree_entry *entry) {
+	if ((apply->declared_len + 1) * 2 > apply->declared_capacity) {
+		const char **old = apply->declared;
+		size_t old_capacity = apply->declared_capacity;
+		apply->declared_capacity = old_capacity ? old_capacity * 2 : 1024;
+		apply->declared = cvirt_xcalloc(apply->declared_capacity,
+			sizeof(const char *));
+		apply->declared_len = 0;
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (old[i]) {
+				declared_insert(apply, old[i]);
+			}
+		}
+		free(old);
+	}
+	declared_insert(apply, entry->name);
+}
+
+static bool is_declared(const struct mtree_apply *apply,
+		const struct cvirt_mtree_entry *entry) {
+	if (!apply->declared_capacity) {
+		return false;
+	}
+	size_t slot = declared_slot(apply, entry->name);
+	while (apply->declared[slot]) {
+		if (apply->declared[slot] == entry->name) {
+			return true;
+		}
+		slot = (slot + 1) & (apply->declared_capacity - 1);
+	}
+	return false;
+}
+
+/*
+ * Drop everything under inode that was not declared by current layer,
+ * as if whiteouts were applied before additions of this layer.
+ */
+static void prune_undeclared(struct mtree_tree *tree,
+		struct cvirt_mtree_inode *inode) {
+	struct mtree_children_index *index = children_index_of(tree, inode);
+	unsigned int kept = 0;
+	for (unsigned int i = 0; i < inode->children_len; i++) {
+		struct cvirt_mtree_entry *child = &inode->children[i];
+		if (!child->name) {
+			continue;
+		} else if (!is_declared(tree->apply, child)) {
+			entry_cleanup(tree, child);
+			continue;
+		}
+		if (S_ISDIR(child->inode->stat.st_mode)) {
+			prune_undeclared(tree, child->inode);
+		}
+		inode->children[kept++] = *child;
+	}
+	if (kept == inode->children_len) {
+		return;
+	}
+	inode->children_len = kept;
+	if (index && kept < CHILDREN_INDEX_THRESHOLD) {
+		children_index_drop(index);
+	} else if (index) {
+		index->holes = 0;
+		children_index_rehash(index, inode);
+	}
+}
+
+// redeclared entry, keep only children of directory that stays a directory
+static void inode_reset(struct mtree_tree *tree,
+		struct cvirt_mtree_inode *inode, mode_t mode) {
+	xattrs_release(tree, inode);
+
+	if (S_ISDIR(inode->stat.st_mode) && S_ISDIR(mode)) {
+		return;
+	} else if (S_ISDIR(inode->stat.st_mode)) {
+		struct mtree_children_index *index = children_index_of(tree, inode);
+		if (index) {
+			children_index_drop(index);
+		}
+		for (int i = 0; i < inode->children_len; i++) {
+			entry_cleanup(tree, &inode->children[i]);
+		}
+		tree_free(tree, inode->children, inode->children_capacity *
+			sizeof(struct cvirt_mtree_entry));
+	} else if (S_ISLNK(inode->stat.st_mode)) {
+		tree_free_str(tree, inode->target);
+	}
+	memset(inode->sha256sum, 0, sizeof(inode->sha256sum));
+	inode->children = NULL;
+	inode->children_len = 0;
+	inode->children_capacity = 0;
+}
+
+static void apply_whiteout(struct mtree_tree *tree, const char *orig_name,
+		const char *base) {
+	char *dir_dup = normalize_tar_entry_name(orig_name);
+	const char *dir = dirname(dir_dup);
+	struct cvirt_mtree_entry *dir_entry = find_entry(tree, &tree->root, dir,
+		false);
+	if (!dir_entry || !S_ISDIR(dir_entry->inode->stat.st_mode)) {
+		free(dir_dup);
+		return;
+	}
+	if (!strcmp(base, ".wh..wh..opq")) {
+		prune_undeclared(tree, dir_entry->inode);
+	} else if (base[4]) {
+		const char *realname = &base[4];
+		struct cvirt_mtree_inode *inode = dir_entry->inode;
+		struct cvirt_mtree_entry *child = find_child(tree, inode, realname,
+			strlen(realname));
+		if (!child) {
+			// nothing to remove
+		} else if (!is_declared(tree->apply, child)) {
+			remove_child(tree, inode, child - inode->children);
+		} else if (S_ISDIR(child->inode->stat.st_mode)) {
+			// addition wins, but from a clean directory
+			prune_undeclared(tree, child->inode);
+		}
+	}
+	free(dir_dup);
+}
+
+/*
+ * Whiteouts and additions are applied in a single pass over the layer.
+ * Entries declared by the layer are recorded in struct mtree_apply,
+ * whiteouts then only remove what was there before this layer, so the
+ * order of whiteouts and additions within the layer does not matter.
+ */
+static int apply_layer(struct mtree_tree *tree,
 		struct cvirt_oci_r_layer *layer, uint32_t flags) {
+	struct mtree_apply apply = {0};
+	tree->apply = &apply;
+
 	struct io_entry_oci_checksum_ctx checksum_ctx = {0};
 	if (flags & CVIRT_MTREE_TREE_CHECKSUM) {
 		gcry_md_open(&checksum_ctx.gcrypt_handle, GCRY_MD_SHA256, 0);
@@ -469,44 +1876,56 @@ static int apply_layer_addition(struct cvirt_mtree_entry *root,
 			&& res != ARCHIVE_FATAL) {
 		const char *orig_name = archive_entry_pathname(archive_entry);
 		char *basename_dup = cvirt_xstrdup(orig_name);
-		if (!strncmp(basename(basename_dup), ".wh.", 4)) {
-			// whiteouts
+		const char *base = basename(basename_dup);
+		if (!strncmp(base, ".wh.", 4)) {
+			apply_whiteout(tree, orig_name, base);
 			free(basename_dup);
 			continue;
 		}
 		free(basename_dup);
 
 		char *path = normalize_tar_entry_name(orig_name);
-		struct cvirt_mtree_entry *entry = find_entry(root, path, true);
+		struct cvirt_mtree_entry *entry = find_entry(tree, &tree->root,
+			path, true);
 		free(path);
+		declare_entry(&apply, entry);
 
 		const char *hardlink = archive_entry_hardlink(archive_entry);
 		if (hardlink) { // hardlink
 			char *linkpath = normalize_tar_entry_name(hardlink);
-			struct cvirt_mtree_entry *target = find_entry(root, linkpath, false);
+			struct cvirt_mtree_entry *target = find_entry(tree,
+				&tree->root, linkpath, false);
 			assert(target);
 			free(linkpath);
+			struct cvirt_mtree_inode *old = entry->inode;
 			entry->inode = target->inode;
 			entry->inode->stat.st_nlink++;
+			if (old) {
+				inode_unref(tree, old);
+			}
 			continue;
 		}
 
+		const struct stat *st = archive_entry_stat(archive_entry);
 		if (!entry->inode) {
-			entry->inode = cvirt_xcalloc(1, sizeof(struct cvirt_mtree_inode));
+			entry->inode = tree_calloc(tree, 1,
+				sizeof(struct cvirt_mtree_inode));
 		} else if (entry->inode->stat.st_nlink > 1) {
 			entry->inode->stat.st_nlink--;
-			entry->inode = cvirt_xcalloc(1, sizeof(struct cvirt_mtree_inode));
+			entry->inode = tree_calloc(tree, 1,
+				sizeof(struct cvirt_mtree_inode));
+		} else {
+			inode_reset(tree, entry->inode, st->st_mode);
 		}
 
 		struct cvirt_mtree_inode *inode = entry->inode;
-		copy_stat(&inode->stat, archive_entry_stat(archive_entry));
+		copy_stat(&inode->stat, st);
 
-		set_xattr_from_libarchive(inode, archive_entry);
+		set_xattr_from_libarchive(tree, inode, archive_entry);
 
 		if (S_ISLNK(inode->stat.st_mode)) {
-			char *link = strdup(archive_entry_symlink(archive_entry));
-			assert(link);
-			inode->target = link;
+			inode->target = tree_strdup(tree,
+				archive_entry_symlink(archive_entry));
 		} else if ((flags & CVIRT_MTREE_TREE_CHECKSUM) &&
 				S_ISREG(inode->stat.st_mode)) {
 			checksum_from_archive(inode->sha256sum, archive,
@@ -516,85 +1935,32 @@ static int apply_layer_addition(struct cvirt_mtree_entry *root,
 	if (flags & CVIRT_MTREE_TREE_CHECKSUM) {
 		gcry_md_close(checksum_ctx.gcrypt_handle);
 	}
-	if (res == ARCHIVE_FATAL) {
-		return -1;
-	}
-
-	return 0;
-}
-
-static void entry_cleanup(struct cvirt_mtree_entry *entry);
-
-static int apply_layer_substration(struct cvirt_mtree_entry *root,
-		struct cvirt_oci_r_layer *layer, uint32_t flags) {
-	struct archive *archive = cvirt_oci_r_layer_get_libarchive(layer);
-	struct archive_entry *archive_entry;
-	int res;
-	while ((res = archive_read_next_header(archive, &archive_entry)) != ARCHIVE_EOF
-			&& res != ARCHIVE_FATAL) {
-		const char *orig_name = archive_entry_pathname(archive_entry);
-		char *basename_dup = cvirt_xstrdup(orig_name);
-		const char *base = basename(basename_dup);
-		if (strncmp(base, ".wh.", 4)) {
-			// not whiteouts
-			free(basename_dup);
-			continue;
+	// indices cost nothing once the layer is applied
+	for (size_t i = 0; i < apply.indices_capacity; i++) {
+		struct mtree_children_index *index = &apply.indices[i];
+		if (index->holes) {
+			children_compact((struct cvirt_mtree_inode *)index->inode);
 		}
-		char *dir_dup = normalize_tar_entry_name(orig_name);
-		const char *dir = dirname(dir_dup);
-		struct cvirt_mtree_entry *dir_entry = find_entry(root, dir, false);
-		if (!dir_entry || !S_ISDIR(dir_entry->inode->stat.st_mode)) {
-			free(basename_dup);
-			free(dir_dup);
-			continue;
-		}
-		if (!strcmp(base, ".wh..wh..opq")) {
-			for (int i = 0; i < dir_entry->inode->children_len; i++) {
-				entry_cleanup(&dir_entry->inode->children[i]);
-			}
-			dir_entry->inode->children_len = 0;
-		} else {
-			const char *realname = &base[4];
-			if (!*realname) {
-				free(basename_dup);
-				free(dir_dup);
-				continue;
-			}
-
-			for (int i = 0; i < dir_entry->inode->children_len; i++) {
-				if (!strcmp(realname, dir_entry->inode->children[i].name)) {
-					entry_cleanup(&dir_entry->inode->children[i]);
-					memmove(&dir_entry->inode->children[i],
-						&dir_entry->inode->children[i + 1],
-						(dir_entry->inode->children_len - 1 - i) *
-						sizeof(struct cvirt_mtree_entry));
-					break;
-				}
-			}
-		}
-		free(basename_dup);
-		free(dir_dup);
+		free(index->slots);
 	}
+	free(apply.indices);
+	free(apply.declared);
+	tree->apply = NULL;
 	if (res == ARCHIVE_FATAL) {
 		return -1;
 	}
+
 	return 0;
 }
 
 struct cvirt_mtree_entry *cvirt_mtree_tree_from_oci_layer(struct cvirt_oci_r_layer *layer, uint32_t flags) {
-	struct cvirt_mtree_entry *result = calloc(1, sizeof(struct cvirt_mtree_entry));
-	if (!result) {
-		return NULL;
-	}
-
-	result->name = strdup("/");
-	assert(result->name);
-	result->inode = cvirt_xcalloc(1, sizeof(struct cvirt_mtree_inode));
+	struct mtree_tree *tree = tree_new(flags);
+	struct cvirt_mtree_entry *result = &tree->root;
 
 	result->inode->stat.st_mode = S_IFDIR | 0755;
 	result->inode->stat.st_nlink = 1;
 
-	int res = apply_layer_addition(result, layer, flags);
+	int res = apply_layer(tree, layer, flags);
 
 	if (res < 0) {
 		cvirt_mtree_tree_destroy(result);
@@ -606,38 +1972,129 @@ struct cvirt_mtree_entry *cvirt_mtree_tree_from_oci_layer(struct cvirt_oci_r_lay
 
 int cvirt_mtree_tree_oci_apply_layer(struct cvirt_mtree_entry *root,
 		struct cvirt_oci_r_layer *layer, uint32_t flags) {
-	int res = apply_layer_substration(root, layer, flags);
-	if (res < 0) {
-		return res;
+	struct mtree_tree *tree = mtree_tree_of(root);
+	return apply_layer(tree, layer, flags);
+}
+
+static int entry_name_cmp(const void *a, const void *b) {
+	const struct cvirt_mtree_entry *ae = a, *be = b;
+	return strcmp(ae->name, be->name);
+}
+
+static void inode_sort(struct cvirt_mtree_inode *inode) {
+	bool sorted = true;
+	for (unsigned int i = 1; i < inode->children_len; i++) {
+		if (strcmp(inode->children[i - 1].name,
+				inode->children[i].name) > 0) {
+			sorted = false;
+			break;
+		}
 	}
-	cvirt_oci_r_layer_rewind(layer);
-	return apply_layer_addition(root, layer, flags);
+	if (!sorted) {
+		qsort(inode->children, inode->children_len,
+			sizeof(struct cvirt_mtree_entry), entry_name_cmp);
+	}
+	for (unsigned int i = 0; i < inode->children_len; i++) {
+		if (S_ISDIR(inode->children[i].inode->stat.st_mode)) {
+			inode_sort(inode->children[i].inode);
+		}
+	}
+}
 
+void cvirt_mtree_tree_sort(struct cvirt_mtree_entry *root) {
+	struct mtree_tree *tree = mtree_tree_of(root);
+	if (!tree->sorted) {
+		inode_sort(root->inode);
+		tree->sorted = true;
+	}
+}
+
+bool cvirt_mtree_tree_is_sorted(struct cvirt_mtree_entry *tree) {
+	return mtree_tree_of(tree)->sorted;
 }
 
-static void inode_unref(struct cvirt_mtree_inode *inode) {
+static void inode_unref(struct mtree_tree *tree,
+		struct cvirt_mtree_inode *inode) {
 	if (!--inode->stat.st_nlink) {
-		for (int i = 0; i < inode->xattrs_len; i++) {
-			free(inode->xattrs[i].name);
-			free(inode->xattrs[i].value);
-		}
-		free(inode->xattrs);
+		xattrs_release(tree, inode);
 
 		if (S_ISDIR(inode->stat.st_mode)) {
+			struct mtree_children_index *index =
+				children_index_of(tree, inode);
+			if (index) {
+				children_index_drop(index);
+			}
 			for (int i = 0; i < inode->children_len; i++) {
-				entry_cleanup(&inode->children[i]);
+				entry_cleanup(tree, &inode->children[i]);
 			}
-			free(inode->children);
+			tree_free(tree, inode->children, inode->children_capacity *
+				sizeof(struct cvirt_mtree_entry));
 		} else if (S_ISLNK(inode->stat.st_mode)) {
-			free(inode->target);
+			tree_free_str(tree, inode->target);
 		}
-		free(inode);
+		tree_free(tree, inode, sizeof(struct cvirt_mtree_inode));
+	}
+}
+
+static void entry_cleanup(struct mtree_tree *tree,
+		struct cvirt_mtree_entry *entry) {
+	if (!entry->name) { // hole left by remove_child
+		return;
 	}
+	tree_free_str(tree, entry->name);
+	inode_unref(tree, entry->inode);
 }
 
-static void entry_cleanup(struct cvirt_mtree_entry *entry) {
-	free(entry->name);
-	inode_unref(entry->inode);
+uint32_t cvirt_mtree_tree_get_flags(struct cvirt_mtree_entry *tree) {
+	return mtree_tree_of(tree)->flags;
+}
+
+static void tree_source_free(struct mtree_tree *tree) {
+	free(tree->source_manifest);
+	for (int i = 0; i < tree->source_diff_ids_len; i++) {
+		free(tree->source_diff_ids[i]);
+	}
+	free(tree->source_diff_ids);
+	tree->source_manifest = NULL;
+	tree->source_diff_ids = NULL;
+	tree->source_diff_ids_len = 0;
+}
+
+void cvirt_mtree_tree_set_oci_source(struct cvirt_mtree_entry *entry,
+		const char *manifest_digest, struct cvirt_oci_r_config *config) {
+	struct mtree_tree *tree = mtree_tree_of(entry);
+	tree_source_free(tree);
+	tree->source_manifest = cvirt_xstrdup(manifest_digest);
+	int len = cvirt_oci_r_config_get_diff_ids_length(config);
+	if (!len) {
+		return;
+	}
+	tree->source_diff_ids = cvirt_xcalloc(len, sizeof(char *));
+	tree->source_diff_ids_len = len;
+	for (int i = 0; i < len; i++) {
+		const char *diff_id = cvirt_oci_r_config_get_diff_id(config, i);
+		tree->source_diff_ids[i] = cvirt_xstrdup(diff_id ? diff_id : "");
+	}
+}
+
+bool cvirt_mtree_tree_is_oci_source(struct cvirt_mtree_entry *entry,
+		const char *manifest_digest, struct cvirt_oci_r_config *config) {
+	struct mtree_tree *tree = mtree_tree_of(entry);
+	if (!tree->source_manifest ||
+			strcmp(tree->source_manifest, manifest_digest)) {
+		return false;
+	}
+	int len = cvirt_oci_r_config_get_diff_ids_length(config);
+	if (len != tree->source_diff_ids_len) {
+		return false;
+	}
+	for (int i = 0; i < len; i++) {
+		const char *diff_id = cvirt_oci_r_config_get_diff_id(config, i);
+		if (!diff_id || strcmp(tree->source_diff_ids[i], diff_id)) {
+			return false;
+		}
+	}
+	return true;
 }
 
 void cvirt_mtree_tree_destroy(struct cvirt_mtree_entry *entry) {
@@ -645,7 +2102,17 @@ void cvirt_mtree_tree_destroy(struct cvirt_mtree_entry *entry) {
 		return;
 	}
 
-	entry_cleanup(entry);
+	struct mtree_tree *tree = mtree_tree_of(entry);
+	if (tree->arena) {
+		mtree_arena_destroy(tree->arena);
+	} else {
+		entry_cleanup(tree, entry);
+	}
+	mtree_intern_fini(&tree->xattr_strings);
+	if (tree->map) {
+		munmap(tree->map, tree->map_len);
+	}
+	tree_source_free(tree);
 
-	free(entry);
+	free(tree);
 }
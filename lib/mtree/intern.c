@@ -0,0 +1,96 @@
+#include "mtree/intern.h"
+#include "xmem.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void mtree_intern_init(struct mtree_intern *intern, struct mtree_arena *arena) {
+	intern->slots = NULL;
+	intern->capacity = 0;
+	intern->len = 0;
+	intern->arena = arena;
+}
+
+static uint32_t intern_hash(const uint8_t *data, size_t len) {
+	uint32_t hash = 2166136261u; // FNV-1a
+	for (size_t i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void intern_grow(struct mtree_intern *intern) {
+	size_t capacity = intern->capacity ? intern->capacity * 2 : 64;
+	struct mtree_intern_slot *slots = cvirt_xcalloc(capacity,
+		sizeof(struct mtree_intern_slot));
+	for (size_t i = 0; i < intern->capacity; i++) {
+		if (!intern->slots[i].data) {
+			continue;
+		}
+		size_t slot = intern->slots[i].hash & (capacity - 1);
+		while (slots[slot].data) {
+			slot = (slot + 1) & (capacity - 1);
+		}
+		slots[slot] = intern->slots[i];
+	}
+	free(intern->slots);
+	intern->slots = slots;
+	intern->capacity = capacity;
+}
+
+// slot holding data, or the empty slot to store it in
+static struct mtree_intern_slot *intern_find(struct mtree_intern *intern,
+		const void *data, size_t len, uint32_t hash) {
+	size_t mask = intern->capacity - 1;
+	size_t slot = hash & mask;
+	while (intern->slots[slot].data) {
+		struct mtree_intern_slot *s = &intern->slots[slot];
+		if (s->hash == hash && s->len == len && !memcmp(s->data, data, len)) {
+			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return &intern->slots[slot];
+}
+
+uint8_t *mtree_intern_lookup(struct mtree_intern *intern, const void *data,
+		size_t len) {
+	if (!intern->capacity) {
+		return NULL;
+	}
+	return intern_find(intern, data, len, intern_hash(data, len))->data;
+}
+
+uint8_t *mtree_intern(struct mtree_intern *intern, const void *data, size_t len) {
+	if ((intern->len + 1) * 2 > intern->capacity) {
+		intern_grow(intern);
+	}
+	uint32_t hash = intern_hash(data, len);
+	struct mtree_intern_slot *slot = intern_find(intern, data, len, hash);
+	if (slot->data) {
+		return slot->data;
+	}
+
+	uint8_t *copy = intern->arena ?
+		mtree_arena_alloc(intern->arena, len + 1) :
+		cvirt_xcalloc(len + 1, sizeof(uint8_t));
+	memcpy(copy, data, len);
+	slot->data = copy;
+	slot->len = len;
+	slot->hash = hash;
+	intern->len++;
+	return copy;
+}
+
+void mtree_intern_fini(struct mtree_intern *intern) {
+	if (!intern->arena) {
+		for (size_t i = 0; i < intern->capacity; i++) {
+			free(intern->slots[i].data);
+		}
+	}
+	free(intern->slots);
+	intern->slots = NULL;
+	intern->capacity = 0;
+	intern->len = 0;
+}
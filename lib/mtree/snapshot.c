@@ -0,0 +1,451 @@
+#include <convirter/mtree/entry.h>
+#include <convirter/mtree/xattr.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mtree/arena.h"
+#include "mtree/entry.h"
+#include "mtree/intern.h"
+#include "mtree/snapshot.h"
+#include "xmem.h"
+
+struct snapshot_buf {
+	uint8_t *data;
+	size_t len;
+	size_t capacity;
+};
+
+static void *snapshot_buf_append(struct snapshot_buf *buf, const void *data,
+		size_t len) {
+	if (buf->len + len > buf->capacity) {
+		size_t capacity = buf->capacity ? buf->capacity : 4096;
+		while (buf->len + len > capacity) {
+			capacity *= 2;
+		}
+		buf->data = cvirt_xrealloc(buf->data, capacity);
+		buf->capacity = capacity;
+	}
+	void *res = &buf->data[buf->len];
+	if (data) {
+		memcpy(res, data, len);
+	} else {
+		memset(res, 0, len);
+	}
+	buf->len += len;
+	return res;
+}
+
+// pointer -> index, for shared inodes and interned xattr strings
+struct snapshot_ptr_map {
+	struct {
+		const void *key;
+		uint64_t value;
+	} *slots;
+	size_t capacity;
+	size_t len;
+};
+
+static size_t snapshot_ptr_slot(const struct snapshot_ptr_map *map,
+		const void *key) {
+	uint64_t hash = (uintptr_t)key * 0x9e3779b97f4a7c15ull;
+	return (hash >> 17) & (map->capacity - 1);
+}
+
+static bool snapshot_ptr_map_get(const struct snapshot_ptr_map *map,
+		const void *key, uint64_t *value) {
+	if (!map->capacity) {
+		return false;
+	}
+	size_t slot = snapshot_ptr_slot(map, key);
+	while (map->slots[slot].key) {
+		if (map->slots[slot].key == key) {
+			*value = map->slots[slot].value;
+			return true;
+		}
+		slot = (slot + 1) & (map->capacity - 1);
+	}
+	return false;
+}
+
+static void snapshot_ptr_map_put(struct snapshot_ptr_map *map,
+		const void *key, uint64_t value) {
+	if ((map->len + 1) * 2 > map->capacity) {
+		struct snapshot_ptr_map grown = {
+			.capacity = map->capacity ? map->capacity * 2 : 1024,
+		};
+		grown.slots = cvirt_xcalloc(grown.capacity, sizeof(*grown.slots));
+		for (size_t i = 0; i < map->capacity; i++) {
+			if (map->slots[i].key) {
+				snapshot_ptr_map_put(&grown, map->slots[i].key,
+					map->slots[i].value);
+			}
+		}
+		free(map->slots);
+		*map = grown;
+	}
+	size_t slot = snapshot_ptr_slot(map, key);
+	while (map->slots[slot].key) {
+		slot = (slot + 1) & (map->capacity - 1);
+	}
+	map->slots[slot].key = key;
+	map->slots[slot].value = value;
+	map->len++;
+}
+
+static uint64_t snapshot_add_string(struct snapshot_buf *strings,
+		const void *data, size_t len) {
+	uint64_t offset = strings->len;
+	snapshot_buf_append(strings, data, len);
+	snapshot_buf_append(strings, "", 1);
+	return offset;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+	const uint8_t *ptr = buf;
+	while (len) {
+		ssize_t res = write(fd, ptr, len);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		ptr += res;
+		len -= res;
+	}
+	return 0;
+}
+
+int cvirt_mtree_tree_save(struct cvirt_mtree_entry *tree, int fd) {
+	struct snapshot_buf inodes = {0}, xattrs = {0}, entries = {0},
+		strings = {0};
+	struct snapshot_ptr_map inode_indices = {0}, string_offsets = {0};
+	// entries in output order, directories expanded breadth-first
+	struct cvirt_mtree_entry **queue = cvirt_xmalloc(
+		sizeof(struct cvirt_mtree_entry *));
+	size_t queue_len = 1, queue_capacity = 1;
+	queue[0] = tree;
+
+	for (size_t k = 0; k < queue_len; k++) {
+		struct cvirt_mtree_entry *entry = queue[k];
+		struct cvirt_mtree_inode *inode = entry->inode;
+		struct mtree_snapshot_entry out_entry = {
+			.name_offset = snapshot_add_string(&strings, entry->name,
+				strlen(entry->name)),
+		};
+		if (snapshot_ptr_map_get(&inode_indices, inode, &out_entry.inode)) {
+			snapshot_buf_append(&entries, &out_entry, sizeof(out_entry));
+			continue;
+		}
+		out_entry.inode = inodes.len / sizeof(struct mtree_snapshot_inode);
+		if (!S_ISDIR(inode->stat.st_mode) && inode->stat.st_nlink > 1) {
+			snapshot_ptr_map_put(&inode_indices, inode, out_entry.inode);
+		}
+		snapshot_buf_append(&entries, &out_entry, sizeof(out_entry));
+
+		struct mtree_snapshot_inode out = {
+			.mode = inode->stat.st_mode,
+			.uid = inode->stat.st_uid,
+			.gid = inode->stat.st_gid,
+			.nlink = inode->stat.st_nlink,
+			.size = inode->stat.st_size,
+			.rdev = inode->stat.st_rdev,
+			.atime_sec = inode->stat.st_atim.tv_sec,
+			.mtime_sec = inode->stat.st_mtim.tv_sec,
+			.ctime_sec = inode->stat.st_ctim.tv_sec,
+			.atime_nsec = inode->stat.st_atim.tv_nsec,
+			.mtime_nsec = inode->stat.st_mtim.tv_nsec,
+			.ctime_nsec = inode->stat.st_ctim.tv_nsec,
+			.xattrs_start = xattrs.len / sizeof(struct mtree_snapshot_xattr),
+			.xattrs_len = inode->xattrs_len,
+		};
+		for (int i = 0; i < inode->xattrs_len; i++) {
+			struct cvirt_mtree_xattr *xattr = &inode->xattrs[i];
+			struct mtree_snapshot_xattr out_xattr = { .len = xattr->len };
+			if (!snapshot_ptr_map_get(&string_offsets, xattr->name,
+					&out_xattr.name_offset)) {
+				out_xattr.name_offset = snapshot_add_string(&strings,
+					xattr->name, strlen(xattr->name));
+				snapshot_ptr_map_put(&string_offsets, xattr->name,
+					out_xattr.name_offset);
+			}
+			if (!snapshot_ptr_map_get(&string_offsets, xattr->value,
+					&out_xattr.value_offset)) {
+				out_xattr.value_offset = snapshot_add_string(&strings,
+					xattr->value, xattr->len);
+				snapshot_ptr_map_put(&string_offsets, xattr->value,
+					out_xattr.value_offset);
+			}
+			snapshot_buf_append(&xattrs, &out_xattr, sizeof(out_xattr));
+		}
+
+		if (S_ISDIR(inode->stat.st_mode)) {
+			out.inode_flags |= mtree_tree_of(tree)->sorted ?
+				MTREE_SNAPSHOT_INODE_SORTED : 0;
+			out.children_start = queue_len;
+			out.children_len = inode->children_len;
+			if (queue_len + inode->children_len > queue_capacity) {
+				while (queue_len + inode->children_len > queue_capacity) {
+					queue_capacity *= 2;
+				}
+				queue = cvirt_xrealloc(queue,
+					queue_capacity * sizeof(struct cvirt_mtree_entry *));
+			}
+			for (int i = 0; i < inode->children_len; i++) {
+				queue[queue_len++] = &inode->children[i];
+			}
+		} else if (S_ISLNK(inode->stat.st_mode)) {
+			out.target_offset = snapshot_add_string(&strings,
+				inode->target, strlen(inode->target));
+		} else if (S_ISREG(inode->stat.st_mode)) {
+			memcpy(out.sha256sum, inode->sha256sum, 32);
+		}
+		snapshot_buf_append(&inodes, &out, sizeof(out));
+	}
+
+	struct mtree_tree *source = mtree_tree_of(tree);
+	uint64_t source_offset = MTREE_SNAPSHOT_NO_SOURCE;
+	if (source->source_manifest) {
+		source_offset = snapshot_add_string(&strings, source->source_manifest,
+			strlen(source->source_manifest));
+		for (int i = 0; i < source->source_diff_ids_len; i++) {
+			snapshot_add_string(&strings, source->source_diff_ids[i],
+				strlen(source->source_diff_ids[i]));
+		}
+	}
+
+	struct mtree_snapshot_header header = {
+		.magic = MTREE_SNAPSHOT_MAGIC,
+		.version = MTREE_SNAPSHOT_VERSION,
+		.byte_order = MTREE_SNAPSHOT_BYTE_ORDER,
+		.flags = cvirt_mtree_tree_get_flags(tree) &
+			(CVIRT_MTREE_TREE_CHECKSUM |
+			CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS),
+		.inodes_offset = sizeof(struct mtree_snapshot_header),
+		.inodes_count = inodes.len / sizeof(struct mtree_snapshot_inode),
+		.xattrs_count = xattrs.len / sizeof(struct mtree_snapshot_xattr),
+		.entries_count = entries.len / sizeof(struct mtree_snapshot_entry),
+		.strings_size = strings.len,
+		.source_offset = source_offset,
+		.source_diff_ids_count = source->source_diff_ids_len,
+	};
+	header.xattrs_offset = header.inodes_offset + inodes.len;
+	header.entries_offset = header.xattrs_offset + xattrs.len;
+	header.strings_offset = header.entries_offset + entries.len;
+
+	int res = write_full(fd, &header, sizeof(header));
+	if (!res) {
+		res = write_full(fd, inodes.data, inodes.len);
+	}
+	if (!res) {
+		res = write_full(fd, xattrs.data, xattrs.len);
+	}
+	if (!res) {
+		res = write_full(fd, entries.data, entries.len);
+	}
+	if (!res) {
+		res = write_full(fd, strings.data, strings.len);
+	}
+
+	free(queue);
+	free(inode_indices.slots);
+	free(string_offsets.slots);
+	free(inodes.data);
+	free(xattrs.data);
+	free(entries.data);
+	free(strings.data);
+	return res;
+}
+
+static bool snapshot_section_valid(const struct stat *st, uint64_t offset,
+		uint64_t count, size_t size) {
+	return offset % 8 == 0 && offset <= (uint64_t)st->st_size &&
+		count <= ((uint64_t)st->st_size - offset) / size;
+}
+
+/*
+ * Nodes are laid out in three bulk allocations from the tree arena,
+ * strings are used in place from the read-only mapping.
+ */
+struct cvirt_mtree_entry *cvirt_mtree_tree_load_mmap(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open snapshot: %s\n", strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(struct mtree_snapshot_header)) {
+		fprintf(stderr, "Invalid snapshot: %s\n", path);
+		close(fd);
+		return NULL;
+	}
+	uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map snapshot: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	const struct mtree_snapshot_header *header = (void *)map;
+	if (memcmp(header->magic, MTREE_SNAPSHOT_MAGIC, 8) ||
+			header->version != MTREE_SNAPSHOT_VERSION ||
+			header->byte_order != MTREE_SNAPSHOT_BYTE_ORDER ||
+			!snapshot_section_valid(&st, header->inodes_offset,
+				header->inodes_count, sizeof(struct mtree_snapshot_inode)) ||
+			!snapshot_section_valid(&st, header->xattrs_offset,
+				header->xattrs_count, sizeof(struct mtree_snapshot_xattr)) ||
+			!snapshot_section_valid(&st, header->entries_offset,
+				header->entries_count, sizeof(struct mtree_snapshot_entry)) ||
+			!snapshot_section_valid(&st, header->strings_offset,
+				header->strings_size, 1) ||
+			!header->entries_count || !header->strings_size ||
+			map[header->strings_offset + header->strings_size - 1]) {
+		fprintf(stderr, "Invalid snapshot: %s\n", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	const struct mtree_snapshot_inode *in_inodes =
+		(void *)&map[header->inodes_offset];
+	const struct mtree_snapshot_xattr *in_xattrs =
+		(void *)&map[header->xattrs_offset];
+	const struct mtree_snapshot_entry *in_entries =
+		(void *)&map[header->entries_offset];
+	char *strings = (char *)&map[header->strings_offset];
+
+	struct mtree_tree *tree = cvirt_xcalloc(1, sizeof(struct mtree_tree));
+	tree->arena = mtree_arena_new();
+	mtree_intern_init(&tree->xattr_strings, tree->arena);
+	tree->flags = header->flags | CVIRT_MTREE_TREE_ARENA;
+	tree->map = map;
+	tree->map_len = st.st_size;
+
+	// a single block, so that freeing nodes can tell them apart
+	size_t inodes_size = header->inodes_count *
+		sizeof(struct cvirt_mtree_inode);
+	size_t entries_size = header->entries_count *
+		sizeof(struct cvirt_mtree_entry);
+	tree->nodes_len = inodes_size + entries_size +
+		header->xattrs_count * sizeof(struct cvirt_mtree_xattr);
+	tree->nodes = mtree_arena_alloc(tree->arena, tree->nodes_len);
+	struct cvirt_mtree_inode *inodes = tree->nodes;
+	struct cvirt_mtree_entry *entries =
+		(void *)((char *)tree->nodes + inodes_size);
+	struct cvirt_mtree_xattr *xattrs =
+		(void *)((char *)tree->nodes + inodes_size + entries_size);
+
+	for (uint64_t i = 0; i < header->xattrs_count; i++) {
+		if (in_xattrs[i].name_offset >= header->strings_size ||
+				in_xattrs[i].value_offset > header->strings_size ||
+				in_xattrs[i].len > header->strings_size -
+				in_xattrs[i].value_offset) {
+			goto invalid;
+		}
+		xattrs[i].name = &strings[in_xattrs[i].name_offset];
+		xattrs[i].value = (uint8_t *)&strings[in_xattrs[i].value_offset];
+		xattrs[i].len = in_xattrs[i].len;
+	}
+
+	bool sorted = true;
+	for (uint64_t i = 0; i < header->inodes_count; i++) {
+		const struct mtree_snapshot_inode *in = &in_inodes[i];
+		struct cvirt_mtree_inode *inode = &inodes[i];
+		if (in->xattrs_start > header->xattrs_count ||
+				in->xattrs_len > header->xattrs_count - in->xattrs_start) {
+			goto invalid;
+		}
+		inode->stat.st_mode = in->mode;
+		inode->stat.st_uid = in->uid;
+		inode->stat.st_gid = in->gid;
+		inode->stat.st_nlink = in->nlink;
+		inode->stat.st_size = in->size;
+		inode->stat.st_rdev = in->rdev;
+		inode->stat.st_atim.tv_sec = in->atime_sec;
+		inode->stat.st_atim.tv_nsec = in->atime_nsec;
+		inode->stat.st_mtim.tv_sec = in->mtime_sec;
+		inode->stat.st_mtim.tv_nsec = in->mtime_nsec;
+		inode->stat.st_ctim.tv_sec = in->ctime_sec;
+		inode->stat.st_ctim.tv_nsec = in->ctime_nsec;
+		if (in->xattrs_len) {
+			inode->xattrs = &xattrs[in->xattrs_start];
+			inode->xattrs_len = in->xattrs_len;
+			inode->xattrs_capacity = in->xattrs_len;
+		}
+		if (S_ISDIR(in->mode)) {
+			// children always come after their parent, no cycles
+			if (!in->children_start ||
+					in->children_start > header->entries_count ||
+					in->children_len > header->entries_count -
+					in->children_start) {
+				goto invalid;
+			}
+			inode->children = &entries[in->children_start];
+			inode->children_len = in->children_len;
+			inode->children_capacity = in->children_len;
+			sorted = sorted &&
+				(in->inode_flags & MTREE_SNAPSHOT_INODE_SORTED);
+		} else if (S_ISLNK(in->mode)) {
+			if (in->target_offset >= header->strings_size) {
+				goto invalid;
+			}
+			inode->target = &strings[in->target_offset];
+		} else if (S_ISREG(in->mode)) {
+			memcpy(inode->sha256sum, in->sha256sum, 32);
+		}
+	}
+
+	for (uint64_t i = 0; i < header->entries_count; i++) {
+		if (in_entries[i].name_offset >= header->strings_size ||
+				in_entries[i].inode >= header->inodes_count) {
+			goto invalid;
+		}
+		const struct mtree_snapshot_inode *in = &in_inodes[in_entries[i].inode];
+		if (S_ISDIR(in->mode) && in->children_start <= i) {
+			goto invalid;
+		}
+		entries[i].name = &strings[in_entries[i].name_offset];
+		entries[i].inode = &inodes[in_entries[i].inode];
+	}
+	if (!S_ISDIR(entries[0].inode->stat.st_mode)) {
+		goto invalid;
+	}
+	tree->root = entries[0];
+	tree->sorted = sorted;
+
+	if (header->source_offset != MTREE_SNAPSHOT_NO_SOURCE) {
+		// strings are NUL-terminated, checked above
+		uint64_t offset = header->source_offset;
+		if (offset >= header->strings_size ||
+				header->source_diff_ids_count > header->strings_size) {
+			goto invalid;
+		}
+		tree->source_manifest = cvirt_xstrdup(&strings[offset]);
+		offset += strlen(&strings[offset]) + 1;
+		if (header->source_diff_ids_count) {
+			tree->source_diff_ids = cvirt_xcalloc(
+				header->source_diff_ids_count, sizeof(char *));
+		}
+		for (uint64_t i = 0; i < header->source_diff_ids_count; i++) {
+			if (offset >= header->strings_size) {
+				goto invalid;
+			}
+			tree->source_diff_ids[i] = cvirt_xstrdup(&strings[offset]);
+			tree->source_diff_ids_len++;
+			offset += strlen(&strings[offset]) + 1;
+		}
+	}
+
+	return &tree->root;
+invalid:
+	fprintf(stderr, "Invalid snapshot: %s\n", path);
+	cvirt_mtree_tree_destroy(&tree->root);
+	return NULL;
+}
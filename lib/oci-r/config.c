@@ -4,7 +4,6 @@
 
 #include <json_object.h>
 
-#include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,7 +20,6 @@ struct cvirt_oci_r_config *cvirt_oci_r_config_from_archive_blob(int fd,
 	if (!name) {
 		goto err;
 	}
-	assert(lseek(fd, 0, SEEK_SET) == 0);
 	config->obj = json_from_archive(fd, name);
 	free(name);
 	if (!config->obj) {
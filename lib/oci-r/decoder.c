@@ -0,0 +1,584 @@
+#include "oci-r/decoder.h"
+#include "xmem.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+#include <zstd.h>
+
+// output pieces of a frame or member decoded on the decoder thread
+#define DECODER_CHUNK		(1024 * 1024)
+// decoded bytes of one parallel round, split between threads
+#define DECODER_BYTES_MAX	(256 * 1024 * 1024)
+#define DECODER_JOB_OUT_MIN	(16 * 1024 * 1024)
+// decoded bytes waiting for the reader, room for the next round
+#define DECODER_RING_BYTES	DECODER_BYTES_MAX
+// zlib counts input in uInt
+#define INFLATE_INPUT_MAX	(1U << 30)
+
+#define ZSTD_SKIPPABLE_MAGIC	0x184D2A50U
+#define ZSTD_SKIPPABLE_MASK	0xFFFFFFF0U
+
+struct decoder_chunk {
+	uint8_t *data;
+	size_t len;
+	struct decoder_chunk *next;
+};
+
+// a gzip member decoded by a job
+struct decoder_member {
+	size_t start;
+	size_t out_offset;
+};
+
+struct decoder_job {
+	struct layer_decoder *decoder;
+	// zstd: the frame, gzip: members starting within, start may be a
+	// guess unless exact
+	size_t start, end;
+	bool exact;
+
+	uint8_t *out;
+	size_t out_len, out_capacity;
+	struct decoder_member *members;
+	int members_len, members_capacity;
+	size_t stop; // gzip: input offset after last complete member
+	int res;
+};
+
+struct layer_decoder {
+	const uint8_t *src;
+	size_t len;
+	enum cvirt_oci_r_layer_compression compression;
+	int threads;
+	size_t job_out_max;
+	// for sizing gzip spans by the ratio seen so far
+	size_t in_total, out_total;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// queue of chunks, bounded by DECODER_RING_BYTES
+	struct decoder_chunk *ring_head, *ring_tail;
+	size_t ring_bytes;
+	bool done, cancel;
+	int res;
+
+	uint8_t *current; // chunk last returned by layer_decoder_read
+	pthread_t thread;
+};
+
+// hands data over to the reader, in order
+static int ring_push(struct layer_decoder *decoder, uint8_t *data, size_t len) {
+	pthread_mutex_lock(&decoder->lock);
+	// a chunk over the bound still goes through once the ring is empty
+	while (decoder->ring_head &&
+			decoder->ring_bytes + len > DECODER_RING_BYTES &&
+			!decoder->cancel) {
+		pthread_cond_wait(&decoder->cond, &decoder->lock);
+	}
+	if (decoder->cancel) {
+		pthread_mutex_unlock(&decoder->lock);
+		free(data);
+		return -ECANCELED;
+	}
+	struct decoder_chunk *chunk = cvirt_xmalloc(sizeof(struct decoder_chunk));
+	chunk->data = data;
+	chunk->len = len;
+	chunk->next = NULL;
+	if (decoder->ring_tail) {
+		decoder->ring_tail->next = chunk;
+	} else {
+		decoder->ring_head = chunk;
+	}
+	decoder->ring_tail = chunk;
+	decoder->ring_bytes += len;
+	pthread_cond_broadcast(&decoder->cond);
+	pthread_mutex_unlock(&decoder->lock);
+	return 0;
+}
+
+static int ring_push_copy(struct layer_decoder *decoder, const uint8_t *data,
+		size_t len) {
+	uint8_t *copy = cvirt_xmalloc(len);
+	memcpy(copy, data, len);
+	return ring_push(decoder, copy, len);
+}
+
+static void job_reserve(struct decoder_job *job, size_t len) {
+	if (job->out_capacity - job->out_len >= len) {
+		return;
+	}
+	size_t capacity = job->out_capacity ? job->out_capacity : DECODER_CHUNK;
+	while (capacity - job->out_len < len) {
+		capacity *= 2;
+	}
+	job->out = cvirt_xrealloc(job->out, capacity);
+	job->out_capacity = capacity;
+}
+
+static bool gzip_is_header(const uint8_t *p, size_t left) {
+	// magic, deflate, no reserved flags, and room for header and trailer
+	return left >= 18 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 &&
+		!(p[3] & 0xe0);
+}
+
+/*
+ * Inflate the member at pos into job->out, as long as the output of the
+ * job stays within job->decoder->job_out_max. On success, pos is moved
+ * past the member.
+ */
+static int gzip_inflate_member(struct decoder_job *job, size_t *pos) {
+	struct layer_decoder *decoder = job->decoder;
+	z_stream strm = {0};
+	if (inflateInit2(&strm, 15 + 16) != Z_OK) {
+		return -ENOMEM;
+	}
+	size_t out_start = job->out_len;
+	size_t in_pos = *pos;
+	int res, err = 0;
+	do {
+		if (!strm.avail_in && in_pos < decoder->len) {
+			size_t left = decoder->len - in_pos;
+			strm.next_in = (uint8_t *)&decoder->src[in_pos];
+			strm.avail_in = left > INFLATE_INPUT_MAX ? INFLATE_INPUT_MAX : left;
+			in_pos += strm.avail_in;
+		}
+		if (job->out_len >= decoder->job_out_max) {
+			err = -E2BIG;
+			break;
+		}
+		job_reserve(job, DECODER_CHUNK);
+		strm.next_out = &job->out[job->out_len];
+		strm.avail_out = DECODER_CHUNK;
+		// with room for output, Z_BUF_ERROR means truncated input
+		res = inflate(&strm, Z_NO_FLUSH);
+		job->out_len += DECODER_CHUNK - strm.avail_out;
+		if (res != Z_OK && res != Z_STREAM_END) {
+			err = res == Z_MEM_ERROR ? -ENOMEM : -EINVAL;
+		}
+	} while (!err && res != Z_STREAM_END);
+	if (!err) {
+		*pos += strm.total_in;
+	} else {
+		job->out_len = out_start;
+	}
+	inflateEnd(&strm);
+	return err;
+}
+
+static void job_add_member(struct decoder_job *job, size_t start, size_t out_offset) {
+	if (job->members_len == job->members_capacity) {
+		job->members_capacity = job->members_capacity ? job->members_capacity * 2 : 16;
+		job->members = cvirt_xrealloc(job->members,
+			job->members_capacity * sizeof(struct decoder_member));
+	}
+	job->members[job->members_len].start = start;
+	job->members[job->members_len].out_offset = out_offset;
+	job->members_len++;
+}
+
+/*
+ * Decode members starting in [start, end). Unless exact, start is only
+ * where to look for a gzip header, a wrong guess fails CRC and length
+ * checks and the next candidate is tried.
+ *
+ * Output is capped at job_out_max, members from there on are left to the
+ * next round, starting at stop. A first member over the cap alone is left
+ * to the decoder thread.
+ */
+static void gzip_job_run(struct decoder_job *job) {
+	struct layer_decoder *decoder = job->decoder;
+	size_t pos = job->start;
+	job->stop = pos;
+	while (pos < job->end && job->out_len < decoder->job_out_max) {
+		const uint8_t *p = &decoder->src[pos];
+		if (!job->exact && !job->members_len) {
+			const uint8_t *found = memchr(p, 0x1f, job->end - pos);
+			if (!found) {
+				break;
+			}
+			pos = found - decoder->src;
+			p = found;
+		}
+		if (!gzip_is_header(p, decoder->len - pos)) {
+			if (job->exact || job->members_len) {
+				break;
+			}
+			pos++;
+			continue;
+		}
+		size_t start = pos, out_offset = job->out_len;
+		job->res = gzip_inflate_member(job, &pos);
+		if (job->res == -EINVAL && !job->exact && !job->members_len) {
+			// not a member after all
+			job->res = 0;
+			pos = start + 1;
+			continue;
+		}
+		if (job->res == -E2BIG && job->members_len) {
+			job->res = 0;
+			break;
+		}
+		if (job->res < 0) {
+			break;
+		}
+		job_add_member(job, start, out_offset);
+		job->stop = pos;
+	}
+}
+
+// frames of the job, out_capacity being their content sizes
+static void zstd_job_run(struct decoder_job *job) {
+	struct layer_decoder *decoder = job->decoder;
+	size_t size = job->out_capacity;
+	job->out = cvirt_xmalloc(size ? size : 1);
+	size_t res = ZSTD_decompress(job->out, size, &decoder->src[job->start],
+		job->end - job->start);
+	if (ZSTD_isError(res) || res != size) {
+		job->res = -EINVAL;
+		return;
+	}
+	job->out_len = res;
+}
+
+static void *job_thread_run(void *arg) {
+	struct decoder_job *job = arg;
+	if (job->decoder->compression == CVIRT_OCI_R_LAYER_COMPRESSION_GZIP) {
+		gzip_job_run(job);
+	} else {
+		zstd_job_run(job);
+	}
+	return NULL;
+}
+
+static void jobs_run(struct decoder_job *jobs, int len) {
+	pthread_t threads[len];
+	bool started[len];
+	for (int i = 1; i < len; i++) {
+		started[i] = !pthread_create(&threads[i], NULL, job_thread_run, &jobs[i]);
+	}
+	job_thread_run(&jobs[0]);
+	for (int i = 1; i < len; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		} else {
+			job_thread_run(&jobs[i]);
+		}
+	}
+}
+
+static void jobs_free(struct decoder_job *jobs, int len) {
+	for (int i = 0; i < len; i++) {
+		free(jobs[i].out);
+		free(jobs[i].members);
+		jobs[i] = (struct decoder_job){0};
+	}
+}
+
+// inflate the member at pos on this thread, straight into the ring
+static int gzip_stream_member(struct layer_decoder *decoder, size_t *pos) {
+	z_stream strm = {0};
+	if (inflateInit2(&strm, 15 + 16) != Z_OK) {
+		return -ENOMEM;
+	}
+	size_t in_pos = *pos;
+	int res, err = 0;
+	do {
+		if (!strm.avail_in && in_pos < decoder->len) {
+			size_t left = decoder->len - in_pos;
+			strm.next_in = (uint8_t *)&decoder->src[in_pos];
+			strm.avail_in = left > INFLATE_INPUT_MAX ? INFLATE_INPUT_MAX : left;
+			in_pos += strm.avail_in;
+		}
+		uint8_t *out = cvirt_xmalloc(DECODER_CHUNK);
+		strm.next_out = out;
+		strm.avail_out = DECODER_CHUNK;
+		// with room for output, Z_BUF_ERROR means truncated input
+		res = inflate(&strm, Z_NO_FLUSH);
+		size_t len = DECODER_CHUNK - strm.avail_out;
+		if (res != Z_OK && res != Z_STREAM_END) {
+			free(out);
+			err = res == Z_MEM_ERROR ? -ENOMEM : -EINVAL;
+			break;
+		}
+		if (len) {
+			err = ring_push(decoder, out, len);
+		} else {
+			free(out);
+		}
+	} while (!err && res != Z_STREAM_END);
+	if (!err) {
+		decoder->in_total += strm.total_in;
+		decoder->out_total += strm.total_out;
+		*pos += strm.total_in;
+	}
+	inflateEnd(&strm);
+	return err;
+}
+
+/*
+ * Members are guessed in spans of the input, one job each, and only
+ * kept if they continue right where the previous job stopped.
+ */
+static int gzip_run(struct layer_decoder *decoder) {
+	size_t pos = 0;
+	// most layers are one member, no point guessing until a second one
+	int res = gzip_stream_member(decoder, &pos);
+	struct decoder_job jobs[decoder->threads];
+	memset(jobs, 0, sizeof(jobs));
+	while (!res && gzip_is_header(&decoder->src[pos], decoder->len - pos)) {
+		// expected compressed size of job_out_max output
+		size_t span = decoder->job_out_max / 2;
+		if (decoder->in_total && decoder->out_total > decoder->in_total) {
+			span = decoder->job_out_max / 2 /
+				(decoder->out_total / decoder->in_total);
+		}
+		span = span ? span : 1;
+		int len = 0;
+		for (size_t start = pos; len < decoder->threads && start < decoder->len;
+				start += span) {
+			jobs[len].decoder = decoder;
+			jobs[len].start = start;
+			jobs[len].end = decoder->len - start > span ? start + span : decoder->len;
+			jobs[len].exact = !len;
+			len++;
+		}
+		jobs_run(jobs, len);
+
+		// chained as long as each job ends where the next one starts
+		size_t next = pos;
+		for (int i = 0; i < len && !res; i++) {
+			int member = 0;
+			while (member < jobs[i].members_len && jobs[i].members[member].start < next) {
+				member++;
+			}
+			if (member == jobs[i].members_len || jobs[i].members[member].start != next) {
+				break;
+			}
+			size_t offset = jobs[i].members[member].out_offset;
+			size_t out_len = jobs[i].out_len - offset;
+			if (!member && !offset) {
+				res = ring_push(decoder, jobs[i].out, out_len);
+				jobs[i].out = NULL;
+			} else {
+				res = ring_push_copy(decoder, &jobs[i].out[offset], out_len);
+			}
+			decoder->in_total += jobs[i].stop - next;
+			decoder->out_total += out_len;
+			next = jobs[i].stop;
+			if (jobs[i].res < 0 || next < jobs[i].end) {
+				// capped or failed, the rest is spanned again
+				break;
+			}
+		}
+		jobs_free(jobs, len);
+		if (!res && next == pos) {
+			// too large for a job, or broken and reported from here
+			res = gzip_stream_member(decoder, &next);
+		}
+		pos = next;
+	}
+	// a member cut short of its header, anything else is trailing garbage
+	if (!res && pos < decoder->len && decoder->src[pos] == 0x1f &&
+			(decoder->len - pos < 2 || decoder->src[pos + 1] == 0x8b)) {
+		res = -EINVAL;
+	}
+	return res;
+}
+
+// decompress the frame at pos on this thread, straight into the ring
+static int zstd_stream_frame(struct layer_decoder *decoder, size_t pos,
+		size_t frame_len) {
+	ZSTD_DStream *stream = ZSTD_createDStream();
+	if (!stream) {
+		return -ENOMEM;
+	}
+	ZSTD_initDStream(stream);
+	ZSTD_inBuffer in = {
+		.src = &decoder->src[pos],
+		.size = frame_len,
+	};
+	int err = 0;
+	size_t res;
+	do {
+		uint8_t *out = cvirt_xmalloc(DECODER_CHUNK);
+		ZSTD_outBuffer outbuf = {
+			.dst = out,
+			.size = DECODER_CHUNK,
+		};
+		res = ZSTD_decompressStream(stream, &outbuf, &in);
+		if (ZSTD_isError(res)) {
+			free(out);
+			err = -EINVAL;
+			break;
+		}
+		if (!outbuf.pos && in.pos == in.size && res) {
+			free(out);
+			err = -EINVAL; // truncated
+			break;
+		}
+		if (outbuf.pos) {
+			err = ring_push(decoder, out, outbuf.pos);
+		} else {
+			free(out);
+		}
+	} while (!err && res);
+	ZSTD_freeDStream(stream);
+	return err;
+}
+
+static bool zstd_is_skippable(const uint8_t *p, size_t left) {
+	if (left < 4) {
+		return false;
+	}
+	uint32_t magic = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+	return (magic & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_MAGIC;
+}
+
+// frames with known, moderate sizes are decoded a round at a time
+static int zstd_run(struct layer_decoder *decoder) {
+	size_t pos = 0;
+	int res = 0;
+	struct decoder_job jobs[decoder->threads];
+	memset(jobs, 0, sizeof(jobs));
+	while (!res && pos < decoder->len) {
+		int len = 0;
+		size_t bytes = 0;
+		while (pos < decoder->len) {
+			const uint8_t *p = &decoder->src[pos];
+			size_t frame_len = ZSTD_findFrameCompressedSize(p, decoder->len - pos);
+			if (ZSTD_isError(frame_len)) {
+				res = len ? 0 : -EINVAL;
+				break;
+			}
+			if (zstd_is_skippable(p, decoder->len - pos)) {
+				pos += frame_len;
+				continue;
+			}
+			unsigned long long size = ZSTD_getFrameContentSize(p, frame_len);
+			if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+					size > decoder->job_out_max ||
+					bytes + size > DECODER_BYTES_MAX) {
+				if (!len) {
+					res = zstd_stream_frame(decoder, pos, frame_len);
+					pos += frame_len;
+				}
+				break;
+			}
+			// small frames, as of zstd:chunked layers, share a job
+			if (len && jobs[len - 1].out_capacity + size <= DECODER_CHUNK) {
+				jobs[len - 1].end = pos + frame_len;
+				jobs[len - 1].out_capacity += size;
+			} else if (len == decoder->threads) {
+				break;
+			} else {
+				jobs[len].decoder = decoder;
+				jobs[len].start = pos;
+				jobs[len].end = pos + frame_len;
+				jobs[len].out_capacity = size;
+				len++;
+			}
+			bytes += size;
+			pos += frame_len;
+		}
+		if (len) {
+			jobs_run(jobs, len);
+			for (int i = 0; i < len && !res; i++) {
+				res = jobs[i].res;
+				if (!res) {
+					res = ring_push(decoder, jobs[i].out, jobs[i].out_len);
+					jobs[i].out = NULL;
+				}
+			}
+			jobs_free(jobs, len);
+		}
+	}
+	return res;
+}
+
+static void *decoder_run(void *arg) {
+	struct layer_decoder *decoder = arg;
+	int res = decoder->compression == CVIRT_OCI_R_LAYER_COMPRESSION_GZIP ?
+		gzip_run(decoder) : zstd_run(decoder);
+	pthread_mutex_lock(&decoder->lock);
+	decoder->res = res;
+	decoder->done = true;
+	pthread_cond_broadcast(&decoder->cond);
+	pthread_mutex_unlock(&decoder->lock);
+	return NULL;
+}
+
+struct layer_decoder *layer_decoder_new(const void *src, size_t len,
+		enum cvirt_oci_r_layer_compression compression, int threads) {
+	if (compression == CVIRT_OCI_R_LAYER_COMPRESSION_NONE) {
+		return NULL;
+	}
+	struct layer_decoder *decoder = cvirt_xcalloc(1, sizeof(struct layer_decoder));
+	decoder->src = src;
+	decoder->len = len;
+	decoder->compression = compression;
+	decoder->threads = threads > 1 ? threads : 1;
+	decoder->job_out_max = DECODER_BYTES_MAX / decoder->threads;
+	if (decoder->job_out_max < DECODER_JOB_OUT_MIN) {
+		decoder->job_out_max = DECODER_JOB_OUT_MIN;
+	}
+	pthread_mutex_init(&decoder->lock, NULL);
+	pthread_cond_init(&decoder->cond, NULL);
+	if (pthread_create(&decoder->thread, NULL, decoder_run, decoder)) {
+		pthread_mutex_destroy(&decoder->lock);
+		pthread_cond_destroy(&decoder->cond);
+		free(decoder);
+		return NULL;
+	}
+	return decoder;
+}
+
+ssize_t layer_decoder_read(struct layer_decoder *decoder, const void **buf) {
+	free(decoder->current);
+	decoder->current = NULL;
+	pthread_mutex_lock(&decoder->lock);
+	while (!decoder->ring_head && !decoder->done) {
+		pthread_cond_wait(&decoder->cond, &decoder->lock);
+	}
+	struct decoder_chunk *chunk = decoder->ring_head;
+	if (!chunk) {
+		int res = decoder->res;
+		pthread_mutex_unlock(&decoder->lock);
+		return res;
+	}
+	decoder->ring_head = chunk->next;
+	if (!decoder->ring_head) {
+		decoder->ring_tail = NULL;
+	}
+	decoder->ring_bytes -= chunk->len;
+	pthread_cond_broadcast(&decoder->cond);
+	pthread_mutex_unlock(&decoder->lock);
+	decoder->current = chunk->data;
+	*buf = chunk->data;
+	ssize_t len = chunk->len;
+	free(chunk);
+	return len;
+}
+
+void layer_decoder_destroy(struct layer_decoder *decoder) {
+	pthread_mutex_lock(&decoder->lock);
+	decoder->cancel = true;
+	pthread_cond_broadcast(&decoder->cond);
+	pthread_mutex_unlock(&decoder->lock);
+	pthread_join(decoder->thread, NULL);
+	while (decoder->ring_head) {
+		struct decoder_chunk *chunk = decoder->ring_head;
+		decoder->ring_head = chunk->next;
+		free(chunk->data);
+		free(chunk);
+	}
+	free(decoder->current);
+	pthread_mutex_destroy(&decoder->lock);
+	pthread_cond_destroy(&decoder->cond);
+	free(decoder);
+}
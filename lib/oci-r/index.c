@@ -5,9 +5,9 @@
 
 #include <json_object.h>
 
-#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 struct cvirt_oci_r_index *cvirt_oci_r_index_from_archive(int fd) {
 	struct cvirt_oci_r_index *index = calloc(1,
@@ -15,7 +15,6 @@ struct cvirt_oci_r_index *cvirt_oci_r_index_from_archive(int fd) {
 	if (!index) {
 		goto err;
 	}
-	assert(lseek(fd, 0, SEEK_SET) == 0);
 	index->obj = json_from_archive(fd, "index.json");
 	if (!index->obj) {
 		goto err;
@@ -82,3 +81,8 @@ void cvirt_oci_r_index_destroy(struct cvirt_oci_r_index *index) {
 	json_object_put(index->obj);
 	free(index);
 }
+
+int cvirt_oci_r_archive_close(int fd) {
+	archive_blob_forget(fd);
+	return close(fd);
+}
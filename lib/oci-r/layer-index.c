@@ -0,0 +1,798 @@
+#include "archive-utils.h"
+#include "oci-r/layer-index.h"
+#include "oci-r/layer.h"
+#include "xmem.h"
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#include <zstd.h>
+
+// zlib counts input in uInt
+#define INFLATE_INPUT_MAX	(1U << 30)
+#define GZIP_TRAILER_SIZE	8
+#define TAR_END_SIZE		1024
+
+struct layer_index {
+	uint8_t *map;
+	size_t map_len;
+	const struct layer_index_header *header;
+	const struct layer_index_checkpoint *checkpoints;
+	const struct layer_index_entry *entries;
+	const uint8_t *windows;
+	const char *strings;
+};
+
+struct index_buf {
+	uint8_t *data;
+	size_t len;
+	size_t capacity;
+};
+
+static void *index_buf_append(struct index_buf *buf, const void *data,
+		size_t len) {
+	if (buf->len + len > buf->capacity) {
+		size_t capacity = buf->capacity ? buf->capacity : 4096;
+		while (buf->len + len > capacity) {
+			capacity *= 2;
+		}
+		buf->data = cvirt_xrealloc(buf->data, capacity);
+		buf->capacity = capacity;
+	}
+	void *res = &buf->data[buf->len];
+	if (data) {
+		memcpy(res, data, len);
+	} else {
+		memset(res, 0, len);
+	}
+	buf->len += len;
+	return res;
+}
+
+// sequential decompression of the blob from the start or a checkpoint
+struct index_stream {
+	const struct cvirt_oci_r_layer *layer;
+	// input window, src[0] being at blob offset src_offset
+	const uint8_t *src;
+	size_t src_len, src_pos;
+	size_t src_offset;
+	uint8_t *buf; // for layers that are not mapped
+	uint8_t *out;
+	uint64_t out_pos; // uncompressed offset of the next decoded byte
+
+	z_stream zstrm;
+	bool zstrm_init;
+	bool raw; // in a deflate stream entered at a block checkpoint
+	size_t skip; // gzip trailer to skip after a raw deflate stream
+	ZSTD_DStream *zstd;
+	bool stream_end; // between gzip members or zstd frames
+
+	// only when building
+	struct index_buf *checkpoints, *windows;
+	uint64_t last_checkpoint;
+};
+
+static void stream_init(struct index_stream *s,
+		const struct cvirt_oci_r_layer *layer) {
+	*s = (struct index_stream){.layer = layer};
+	if (!layer->map) {
+		s->buf = cvirt_xmalloc(BUFSZ);
+	}
+	s->out = cvirt_xmalloc(BUFSZ);
+	switch (layer->compression) {
+	case CVIRT_OCI_R_LAYER_COMPRESSION_GZIP:
+		s->zstrm_init = inflateInit2(&s->zstrm, 15 + 16) == Z_OK;
+		break;
+	case CVIRT_OCI_R_LAYER_COMPRESSION_ZSTD:
+		s->zstd = ZSTD_createDStream();
+		break;
+	case CVIRT_OCI_R_LAYER_COMPRESSION_NONE:
+		break;
+	}
+}
+
+static void stream_cleanup(struct index_stream *s) {
+	if (s->zstrm_init) {
+		inflateEnd(&s->zstrm);
+	}
+	ZSTD_freeDStream(s->zstd);
+	free(s->buf);
+	free(s->out);
+}
+
+static ssize_t stream_fill(struct index_stream *s) {
+	if (s->src_pos < s->src_len) {
+		return s->src_len - s->src_pos;
+	}
+	s->src_offset += s->src_len;
+	s->src_len = s->src_pos = 0;
+	if (s->src_offset >= s->layer->blob.size) {
+		return 0;
+	}
+	if (s->layer->map) {
+		s->src = (uint8_t *)s->layer->map + s->layer->map_offset +
+			s->src_offset;
+		s->src_len = s->layer->blob.size - s->src_offset;
+		return s->src_len;
+	}
+	ssize_t res = archive_blob_pread(s->layer->fd, &s->layer->blob, s->buf,
+		BUFSZ, s->src_offset);
+	if (res < 0) {
+		return res;
+	}
+	s->src = s->buf;
+	s->src_len = res;
+	return res;
+}
+
+static void stream_checkpoint(struct index_stream *s,
+		enum layer_index_checkpoint_type type, int bits) {
+	size_t count = s->checkpoints->len / sizeof(struct layer_index_checkpoint);
+	if (count && s->out_pos - s->last_checkpoint < LAYER_INDEX_SPAN &&
+			s->layer->compression == CVIRT_OCI_R_LAYER_COMPRESSION_GZIP) {
+		return;
+	}
+	struct layer_index_checkpoint checkpoint = {
+		.in_offset = s->src_offset + s->src_pos,
+		.out_offset = s->out_pos,
+		.window_offset = s->windows->len,
+		.type = type,
+		.bits = bits,
+	};
+	if (type == LAYER_INDEX_CHECKPOINT_BLOCK) {
+		uint8_t window[LAYER_INDEX_WINDOW];
+		uInt window_len = sizeof(window);
+		if (inflateGetDictionary(&s->zstrm, window, &window_len) != Z_OK) {
+			return;
+		}
+		if (window_len) {
+			uLongf len = compressBound(window_len);
+			uint8_t *dst = index_buf_append(s->windows, NULL, len);
+			if (compress2(dst, &len, window, window_len, Z_BEST_COMPRESSION) != Z_OK) {
+				s->windows->len = checkpoint.window_offset;
+				return;
+			}
+			s->windows->len = checkpoint.window_offset + len;
+			checkpoint.window_len = len;
+		}
+	}
+	index_buf_append(s->checkpoints, &checkpoint, sizeof(checkpoint));
+	s->last_checkpoint = s->out_pos;
+}
+
+static ssize_t gzip_decode(struct index_stream *s, uint8_t *dst, size_t len) {
+	size_t produced = 0;
+	while (!produced) {
+		ssize_t avail = stream_fill(s);
+		if (avail < 0) {
+			return avail;
+		}
+		if (!avail) {
+			return s->stream_end && !s->skip ? 0 : -EIO;
+		}
+		if (s->skip) {
+			size_t n = (size_t)avail < s->skip ? (size_t)avail : s->skip;
+			s->src_pos += n;
+			s->skip -= n;
+			continue;
+		}
+		s->zstrm.next_in = (uint8_t *)&s->src[s->src_pos];
+		s->zstrm.avail_in = avail > INFLATE_INPUT_MAX ? INFLATE_INPUT_MAX : avail;
+		s->zstrm.next_out = dst;
+		s->zstrm.avail_out = len;
+		uInt avail_in = s->zstrm.avail_in;
+		// stop at block boundaries for checkpoints when building
+		int res = inflate(&s->zstrm, s->checkpoints ? Z_BLOCK : Z_NO_FLUSH);
+		size_t used = avail_in - s->zstrm.avail_in;
+		s->src_pos += used;
+		produced = len - s->zstrm.avail_out;
+		s->out_pos += produced;
+		if (used || produced) {
+			s->stream_end = false;
+		}
+		if (res == Z_STREAM_END) {
+			s->stream_end = true;
+			if (s->raw) {
+				s->raw = false;
+				s->skip = GZIP_TRAILER_SIZE;
+				inflateReset2(&s->zstrm, 15 + 16);
+			} else {
+				inflateReset(&s->zstrm);
+			}
+		} else if (res != Z_OK) {
+			return -EIO;
+		} else if (s->checkpoints && (s->zstrm.data_type & 128) &&
+				!(s->zstrm.data_type & 64)) {
+			stream_checkpoint(s, LAYER_INDEX_CHECKPOINT_BLOCK,
+				s->zstrm.data_type & 7);
+		}
+	}
+	return produced;
+}
+
+static ssize_t zstd_decode(struct index_stream *s, uint8_t *dst, size_t len) {
+	size_t produced = 0;
+	while (!produced) {
+		ssize_t avail = stream_fill(s);
+		if (avail < 0) {
+			return avail;
+		}
+		if (!avail) {
+			return s->stream_end ? 0 : -EIO;
+		}
+		if (s->checkpoints && s->stream_end) {
+			stream_checkpoint(s, LAYER_INDEX_CHECKPOINT_STREAM, 0);
+		}
+		ZSTD_inBuffer in = {&s->src[s->src_pos], avail, 0};
+		ZSTD_outBuffer out = {dst, len, 0};
+		size_t res = ZSTD_decompressStream(s->zstd, &out, &in);
+		if (ZSTD_isError(res)) {
+			return -EIO;
+		}
+		s->src_pos += in.pos;
+		produced = out.pos;
+		s->out_pos += produced;
+		if (in.pos || out.pos) {
+			s->stream_end = false;
+		}
+		if (!res) {
+			s->stream_end = true;
+		}
+	}
+	return produced;
+}
+
+/*
+ * Next decoded bytes, at most len, 0 at the end of the blob.
+ */
+static ssize_t stream_decode(struct index_stream *s, uint8_t *dst, size_t len) {
+	switch (s->layer->compression) {
+	case CVIRT_OCI_R_LAYER_COMPRESSION_GZIP:
+		return gzip_decode(s, dst, len);
+	case CVIRT_OCI_R_LAYER_COMPRESSION_ZSTD:
+		return zstd_decode(s, dst, len);
+	case CVIRT_OCI_R_LAYER_COMPRESSION_NONE:
+		break;
+	}
+	ssize_t avail = stream_fill(s);
+	if (avail <= 0) {
+		return avail;
+	}
+	size_t res = (size_t)avail < len ? (size_t)avail : len;
+	memcpy(dst, &s->src[s->src_pos], res);
+	s->src_pos += res;
+	s->out_pos += res;
+	return res;
+}
+
+/*
+ * Restart decoding at checkpoint, or at the blob start if NULL.
+ */
+static int stream_start(struct index_stream *s, const struct layer_index *index,
+		const struct layer_index_checkpoint *checkpoint) {
+	s->src_offset = checkpoint ? checkpoint->in_offset : 0;
+	s->src_len = s->src_pos = 0;
+	s->out_pos = checkpoint ? checkpoint->out_offset : 0;
+	s->skip = 0;
+	s->raw = false;
+	s->stream_end = true;
+	switch (s->layer->compression) {
+	case CVIRT_OCI_R_LAYER_COMPRESSION_GZIP:
+		if (!s->zstrm_init) {
+			return -ENOMEM;
+		}
+		if (!checkpoint || checkpoint->type == LAYER_INDEX_CHECKPOINT_STREAM) {
+			inflateReset2(&s->zstrm, 15 + 16);
+			return 0;
+		}
+		inflateReset2(&s->zstrm, -15);
+		s->raw = true;
+		s->stream_end = false;
+		if (checkpoint->bits) {
+			uint8_t byte;
+			if (!checkpoint->in_offset || archive_blob_pread(s->layer->fd,
+					&s->layer->blob, &byte, 1, checkpoint->in_offset - 1) != 1) {
+				return -EIO;
+			}
+			inflatePrime(&s->zstrm, checkpoint->bits,
+				byte >> (8 - checkpoint->bits));
+		}
+		if (checkpoint->window_len) {
+			uint8_t window[LAYER_INDEX_WINDOW];
+			uLongf window_len = sizeof(window);
+			if (uncompress(window, &window_len,
+					&index->windows[checkpoint->window_offset],
+					checkpoint->window_len) != Z_OK ||
+					inflateSetDictionary(&s->zstrm, window,
+					window_len) != Z_OK) {
+				return -EIO;
+			}
+		}
+		return 0;
+	case CVIRT_OCI_R_LAYER_COMPRESSION_ZSTD:
+		if (!s->zstd) {
+			return -ENOMEM;
+		}
+		ZSTD_DCtx_reset(s->zstd, ZSTD_reset_session_only);
+		return 0;
+	case CVIRT_OCI_R_LAYER_COMPRESSION_NONE:
+		break;
+	}
+	return 0;
+}
+
+// entry paths as stored, without leading "./" or "/" and trailing "/"
+static const char *index_path_trim(const char *path, size_t *len) {
+	while (true) {
+		if (path[0] == '/') {
+			path++;
+		} else if (path[0] == '.' && path[1] == '/') {
+			path += 2;
+		} else if (path[0] == '.' && !path[1]) {
+			path++;
+		} else {
+			break;
+		}
+	}
+	size_t res = strlen(path);
+	while (res && path[res - 1] == '/') {
+		res--;
+	}
+	*len = res;
+	return path;
+}
+
+static la_ssize_t build_read(struct archive *archive, void *data,
+		const void **buf) {
+	struct index_stream *s = data;
+	ssize_t res = stream_decode(s, s->out, BUFSZ);
+	if (res < 0) {
+		archive_set_error(archive, -res, "decompress layer blob failed");
+		return ARCHIVE_FATAL;
+	}
+	*buf = s->out;
+	return res;
+}
+
+struct build_entry {
+	char *path;
+	struct layer_index_entry entry;
+};
+
+static int build_entry_cmp(const void *a, const void *b) {
+	const struct build_entry *ea = a, *eb = b;
+	int res = strcmp(ea->path, eb->path);
+	if (res) {
+		return res;
+	}
+	return ea->entry.header_offset < eb->entry.header_offset ? -1 :
+		ea->entry.header_offset > eb->entry.header_offset;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+	const uint8_t *ptr = buf;
+	while (len) {
+		ssize_t res = write(fd, ptr, len);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		ptr += res;
+		len -= res;
+	}
+	return 0;
+}
+
+int layer_index_build(const struct cvirt_oci_r_layer *layer, int fd) {
+	struct index_buf checkpoints = {0}, windows = {0}, entries = {0},
+		strings = {0};
+	struct build_entry *found = NULL;
+	size_t found_len = 0, found_capacity = 0;
+	struct index_stream stream;
+	stream_init(&stream, layer);
+	if (layer->compression != CVIRT_OCI_R_LAYER_COMPRESSION_NONE) {
+		stream.checkpoints = &checkpoints;
+		stream.windows = &windows;
+	}
+	int res = stream_start(&stream, NULL, NULL);
+	if (res < 0) {
+		goto cleanup;
+	}
+
+	struct archive *archive = archive_read_new();
+	if (!archive) {
+		res = -ENOMEM;
+		goto cleanup;
+	}
+	archive_read_support_format_tar(archive);
+	if (archive_read_open(archive, &stream, NULL, build_read, NULL) != ARCHIVE_OK) {
+		fprintf(stderr, "open layer archive failed: %s\n",
+			archive_error_string(archive));
+		res = -EIO;
+		goto cleanup_archive;
+	}
+	// an entry ends where the next header or the end-of-archive marker starts
+	struct archive_entry *entry;
+	while ((res = archive_read_next_header(archive, &entry)) == ARCHIVE_OK) {
+		uint64_t pos = archive_read_header_position(archive);
+		if (found_len) {
+			found[found_len - 1].entry.end_offset = pos;
+		}
+		if (found_len == found_capacity) {
+			found_capacity = found_capacity ? found_capacity * 2 : 1024;
+			found = cvirt_xrealloc(found,
+				found_capacity * sizeof(struct build_entry));
+		}
+		const char *pathname = archive_entry_pathname(entry);
+		size_t len;
+		const char *path = index_path_trim(pathname ? pathname : "", &len);
+		found[found_len++] = (struct build_entry){
+			.path = cvirt_xstrndup(path, len),
+			.entry = {.header_offset = pos},
+		};
+	}
+	if (res != ARCHIVE_EOF) {
+		fprintf(stderr, "read layer archive failed: %s\n",
+			archive_error_string(archive));
+		res = -EIO;
+		goto cleanup_archive;
+	}
+	uint64_t tar_size = archive_read_header_position(archive);
+	if (found_len) {
+		found[found_len - 1].entry.end_offset = tar_size;
+	}
+
+	qsort(found, found_len, sizeof(struct build_entry), build_entry_cmp);
+	for (size_t i = 0; i < found_len; i++) {
+		found[i].entry.path_offset = strings.len;
+		index_buf_append(&strings, found[i].path, strlen(found[i].path) + 1);
+		index_buf_append(&entries, &found[i].entry, sizeof(found[i].entry));
+	}
+	// keep the string table aligned
+	if (windows.len % 8) {
+		index_buf_append(&windows, NULL, 8 - windows.len % 8);
+	}
+
+	struct layer_index_header header = {
+		.magic = LAYER_INDEX_MAGIC,
+		.version = LAYER_INDEX_VERSION,
+		.byte_order = LAYER_INDEX_BYTE_ORDER,
+		.compression = layer->compression,
+		.blob_size = layer->blob.size,
+		.tar_size = tar_size,
+		.checkpoints_offset = sizeof(header),
+		.checkpoints_count = checkpoints.len / sizeof(struct layer_index_checkpoint),
+		.entries_count = found_len,
+		.windows_size = windows.len,
+		.strings_size = strings.len,
+	};
+	header.entries_offset = header.checkpoints_offset + checkpoints.len;
+	header.windows_offset = header.entries_offset + entries.len;
+	header.strings_offset = header.windows_offset + windows.len;
+
+	res = write_full(fd, &header, sizeof(header));
+	if (!res) {
+		res = write_full(fd, checkpoints.data, checkpoints.len);
+	}
+	if (!res) {
+		res = write_full(fd, entries.data, entries.len);
+	}
+	if (!res) {
+		res = write_full(fd, windows.data, windows.len);
+	}
+	if (!res) {
+		res = write_full(fd, strings.data, strings.len);
+	}
+
+cleanup_archive:
+	archive_read_free(archive);
+cleanup:
+	for (size_t i = 0; i < found_len; i++) {
+		free(found[i].path);
+	}
+	free(found);
+	stream_cleanup(&stream);
+	free(checkpoints.data);
+	free(windows.data);
+	free(entries.data);
+	free(strings.data);
+	return res;
+}
+
+static bool index_section_valid(size_t len, uint64_t offset, uint64_t count,
+		size_t size) {
+	return offset % 8 == 0 && offset <= len && count <= (len - offset) / size;
+}
+
+struct layer_index *layer_index_load(const char *path,
+		const struct cvirt_oci_r_layer *layer) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(struct layer_index_header)) {
+		close(fd);
+		return NULL;
+	}
+	uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	struct layer_index *index = cvirt_xcalloc(1, sizeof(struct layer_index));
+	index->map = map;
+	index->map_len = st.st_size;
+	index->header = (void *)map;
+	const struct layer_index_header *header = index->header;
+	if (memcmp(header->magic, LAYER_INDEX_MAGIC, 8) ||
+			header->version != LAYER_INDEX_VERSION ||
+			header->byte_order != LAYER_INDEX_BYTE_ORDER ||
+			header->compression != layer->compression ||
+			header->blob_size != layer->blob.size ||
+			!index_section_valid(index->map_len, header->checkpoints_offset,
+				header->checkpoints_count,
+				sizeof(struct layer_index_checkpoint)) ||
+			!index_section_valid(index->map_len, header->entries_offset,
+				header->entries_count, sizeof(struct layer_index_entry)) ||
+			!index_section_valid(index->map_len, header->windows_offset,
+				header->windows_size, 1) ||
+			!index_section_valid(index->map_len, header->strings_offset,
+				header->strings_size, 1) ||
+			(header->strings_size &&
+			map[header->strings_offset + header->strings_size - 1]) ||
+			(header->compression != CVIRT_OCI_R_LAYER_COMPRESSION_NONE &&
+			!header->checkpoints_count)) {
+		goto invalid;
+	}
+	index->checkpoints = (void *)&map[header->checkpoints_offset];
+	index->entries = (void *)&map[header->entries_offset];
+	index->windows = &map[header->windows_offset];
+	index->strings = (char *)&map[header->strings_offset];
+
+	for (uint64_t i = 0; i < header->checkpoints_count; i++) {
+		const struct layer_index_checkpoint *checkpoint =
+			&index->checkpoints[i];
+		if (checkpoint->in_offset > header->blob_size ||
+				checkpoint->bits > 7 ||
+				checkpoint->window_offset > header->windows_size ||
+				checkpoint->window_len > header->windows_size -
+				checkpoint->window_offset ||
+				(i && checkpoint->out_offset <
+				index->checkpoints[i - 1].out_offset)) {
+			goto invalid;
+		}
+	}
+	for (uint64_t i = 0; i < header->entries_count; i++) {
+		const struct layer_index_entry *entry = &index->entries[i];
+		if (entry->path_offset >= header->strings_size ||
+				entry->header_offset > entry->end_offset ||
+				entry->end_offset > header->tar_size) {
+			goto invalid;
+		}
+	}
+	return index;
+
+invalid:
+	layer_index_destroy(index);
+	return NULL;
+}
+
+void layer_index_destroy(struct layer_index *index) {
+	if (!index) {
+		return;
+	}
+	munmap(index->map, index->map_len);
+	free(index);
+}
+
+struct index_range {
+	uint64_t start, end;
+};
+
+struct layer_index_reader {
+	struct index_stream stream;
+	const struct layer_index *index;
+	struct index_range *ranges;
+	size_t ranges_len, range;
+	bool started, positioned, finished;
+};
+
+// first entry with path not less than key
+static uint64_t index_lower_bound(const struct layer_index *index,
+		const char *key) {
+	uint64_t lo = 0, hi = index->header->entries_count;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (strcmp(&index->strings[index->entries[mid].path_offset], key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// last checkpoint at or before out_offset
+static const struct layer_index_checkpoint *index_checkpoint_find(
+		const struct layer_index *index, uint64_t out_offset) {
+	uint64_t lo = 0, hi = index->header->checkpoints_count;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (index->checkpoints[mid].out_offset <= out_offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo ? &index->checkpoints[lo - 1] : NULL;
+}
+
+static int index_range_cmp(const void *a, const void *b) {
+	const struct index_range *ra = a, *rb = b;
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+static void reader_add_entry(struct layer_index_reader *reader, uint64_t i) {
+	reader->ranges[reader->ranges_len++] = (struct index_range){
+		.start = reader->index->entries[i].header_offset,
+		.end = reader->index->entries[i].end_offset,
+	};
+}
+
+struct layer_index_reader *layer_index_reader_new(
+		const struct cvirt_oci_r_layer *layer, const struct layer_index *index,
+		const char *path) {
+	size_t len;
+	path = index_path_trim(path, &len);
+	char key[len + 2];
+	memcpy(key, path, len);
+	key[len] = '\0';
+
+	struct layer_index_reader *reader =
+		cvirt_xcalloc(1, sizeof(struct layer_index_reader));
+	reader->index = index;
+	reader->ranges = cvirt_xmalloc((index->header->entries_count + 1) *
+		sizeof(struct index_range));
+	uint64_t count = index->header->entries_count;
+	if (!len) {
+		for (uint64_t i = 0; i < count; i++) {
+			reader_add_entry(reader, i);
+		}
+	} else {
+		uint64_t i = index_lower_bound(index, key);
+		if (i < count && !strcmp(&index->strings[index->entries[i].path_offset], key)) {
+			reader_add_entry(reader, i);
+		}
+		// the subtree, sorting after "path/"
+		key[len] = '/';
+		key[len + 1] = '\0';
+		for (i = index_lower_bound(index, key); i < count &&
+				!strncmp(&index->strings[index->entries[i].path_offset],
+				key, len + 1); i++) {
+			reader_add_entry(reader, i);
+		}
+	}
+	if (!reader->ranges_len) {
+		free(reader->ranges);
+		free(reader);
+		return NULL;
+	}
+
+	// in tar order, with neighbours merged
+	qsort(reader->ranges, reader->ranges_len, sizeof(struct index_range),
+		index_range_cmp);
+	size_t merged = 0;
+	for (size_t i = 1; i < reader->ranges_len; i++) {
+		if (reader->ranges[i].start <= reader->ranges[merged].end) {
+			if (reader->ranges[i].end > reader->ranges[merged].end) {
+				reader->ranges[merged].end = reader->ranges[i].end;
+			}
+		} else {
+			reader->ranges[++merged] = reader->ranges[i];
+		}
+	}
+	reader->ranges_len = merged + 1;
+
+	stream_init(&reader->stream, layer);
+	return reader;
+}
+
+/*
+ * Get the stream to target, restarting at the checkpoint before it unless
+ * decoding from the current position is no further.
+ */
+static int reader_seek(struct layer_index_reader *reader, uint64_t target) {
+	struct index_stream *s = &reader->stream;
+	if (s->layer->compression == CVIRT_OCI_R_LAYER_COMPRESSION_NONE) {
+		s->src_offset = target;
+		s->src_len = s->src_pos = 0;
+		s->out_pos = target;
+		return 0;
+	}
+	const struct layer_index_checkpoint *checkpoint =
+		index_checkpoint_find(reader->index, target);
+	if (!checkpoint) {
+		return -EIO;
+	}
+	if (!reader->started || s->out_pos > target ||
+			checkpoint->out_offset > s->out_pos) {
+		int res = stream_start(s, reader->index, checkpoint);
+		if (res < 0) {
+			return res;
+		}
+		reader->started = true;
+	}
+	while (s->out_pos < target) {
+		uint64_t left = target - s->out_pos;
+		ssize_t res = stream_decode(s, s->out, left < BUFSZ ? left : BUFSZ);
+		if (res < 0) {
+			return res;
+		}
+		if (!res) {
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+ssize_t layer_index_reader_read(struct layer_index_reader *reader,
+		const void **buf) {
+	struct index_stream *s = &reader->stream;
+	while (reader->range < reader->ranges_len) {
+		const struct index_range *range = &reader->ranges[reader->range];
+		if (!reader->positioned) {
+			int res = reader_seek(reader, range->start);
+			if (res < 0) {
+				return res;
+			}
+			reader->positioned = true;
+		}
+		if (s->out_pos >= range->end) {
+			reader->range++;
+			reader->positioned = false;
+			continue;
+		}
+		uint64_t left = range->end - s->out_pos;
+		ssize_t res = stream_decode(s, s->out, left < BUFSZ ? left : BUFSZ);
+		if (res < 0) {
+			return res;
+		}
+		if (!res) {
+			return -EIO;
+		}
+		*buf = s->out;
+		return res;
+	}
+	if (reader->finished) {
+		return 0;
+	}
+	reader->finished = true;
+	memset(s->out, 0, TAR_END_SIZE);
+	*buf = s->out;
+	return TAR_END_SIZE;
+}
+
+void layer_index_reader_destroy(struct layer_index_reader *reader) {
+	if (!reader) {
+		return;
+	}
+	stream_cleanup(&reader->stream);
+	free(reader->ranges);
+	free(reader);
+}
@@ -1,14 +1,20 @@
 #include "archive-utils.h"
 #include "convirter/oci-r/layer.h"
+#include "oci-r/decoder.h"
 #include "oci-r/layer.h"
+#include "oci-r/layer-index.h"
 
 #include <archive.h>
 
-#include <assert.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 int inplace_open(struct archive *archive, void *data) {
 	return ARCHIVE_OK;
@@ -16,39 +22,120 @@ int inplace_open(struct archive *archive, void *data) {
 
 la_ssize_t inplace_read(struct archive *archive, void *data, const void **buf) {
 	struct cvirt_oci_r_layer *layer = data;
+	if (layer->index_reader) {
+		ssize_t res = layer_index_reader_read(layer->index_reader, buf);
+		if (res < 0) {
+			archive_set_error(archive, -res, "decompress layer blob failed");
+			return ARCHIVE_FATAL;
+		}
+		return res;
+	}
+	if (layer->decoder) {
+		ssize_t res = layer_decoder_read(layer->decoder, buf);
+		if (res < 0) {
+			archive_set_error(archive, -res, "decompress layer blob failed");
+			return ARCHIVE_FATAL;
+		}
+		return res;
+	}
+	if (layer->map) {
+		// hand the whole remaining blob to the decompressor at once
+		*buf = (char *)layer->map + layer->map_offset + layer->pos;
+		size_t res = layer->blob.size - layer->pos;
+		layer->pos += res;
+		return res;
+	}
 	*buf = layer->buf;
-	return archive_read_data(layer->image_archive, layer->buf, BUFSZ);
+	ssize_t res = archive_blob_pread(layer->fd, &layer->blob, layer->buf,
+		BUFSZ, layer->pos);
+	if (res < 0) {
+		archive_set_error(archive, -res, "read layer blob failed");
+		return ARCHIVE_FATAL;
+	}
+	layer->pos += res;
+	return res;
 }
 
-int inplace_close(struct archive *archive, void *data) {
+/*
+ * Lets libarchive jump over entry data of uncompressed layers, header-only
+ * scans then read headers only. Decoded, decompressed and indexed streams
+ * are read through by libarchive as before.
+ */
+la_int64_t inplace_skip(struct archive *archive, void *data, la_int64_t request) {
+	struct cvirt_oci_r_layer *layer = data;
+	if (layer->decoder || layer->index_reader || request <= 0) {
+		return 0;
+	}
+	size_t left = layer->blob.size - layer->pos;
+	size_t res = (uint64_t)request > left ? left : (size_t)request;
+	layer->pos += res;
+	return res;
+}
+
+la_int64_t inplace_seek(struct archive *archive, void *data, la_int64_t offset,
+		int whence) {
 	struct cvirt_oci_r_layer *layer = data;
-	archive_read_free(layer->image_archive);
-	layer->image_archive = NULL;
+	if (layer->decoder || layer->index_reader) {
+		return ARCHIVE_FATAL;
+	}
+	la_int64_t pos;
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = layer->pos + offset;
+		break;
+	case SEEK_END:
+		pos = layer->blob.size + offset;
+		break;
+	default:
+		return ARCHIVE_FATAL;
+	}
+	if (pos < 0 || pos > layer->blob.size) {
+		return ARCHIVE_FATAL;
+	}
+	layer->pos = pos;
+	return pos;
+}
+
+int inplace_close(struct archive *archive, void *data) {
 	return ARCHIVE_OK;
 }
 
-struct cvirt_oci_r_layer *cvirt_oci_r_layer_from_archive_blob(int fd,
-		const char *digest,
-		enum cvirt_oci_r_layer_compression compression) {
-	struct cvirt_oci_r_layer *layer = calloc(1,
-		sizeof(struct cvirt_oci_r_layer));
-	if (!layer) {
-		return NULL;
+static void layer_map(struct cvirt_oci_r_layer *layer) {
+	if (!layer->blob.size) {
+		return;
 	}
-	assert(lseek(fd, 0, SEEK_SET) == 0);
-	layer->fd = fd;
-	layer->name = digest_to_name(digest);
-	layer->compression = compression;
-	layer->image_archive = archive_from_fd_and_seek(fd, layer->name, NULL);
-	if (!layer->image_archive) {
-		goto err;
+	long page_size = sysconf(_SC_PAGESIZE);
+	off_t start = layer->blob.offset / page_size * page_size;
+	layer->map_offset = layer->blob.offset - start;
+	layer->map_len = layer->map_offset + layer->blob.size;
+	void *map = mmap(NULL, layer->map_len, PROT_READ, MAP_PRIVATE,
+		layer->fd, start);
+	if (map == MAP_FAILED) {
+		return;
 	}
+	madvise(map, layer->map_len, MADV_SEQUENTIAL);
+	layer->map = map;
+}
+
+static int layer_open_archive(struct cvirt_oci_r_layer *layer) {
+	layer->pos = 0;
 	layer->layer_archive = archive_read_new();
 	if (!layer->layer_archive) {
-		goto err;
+		return -ENOMEM;
 	}
 	archive_read_support_format_tar(layer->layer_archive);
-	switch (compression) {
+	if (!layer->index_reader && layer->map &&
+			layer->blob.size >= DECODER_MIN_SIZE) {
+		// decompressed on other threads, libarchive only sees tar
+		layer->decoder = layer_decoder_new((char *)layer->map + layer->map_offset,
+			layer->blob.size, layer->compression, layer->decoder_threads ?
+			layer->decoder_threads : sysconf(_SC_NPROCESSORS_ONLN));
+	}
+	bool decoded = layer->decoder || layer->index_reader;
+	switch (decoded ? CVIRT_OCI_R_LAYER_COMPRESSION_NONE : layer->compression) {
 	case CVIRT_OCI_R_LAYER_COMPRESSION_GZIP:
 		archive_read_support_filter_gzip(layer->layer_archive);
 		break;
@@ -58,55 +145,153 @@ struct cvirt_oci_r_layer *cvirt_oci_r_layer_from_archive_blob(int fd,
 	case CVIRT_OCI_R_LAYER_COMPRESSION_NONE:
 		break;
 	}
-	int res = archive_read_open(layer->layer_archive, layer, inplace_open,
-		inplace_read, inplace_close);
-	if (res == ARCHIVE_OK) {
+	archive_read_set_callback_data(layer->layer_archive, layer);
+	archive_read_set_open_callback(layer->layer_archive, inplace_open);
+	archive_read_set_read_callback(layer->layer_archive, inplace_read);
+	archive_read_set_skip_callback(layer->layer_archive, inplace_skip);
+	archive_read_set_seek_callback(layer->layer_archive, inplace_seek);
+	archive_read_set_close_callback(layer->layer_archive, inplace_close);
+	int res = archive_read_open1(layer->layer_archive);
+	if (res != ARCHIVE_OK) {
+		fprintf(stderr, "open layer archive failed: %s\n",
+			archive_error_string(layer->layer_archive));
+		archive_read_free(layer->layer_archive);
+		layer->layer_archive = NULL;
+		if (layer->decoder) {
+			layer_decoder_destroy(layer->decoder);
+			layer->decoder = NULL;
+		}
+		return -EIO;
+	}
+	return 0;
+}
+
+struct cvirt_oci_r_layer *cvirt_oci_r_layer_from_archive_blob(int fd,
+		const char *digest,
+		enum cvirt_oci_r_layer_compression compression) {
+	struct cvirt_oci_r_layer *layer = calloc(1,
+		sizeof(struct cvirt_oci_r_layer));
+	if (!layer) {
+		return NULL;
+	}
+	layer->fd = fd;
+	layer->compression = compression;
+	layer->digest = strdup(digest);
+	if (!layer->digest) {
+		goto err;
+	}
+	char *name = digest_to_name(digest);
+	if (!name) {
+		goto err;
+	}
+	int res = archive_blob_lookup(fd, name, &layer->blob);
+	free(name);
+	if (res < 0) {
+		goto err;
+	}
+	layer_map(layer);
+	if (!layer->map) {
+		layer->buf = malloc(BUFSZ);
+		if (!layer->buf) {
+			goto err;
+		}
+	}
+	if (layer_open_archive(layer) == 0) {
 		return layer;
 	}
-	fprintf(stderr, "cvirt_oci_r_layer_from_archive_blob: open layer archive failed: %s\n",
-		archive_error_string(layer->layer_archive));
 err:
-	archive_read_free(layer->layer_archive);
-	archive_read_free(layer->image_archive);
+	if (layer->map) {
+		munmap(layer->map, layer->map_len);
+	}
+	free(layer->buf);
+	free(layer->digest);
 	free(layer);
 	return NULL;
 }
 
-int cvirt_oci_r_layer_rewind(struct cvirt_oci_r_layer *layer) {
+static void layer_close_archive(struct cvirt_oci_r_layer *layer) {
 	archive_read_free(layer->layer_archive);
-	archive_read_free(layer->image_archive);
-	assert(lseek(layer->fd, 0, SEEK_SET) == 0);
-	layer->image_archive = archive_from_fd_and_seek(layer->fd, layer->name, NULL);
-	if (!layer->image_archive) {
-		goto err;
+	if (layer->decoder) {
+		layer_decoder_destroy(layer->decoder);
+		layer->decoder = NULL;
 	}
-	layer->layer_archive = archive_read_new();
-	if (!layer->layer_archive) {
-		goto err;
+}
+
+int cvirt_oci_r_layer_rewind(struct cvirt_oci_r_layer *layer) {
+	layer_close_archive(layer);
+	layer_index_reader_destroy(layer->index_reader);
+	layer->index_reader = NULL;
+	return layer_open_archive(layer);
+}
+
+int cvirt_oci_r_layer_set_threads(struct cvirt_oci_r_layer *layer,
+		int threads) {
+	if (threads < 0) {
+		return -EINVAL;
 	}
-	archive_read_support_format_tar(layer->layer_archive);
-	switch (layer->compression) {
-	case CVIRT_OCI_R_LAYER_COMPRESSION_GZIP:
-		archive_read_support_filter_gzip(layer->layer_archive);
-		break;
-	case CVIRT_OCI_R_LAYER_COMPRESSION_ZSTD:
-		archive_read_support_filter_zstd(layer->layer_archive);
-		break;
-	case CVIRT_OCI_R_LAYER_COMPRESSION_NONE:
-		break;
+	layer->decoder_threads = threads;
+	return cvirt_oci_r_layer_rewind(layer);
+}
+
+int cvirt_oci_r_layer_use_index(struct cvirt_oci_r_layer *layer,
+		const char *dir) {
+	// sha256:<hex> as sha256-<hex>
+	char path[strlen(dir) + strlen(layer->digest) + 2];
+	sprintf(path, "%s/%s", dir, layer->digest);
+	char *sep = strrchr(path, ':');
+	if (sep && sep > &path[strlen(dir)]) {
+		*sep = '-';
 	}
-	int res = archive_read_open(layer->layer_archive, layer, inplace_open,
-		inplace_read, inplace_close);
-	if (res == ARCHIVE_OK) {
-		return 0;
+	struct layer_index *index = layer_index_load(path, layer);
+	if (!index) {
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+			return -errno;
+		}
+		char tmp_path[sizeof(path) + 7];
+		sprintf(tmp_path, "%s.XXXXXX", path);
+		int fd = mkstemp(tmp_path);
+		if (fd < 0) {
+			return -errno;
+		}
+		fchmod(fd, 0644);
+		int res = layer_index_build(layer, fd);
+		close(fd);
+		if (!res && rename(tmp_path, path) < 0) {
+			res = -errno;
+		}
+		if (res < 0) {
+			unlink(tmp_path);
+			return res;
+		}
+		index = layer_index_load(path, layer);
+		if (!index) {
+			return -EIO;
+		}
 	}
-	fprintf(stderr, "cvirt_oci_r_layer_rewind: open layer archive failed: %s\n",
-		archive_error_string(layer->layer_archive));
-err:
-	archive_read_free(layer->layer_archive);
-	archive_read_free(layer->image_archive);
-	free(layer);
-	return -1;
+	// the old index may be read from
+	if (layer->index_reader && cvirt_oci_r_layer_rewind(layer) < 0) {
+		layer_index_destroy(index);
+		return -EIO;
+	}
+	layer_index_destroy(layer->index);
+	layer->index = index;
+	return 0;
+}
+
+int cvirt_oci_r_layer_open_path(struct cvirt_oci_r_layer *layer,
+		const char *path) {
+	if (!layer->index) {
+		return -EINVAL;
+	}
+	struct layer_index_reader *reader =
+		layer_index_reader_new(layer, layer->index, path);
+	if (!reader) {
+		return -ENOENT;
+	}
+	layer_close_archive(layer);
+	layer_index_reader_destroy(layer->index_reader);
+	layer->index_reader = reader;
+	return layer_open_archive(layer);
 }
 
 struct archive *cvirt_oci_r_layer_get_libarchive(struct cvirt_oci_r_layer *layer) {
@@ -114,8 +299,13 @@ struct archive *cvirt_oci_r_layer_get_libarchive(struct cvirt_oci_r_layer *layer
 }
 
 void cvirt_oci_r_layer_destroy(struct cvirt_oci_r_layer *layer) {
-	archive_read_free(layer->layer_archive);
-	archive_read_free(layer->image_archive);
-	free(layer->name);
+	layer_close_archive(layer);
+	layer_index_reader_destroy(layer->index_reader);
+	layer_index_destroy(layer->index);
+	free(layer->digest);
+	if (layer->map) {
+		munmap(layer->map, layer->map_len);
+	}
+	free(layer->buf);
 	free(layer);
 }
@@ -5,7 +5,6 @@
 
 #include <json_object.h>
 
-#include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,7 +21,6 @@ struct cvirt_oci_r_manifest *cvirt_oci_r_manifest_from_archive_blob(int fd,
 	if (!name) {
 		goto err;
 	}
-	assert(lseek(fd, 0, SEEK_SET) == 0);
 	manifest->obj = json_from_archive(fd, name);
 	free(name);
 	if (!manifest->obj) {
@@ -1,18 +1,16 @@
 #include "convirter/oci/blob.h"
 #include "oci/blob.h"
+#include "oci/chunked.h"
 #include "oci/config.h"
 #include "oci/layer.h"
 #include "oci/manifest.h"
 #include "sha256.h"
 #include "xmem.h"
 
-#include <archive.h>
-
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 
 struct cvirt_oci_blob *cvirt_oci_blob_from_layer(struct cvirt_oci_layer *layer) {
 	struct cvirt_oci_blob *blob = NULL;
@@ -27,32 +25,42 @@ struct cvirt_oci_blob *cvirt_oci_blob_from_layer(struct cvirt_oci_layer *layer)
 		blob->store_type = STORE_FS;
 		blob->digest_type = DIGEST_SHA256;
 
-		blob->path = strdup(layer->compressed_filename);
+		blob->path = strdup(layer->tmp_filename);
 		if (!blob->path) {
 			free(blob);
 			return NULL;
 		}
 
-		blob->sha256 = sha256sum_from_file(blob->path);
+		// hashed while written, see cvirt_oci_layer_close
+		blob->sha256 = strdup(layer->blob_sha256);
 		if (!blob->sha256) {
 			free(blob->path);
 			free(blob);
 			return NULL;
 		}
-
-		struct stat st;
-		if (stat(blob->path, &st) < 0) {
-			perror("stat");
-			free(blob->path);
-			free(blob);
-			return NULL;
+		blob->size = layer->blob_size;
+
+		if (layer->chunked_checksum) {
+			blob->annotations = json_object_new_object();
+			if (!blob->annotations) {
+				free(blob->sha256);
+				free(blob->path);
+				free(blob);
+				return NULL;
+			}
+			json_object_object_add(blob->annotations,
+				CHUNKED_MANIFEST_CHECKSUM_ANNOTATION,
+				json_object_new_string(layer->chunked_checksum));
+			json_object_object_add(blob->annotations,
+				CHUNKED_MANIFEST_POSITION_ANNOTATION,
+				json_object_new_string(layer->chunked_position));
 		}
-		blob->size = st.st_size;
 	} else if (layer->layer_type == EXISTING_BLOB_FROM_ARCHIVE) {
 		blob->store_type = STORE_ARCHIVE;
 		blob->digest_type = DIGEST_PREFIXED;
-		blob->size = layer->size;
-		blob->from_archive = layer->from_archive;
+		blob->size = layer->from_blob.size;
+		blob->from_fd = layer->from_fd;
+		blob->from_blob = layer->from_blob;
 		blob->digest = cvirt_xstrdup(layer->digest);
 	}
 
@@ -136,6 +144,11 @@ struct json_object *descriptor_from_oci_blob(struct cvirt_oci_blob *blob) {
 	}
 	json_object_object_add(root_obj, "size", size);
 
+	if (blob->annotations) {
+		json_object_object_add(root_obj, "annotations",
+			json_object_get(blob->annotations));
+	}
+
 	return root_obj;
 err:
 	json_object_put(root_obj);
@@ -150,9 +163,8 @@ void cvirt_oci_blob_destory(struct cvirt_oci_blob *blob) {
 	}
 	if (blob->store_type == STORE_FS) {
 		free(blob->path);
-	} else if (blob->store_type == STORE_ARCHIVE) {
-		archive_read_free(blob->from_archive);
 	}
+	json_object_put(blob->annotations);
 	free(blob);
 }
 
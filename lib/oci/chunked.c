@@ -0,0 +1,508 @@
+#include "archive-utils.h"
+#include "compressor.h"
+#include "oci/chunked.h"
+#include "sha256.h"
+#include "xmem.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <gcrypt.h>
+#include <json-c/json_tokener.h>
+#include <zstd.h>
+
+#define ZSTD_SKIPPABLE_MAGIC	0x184D2A50U
+#define CHUNKED_FOOTER_MAGIC	"GNUlInUx"
+#define CHUNKED_MANIFEST_TYPE	1
+// offset, lengths and type of the TOC, then of tar-split, which we lack
+#define CHUNKED_FOOTER_SIZE	(8 * 7 + 8)
+
+enum chunked_state {
+	CHUNKED_HEADER,
+	CHUNKED_EXTENSION, // pax or GNU long name data
+	CHUNKED_CONTENT,
+	CHUNKED_PADDING,
+	CHUNKED_TRAILER, // end-of-archive marker and beyond
+};
+
+struct chunked_writer {
+	struct compressor *compressor;
+	int level;
+	const size_t *blob_size;
+
+	enum chunked_state state;
+	char header[TAR_BLOCK_SIZE];
+	size_t header_len;
+	uint64_t left; // of the current extension, content or padding
+	uint64_t padding; // after it
+
+	char ext_type;
+	char *ext;
+	size_t ext_len, ext_capacity;
+
+	// from extension headers, for the next entry
+	char *long_name, *long_link;
+	char *pax_path, *pax_link, *pax_uname, *pax_gname;
+	int64_t pax_size, pax_uid, pax_gid, pax_mtime;
+	struct json_object *pax_xattrs;
+
+	struct json_object *entry;
+	bool framed; // content in frames of its own
+	gcry_md_hd_t digest;
+	struct json_object *entries;
+};
+
+static void chunked_reset_extensions(struct chunked_writer *writer) {
+	free(writer->long_name);
+	free(writer->long_link);
+	free(writer->pax_path);
+	free(writer->pax_link);
+	free(writer->pax_uname);
+	free(writer->pax_gname);
+	writer->long_name = writer->long_link = NULL;
+	writer->pax_path = writer->pax_link = NULL;
+	writer->pax_uname = writer->pax_gname = NULL;
+	writer->pax_size = writer->pax_uid = writer->pax_gid =
+		writer->pax_mtime = -1;
+	json_object_put(writer->pax_xattrs);
+	writer->pax_xattrs = NULL;
+}
+
+struct chunked_writer *chunked_writer_new(struct compressor *compressor,
+		int level, const size_t *blob_size) {
+	struct chunked_writer *writer = cvirt_xcalloc(1,
+		sizeof(struct chunked_writer));
+	writer->compressor = compressor;
+	writer->level = level;
+	writer->blob_size = blob_size;
+	chunked_reset_extensions(writer);
+	writer->entries = json_object_new_array();
+	if (!writer->entries || gcry_md_open(&writer->digest, GCRY_MD_SHA256, 0)) {
+		chunked_writer_free(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+// LIBARCHIVE.xattr names are URL-encoded
+static char *url_decode(const char *src, size_t len) {
+	char *res = cvirt_xmalloc(len + 1);
+	size_t j = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (src[i] == '%' && i + 2 < len && hex_value(src[i + 1]) >= 0 &&
+				hex_value(src[i + 2]) >= 0) {
+			res[j++] = hex_value(src[i + 1]) << 4 | hex_value(src[i + 2]);
+			i += 2;
+		} else {
+			res[j++] = src[i];
+		}
+	}
+	res[j] = '\0';
+	return res;
+}
+
+static void chunked_parse_pax(struct chunked_writer *writer) {
+	const char *data = writer->ext;
+	size_t len = writer->ext_len;
+	size_t pos = 0;
+	while (pos < len) {
+		char *end;
+		long record_len = strtol(&data[pos], &end, 10);
+		if (record_len <= 0 || pos + record_len > len || *end != ' ') {
+			return;
+		}
+		const char *key = end + 1;
+		const char *record_end = &data[pos + record_len - 1]; // '\n'
+		const char *eq = memchr(key, '=', record_end - key);
+		pos += record_len;
+		if (!eq) {
+			continue;
+		}
+		size_t key_len = eq - key;
+		const char *value = eq + 1;
+		size_t value_len = record_end - value;
+#define PAX_KEY(name)	(key_len == strlen(name) && !strncmp(key, name, key_len))
+		if (PAX_KEY("path")) {
+			free(writer->pax_path);
+			writer->pax_path = cvirt_xstrndup(value, value_len);
+		} else if (PAX_KEY("linkpath")) {
+			free(writer->pax_link);
+			writer->pax_link = cvirt_xstrndup(value, value_len);
+		} else if (PAX_KEY("uname")) {
+			free(writer->pax_uname);
+			writer->pax_uname = cvirt_xstrndup(value, value_len);
+		} else if (PAX_KEY("gname")) {
+			free(writer->pax_gname);
+			writer->pax_gname = cvirt_xstrndup(value, value_len);
+		} else if (PAX_KEY("size")) {
+			writer->pax_size = strtoll(value, NULL, 10);
+		} else if (PAX_KEY("uid")) {
+			writer->pax_uid = strtoll(value, NULL, 10);
+		} else if (PAX_KEY("gid")) {
+			writer->pax_gid = strtoll(value, NULL, 10);
+		} else if (PAX_KEY("mtime")) {
+			writer->pax_mtime = strtoll(value, NULL, 10);
+		} else if (key_len > 17 && !strncmp(key, "LIBARCHIVE.xattr.", 17)) {
+			// values are base64 already, the TOC has it padded
+			if (!writer->pax_xattrs) {
+				writer->pax_xattrs = json_object_new_object();
+			}
+			char *name = url_decode(&key[17], key_len - 17);
+			char padded[value_len + 3];
+			memcpy(padded, value, value_len);
+			while (value_len % 4) {
+				padded[value_len++] = '=';
+			}
+			json_object_object_add(writer->pax_xattrs, name,
+				json_object_new_string_len(padded, value_len));
+			free(name);
+		}
+#undef PAX_KEY
+	}
+}
+
+static const char *chunked_type(char type) {
+	switch (type) {
+	case '1':
+		return "hardlink";
+	case '2':
+		return "symlink";
+	case '3':
+		return "char";
+	case '4':
+		return "block";
+	case '5':
+		return "dir";
+	case '6':
+		return "fifo";
+	}
+	return "reg";
+}
+
+static void json_add_string(struct json_object *obj, const char *key,
+		const char *value) {
+	json_object_object_add(obj, key, json_object_new_string(value));
+}
+
+static void json_add_int(struct json_object *obj, const char *key,
+		int64_t value) {
+	json_object_object_add(obj, key, json_object_new_int64(value));
+}
+
+// TOC entry from the header just completed
+static void chunked_entry_begin(struct chunked_writer *writer, int64_t size) {
+	const char *header = writer->header;
+	char type = header[156];
+	struct json_object *entry = json_object_new_object();
+	json_add_string(entry, "type", chunked_type(type));
+
+	if (writer->pax_path) {
+		json_add_string(entry, "name", writer->pax_path);
+	} else if (writer->long_name) {
+		json_add_string(entry, "name", writer->long_name);
+	} else {
+		char name[155 + 1 + 100 + 1] = {0};
+		if (!memcmp(&header[257], "ustar", 5) && header[345]) {
+			strncpy(name, &header[345], 155);
+			strcat(name, "/");
+		}
+		strncat(name, header, 100);
+		json_add_string(entry, "name", name);
+	}
+	if (type == '1' || type == '2') {
+		if (writer->pax_link) {
+			json_add_string(entry, "linkName", writer->pax_link);
+		} else if (writer->long_link) {
+			json_add_string(entry, "linkName", writer->long_link);
+		} else {
+			char link[100 + 1] = {0};
+			strncpy(link, &header[157], 100);
+			json_add_string(entry, "linkName", link);
+		}
+	}
+
+	json_add_int(entry, "mode", tar_parse_number(&header[100], 8) & 07777);
+	json_add_int(entry, "size", type == '0' || type == '\0' ? size : 0);
+	json_add_int(entry, "uid", writer->pax_uid >= 0 ?
+		writer->pax_uid : tar_parse_number(&header[108], 8));
+	json_add_int(entry, "gid", writer->pax_gid >= 0 ?
+		writer->pax_gid : tar_parse_number(&header[116], 8));
+	// ustar uname and gname are NUL-padded, not always terminated
+	char owner[32 + 1] = {0};
+	if (writer->pax_uname) {
+		json_add_string(entry, "userName", writer->pax_uname);
+	} else if (header[265]) {
+		strncpy(owner, &header[265], 32);
+		json_add_string(entry, "userName", owner);
+	}
+	if (writer->pax_gname) {
+		json_add_string(entry, "groupName", writer->pax_gname);
+	} else if (header[297]) {
+		memset(owner, 0, sizeof(owner));
+		strncpy(owner, &header[297], 32);
+		json_add_string(entry, "groupName", owner);
+	}
+
+	time_t mtime = writer->pax_mtime >= 0 ?
+		writer->pax_mtime : tar_parse_number(&header[136], 12);
+	struct tm tm;
+	char modtime[32];
+	if (gmtime_r(&mtime, &tm) &&
+			strftime(modtime, sizeof(modtime), "%Y-%m-%dT%H:%M:%SZ", &tm)) {
+		json_add_string(entry, "modtime", modtime);
+	}
+	if (type == '3' || type == '4') {
+		json_add_int(entry, "devMajor", tar_parse_number(&header[329], 8));
+		json_add_int(entry, "devMinor", tar_parse_number(&header[337], 8));
+	}
+	if (writer->pax_xattrs) {
+		json_object_object_add(entry, "xattrs", writer->pax_xattrs);
+		writer->pax_xattrs = NULL;
+	}
+	writer->entry = entry;
+}
+
+static int chunked_entry_end(struct chunked_writer *writer) {
+	if (writer->framed) {
+		if (compressor_end_frame(writer->compressor) < 0) {
+			return -1;
+		}
+		json_add_int(writer->entry, "endOffset", *writer->blob_size);
+		gcry_md_final(writer->digest);
+		char *hex = sha256sum_to_hex(gcry_md_read(writer->digest, 0));
+		if (!hex) {
+			return -1;
+		}
+		char digest[7 + 64 + 1];
+		sprintf(digest, "sha256:%s", hex);
+		free(hex);
+		json_add_string(writer->entry, "digest", digest);
+		writer->framed = false;
+	}
+	json_object_array_add(writer->entries, writer->entry);
+	writer->entry = NULL;
+	return 0;
+}
+
+// at the end of a section, on to the next
+static int chunked_section_end(struct chunked_writer *writer) {
+	switch (writer->state) {
+	case CHUNKED_EXTENSION:
+		writer->ext[writer->ext_len] = '\0';
+		if (writer->ext_type == 'x') {
+			chunked_parse_pax(writer);
+		} else if (writer->ext_type == 'L') {
+			free(writer->long_name);
+			writer->long_name = cvirt_xstrdup(writer->ext);
+		} else if (writer->ext_type == 'K') {
+			free(writer->long_link);
+			writer->long_link = cvirt_xstrdup(writer->ext);
+		}
+		break;
+	case CHUNKED_CONTENT:
+		if (chunked_entry_end(writer) < 0) {
+			return -1;
+		}
+		break;
+	default:
+		writer->state = CHUNKED_HEADER;
+		return 0;
+	}
+	writer->left = writer->padding;
+	writer->state = writer->left ? CHUNKED_PADDING : CHUNKED_HEADER;
+	return 0;
+}
+
+static bool block_is_zero(const char *block) {
+	for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+		if (block[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int chunked_header(struct chunked_writer *writer) {
+	const char *header = writer->header;
+	if (block_is_zero(header)) {
+		writer->state = CHUNKED_TRAILER;
+		return 0;
+	}
+	char type = header[156];
+	int64_t size = writer->pax_size >= 0 ?
+		writer->pax_size : tar_parse_number(&header[124], 12);
+	if (size < 0) {
+		return -1;
+	}
+	writer->left = size;
+	writer->padding = -size & (TAR_BLOCK_SIZE - 1);
+
+	if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+		writer->state = CHUNKED_EXTENSION;
+		writer->ext_type = type;
+		writer->ext_len = 0;
+		if ((size_t)size + 1 > writer->ext_capacity) {
+			writer->ext_capacity = size + 1;
+			writer->ext = cvirt_xrealloc(writer->ext, writer->ext_capacity);
+		}
+	} else {
+		writer->state = CHUNKED_CONTENT;
+		chunked_entry_begin(writer, size);
+		chunked_reset_extensions(writer);
+		if ((type == '0' || type == '\0') && size) {
+			// header ends the previous frame, content starts its own
+			if (compressor_end_frame(writer->compressor) < 0) {
+				return -1;
+			}
+			json_add_int(writer->entry, "offset", *writer->blob_size);
+			gcry_md_reset(writer->digest);
+			writer->framed = true;
+		}
+	}
+	return writer->left ? 0 : chunked_section_end(writer);
+}
+
+int chunked_writer_write(struct chunked_writer *writer, const void *buf,
+		size_t len) {
+	const char *p = buf;
+	while (len) {
+		size_t n;
+		if (writer->state == CHUNKED_HEADER) {
+			n = TAR_BLOCK_SIZE - writer->header_len;
+			n = n > len ? len : n;
+			memcpy(&writer->header[writer->header_len], p, n);
+			writer->header_len += n;
+		} else if (writer->state == CHUNKED_TRAILER) {
+			n = len;
+		} else {
+			n = writer->left > len ? len : writer->left;
+			if (writer->state == CHUNKED_EXTENSION) {
+				memcpy(&writer->ext[writer->ext_len], p, n);
+				writer->ext_len += n;
+			} else if (writer->state == CHUNKED_CONTENT && writer->framed) {
+				gcry_md_write(writer->digest, p, n);
+			}
+			writer->left -= n;
+		}
+		if (compressor_write(writer->compressor, p, n) < 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+
+		if (writer->state == CHUNKED_HEADER) {
+			if (writer->header_len == TAR_BLOCK_SIZE) {
+				writer->header_len = 0;
+				if (chunked_header(writer) < 0) {
+					return -1;
+				}
+			}
+		} else if (writer->state != CHUNKED_TRAILER && !writer->left) {
+			if (chunked_section_end(writer) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void put_le64(uint8_t *dst, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		dst[i] = value >> (i * 8);
+	}
+}
+
+static int write_skippable_frame(compressor_write_callback *write_cb,
+		void *client_data, const void *data, uint32_t len) {
+	uint8_t header[8];
+	for (int i = 0; i < 4; i++) {
+		header[i] = ZSTD_SKIPPABLE_MAGIC >> (i * 8);
+		header[i + 4] = len >> (i * 8);
+	}
+	if (write_cb(client_data, header, sizeof(header)) < 0 ||
+			write_cb(client_data, data, len) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int chunked_writer_close(struct chunked_writer *writer,
+		compressor_write_callback *write_cb, void *client_data,
+		char **checksum, char **position) {
+	struct json_object *toc = json_object_new_object();
+	if (!toc) {
+		return -1;
+	}
+	json_add_int(toc, "version", 1);
+	json_object_object_add(toc, "entries", json_object_get(writer->entries));
+	const char *toc_str = json_object_to_json_string_ext(toc,
+		JSON_C_TO_STRING_PLAIN);
+	size_t toc_len = strlen(toc_str);
+	size_t bound = ZSTD_compressBound(toc_len);
+	uint8_t *compressed = cvirt_xmalloc(bound);
+	size_t compressed_len = ZSTD_compress(compressed, bound, toc_str, toc_len,
+		writer->level ? writer->level : ZSTD_CLEVEL_DEFAULT);
+	json_object_put(toc);
+	int res = -1;
+	if (ZSTD_isError(compressed_len) || compressed_len > UINT32_MAX) {
+		fprintf(stderr, "compress layer TOC failed\n");
+		goto out;
+	}
+
+	size_t offset = *writer->blob_size + 8; // after the frame header
+	if (write_skippable_frame(write_cb, client_data, compressed,
+			compressed_len) < 0) {
+		goto out;
+	}
+	uint8_t footer[CHUNKED_FOOTER_SIZE] = {0};
+	put_le64(&footer[0], offset);
+	put_le64(&footer[8], compressed_len);
+	put_le64(&footer[16], toc_len);
+	put_le64(&footer[24], CHUNKED_MANIFEST_TYPE);
+	memcpy(&footer[56], CHUNKED_FOOTER_MAGIC, 8);
+	if (write_skippable_frame(write_cb, client_data, footer,
+			sizeof(footer)) < 0) {
+		goto out;
+	}
+
+	uint8_t digest[32];
+	gcry_md_hash_buffer(GCRY_MD_SHA256, digest, compressed, compressed_len);
+	char *hex = sha256sum_to_hex(digest);
+	if (!hex) {
+		goto out;
+	}
+	*checksum = cvirt_xmalloc(7 + 64 + 1);
+	sprintf(*checksum, "sha256:%s", hex);
+	free(hex);
+	*position = cvirt_xmalloc(4 * 21);
+	sprintf(*position, "%zu:%zu:%zu:%d", offset, compressed_len, toc_len,
+		CHUNKED_MANIFEST_TYPE);
+	res = 0;
+out:
+	free(compressed);
+	return res;
+}
+
+void chunked_writer_free(struct chunked_writer *writer) {
+	chunked_reset_extensions(writer);
+	free(writer->ext);
+	json_object_put(writer->entry);
+	json_object_put(writer->entries);
+	gcry_md_close(writer->digest);
+	free(writer);
+}
@@ -127,16 +127,18 @@ int cvirt_oci_image_add_blob(struct cvirt_oci_image *image, struct cvirt_oci_blo
 		close(fd);
 	} else if (blob->store_type == STORE_ARCHIVE) {
 		char buf[bufsz];
-		size_t sz = blob->size;
-		while (sz) {
-			ssize_t r = archive_read_data(blob->from_archive, buf, sz > bufsz ? bufsz : sz);
+		size_t offset = 0;
+		while (offset < blob->size) {
+			ssize_t r = archive_blob_pread(blob->from_fd, &blob->from_blob,
+				buf, bufsz, offset);
 			if (r < 0) {
-				return -errno;
+				return r;
 			} else if (r == 0) {
-				fprintf(stderr, "%s ends permaturely: %ld remaining\n", blob->path, sz);
+				fprintf(stderr, "blob ends permaturely: %ld remaining\n",
+					blob->size - offset);
 				return -1;
 			}
-			sz -= r;
+			offset += r;
 			if (archive_write_data(image->archive, buf, r) < 0) {
 				return -errno;
 			}
@@ -1,5 +1,6 @@
 #include "convirter/oci/layer.h"
 #include "convirter/oci-r/layer.h"
+#include "oci/chunked.h"
 #include "oci/layer.h"
 #include "oci-r/layer.h"
 #include "archive-utils.h"
@@ -8,10 +9,13 @@
 #include "xmem.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <archive.h>
+#include <gcrypt.h>
 
 #define LAYER_FILE_TEMPLATE	"/cvirt-oci-layer-XXXXXX"
 
@@ -19,8 +23,80 @@ static const char media_type_zstd[] = "application/vnd.oci.image.layer.v1.tar+zs
 static const char media_type_gzip[] = "application/vnd.oci.image.layer.v1.tar+gzip";
 static const char media_type_raw[] = "application/vnd.oci.image.layer.v1.tar";
 
+// blob as written to tmp_filename, hashed for its digest on the way
+static ssize_t layer_write_blob(void *client_data, const void *buf, size_t len) {
+	struct cvirt_oci_layer *layer = client_data;
+	if (layer->compressor) {
+		gcry_md_write(layer->blob_hash, buf, len);
+	}
+	size_t written = 0;
+	while (written < len) {
+		ssize_t res = write(layer->fd, (const char *)buf + written, len - written);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		written += res;
+	}
+	layer->blob_size += len;
+	return len;
+}
+
+/*
+ * Tar stream of the layer, hashed for diff_id and compressed in the same
+ * pass, so only the blob ever hits the disk.
+ */
+static la_ssize_t layer_write_tar(struct archive *archive, void *client_data,
+		const void *buf, size_t len) {
+	struct cvirt_oci_layer *layer = client_data;
+	gcry_md_write(layer->diff_id_hash, buf, len);
+	if (!layer->compressor) {
+		if (layer_write_blob(client_data, buf, len) < 0) {
+			archive_set_error(archive, errno, "write layer: %s", strerror(errno));
+			return -1;
+		}
+		return len;
+	}
+	int res = layer->chunked ?
+		chunked_writer_write(layer->chunked, buf, len) :
+		compressor_write(layer->compressor, buf, len);
+	if (res < 0) {
+		archive_set_error(archive, EIO, "compress layer: %s",
+			compressor_error_string(layer->compressor));
+		return -1;
+	}
+	return len;
+}
+
+static void new_layer_cleanup(struct cvirt_oci_layer *layer) {
+	if (layer->archive) { // not closed
+		archive_write_free(layer->archive);
+	}
+	if (layer->chunked) {
+		chunked_writer_free(layer->chunked);
+	}
+	if (layer->compressor) {
+		compressor_free(layer->compressor);
+	}
+	if (layer->fd >= 0) {
+		close(layer->fd);
+	}
+	gcry_md_close(layer->diff_id_hash);
+	gcry_md_close(layer->blob_hash);
+	if (layer->tmp_filename) {
+		unlink(layer->tmp_filename);
+	}
+	free(layer->tmp_filename);
+	free(layer->diff_id_sha256);
+	free(layer->blob_sha256);
+	free(layer->chunked_checksum);
+	free(layer->chunked_position);
+}
+
 struct cvirt_oci_layer *cvirt_oci_layer_new(
-		enum cvirt_oci_layer_compression compression, int level) {
+		enum cvirt_oci_layer_compression compression, int level, int threads) {
 	int res;
 	struct cvirt_oci_layer *layer = calloc(1, sizeof(struct cvirt_oci_layer));
 	if (!layer) {
@@ -33,6 +109,7 @@ struct cvirt_oci_layer *cvirt_oci_layer_new(
 
 	switch (layer->compression) {
 	case CVIRT_OCI_LAYER_COMPRESSION_ZSTD:
+	case CVIRT_OCI_LAYER_COMPRESSION_ZSTD_CHUNKED:
 		layer->media_type = media_type_zstd;
 		break;
 	case CVIRT_OCI_LAYER_COMPRESSION_GZIP:
@@ -43,61 +120,84 @@ struct cvirt_oci_layer *cvirt_oci_layer_new(
 		break;
 	}
 
+	layer->fd = -1;
 	const char *tmpdir = getenv("TMPDIR");
 	if (tmpdir) {
 		layer->tmp_filename = calloc(strlen(tmpdir) + strlen(LAYER_FILE_TEMPLATE) + 1, sizeof(char));
 		if (!layer->tmp_filename) {
-			free(layer);
-			layer = NULL;
-			goto out;
+			goto err;
 		}
 		strcpy(layer->tmp_filename, tmpdir);
 		strcat(layer->tmp_filename, LAYER_FILE_TEMPLATE);
 	} else {
 		layer->tmp_filename = strdup("/tmp" LAYER_FILE_TEMPLATE);
 		if (!layer->tmp_filename) {
-			free(layer);
-			layer = NULL;
-			goto out;
+			goto err;
 		}
 	}
 	layer->fd = mkstemp(layer->tmp_filename);
 	if (layer->fd < 0) {
-		free(layer);
-		layer = NULL;
-		goto out;
+		goto err;
+	}
+
+	if (gcry_md_open(&layer->diff_id_hash, GCRY_MD_SHA256, 0) ||
+			gcry_md_open(&layer->blob_hash, GCRY_MD_SHA256, 0)) {
+		goto err;
+	}
+
+	switch (layer->compression) {
+	case CVIRT_OCI_LAYER_COMPRESSION_ZSTD:
+		layer->compressor = compressor_open(COMPRESSION_ZSTD,
+			layer->compression_level, threads, layer, layer_write_blob);
+		break;
+	case CVIRT_OCI_LAYER_COMPRESSION_GZIP:
+		layer->compressor = compressor_open(COMPRESSION_GZIP,
+			layer->compression_level, threads, layer, layer_write_blob);
+		break;
+	case CVIRT_OCI_LAYER_COMPRESSION_ZSTD_CHUNKED:
+		layer->compressor = compressor_open(COMPRESSION_ZSTD_FRAMES,
+			layer->compression_level, threads, layer, layer_write_blob);
+		if (layer->compressor) {
+			layer->chunked = chunked_writer_new(layer->compressor,
+				layer->compression_level, &layer->blob_size);
+			if (!layer->chunked) {
+				goto err;
+			}
+		}
+		break;
+	case CVIRT_OCI_LAYER_COMPRESSION_NONE:
+		break;
+	}
+	if (layer->compression != CVIRT_OCI_LAYER_COMPRESSION_NONE &&
+			!layer->compressor) {
+		goto err;
 	}
 
 	layer->archive = archive_write_new();
 	if (!layer->archive) {
-		free(layer);
-		layer = NULL;
-		goto out;
+		goto err;
 	}
 	res = archive_write_set_format_pax_restricted(layer->archive);
 	if (res < 0) {
-		archive_write_free(layer->archive);
-		free(layer);
-		layer = NULL;
-		goto out;
+		goto err;
 	}
 	res = archive_write_set_format_option(layer->archive, "pax", "xattrheader", "LIBARCHIVE");
 	if (res < 0) {
-		archive_write_free(layer->archive);
-		free(layer);
-		layer = NULL;
-		goto out;
+		goto err;
 	}
-	res = archive_write_open_fd(layer->archive, layer->fd);
+	// as archive_write_open_fd does for regular files, keeps diff_id as before
+	archive_write_set_bytes_in_last_block(layer->archive, 1);
+	res = archive_write_open(layer->archive, layer, NULL, layer_write_tar, NULL);
 	if (res < 0) {
-		archive_write_free(layer->archive);
-		free(layer);
-		layer = NULL;
-		goto out;
+		goto err;
 	}
 
 out:
 	return layer;
+err:
+	new_layer_cleanup(layer);
+	free(layer);
+	return NULL;
 }
 
 struct cvirt_oci_layer *cvirt_oci_layer_from_archive_blob(int fd,
@@ -121,19 +221,17 @@ struct cvirt_oci_layer *cvirt_oci_layer_from_archive_blob(int fd,
 		break;
 	}
 	char *name = digest_to_name(digest);
-	struct archive_entry *entry;
-	assert(lseek(fd, 0, SEEK_SET) == 0);
-	layer->from_archive = archive_from_fd_and_seek(fd, name, &entry);
-	free(name);
-	layer->size = archive_entry_size(entry);
-	if (!layer->from_archive) {
+	if (!name) {
 		free(layer);
 		return NULL;
 	}
-	int index = 0;
-	while (digest[index] != ':') {
-		index++;
+	int res = archive_blob_lookup(fd, name, &layer->from_blob);
+	free(name);
+	if (res < 0) {
+		free(layer);
+		return NULL;
 	}
+	layer->from_fd = fd;
 	layer->digest = cvirt_xstrdup(digest);
 	layer->diff_id = cvirt_xstrdup(diff_id);
 	return layer;
@@ -141,55 +239,57 @@ struct cvirt_oci_layer *cvirt_oci_layer_from_archive_blob(int fd,
 
 int cvirt_oci_layer_close(struct cvirt_oci_layer *layer) {
 	assert(layer->layer_type == NEW_LAYER);
-	archive_write_close(layer->archive);
-	archive_write_free(layer->archive);
-	layer->diff_id_sha256 = sha256sum_from_file(layer->tmp_filename);
-	if (!layer->diff_id_sha256) {
-		return -1;
-	}
-
-	enum compression compression;
-	switch (layer->compression) {
-	case CVIRT_OCI_LAYER_COMPRESSION_ZSTD:
-		compression = COMPRESSION_ZSTD;
-		break;
-	case CVIRT_OCI_LAYER_COMPRESSION_GZIP:
-		compression = COMPRESSION_GZIP;
-		break;
-	case CVIRT_OCI_LAYER_COMPRESSION_NONE:
-		layer->compressed_filename = strdup(layer->tmp_filename);
-		return 0;
+	int res = archive_write_close(layer->archive);
+	if (res < 0) {
+		fprintf(stderr, "write layer failed: %s\n", archive_error_string(layer->archive));
 	}
-
-	const char *tmpdir = getenv("TMPDIR");
-	if (tmpdir) {
-		layer->compressed_filename = calloc(strlen(tmpdir) + strlen(LAYER_FILE_TEMPLATE) + 1, sizeof(char));
-		if (!layer->compressed_filename) {
-			return -1;
+	archive_write_free(layer->archive);
+	layer->archive = NULL;
+	if (layer->compressor) {
+		// flush what the tar trailer left in the compressor
+		if (res >= 0) {
+			res = compressor_close(layer->compressor);
+			if (res < 0) {
+				fprintf(stderr, "compress layer failed: %s\n",
+					compressor_error_string(layer->compressor));
+			}
 		}
-		strcpy(layer->compressed_filename, tmpdir);
-		strcat(layer->compressed_filename, LAYER_FILE_TEMPLATE);
-	} else {
-		layer->compressed_filename = strdup("/tmp" LAYER_FILE_TEMPLATE);
-		if (!layer->compressed_filename) {
-			return -1;
+		if (layer->chunked) {
+			// TOC after the last frame, in skippable frames
+			if (res >= 0) {
+				res = chunked_writer_close(layer->chunked, layer_write_blob,
+					layer, &layer->chunked_checksum,
+					&layer->chunked_position);
+				if (res < 0) {
+					fprintf(stderr, "write layer TOC failed\n");
+				}
+			}
+			chunked_writer_free(layer->chunked);
+			layer->chunked = NULL;
 		}
+		compressor_free(layer->compressor);
+		layer->compressor = NULL;
 	}
-	int compressed_fd = mkstemp(layer->compressed_filename);
-	if (compressed_fd < 0) {
+	close(layer->fd);
+	layer->fd = -1;
+	if (res < 0) {
 		return -1;
 	}
-	lseek(layer->fd, 0, SEEK_SET);
 
-	int res = compress(layer->fd, compressed_fd, compression, layer->compression_level);
-	if (res < 0) {
-		fprintf(stderr, "compress layer failed: %d\n", res);
+	gcry_md_final(layer->diff_id_hash);
+	layer->diff_id_sha256 = sha256sum_to_hex(gcry_md_read(layer->diff_id_hash, 0));
+	if (!layer->diff_id_sha256) {
+		return -1;
+	}
+	if (layer->compression == CVIRT_OCI_LAYER_COMPRESSION_NONE) {
+		layer->blob_sha256 = strdup(layer->diff_id_sha256);
+	} else {
+		gcry_md_final(layer->blob_hash);
+		layer->blob_sha256 = sha256sum_to_hex(gcry_md_read(layer->blob_hash, 0));
+	}
+	if (!layer->blob_sha256) {
 		return -1;
 	}
-
-	close(compressed_fd);
-	close(layer->fd);
-	unlink(layer->tmp_filename);
 	return 0;
 }
 
@@ -203,10 +303,7 @@ struct archive *cvirt_oci_layer_get_libarchive(struct cvirt_oci_layer *layer) {
 
 void cvirt_oci_layer_destroy(struct cvirt_oci_layer *layer) {
 	if (layer->layer_type == NEW_LAYER) {
-		unlink(layer->compressed_filename);
-		free(layer->tmp_filename);
-		free(layer->diff_id_sha256);
-		free(layer->compressed_filename);
+		new_layer_cleanup(layer);
 	} else if (layer->layer_type == EXISTING_BLOB_FROM_ARCHIVE) {
 		free(layer->digest);
 		free(layer->diff_id);
@@ -11,7 +11,7 @@
 
 #include <gcrypt.h>
 
-static void bin_to_hex(char *dest, uint8_t *src, size_t sz) {
+static void bin_to_hex(char *dest, const uint8_t *src, size_t sz) {
 	for (int a = 0; a < sz; a++) {
 		sprintf(&dest[a * 2], "%02x", src[a]);
 	}
@@ -62,3 +62,12 @@ char *sha256sum_from_mem(const char *buf, size_t sz) {
 	free(digest);
 	return sum;
 }
+
+char *sha256sum_to_hex(const uint8_t *digest) {
+	char *sum = calloc(65, sizeof(char));
+	if (!sum) {
+		return NULL;
+	}
+	bin_to_hex(sum, digest, 32);
+	return sum;
+}
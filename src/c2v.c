@@ -608,7 +608,7 @@ int main(int argc, char *argv[]) {
 	struct cvirt_oci_r_layer *layer = cvirt_oci_r_layer_from_archive_blob(
 		fd, cvirt_oci_r_manifest_get_layer_digest(manifest, 0),
 		cvirt_oci_r_manifest_get_layer_compression(manifest, 0));
-	layer_trees[0] = cvirt_mtree_tree_from_oci_layer(layer, 0);
+	layer_trees[0] = cvirt_mtree_tree_from_oci_layer(layer, CVIRT_MTREE_TREE_ARENA);
 	size_t needed = estimate_disk_usage(layer_trees[0]);
 	cvirt_oci_r_layer_destroy(layer);
 	for (int i = 1; i < len; i++) {
@@ -616,7 +616,7 @@ int main(int argc, char *argv[]) {
 		struct cvirt_oci_r_layer *layer =
 			cvirt_oci_r_layer_from_archive_blob(fd, layer_digest,
 			cvirt_oci_r_manifest_get_layer_compression(manifest, i));
-		layer_trees[i] = cvirt_mtree_tree_from_oci_layer(layer, 0);
+		layer_trees[i] = cvirt_mtree_tree_from_oci_layer(layer, CVIRT_MTREE_TREE_ARENA);
 		needed += estimate_disk_usage(layer_trees[i]);
 		cvirt_oci_r_layer_destroy(layer);
 	}
@@ -703,7 +703,7 @@ int main(int argc, char *argv[]) {
 	cvirt_oci_r_config_destroy(config);
 	cvirt_oci_r_manifest_destroy(manifest);
 	cvirt_oci_r_index_destroy(index);
-	close(fd);
+	cvirt_oci_r_archive_close(fd);
 
 	guestfs_umount_all(global_state.guestfs);
 	guestfs_shutdown(global_state.guestfs);
@@ -32,9 +32,11 @@ struct findlayer_config {
 	bool best_image_only;
 	const char *data;
 	bool keep_btrfs_snapshots;
+	bool bulk_scan;
+	int jobs;
 };
 
-static struct findlayer_config config = {0};
+static struct findlayer_config config = { .jobs = 1 };
 
 static const char usage[] = "\
 Usage: %s [OPTION]... INPUT\n\
@@ -44,19 +46,26 @@ Find the best container image for a VM image for v2c layer reuse.\n\
                               of all considered image names and estimated reused\n\
                               bytes\n\
   -d, --data=DIR              Use DIR as data directory instead of .\n\
-      --keep-btrfs-snapshots  Do not try to ignore btrfs snapshots\n";
+  -j, --jobs=N                Walk INPUT with N appliances in parallel\n\
+      --keep-btrfs-snapshots  Do not try to ignore btrfs snapshots\n\
+      --bulk-scan             List the whole file system at once and stat in\n\
+                              large batches instead of per directory\n\
+\n\
+INPUT is a VM image, or snapshot:FILE for an mtree snapshot with checksums\n";
 
 
 static const struct option long_options[] = {
 	{"best-only",			no_argument,	NULL,	'b'},
 	{"data",		required_argument,	NULL,	'd'},
+	{"jobs",		required_argument,	NULL,	'j'},
 	{"keep-btrfs-snapshots",	no_argument,	NULL,	1},
+	{"bulk-scan",			no_argument,	NULL,	2},
 	{0},
 };
 
 static int parse_options(struct findlayer_config *config, int argc, char *argv[]) {
 	int opt;
-	while ((opt = getopt_long(argc, argv, "bd:", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "bd:j:", long_options, NULL)) != -1) {
 		switch (opt) {
 		case '?':
 			return -EINVAL;
@@ -66,9 +75,18 @@ static int parse_options(struct findlayer_config *config, int argc, char *argv[]
 		case 'd':
 			config->data = optarg;
 			break;
+		case 'j':
+			config->jobs = atoi(optarg);
+			if (config->jobs < 1) {
+				return -EINVAL;
+			}
+			break;
 		case 1:
 			config->keep_btrfs_snapshots = true;
 			break;
+		case 2:
+			config->bulk_scan = true;
+			break;
 		}
 	}
 	return 0;
@@ -290,18 +308,36 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr, usage, argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	guestfs_h *guestfs = create_guestfs_mount_first_linux(argv[optind], NULL);
-	if (!guestfs) {
-		exit(EXIT_FAILURE);
-	}
-
 	uint32_t flags = CVIRT_MTREE_TREE_CHECKSUM |
-		CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS;
+		CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS |
+		CVIRT_MTREE_TREE_GUESTFS_CHECKSUM_IN_APPLIANCE |
+		CVIRT_MTREE_TREE_ARENA;
 	if (config.keep_btrfs_snapshots) {
 		flags ^= CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS;
 	}
+	if (config.bulk_scan) {
+		flags |= CVIRT_MTREE_TREE_GUESTFS_BULK_SCAN;
+	}
 
-	struct cvirt_mtree_entry *tree = cvirt_mtree_tree_from_guestfs(guestfs, flags);
+	struct cvirt_mtree_entry *tree;
+	if (!strncmp(argv[optind], "snapshot:", 9)) {
+		tree = cvirt_mtree_tree_load_mmap(&argv[optind][9]);
+		if (!tree) {
+			exit(EXIT_FAILURE);
+		}
+		if (!(cvirt_mtree_tree_get_flags(tree) & CVIRT_MTREE_TREE_CHECKSUM)) {
+			fprintf(stderr, "Snapshot has no checksum\n");
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		guestfs_h **guestfs = create_guestfs_pool_mount_first_linux(
+			argv[optind], config.jobs);
+		if (!guestfs) {
+			exit(EXIT_FAILURE);
+		}
+		tree = cvirt_mtree_tree_from_guestfs_pool(guestfs, config.jobs, flags);
+		destroy_guestfs_pool(guestfs, config.jobs);
+	}
 	int max_len = max_filename_length(tree);
 	char path_buffer[max_len + 1];
 	gcry_md_hd_t gcry;
@@ -108,23 +108,7 @@ static void build_filter(struct cvirt_mtree_entry *tree, uint8_t *filter, int lo
 	}
 }
 
-int main(int argc, char *argv[]) {
-	if (argc != 3) {
-		return EXIT_FAILURE;
-	}
-
-	int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
-	if (fd < 0) {
-		fprintf(stderr, "Failed to open OCI archive: %s\n", strerror(errno));
-		return EXIT_FAILURE;
-	}
-	int fdout = open(argv[2], O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
-	if (fdout < 0) {
-		close(fd);
-		fprintf(stderr, "Failed to create filter: %s\n", strerror(errno));
-		return EXIT_FAILURE;
-	}
-
+static struct cvirt_mtree_entry *tree_from_archive(int fd) {
 	struct cvirt_oci_r_index *index = cvirt_oci_r_index_from_archive(fd);
 	const char *manifest_digest = cvirt_oci_r_index_get_native_manifest_digest(index);
 	struct cvirt_oci_r_manifest *manifest = cvirt_oci_r_manifest_from_archive_blob(fd, manifest_digest);
@@ -132,7 +116,8 @@ int main(int argc, char *argv[]) {
 	struct cvirt_oci_r_layer *layer =
 		cvirt_oci_r_layer_from_archive_blob(fd, layer_digest,
 		cvirt_oci_r_manifest_get_layer_compression(manifest, 0));
-	struct cvirt_mtree_entry *tree = cvirt_mtree_tree_from_oci_layer(layer, CVIRT_MTREE_TREE_CHECKSUM);
+	struct cvirt_mtree_entry *tree = cvirt_mtree_tree_from_oci_layer(layer,
+		CVIRT_MTREE_TREE_CHECKSUM | CVIRT_MTREE_TREE_ARENA);
 	cvirt_oci_r_layer_destroy(layer);
 	int len = cvirt_oci_r_manifest_get_layers_length(manifest);
 	for (int i = 1; i < len; i++) {
@@ -145,7 +130,41 @@ int main(int argc, char *argv[]) {
 	}
 	cvirt_oci_r_manifest_destroy(manifest);
 	cvirt_oci_r_index_destroy(index);
-	close(fd);
+	return tree;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 3) {
+		return EXIT_FAILURE;
+	}
+
+	struct cvirt_mtree_entry *tree;
+	if (!strncmp(argv[1], "snapshot:", 9)) {
+		tree = cvirt_mtree_tree_load_mmap(&argv[1][9]);
+		if (!tree) {
+			return EXIT_FAILURE;
+		}
+		if (!(cvirt_mtree_tree_get_flags(tree) & CVIRT_MTREE_TREE_CHECKSUM)) {
+			fprintf(stderr, "Snapshot has no checksum\n");
+			cvirt_mtree_tree_destroy(tree);
+			return EXIT_FAILURE;
+		}
+	} else {
+		int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "Failed to open OCI archive: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		tree = tree_from_archive(fd);
+		cvirt_oci_r_archive_close(fd);
+	}
+
+	int fdout = open(argv[2], O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fdout < 0) {
+		cvirt_mtree_tree_destroy(tree);
+		fprintf(stderr, "Failed to create filter: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
 
 	int entries = count_files(tree);
 	int filename_length = max_filename_length(tree);
@@ -1,14 +1,18 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -34,12 +38,33 @@ Usage: %s [OPTION]... INPUT OUTPUT\n\
 Convert a VM image into OCI-compatible container image.\n\
 \n\
       --compression=ALGO[:LEVEL]  Compress layers with algorithm ALGO\n\
-                                  Available algorithms: zstd, gzip, none\n\
+                                  Available algorithms: zstd, zstd:chunked,\n\
+                                  gzip, none\n\
                                   Defaults to zstd\n\
+      --compression-threads=N     Compress layers with N threads\n\
+                                  Defaults to number of online CPUs\n\
       --no-systemd-cleanup        Disable removing systemd units that will\n\
                                   likely fail and is unneeded in containers\n\
-      --layer-reuse=ARCHIVE       Try to reuse layers from ARCHIVE\n\
+      --layer-reuse=ARCHIVE       Try to reuse first layers of ARCHIVE, set once\n\
+                                  for each candidate, the smallest new layer\n\
+                                  wins\n\
+      --layer-reuse-snapshot=FILE Read file tree of --layer-reuse ARCHIVE from\n\
+                                  mtree snapshot FILE instead of its layers,\n\
+                                  with one ARCHIVE, reusing all its layers\n\
       --keep-btrfs-snapshots      Do not try to ignore btrfs snapshots\n\
+      --bulk-scan                 List the whole file system at once and stat\n\
+                                  in large batches instead of per directory\n\
+      --prefetch-depth=N          Read up to N entries ahead of layer\n\
+                                  compression, 0 to disable, defaults to 1024\n\
+      --prefetch-memory=MIB       Buffer at most MIB MiB of read-ahead content,\n\
+                                  defaults to 256\n\
+      --split-layers=MIB          Split the new layer into layers of about MIB\n\
+                                  MiB each, built in parallel\n\
+      --split-layer-prefix=PATH   Put PATH into layers of its own when\n\
+                                  splitting, set once for each path, defaults\n\
+                                  to /usr, /opt, /var and /home\n\
+      --split-jobs=N              Build up to N split layers at once, each\n\
+                                  with its own appliance, defaults to 2\n\
 \n\
 Options below set respective config of output container image:\n"
 COMMON_EXEC_CONFIG_OPTIONS_HELP;
@@ -51,6 +76,14 @@ static const struct option long_options[] = {
 	{"no-systemd-cleanup",	no_argument,	NULL,	2},
 	{"layer-reuse",	required_argument,	NULL,	3},
 	{"keep-btrfs-snapshots",no_argument,	NULL,	4},
+	{"layer-reuse-snapshot",	required_argument,	NULL,	5},
+	{"bulk-scan",	no_argument,	NULL,	6},
+	{"prefetch-depth",	required_argument,	NULL,	7},
+	{"prefetch-memory",	required_argument,	NULL,	8},
+	{"compression-threads",	required_argument,	NULL,	9},
+	{"split-layers",	required_argument,	NULL,	10},
+	{"split-layer-prefix",	required_argument,	NULL,	11},
+	{"split-jobs",	required_argument,	NULL,	12},
 	COMMON_EXEC_CONFIG_LONG_OPTIONS(common_exec_config_start),
 	{0},
 };
@@ -66,6 +99,30 @@ static const char *temporary_paths[] = {
 };
 
 static const int bufsz = 4000 * 1024;
+// files from this size on are streamed with guestfs_download
+static const int64_t stream_file_min = 64 * 1024 * 1024;
+static const int stream_pipe_size = 1024 * 1024;
+
+// path is a directory with contents excluded
+static bool is_temporary_dir(const char *path) {
+	for (int i = 0; temporary_paths[i]; i++) {
+		if (!strcmp(path, temporary_paths[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// path is under a directory with contents excluded
+static bool is_temporary_content(const char *path) {
+	for (int i = 0; temporary_paths[i]; i++) {
+		size_t len = strlen(temporary_paths[i]);
+		if (!strncmp(path, temporary_paths[i], len) && path[len] == '/') {
+			return true;
+		}
+	}
+	return false;
+}
 
 struct v2c_state {
 	guestfs_h *guestfs;
@@ -73,18 +130,54 @@ struct v2c_state {
 	struct archive_entry *layer_entry;
 	struct archive_entry_linkresolver *layer_link_resolver;
 	time_t modification_start, modification_end;
+	// content of the file being written, fetched with its siblings,
+	// taken by new_entry if written
+	char *prefetched;
+	size_t prefetched_len;
+	// writes layer_archive on another thread while set
+	struct v2c_pipeline *pipeline;
+	// bufsz buffer for files streamed with guestfs_download
+	char *content_buf;
 	struct {
 		time_t source_date_epoch;
 		bool set_modification_epoch;
 		enum cvirt_oci_layer_compression compression;
 		int compression_level;
+		int compression_threads;
 		bool disable_systemd_cleanup;
 		struct common_exec_config exec;
-		int layer_reuse_fd;
+		int *layer_reuse_fds; // candidates, in order given
+		const char **layer_reuse_paths;
+		int layer_reuse_len;
+		const char *layer_reuse_snapshot;
 		bool keep_btrfs_snapshots;
+		bool bulk_scan;
+		int prefetch_depth;
+		size_t prefetch_memory;
+		size_t split_layer_max; // 0 for a single layer
+		const char **split_prefixes; // NULL-terminated
+		int split_prefixes_len;
+		int split_jobs;
 	} config;
 };
 
+static void add_layer_reuse(struct v2c_state *state, const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	int len = state->config.layer_reuse_len + 1;
+	state->config.layer_reuse_fds = realloc(state->config.layer_reuse_fds,
+		len * sizeof(int));
+	state->config.layer_reuse_paths = realloc(state->config.layer_reuse_paths,
+		len * sizeof(const char *));
+	assert(state->config.layer_reuse_fds && state->config.layer_reuse_paths);
+	state->config.layer_reuse_fds[len - 1] = fd;
+	state->config.layer_reuse_paths[len - 1] = path;
+	state->config.layer_reuse_len = len;
+}
+
 static int parse_options(struct v2c_state *state, int argc, char *argv[]) {
 	int opt;
 	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
@@ -109,6 +202,13 @@ static int parse_options(struct v2c_state *state, int argc, char *argv[]) {
 				} else if (optarg[4]) {
 					return -EINVAL;
 				}
+			} else if (!strncmp(optarg, "zstd:chunked", 12)) {
+				state->config.compression = CVIRT_OCI_LAYER_COMPRESSION_ZSTD_CHUNKED;
+				if (optarg[12] == ':') {
+					state->config.compression_level = atoi(&optarg[13]);
+				} else if (optarg[12]) {
+					return -EINVAL;
+				}
 			} else if (!strncmp(optarg, "zstd", 4)) {
 				state->config.compression = CVIRT_OCI_LAYER_COMPRESSION_ZSTD;
 				if (optarg[4] == ':') {
@@ -124,25 +224,354 @@ static int parse_options(struct v2c_state *state, int argc, char *argv[]) {
 			state->config.disable_systemd_cleanup = true;
 			break;
 		case 3:
-			state->config.layer_reuse_fd = open(optarg, O_RDONLY | O_CLOEXEC);
-			if (state->config.layer_reuse_fd == -1) {
-				perror("open");
-				exit(EXIT_FAILURE);
-			}
+			add_layer_reuse(state, optarg);
 			break;
 		case 4:
 			state->config.keep_btrfs_snapshots = true;
 			break;
+		case 5:
+			state->config.layer_reuse_snapshot = optarg;
+			break;
+		case 6:
+			state->config.bulk_scan = true;
+			break;
+		case 7:
+			state->config.prefetch_depth = atoi(optarg);
+			if (state->config.prefetch_depth < 0) {
+				return -EINVAL;
+			}
+			break;
+		case 8:
+			if (atoi(optarg) < 1) {
+				return -EINVAL;
+			}
+			state->config.prefetch_memory = (size_t)atoi(optarg) * 1024 * 1024;
+			break;
+		case 9:
+			state->config.compression_threads = atoi(optarg);
+			if (state->config.compression_threads < 1) {
+				return -EINVAL;
+			}
+			break;
+		case 10:
+			if (atoi(optarg) < 1) {
+				return -EINVAL;
+			}
+			state->config.split_layer_max = (size_t)atoi(optarg) * 1024 * 1024;
+			break;
+		case 11:
+			if (optarg[0] != '/') {
+				return -EINVAL;
+			}
+			state->config.split_prefixes = realloc(state->config.split_prefixes,
+				(state->config.split_prefixes_len + 2) * sizeof(const char *));
+			assert(state->config.split_prefixes);
+			state->config.split_prefixes[state->config.split_prefixes_len++] = optarg;
+			state->config.split_prefixes[state->config.split_prefixes_len] = NULL;
+			break;
+		case 12:
+			state->config.split_jobs = atoi(optarg);
+			if (state->config.split_jobs < 1) {
+				return -EINVAL;
+			}
+			break;
+		}
+	}
+	return 0;
+}
+
+// a header if entry is set, data otherwise
+struct v2c_pipeline_item {
+	struct archive_entry *entry;
+	char *data;
+	size_t len;
+	bool pooled; // data is a bufsz buffer to return to the pool
+	struct v2c_pipeline_item *next;
+};
+
+/*
+ * Bounded queue of layer writes, the main thread keeps reading from
+ * the appliance while the writer thread tars and compresses.
+ */
+struct v2c_pipeline {
+	struct archive *archive;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct v2c_pipeline_item *head, *tail;
+	int depth, max_depth;
+	size_t bytes, max_bytes;
+	char **pool; // free bufsz buffers
+	int pool_len, pool_capacity;
+	bool done;
+	int res;
+	pthread_t thread;
+};
+
+enum v2c_data_ownership {
+	DATA_BORROWED,
+	DATA_OWNED, // freed once written
+	DATA_POOLED, // from pipeline_buffer
+};
+
+static void pipeline_release(struct v2c_pipeline *pipeline,
+		struct v2c_pipeline_item *item) {
+	if (item->entry) {
+		archive_entry_free(item->entry);
+	} else if (item->pooled) {
+		pthread_mutex_lock(&pipeline->lock);
+		if (pipeline->pool_len < pipeline->pool_capacity) {
+			pipeline->pool[pipeline->pool_len++] = item->data;
+			item->data = NULL;
+		}
+		pthread_mutex_unlock(&pipeline->lock);
+	}
+	free(item->data);
+	free(item);
+}
+
+static void *pipeline_run(void *arg) {
+	struct v2c_pipeline *pipeline = arg;
+	pthread_mutex_lock(&pipeline->lock);
+	while (true) {
+		while (!pipeline->head && !pipeline->done) {
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+		}
+		struct v2c_pipeline_item *item = pipeline->head;
+		if (!item) {
+			break;
+		}
+		pipeline->head = item->next;
+		if (!pipeline->head) {
+			pipeline->tail = NULL;
+		}
+		pthread_mutex_unlock(&pipeline->lock);
+
+		// keep draining after an error, the producer would block otherwise
+		if (!pipeline->res) {
+			int res = item->entry ?
+				archive_write_header(pipeline->archive, item->entry) :
+				archive_write_data(pipeline->archive, item->data, item->len);
+			if (res < ARCHIVE_WARN) {
+				fprintf(stderr, "Failed to write layer: %s\n",
+					archive_error_string(pipeline->archive));
+				pipeline->res = -EIO;
+			}
+		}
+		size_t len = item->len;
+		pipeline_release(pipeline, item);
+
+		pthread_mutex_lock(&pipeline->lock);
+		pipeline->depth--;
+		pipeline->bytes -= len;
+		pthread_cond_broadcast(&pipeline->cond);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+	return NULL;
+}
+
+static struct v2c_pipeline *pipeline_start(struct archive *archive,
+		int max_depth, size_t max_bytes) {
+	struct v2c_pipeline *pipeline = calloc(1, sizeof(struct v2c_pipeline));
+	assert(pipeline);
+	pipeline->archive = archive;
+	pipeline->max_depth = max_depth;
+	pipeline->max_bytes = max_bytes;
+	pipeline->pool_capacity = max_bytes / bufsz + 1;
+	pipeline->pool = calloc(pipeline->pool_capacity, sizeof(char *));
+	assert(pipeline->pool);
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->cond, NULL);
+	if (pthread_create(&pipeline->thread, NULL, pipeline_run, pipeline)) {
+		// write synchronously instead
+		pthread_mutex_destroy(&pipeline->lock);
+		pthread_cond_destroy(&pipeline->cond);
+		free(pipeline->pool);
+		free(pipeline);
+		return NULL;
+	}
+	return pipeline;
+}
+
+// wait for queued writes, then free pipeline
+static int pipeline_finish(struct v2c_pipeline *pipeline) {
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->done = true;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+	pthread_join(pipeline->thread, NULL);
+
+	int res = pipeline->res;
+	for (int i = 0; i < pipeline->pool_len; i++) {
+		free(pipeline->pool[i]);
+	}
+	free(pipeline->pool);
+	pthread_mutex_destroy(&pipeline->lock);
+	pthread_cond_destroy(&pipeline->cond);
+	free(pipeline);
+	return res;
+}
+
+static void pipeline_push(struct v2c_pipeline *pipeline,
+		struct v2c_pipeline_item *item) {
+	pthread_mutex_lock(&pipeline->lock);
+	// an item larger than max_bytes still goes through alone
+	while (pipeline->depth >= pipeline->max_depth || (pipeline->bytes &&
+			pipeline->bytes + item->len > pipeline->max_bytes)) {
+		pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+	}
+	if (pipeline->tail) {
+		pipeline->tail->next = item;
+	} else {
+		pipeline->head = item;
+	}
+	pipeline->tail = item;
+	pipeline->depth++;
+	pipeline->bytes += item->len;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+// bufsz buffer to pass as DATA_POOLED, recycled from written ones
+static char *pipeline_buffer(struct v2c_pipeline *pipeline) {
+	char *buf = NULL;
+	pthread_mutex_lock(&pipeline->lock);
+	if (pipeline->pool_len) {
+		buf = pipeline->pool[--pipeline->pool_len];
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+	if (!buf) {
+		buf = malloc(bufsz);
+		assert(buf);
+	}
+	return buf;
+}
+
+static int layer_write_header(struct v2c_state *state, struct archive_entry *entry) {
+	if (!state->pipeline) {
+		return archive_write_header(state->layer_archive, entry);
+	}
+	struct v2c_pipeline_item *item = calloc(1, sizeof(struct v2c_pipeline_item));
+	assert(item);
+	item->entry = archive_entry_clone(entry);
+	assert(item->entry);
+	pipeline_push(state->pipeline, item);
+	return ARCHIVE_OK;
+}
+
+static int layer_write_data(struct v2c_state *state, char *data, size_t len,
+		enum v2c_data_ownership ownership) {
+	if (!state->pipeline) {
+		int res = archive_write_data(state->layer_archive, data, len) < 0 ?
+			-EIO : 0;
+		if (ownership != DATA_BORROWED) {
+			free(data);
 		}
+		return res;
+	}
+	struct v2c_pipeline_item *item = calloc(1, sizeof(struct v2c_pipeline_item));
+	assert(item);
+	if (ownership == DATA_BORROWED) {
+		item->data = malloc(len);
+		assert(item->data);
+		memcpy(item->data, data, len);
+	} else {
+		item->data = data;
 	}
+	item->len = len;
+	item->pooled = ownership == DATA_POOLED;
+	pipeline_push(state->pipeline, item);
 	return 0;
 }
 
+struct download_job {
+	guestfs_h *guestfs;
+	const char *path;
+	int fd;
+	int res;
+};
+
+static void *download_run(void *arg) {
+	struct download_job *job = arg;
+	char fd_path[32];
+	snprintf(fd_path, sizeof(fd_path), "/dev/fd/%d", job->fd);
+	job->res = guestfs_download(job->guestfs, job->path, fd_path);
+	close(job->fd); // EOF for the reader
+	return NULL;
+}
+
+/*
+ * guestfs_download a file into a pipe on another thread and feed the layer
+ * from one buffer reused across files, memory stays constant regardless of
+ * file size.
+ */
+static int stream_file_content(struct v2c_state *state, const char *path, int64_t size) {
+	if (!state->pipeline && !state->content_buf) {
+		state->content_buf = malloc(bufsz);
+		if (!state->content_buf) {
+			return -ENOMEM;
+		}
+	}
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		return -errno;
+	}
+	// best effort, a larger pipe means fewer wakeups on both ends
+	fcntl(fds[1], F_SETPIPE_SZ, stream_pipe_size);
+	struct download_job job = {
+		.guestfs = state->guestfs,
+		.path = path,
+		.fd = fds[1],
+	};
+	pthread_t thread;
+	int res = -pthread_create(&thread, NULL, download_run, &job);
+	if (res < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return res;
+	}
+
+	int64_t offset = 0;
+	while (offset != size) {
+		// with the pipeline, buffers are handed over and recycled once written
+		char *buf = state->pipeline ?
+			pipeline_buffer(state->pipeline) : state->content_buf;
+		ssize_t len = read(fds[0], buf,
+			size - offset > bufsz ? bufsz : size - offset);
+		if (len <= 0) {
+			res = len < 0 ? -errno : -EIO; // short download
+			if (state->pipeline) {
+				free(buf);
+			}
+			break;
+		}
+		res = layer_write_data(state, buf, len,
+			state->pipeline ? DATA_POOLED : DATA_BORROWED);
+		if (res < 0) {
+			break;
+		}
+		offset += len;
+	}
+
+	// let guestfs_download run to completion if we stopped early
+	char drain[4096];
+	while (read(fds[0], drain, sizeof(drain)) > 0);
+	close(fds[0]);
+	pthread_join(thread, NULL);
+	if (!res && job.res < 0) {
+		res = -EIO;
+	}
+	return res;
+}
+
 static int dump_file_content(struct v2c_state *state, const char *path, int64_t size) {
+	if (size >= stream_file_min) {
+		return stream_file_content(state, path, size);
+	}
 	// guestfs_read_file does guestfs_download and reads the whole file into memory
 	// read by our own to control buffer size
 	// guestfs_download have it's own (allocated and freed at each batch) buffer and extra IO
 	// guestfs_pread, although still allocates buffer at each call, is the fastest one
+	// for small files, large ones are streamed with guestfs_download above
 	int64_t offset = 0;
 	size_t read = 0;
 	int res = 0;
@@ -153,10 +582,9 @@ static int dump_file_content(struct v2c_state *state, const char *path, int64_t
 			return -errno;
 		}
 		offset += read;
-		res = archive_write_data(state->layer_archive, buf, read);
-		free(buf);
+		res = layer_write_data(state, buf, read, DATA_OWNED);
 		if (res < 0) {
-			return -errno;
+			return res;
 		}
 	}
 	return 0;
@@ -282,26 +710,31 @@ static int setup_config(struct v2c_state *state, struct cvirt_oci_config *config
 
 static const size_t ustar_logical_record_size = 512;
 
-size_t new_entry(struct v2c_state *state, struct cvirt_mtree_entry *entry,
-		const char *path, bool dry_run) {
+void new_entry(struct v2c_state *state, struct cvirt_mtree_entry *entry,
+		const char *path) {
 	archive_entry_clear(state->layer_entry);
 	archive_entry_set_pathname(state->layer_entry, &path[1]);
-	struct stat *const stat = &entry->inode->stat;
-	archive_entry_copy_stat(state->layer_entry, stat);
+	struct cvirt_mtree_stat *const stat = &entry->inode->stat;
+	archive_entry_set_mode(state->layer_entry, stat->st_mode);
+	archive_entry_set_uid(state->layer_entry, stat->st_uid);
+	archive_entry_set_gid(state->layer_entry, stat->st_gid);
+	archive_entry_set_nlink(state->layer_entry, stat->st_nlink);
+	archive_entry_set_size(state->layer_entry, stat->st_size);
+	archive_entry_set_rdev(state->layer_entry, stat->st_rdev);
+	archive_entry_set_atime(state->layer_entry, stat->st_atim.tv_sec,
+		stat->st_atim.tv_nsec);
+	archive_entry_set_mtime(state->layer_entry, stat->st_mtim.tv_sec,
+		stat->st_mtim.tv_nsec);
+	archive_entry_set_ctime(state->layer_entry, stat->st_ctim.tv_sec,
+		stat->st_ctim.tv_nsec);
+	// links share the inode, its address identifies them for linkify
+	archive_entry_set_dev(state->layer_entry, 0);
+	archive_entry_set_ino64(state->layer_entry, (uintptr_t)entry->inode);
 
 	// in pax, data is stored on first seen, and archive_entry_linkify
 	// *sparse is for format where data is stored at last seen.
 	struct archive_entry *dummy;
 	archive_entry_linkify(state->layer_link_resolver, &state->layer_entry, &dummy);	
-	if (dry_run) {
-		size_t sz = ustar_logical_record_size;
-		if (S_ISREG(entry->inode->stat.st_mode) && archive_entry_size(state->layer_entry)) {
-			sz += (entry->inode->stat.st_size + ustar_logical_record_size - 1) /
-				ustar_logical_record_size * ustar_logical_record_size;
-		}
-		// TODO consider pax extended header
-		return sz;
-	}
 
 	if (S_ISLNK(stat->st_mode)) {
 		archive_entry_set_symlink(state->layer_entry, entry->inode->target);
@@ -314,20 +747,22 @@ size_t new_entry(struct v2c_state *state, struct cvirt_mtree_entry *entry,
 			entry->inode->xattrs[i].len);
 	}
 
-	archive_write_header(state->layer_archive, state->layer_entry);
+	layer_write_header(state, state->layer_entry);
 
 	// size is set to zero if linkify found hardlink to previous entry
 	if (S_ISREG(stat->st_mode) && archive_entry_size(state->layer_entry)) {
-		dump_file_content(state, path, stat->st_size);
+		if (state->prefetched) {
+			layer_write_data(state, state->prefetched,
+				state->prefetched_len, DATA_OWNED);
+			state->prefetched = NULL;
+		} else {
+			dump_file_content(state, path, stat->st_size);
+		}
 	}
-	return 0;
 }
 
-size_t new_whiteout_entry(struct v2c_state *state,
-		const char *basepath, const char *name, bool dry_run) {
-	if (dry_run) {
-		return ustar_logical_record_size;
-	}
+void new_whiteout_entry(struct v2c_state *state,
+		const char *basepath, const char *name) {
 	archive_entry_clear(state->layer_entry);
 	char path[strlen(basepath) + strlen(name) + 5];
 	strcpy(path, &basepath[1]); // trim /
@@ -336,11 +771,60 @@ size_t new_whiteout_entry(struct v2c_state *state,
 	archive_entry_set_pathname(state->layer_entry, path);
 	archive_entry_set_filetype(state->layer_entry, AE_IFREG);
 	archive_entry_set_size(state->layer_entry, 0);
-	archive_write_header(state->layer_archive, state->layer_entry);
-	return 0;
+	layer_write_header(state, state->layer_entry);
+}
+
+// regular files with other links, linkify writes their data once
+struct v2c_links {
+	struct cvirt_mtree_inode **inodes;
+	size_t len, capacity;
+};
+
+static size_t data_size(off_t size) {
+	return (size + ustar_logical_record_size - 1) /
+		ustar_logical_record_size * ustar_logical_record_size;
+}
+
+// size new_entry would write, data of links deferred to links_size
+static size_t entry_size(struct cvirt_mtree_entry *entry, struct v2c_links *links) {
+	struct cvirt_mtree_stat *stat = &entry->inode->stat;
+	// TODO consider pax extended header
+	size_t sz = ustar_logical_record_size;
+	if (!S_ISREG(stat->st_mode)) {
+		return sz;
+	}
+	if (stat->st_nlink == 1) {
+		return sz + data_size(stat->st_size);
+	}
+	if (links->len == links->capacity) {
+		links->capacity = links->capacity ? links->capacity * 2 : 64;
+		links->inodes = realloc(links->inodes,
+			links->capacity * sizeof(struct cvirt_mtree_inode *));
+		assert(links->inodes);
+	}
+	links->inodes[links->len++] = entry->inode;
+	return sz;
 }
 
-static bool compare_stat(struct stat *a, struct stat *b) {
+static int compare_inode_ptr(const void *a, const void *b) {
+	uintptr_t x = (uintptr_t)*(struct cvirt_mtree_inode *const *)a;
+	uintptr_t y = (uintptr_t)*(struct cvirt_mtree_inode *const *)b;
+	return (x > y) - (x < y);
+}
+
+static size_t links_size(struct v2c_links *links) {
+	qsort(links->inodes, links->len, sizeof(struct cvirt_mtree_inode *),
+		compare_inode_ptr);
+	size_t sz = 0;
+	for (size_t i = 0; i < links->len; i++) {
+		if (!i || links->inodes[i] != links->inodes[i - 1]) {
+			sz += data_size(links->inodes[i]->stat.st_size);
+		}
+	}
+	return sz;
+}
+
+static bool compare_stat(struct cvirt_mtree_stat *a, struct cvirt_mtree_stat *b) {
 	if (a->st_mode != b->st_mode) {
 		return true;
 	}
@@ -400,245 +884,1594 @@ static bool compare_xattr(struct cvirt_mtree_inode *a, struct cvirt_mtree_inode
 	return false;
 }
 
-enum v2c_build_layer_mode {
-	BUILD_LAYER_FULL,
-	BUILD_LAYER_DRYRUN,
-	BUILD_LAYER_TEST_DIR
+/*
+ * Changes of a directory on both sides, from one diff_layer pass, replayed
+ * by emit_plan. Children of b are referred to by index.
+ */
+struct v2c_plan_emit {
+	int index;
+	bool created; // not in a, written as a whole
+	struct v2c_plan *plan; // changes inside, for directories on both sides
+	size_t size; // to write, data of links left out
+	bool links; // regular files with other links among what is written
 };
 
-size_t build_layer(struct cvirt_mtree_entry *a, struct cvirt_mtree_entry *b,
-		const char *path, enum v2c_build_layer_mode mode, struct v2c_state *state) {
-	bool differs = false;
-	if (!a) {
-		differs = true;
-	} else {
-		if (path[1] != '\0') { //TODO compare root?
-			if (compare_stat(&a->inode->stat, &b->inode->stat) ||
-					compare_xattr(a->inode, b->inode)) {
-				differs = true;
-			}
-		}
+struct v2c_plan {
+	struct cvirt_mtree_inode *a;
+	struct cvirt_mtree_entry *b;
+	int *remove; // children of a to whiteout
+	int remove_len;
+	struct v2c_plan_emit *emit;
+	int emit_len;
+};
 
-		if (S_ISREG(a->inode->stat.st_mode)) {
-			if (memcmp(a->inode->sha256sum, b->inode->sha256sum, 32)) {
-				differs = true;;
-			}
-		} else if (S_ISLNK(a->inode->stat.st_mode)) {
-			if (strcmp(a->inode->target, b->inode->target)) {
-				differs = true;;
-			}
+// sizes of writing b as a whole, summed up while diffing
+struct v2c_plan_sizes {
+	size_t baseline;
+	struct v2c_links baseline_links, reuse_links;
+};
+
+#define BUNDLE_FILE_MAX		(64 * 1024)
+#define BUNDLE_BYTES_MAX	(32 * 1024 * 1024)
+#define BUNDLE_FILES_MIN	2
+
+#define BUNDLE_FILE_TEMPLATE	"/v2c-bundle-XXXXXX"
+
+// small files of a directory, fetched together with one tar_out
+struct v2c_bundle {
+	char **data; // by child index, NULL if not fetched
+	size_t *len;
+	int end; // emits before this were considered already
+};
+
+static bool is_bundle_candidate(struct cvirt_mtree_entry *entry) {
+	struct cvirt_mtree_stat *stat = &entry->inode->stat;
+	return S_ISREG(stat->st_mode) && stat->st_size > 0 &&
+		stat->st_size <= BUNDLE_FILE_MAX;
+}
+
+// exclude patterns are globs, one per line
+static bool is_tar_excludable(const char *name) {
+	return !strchr(name, '\n');
+}
+
+static char *tar_exclude_pattern(const char *name) {
+	char *res = calloc(strlen(name) * 2 + 1, sizeof(char));
+	assert(res);
+	char *dst = res;
+	for (const char *src = name; *src; src++) {
+		if (strchr("*?[]\\", *src)) {
+			*dst++ = '\\';
 		}
+		*dst++ = *src;
 	}
+	return res;
+}
 
-	size_t layer_size = 0;
-	if (S_ISDIR(b->inode->stat.st_mode)) {
-		for (int i = 0; temporary_paths[i]; i++) { //TODO opt-out
-			if (!strcmp(path, temporary_paths[i])) {
-				// skip contents
-				goto create_entry_if_differs;
-			}
-		}
-		int b_match[b->inode->children_len];
-		memset(b_match, 0, sizeof(int) * b->inode->children_len);
-		bool b_create[b->inode->children_len];
-		memset(b_create, 0, sizeof(bool) * b->inode->children_len);
-		int a_len = (a && S_ISDIR(a->inode->stat.st_mode)) ? a->inode->children_len : 1;
-		bool a_remove[a_len];
-		memset(a_remove, 0, sizeof(bool) * a_len);
-		int max_len = 0;
-
-		if (a && S_ISDIR(a->inode->stat.st_mode)) {
-			for (int i = 0; i < a->inode->children_len; i++) {
-				int len = strlen(a->inode->children[i].name);
-				max_len = len > max_len ? len : max_len;
-			}
-		}
-		for (int i = 0; i < b->inode->children_len; i++) {
-			int len = strlen(b->inode->children[i].name);
-			max_len = len > max_len ? len : max_len;
-		}
-		int name_index = strlen(path) + 1;
-		char npath[name_index + max_len + 1];
-		if (path[1]) {
-			strcpy(npath, path);
+static int child_index(struct cvirt_mtree_inode *dir, const char *name) {
+	int lo = 0, hi = dir->children_len;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		int cmp = strcmp(dir->children[mid].name, name);
+		if (!cmp) {
+			return mid;
+		} else if (cmp < 0) {
+			lo = mid + 1;
 		} else {
-			npath[0] = '\0';
-			name_index = 1;
-		}
-		strcat(npath, "/");
-
-		// on building: do a lightweight search, stop on first
-		// child that need update, create dir, restart a full search
-		// (prevent recurse everything twice)
-		enum v2c_build_layer_mode recur_mode = (mode == BUILD_LAYER_FULL) ?
-			BUILD_LAYER_TEST_DIR : mode;
-		if (a && S_ISDIR(a->inode->stat.st_mode)) {
-			for (int i = 0; i < a->inode->children_len; i++) {
-				bool found = false;
-				for (int j = 0; j < b->inode->children_len; j++) {
-					if (b_match[j]) {
-						continue;
-					}
-					if (!strcmp(a->inode->children[i].name,
-							b->inode->children[j].name)) {
-						found = true;
-						b_match[j] = i + 1;
-						strcpy(&npath[name_index], b->inode->children[j].name);
-						size_t res = build_layer(
-							&a->inode->children[i],
-							&b->inode->children[j],
-							npath, recur_mode, state);
-						if (res) {
-							if (mode == BUILD_LAYER_TEST_DIR) {
-								return true;
-							}
-							b_create[j] = true;
-							layer_size += res;
-						}
-						break;
-					}
-				}
-				if (!found) {
-					if (mode == BUILD_LAYER_TEST_DIR) {
-						return true;
-					}
-					a_remove[i] = true;
-					layer_size += new_whiteout_entry(state, path, a->inode->children[i].name, true);
-				}
-			}
-		}
-		for (int j = 0; j < b->inode->children_len; j++) {
-			if (!strncmp(b->inode->children[j].name, ".wh.", 4)) {
-				// no way to store names like whiteouts in OCI
-				continue;
-			}
-			if (!b_match[j]) {
-				if (mode == BUILD_LAYER_TEST_DIR) {
-					return true;
-				}
-				b_create[j] = true;
-				strcpy(&npath[name_index], b->inode->children[j].name);
-				layer_size += build_layer(NULL, &b->inode->children[j], npath, recur_mode, state);
-			}
-		}
-		if (layer_size) {
-			// directory itself
-			layer_size += new_entry(state, b, path, mode != BUILD_LAYER_FULL);
-			if (mode == BUILD_LAYER_FULL) { // apply changes
-				if (a) {
-					for (int i = 0; i < a->inode->children_len; i++) {
-						if (a_remove[i]) {
-							new_whiteout_entry(state, path, a->inode->children[i].name, false);
-						}
-					}
-				}
-				for (int i = 0; i < b->inode->children_len; i++) {
-					if (b_create[i]) {
-						strcpy(&npath[name_index], b->inode->children[i].name);
-						build_layer(b_match[i] ? &a->inode->children[b_match[i] - 1] : NULL,
-							&b->inode->children[i], npath, mode, state);
-					}
-				}
-			}
-			return layer_size;
+			hi = mid;
 		}
 	}
+	return -1;
+}
 
-create_entry_if_differs:
-	if (differs) {
-		if (mode == BUILD_LAYER_TEST_DIR) {
-			return true;
+// unlinked host file, named by fd_path
+static int unlinked_file(const char *template, char *fd_path, size_t len) {
+	const char *tmpdir = getenv("TMPDIR");
+	if (!tmpdir) {
+		tmpdir = "/tmp";
+	}
+	char tmp_filename[strlen(tmpdir) + strlen(template) + 1];
+	strcpy(tmp_filename, tmpdir);
+	strcat(tmp_filename, template);
+	int fd = mkstemp(tmp_filename);
+	if (fd >= 0) {
+		unlink(tmp_filename);
+		snprintf(fd_path, len, "/dev/fd/%d", fd);
+	}
+	return fd;
+}
+
+static void bundle_read(struct v2c_bundle *bundle, struct cvirt_mtree_inode *dir,
+		const bool *selected, int fd) {
+	struct archive *in = archive_read_new();
+	assert(in);
+	archive_read_support_format_tar(in);
+	struct archive_entry *entry;
+	if (archive_read_open_fd(in, fd, bufsz) != ARCHIVE_OK) {
+		archive_read_free(in);
+		return;
+	}
+	int res;
+	while ((res = archive_read_next_header(in, &entry)) == ARCHIVE_OK ||
+			res == ARCHIVE_WARN) {
+		const char *name = archive_entry_pathname(entry);
+		if (name[0] == '.' && name[1] == '/') {
+			name += 2;
+		}
+		int i = child_index(dir, name);
+		// mismatching sizes are left to pread
+		if (i < 0 || !selected[i] || archive_entry_filetype(entry) != AE_IFREG ||
+				archive_entry_size(entry) != dir->children[i].inode->stat.st_size) {
+			continue;
+		}
+		size_t len = archive_entry_size(entry);
+		char *data = malloc(len);
+		assert(data);
+		if (archive_read_data(in, data, len) != (la_ssize_t)len) {
+			free(data);
+			continue;
 		}
-		return new_entry(state, b, path, mode != BUILD_LAYER_FULL);
+		bundle->data[i] = data;
+		bundle->len[i] = len;
 	}
-	return 0;
+	archive_read_free(in);
 }
 
-void timestamp_fixup(struct cvirt_mtree_entry *tree, struct v2c_state *state) {
-	struct stat *stat = &tree->inode->stat;
-	if (stat->st_atim.tv_sec >= state->modification_start &&
-			stat->st_atim.tv_sec <= state->modification_end) {
-		stat->st_atim.tv_sec = state->config.source_date_epoch;
-		stat->st_atim.tv_nsec = 0;
+/*
+ * Fetch small files to emit from emit[start] on, up to BUNDLE_BYTES_MAX,
+ * with a tar_out of the directory excluding every other child.
+ */
+static void bundle_fetch(struct v2c_state *state, struct v2c_bundle *bundle,
+		struct cvirt_mtree_inode *dir, const char *path,
+		const struct v2c_plan_emit *emit, int emit_len, int start) {
+	int len = dir->children_len;
+	for (int j = 0; j < len; j++) {
+		if (!is_tar_excludable(dir->children[j].name)) {
+			// no exclude line for it, fetch files one by one
+			bundle->end = emit_len;
+			return;
+		}
 	}
-	if (stat->st_mtim.tv_sec >= state->modification_start &&
-			stat->st_mtim.tv_sec <= state->modification_end) {
-		stat->st_mtim.tv_sec = state->config.source_date_epoch;
-		stat->st_mtim.tv_nsec = 0;
+	bool *selected = calloc(len, sizeof(bool));
+	assert(selected);
+	size_t bytes = 0;
+	int count = 0, k = start;
+	for (; k < emit_len && bytes < BUNDLE_BYTES_MAX; k++) {
+		int i = emit[k].index;
+		if (is_bundle_candidate(&dir->children[i])) {
+			selected[i] = true;
+			bytes += dir->children[i].inode->stat.st_size;
+			count++;
+		}
 	}
-	if (stat->st_ctim.tv_sec >= state->modification_start &&
-			stat->st_ctim.tv_sec <= state->modification_end) {
-		stat->st_ctim.tv_sec = state->config.source_date_epoch;
-		stat->st_ctim.tv_nsec = 0;
+	bundle->end = k;
+	if (count < BUNDLE_FILES_MIN) {
+		goto free_selected;
 	}
 
-	if (S_ISDIR(stat->st_mode)) {
-		for (int i = 0; i < tree->inode->children_len; i++) {
-			timestamp_fixup(&tree->inode->children[i], state);
+	char **excludes = calloc(len - count + 1, sizeof(char *));
+	assert(excludes);
+	int excludes_len = 0;
+	for (int j = 0; j < len; j++) {
+		if (!selected[j]) {
+			excludes[excludes_len++] = tar_exclude_pattern(dir->children[j].name);
 		}
 	}
-}
 
-int main(int argc, char *argv[]) {
-	struct v2c_state state = {
-		.config =  {
-			.compression = CVIRT_OCI_LAYER_COMPRESSION_ZSTD,
-		},
-	};
-	if (parse_options(&state, argc, argv) < 0 || argc - optind != 2) {
-		fprintf(stderr, usage, argv[0]);
-		exit(EXIT_FAILURE);
+	char fd_path[32];
+	int fd = unlinked_file(BUNDLE_FILE_TEMPLATE, fd_path, sizeof(fd_path));
+	if (fd >= 0) {
+		if (guestfs_tar_out_opts(state->guestfs, path, fd_path,
+				GUESTFS_TAR_OUT_OPTS_EXCLUDES, excludes, -1) == 0 &&
+				lseek(fd, 0, SEEK_SET) == 0) {
+			bundle_read(bundle, dir, selected, fd);
+		}
+		close(fd);
 	}
 
-	char *source_date_epoch_env = getenv("SOURCE_DATE_EPOCH");
-	if (source_date_epoch_env) {
-		state.config.set_modification_epoch = true;
-		state.config.source_date_epoch = atoll(source_date_epoch_env);
+	for (int j = 0; j < excludes_len; j++) {
+		free(excludes[j]);
 	}
+	free(excludes);
+free_selected:
+	free(selected);
+}
 
-	state.modification_start = time(NULL);
-
-	char **succeeded_mounts;
-	state.guestfs = create_guestfs_mount_first_linux(argv[optind], &succeeded_mounts);
-	if (!state.guestfs) {
-		exit(EXIT_FAILURE);
+// npath + name_index is where names of children of dir at path go
+static size_t child_path_len(struct cvirt_mtree_inode *dir, const char *path) {
+	size_t max_len = 0;
+	for (int i = 0; i < dir->children_len; i++) {
+		size_t len = strlen(dir->children[i].name);
+		max_len = len > max_len ? len : max_len;
 	}
+	return strlen(path) + max_len + 2;
+}
 
-	struct cvirt_oci_layer *layer = cvirt_oci_layer_new(state.config.compression,
-		state.config.compression_level);
-	if (!layer) {
-		perror("cvirt_oci_layer_new");
-		exit(EXIT_FAILURE);
+static int child_path_init(char *npath, const char *path) {
+	if (path[1]) {
+		strcpy(npath, path);
+	} else {
+		npath[0] = '\0';
 	}
+	strcat(npath, "/");
+	return strlen(npath);
+}
 
-	state.layer_archive = cvirt_oci_layer_get_libarchive(layer);
-	state.layer_entry = archive_entry_new();
-	if (!state.layer_entry) {
-		perror("archive_entry_new");
-		exit(EXIT_FAILURE);
+// b is written as a whole, in both layers
+static size_t tree_size(struct cvirt_mtree_entry *b, const char *path,
+		struct v2c_plan_sizes *sizes) {
+	sizes->baseline += entry_size(b, &sizes->baseline_links);
+	size_t layer_size = entry_size(b, &sizes->reuse_links);
+	if (!S_ISDIR(b->inode->stat.st_mode) || is_temporary_dir(path)) { //TODO opt-out
+		return layer_size;
 	}
 
-	cleanup_fstab(&state, succeeded_mounts);
-
-	for (int i = 0; succeeded_mounts[i]; i++) {
-		free(succeeded_mounts[i]);
+	char npath[child_path_len(b->inode, path)];
+	int name_index = child_path_init(npath, path);
+	for (int i = 0; i < b->inode->children_len; i++) {
+		if (!strncmp(b->inode->children[i].name, ".wh.", 4)) {
+			// no way to store names like whiteouts in OCI
+			continue;
+		}
+		strcpy(&npath[name_index], b->inode->children[i].name);
+		layer_size += tree_size(&b->inode->children[i], npath, sizes);
 	}
-	free(succeeded_mounts);
+	return layer_size;
+}
 
-	if (!state.config.disable_systemd_cleanup) {
-		cleanup_systemd(&state);
+static void plan_destroy(struct v2c_plan *plan) {
+	for (int i = 0; i < plan->emit_len; i++) {
+		if (plan->emit[i].plan) {
+			plan_destroy(plan->emit[i].plan);
+		}
 	}
+	free(plan->remove);
+	free(plan->emit);
+	free(plan);
+}
 
-	state.modification_end = time(NULL);
-
-	uint32_t flags = CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS;
-	if (state.config.keep_btrfs_snapshots) {
-		flags ^= CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS;
+/*
+ * Compare a, NULL if missing, against b in one pass. Returns the size of
+ * entries to write for b on top of a, 0 if none, and sets plan for
+ * directories on both sides with changes inside. Sizes of writing b as a
+ * whole are added up in sizes on the way.
+ */
+static size_t diff_layer(struct cvirt_mtree_entry *a, struct cvirt_mtree_entry *b,
+		const char *path, struct v2c_plan_sizes *sizes, struct v2c_plan **plan) {
+	*plan = NULL;
+	if (!a) {
+		return tree_size(b, path, sizes);
 	}
-	struct cvirt_mtree_entry *guestfs_tree = cvirt_mtree_tree_from_guestfs(state.guestfs, flags);
+	sizes->baseline += entry_size(b, &sizes->baseline_links);
 
-	if (state.config.set_modification_epoch) {
-		timestamp_fixup(guestfs_tree, &state);
+	bool differs = false;
+	if (path[1] != '\0') { //TODO compare root?
+		if (compare_stat(&a->inode->stat, &b->inode->stat) ||
+				compare_xattr(a->inode, b->inode)) {
+			differs = true;
+		}
+	}
+
+	if (S_ISREG(a->inode->stat.st_mode)) {
+		if (memcmp(a->inode->sha256sum, b->inode->sha256sum, 32)) {
+			differs = true;;
+		}
+	} else if (S_ISLNK(a->inode->stat.st_mode)) {
+		if (strcmp(a->inode->target, b->inode->target)) {
+			differs = true;;
+		}
+	}
+
+	if (!S_ISDIR(b->inode->stat.st_mode) || is_temporary_dir(path)) { //TODO opt-out
+		return differs ? entry_size(b, &sizes->reuse_links) : 0;
+	}
+
+	/*
+	 * children are sorted by name (cvirt_mtree_tree_sort),
+	 * match them with a merge-join
+	 */
+	int a_len = S_ISDIR(a->inode->stat.st_mode) ? a->inode->children_len : 0;
+	int b_len = b->inode->children_len;
+	struct v2c_plan *res = calloc(1, sizeof(struct v2c_plan));
+	assert(res);
+	res->a = a->inode;
+	res->b = b;
+	res->remove = calloc(a_len + 1, sizeof(int));
+	assert(res->remove);
+	res->emit = calloc(b_len + 1, sizeof(struct v2c_plan_emit));
+	assert(res->emit);
+
+	char npath[child_path_len(b->inode, path)];
+	int name_index = child_path_init(npath, path);
+
+	size_t layer_size = 0;
+	int i = 0, j = 0;
+	while (i < a_len || j < b_len) {
+		int cmp = (i >= a_len) ? 1 : (j >= b_len) ? -1 :
+			strcmp(a->inode->children[i].name,
+				b->inode->children[j].name);
+		if (cmp < 0) {
+			res->remove[res->remove_len++] = i;
+			layer_size += ustar_logical_record_size;
+			i++;
+		} else if (cmp > 0) {
+			if (!strncmp(b->inode->children[j].name, ".wh.", 4)) {
+				// no way to store names like whiteouts in OCI
+				j++;
+				continue;
+			}
+			strcpy(&npath[name_index], b->inode->children[j].name);
+			size_t links_len = sizes->reuse_links.len;
+			size_t child_size = tree_size(&b->inode->children[j], npath, sizes);
+			layer_size += child_size;
+			res->emit[res->emit_len++] = (struct v2c_plan_emit) {
+				.index = j,
+				.created = true,
+				.size = child_size,
+				.links = sizes->reuse_links.len > links_len,
+			};
+			j++;
+		} else {
+			struct v2c_plan *child_plan;
+			strcpy(&npath[name_index], b->inode->children[j].name);
+			size_t links_len = sizes->reuse_links.len;
+			size_t child_size = diff_layer(&a->inode->children[i],
+				&b->inode->children[j], npath, sizes, &child_plan);
+			if (child_size) {
+				layer_size += child_size;
+				res->emit[res->emit_len++] = (struct v2c_plan_emit) {
+					.index = j,
+					.plan = child_plan,
+					.size = child_size,
+					.links = sizes->reuse_links.len > links_len,
+				};
+			}
+			i++;
+			j++;
+		}
+	}
+	if (layer_size) {
+		// directory itself
+		*plan = res;
+		return layer_size + entry_size(b, &sizes->reuse_links);
+	}
+	plan_destroy(res);
+	return differs ? entry_size(b, &sizes->reuse_links) : 0;
+}
+
+static void emit_plan(struct v2c_state *state, struct v2c_plan *plan,
+	const char *path);
+static void emit_tree(struct v2c_state *state, struct cvirt_mtree_entry *b,
+	const char *path);
+
+static void emit_children(struct v2c_state *state, struct cvirt_mtree_entry *b,
+		const char *path, const struct v2c_plan_emit *emit, int emit_len) {
+	char npath[child_path_len(b->inode, path)];
+	int name_index = child_path_init(npath, path);
+	struct v2c_bundle bundle = {0};
+	for (int k = 0; k < emit_len; k++) {
+		struct cvirt_mtree_entry *child = &b->inode->children[emit[k].index];
+		if (k >= bundle.end && is_bundle_candidate(child)) {
+			if (!bundle.data) {
+				bundle.data = calloc(b->inode->children_len, sizeof(char *));
+				bundle.len = calloc(b->inode->children_len, sizeof(size_t));
+				assert(bundle.data && bundle.len);
+			}
+			bundle_fetch(state, &bundle, b->inode, path, emit, emit_len, k);
+		}
+		if (bundle.data) {
+			state->prefetched = bundle.data[emit[k].index];
+			state->prefetched_len = bundle.len[emit[k].index];
+			bundle.data[emit[k].index] = NULL;
+		}
+		strcpy(&npath[name_index], child->name);
+		if (emit[k].plan) {
+			emit_plan(state, emit[k].plan, npath);
+		} else if (emit[k].created) {
+			emit_tree(state, child, npath);
+		} else {
+			new_entry(state, child, npath);
+		}
+		// left if not written, like hardlinks
+		free(state->prefetched);
+		state->prefetched = NULL;
+	}
+	free(bundle.data);
+	free(bundle.len);
+}
+
+// write b as a whole
+static void emit_tree(struct v2c_state *state, struct cvirt_mtree_entry *b,
+		const char *path) {
+	new_entry(state, b, path);
+	if (!S_ISDIR(b->inode->stat.st_mode) || is_temporary_dir(path)) { //TODO opt-out
+		return;
+	}
+
+	int b_len = b->inode->children_len;
+	struct v2c_plan_emit *emit = calloc(b_len + 1, sizeof(struct v2c_plan_emit));
+	assert(emit);
+	int emit_len = 0;
+	for (int i = 0; i < b_len; i++) {
+		if (!strncmp(b->inode->children[i].name, ".wh.", 4)) {
+			// no way to store names like whiteouts in OCI
+			continue;
+		}
+		emit[emit_len++] = (struct v2c_plan_emit) {
+			.index = i,
+			.created = true,
+		};
+	}
+	emit_children(state, b, path, emit, emit_len);
+	free(emit);
+}
+
+// replay diff_layer
+static void emit_plan(struct v2c_state *state, struct v2c_plan *plan,
+		const char *path) {
+	// directory itself
+	new_entry(state, plan->b, path);
+	for (int i = 0; i < plan->remove_len; i++) {
+		new_whiteout_entry(state, path, plan->a->children[plan->remove[i]].name);
+	}
+	emit_children(state, plan->b, path, plan->emit, plan->emit_len);
+}
+
+// b as a whole, with sizes of children for split_walk, as diff_layer has them
+static struct v2c_plan *plan_from_tree(struct cvirt_mtree_entry *b,
+		const char *path) {
+	struct v2c_plan *plan = calloc(1, sizeof(struct v2c_plan));
+	assert(plan);
+	plan->b = b;
+	plan->remove = calloc(1, sizeof(int));
+	assert(plan->remove);
+	plan->emit = calloc(b->inode->children_len + 1, sizeof(struct v2c_plan_emit));
+	assert(plan->emit);
+
+	char npath[child_path_len(b->inode, path)];
+	int name_index = child_path_init(npath, path);
+	for (int i = 0; i < b->inode->children_len; i++) {
+		if (!strncmp(b->inode->children[i].name, ".wh.", 4)) {
+			// no way to store names like whiteouts in OCI
+			continue;
+		}
+		struct v2c_plan_sizes sizes = {0};
+		strcpy(&npath[name_index], b->inode->children[i].name);
+		size_t size = tree_size(&b->inode->children[i], npath, &sizes);
+		plan->emit[plan->emit_len++] = (struct v2c_plan_emit) {
+			.index = i,
+			.created = true,
+			.size = size,
+			.links = sizes.reuse_links.len,
+		};
+		free(sizes.baseline_links.inodes);
+		free(sizes.reuse_links.inodes);
+	}
+	return plan;
+}
+
+static const char *default_split_prefixes[] = {
+	"/usr",
+	"/opt",
+	"/var",
+	"/home",
+	NULL,
+};
+
+// layer an inode with links went to, in open addressing by pointer
+struct v2c_split_link {
+	struct cvirt_mtree_inode *inode; // NULL for empty slot
+	int layer;
+};
+
+/*
+ * Partition of a plan into layers applied in order, each a pruned copy of
+ * the plan. Directories leading to entries are repeated in every layer
+ * with the same metadata, so layers never conflict. Every link of an inode
+ * goes to the layer of its first one, which also carries the data.
+ */
+struct v2c_split {
+	size_t max_size;
+	const char *const *prefixes;
+	struct v2c_plan **layers;
+	int layers_len, layers_capacity;
+	size_t size; // of the last layer so far
+	bool fresh; // next entry goes to a new layer
+	// copies and plans made while splitting, freed without what they point to
+	struct v2c_plan **owned;
+	int owned_len, owned_capacity;
+	struct v2c_split_link *links;
+	size_t links_len, links_capacity;
+	struct v2c_links scan; // links of an emit not in a layer yet
+};
+
+// position of split_walk, with the copy of plan in the last layer
+struct v2c_split_frame {
+	struct v2c_plan *plan;
+	struct v2c_plan *copy;
+	int copy_layer;
+	int index; // of plan->b in the parent
+	struct v2c_split_frame *parent;
+};
+
+// 1 if path gets layers of its own, -1 if such path is below it, 0 otherwise
+static int split_prefix_match(struct v2c_split *split, const char *path) {
+	size_t len = strlen(path);
+	int res = 0;
+	for (int i = 0; split->prefixes[i]; i++) {
+		const char *prefix = split->prefixes[i];
+		size_t prefix_len = strlen(prefix);
+		while (prefix_len > 1 && prefix[prefix_len - 1] == '/') {
+			prefix_len--;
+		}
+		if (prefix_len == len && !strncmp(prefix, path, len)) {
+			return 1;
+		}
+		if (len == 1 || (prefix_len > len && !strncmp(prefix, path, len) &&
+				prefix[len] == '/')) {
+			res = -1;
+		}
+	}
+	return res;
+}
+
+static void split_own(struct v2c_split *split, struct v2c_plan *plan) {
+	if (split->owned_len == split->owned_capacity) {
+		split->owned_capacity = split->owned_capacity ?
+			split->owned_capacity * 2 : 64;
+		split->owned = realloc(split->owned,
+			split->owned_capacity * sizeof(struct v2c_plan *));
+		assert(split->owned);
+	}
+	split->owned[split->owned_len++] = plan;
+}
+
+static void split_new_layer(struct v2c_split *split) {
+	split->fresh = true;
+}
+
+static struct v2c_split_link *split_link_slot(struct v2c_split *split,
+		struct cvirt_mtree_inode *inode) {
+	size_t mask = split->links_capacity - 1;
+	size_t i = ((uintptr_t)inode >> 4) * 0x9e3779b97f4a7c15ull & mask;
+	while (split->links[i].inode && split->links[i].inode != inode) {
+		i = (i + 1) & mask;
+	}
+	return &split->links[i];
+}
+
+// layer of the first link of inode, -1 if not placed yet
+static int split_link_layer(struct v2c_split *split,
+		struct cvirt_mtree_inode *inode) {
+	if (!split->links_len) {
+		return -1;
+	}
+	struct v2c_split_link *slot = split_link_slot(split, inode);
+	return slot->inode ? slot->layer : -1;
+}
+
+static void split_link_place(struct v2c_split *split,
+		struct cvirt_mtree_inode *inode, int layer) {
+	if ((split->links_len + 1) * 2 > split->links_capacity) {
+		struct v2c_split_link *old = split->links;
+		size_t old_capacity = split->links_capacity;
+		split->links_capacity = old_capacity ? old_capacity * 2 : 256;
+		split->links = calloc(split->links_capacity,
+			sizeof(struct v2c_split_link));
+		assert(split->links);
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (old[i].inode) {
+				*split_link_slot(split, old[i].inode) = old[i];
+			}
+		}
+		free(old);
+	}
+	struct v2c_split_link *slot = split_link_slot(split, inode);
+	if (!slot->inode) {
+		slot->inode = inode;
+		slot->layer = layer;
+		split->links_len++;
+	}
+}
+
+// -1 for no layer yet, -2 for links in several layers
+static int split_links_merge(int res, int layer) {
+	if (layer < 0 || res == layer) {
+		return res;
+	}
+	return res == -1 ? layer : -2;
+}
+
+// links of entry not placed go to split->scan, like in entry_size
+static int split_scan_entry(struct v2c_split *split,
+		struct cvirt_mtree_entry *entry, int res) {
+	struct cvirt_mtree_stat *stat = &entry->inode->stat;
+	if (!S_ISREG(stat->st_mode) || stat->st_nlink == 1) {
+		return res;
+	}
+	int layer = split_link_layer(split, entry->inode);
+	if (layer < 0) {
+		entry_size(entry, &split->scan);
+	}
+	return split_links_merge(res, layer);
+}
+
+// like emit_tree
+static int split_scan_tree(struct v2c_split *split,
+		struct cvirt_mtree_entry *b, const char *path, int res) {
+	res = split_scan_entry(split, b, res);
+	if (!S_ISDIR(b->inode->stat.st_mode) || is_temporary_dir(path)) { //TODO opt-out
+		return res;
+	}
+
+	char npath[child_path_len(b->inode, path)];
+	int name_index = child_path_init(npath, path);
+	for (int i = 0; i < b->inode->children_len; i++) {
+		if (!strncmp(b->inode->children[i].name, ".wh.", 4)) {
+			// no way to store names like whiteouts in OCI
+			continue;
+		}
+		strcpy(&npath[name_index], b->inode->children[i].name);
+		res = split_scan_tree(split, &b->inode->children[i], npath, res);
+	}
+	return res;
+}
+
+/*
+ * Layer the links emitted would have to go to, like split_links_merge,
+ * with those not placed yet in split->scan.
+ */
+static int split_scan_emits(struct v2c_split *split,
+		struct cvirt_mtree_entry *b, const char *path,
+		const struct v2c_plan_emit *emit, int emit_len, int res) {
+	char npath[child_path_len(b->inode, path)];
+	int name_index = child_path_init(npath, path);
+	for (int k = 0; k < emit_len; k++) {
+		if (!emit[k].links) {
+			continue;
+		}
+		struct cvirt_mtree_entry *child = &b->inode->children[emit[k].index];
+		strcpy(&npath[name_index], child->name);
+		if (emit[k].plan) {
+			res = split_scan_emits(split, child, npath, emit[k].plan->emit,
+				emit[k].plan->emit_len, res);
+		} else if (emit[k].created) {
+			res = split_scan_tree(split, child, npath, res);
+		} else {
+			res = split_scan_entry(split, child, res);
+		}
+	}
+	return res;
+}
+
+static struct v2c_plan *split_copy(struct v2c_split *split,
+		struct v2c_plan *plan) {
+	struct v2c_plan *copy = calloc(1, sizeof(struct v2c_plan));
+	assert(copy);
+	copy->a = plan->a;
+	copy->b = plan->b;
+	copy->remove = calloc(plan->remove_len + 1, sizeof(int));
+	assert(copy->remove);
+	copy->emit = calloc(plan->emit_len + 1, sizeof(struct v2c_plan_emit));
+	assert(copy->emit);
+	split_own(split, copy);
+	return copy;
+}
+
+// copy of frame->plan in the last layer, made along with its parents
+static struct v2c_plan *split_node(struct v2c_split *split,
+		struct v2c_split_frame *frame) {
+	if (!split->fresh && frame->copy && frame->copy_layer == split->layers_len - 1) {
+		return frame->copy;
+	}
+	struct v2c_plan *copy = split_copy(split, frame->plan);
+
+	if (frame->parent) {
+		struct v2c_plan *parent = split_node(split, frame->parent);
+		parent->emit[parent->emit_len++] = (struct v2c_plan_emit) {
+			.index = frame->index,
+			.plan = copy,
+		};
+	} else {
+		if (split->layers_len == split->layers_capacity) {
+			split->layers_capacity = split->layers_capacity ?
+				split->layers_capacity * 2 : 8;
+			split->layers = realloc(split->layers,
+				split->layers_capacity * sizeof(struct v2c_plan *));
+			assert(split->layers);
+		}
+		split->layers[split->layers_len++] = copy;
+		split->fresh = false;
+		split->size = 0;
+	}
+	frame->copy = copy;
+	frame->copy_layer = split->layers_len - 1;
+	// directory itself
+	split->size += ustar_logical_record_size;
+	return copy;
+}
+
+// copy of frame->plan in an earlier layer, for links joining their first one
+static struct v2c_plan *split_node_at(struct v2c_split *split,
+		struct v2c_split_frame *frame, int layer) {
+	if (frame->copy && frame->copy_layer == layer) {
+		return frame->copy;
+	} else if (!frame->parent) {
+		return split->layers[layer];
+	}
+	struct v2c_plan *parent = split_node_at(split, frame->parent, layer);
+	for (int k = parent->emit_len - 1; k >= 0; k--) {
+		if (parent->emit[k].index == frame->index && parent->emit[k].plan) {
+			return parent->emit[k].plan;
+		}
+	}
+	struct v2c_plan *copy = split_copy(split, frame->plan);
+	parent->emit[parent->emit_len++] = (struct v2c_plan_emit) {
+		.index = frame->index,
+		.plan = copy,
+	};
+	return copy;
+}
+
+/*
+ * Fill layers up to max_size in plan order, descending into directories
+ * too large for one layer, leading to a prefix, or with links that cannot
+ * all go to the layer of their first one. Data of links counts once, in
+ * that layer.
+ */
+static void split_walk(struct v2c_split *split, struct v2c_split_frame *frame,
+		const char *path) {
+	struct v2c_plan *plan = frame->plan;
+	bool isolated = split_prefix_match(split, path) > 0;
+	if (isolated) {
+		split_new_layer(split);
+	}
+
+	if (plan->remove_len) {
+		struct v2c_plan *copy = split_node(split, frame);
+		memcpy(copy->remove, plan->remove, plan->remove_len * sizeof(int));
+		copy->remove_len = plan->remove_len;
+		split->size += plan->remove_len * ustar_logical_record_size;
+	}
+
+	char npath[child_path_len(plan->b->inode, path)];
+	int name_index = child_path_init(npath, path);
+	for (int k = 0; k < plan->emit_len; k++) {
+		struct v2c_plan_emit *emit = &plan->emit[k];
+		struct cvirt_mtree_entry *child = &plan->b->inode->children[emit->index];
+		strcpy(&npath[name_index], child->name);
+		split->scan.len = 0;
+		int links_layer = emit->links ?
+			split_scan_emits(split, plan->b, path, emit, 1, -1) : -1;
+		size_t links_data = links_size(&split->scan);
+		bool fits = !split->fresh &&
+			split->size + emit->size + links_data <= split->max_size;
+		bool descend = emit->size > split->max_size ||
+			split_prefix_match(split, npath) || links_layer == -2 ||
+			(links_layer >= 0 && (links_layer != split->layers_len - 1 || !fits));
+		struct v2c_plan *child_plan = emit->plan;
+		if (descend && !child_plan && emit->created &&
+				S_ISDIR(child->inode->stat.st_mode) &&
+				!is_temporary_dir(npath)) {
+			child_plan = plan_from_tree(child, npath);
+			split_own(split, child_plan);
+		}
+		if (descend && child_plan) {
+			struct v2c_split_frame child_frame = {
+				.plan = child_plan,
+				.index = emit->index,
+				.parent = frame,
+			};
+			split_walk(split, &child_frame, npath);
+			continue;
+		}
+
+		int layer;
+		struct v2c_plan *copy;
+		if (links_layer >= 0 &&
+				(split->fresh || links_layer != split->layers_len - 1)) {
+			// a link, with its first one in an earlier layer
+			layer = links_layer;
+			copy = split_node_at(split, frame, layer);
+		} else {
+			if (links_layer < 0 && !split->fresh && !fits) {
+				split_new_layer(split);
+			}
+			copy = split_node(split, frame);
+			layer = split->layers_len - 1;
+			split->size += emit->size + links_data;
+		}
+		copy->emit[copy->emit_len++] = *emit;
+		for (size_t i = 0; i < split->scan.len; i++) {
+			split_link_place(split, split->scan.inodes[i], layer);
+		}
+	}
+
+	if (isolated) {
+		split_new_layer(split);
+	}
+}
+
+static bool is_modified_by_v2c(time_t t, struct v2c_state *state) {
+	return t >= state->modification_start && t <= state->modification_end;
+}
+
+void timestamp_fixup(struct cvirt_mtree_entry *tree, struct v2c_state *state) {
+	struct cvirt_mtree_stat *stat = &tree->inode->stat;
+	if (is_modified_by_v2c(stat->st_atim.tv_sec, state)) {
+		stat->st_atim.tv_sec = state->config.source_date_epoch;
+		stat->st_atim.tv_nsec = 0;
+	}
+	if (is_modified_by_v2c(stat->st_mtim.tv_sec, state)) {
+		stat->st_mtim.tv_sec = state->config.source_date_epoch;
+		stat->st_mtim.tv_nsec = 0;
+	}
+	if (is_modified_by_v2c(stat->st_ctim.tv_sec, state)) {
+		stat->st_ctim.tv_sec = state->config.source_date_epoch;
+		stat->st_ctim.tv_nsec = 0;
+	}
+
+	if (S_ISDIR(stat->st_mode)) {
+		for (int i = 0; i < tree->inode->children_len; i++) {
+			timestamp_fixup(&tree->inode->children[i], state);
+		}
+	}
+}
+
+struct tar_out_job {
+	guestfs_h *guestfs;
+	int fd;
+	int res;
+};
+
+static void *tar_out_run(void *arg) {
+	struct tar_out_job *job = arg;
+	char fd_path[32];
+	snprintf(fd_path, sizeof(fd_path), "/dev/fd/%d", job->fd);
+	job->res = guestfs_tar_out_opts(job->guestfs, "/", fd_path,
+		GUESTFS_TAR_OUT_OPTS_NUMERICOWNER, 1,
+		GUESTFS_TAR_OUT_OPTS_XATTRS, 1,
+		GUESTFS_TAR_OUT_OPTS_SELINUX, 1,
+		GUESTFS_TAR_OUT_OPTS_ACLS, 1,
+		-1);
+	close(job->fd); // EOF for the reader
+	return NULL;
+}
+
+// ./foo -> foo, . -> "" as the root entry of emit_tree
+static const char *stream_entry_name(const char *name) {
+	if (name[0] == '.' && (name[1] == '/' || !name[1])) {
+		name++;
+	}
+	while (*name == '/') {
+		name++;
+	}
+	return name;
+}
+
+// link whose first link was left out from the stream
+struct v2c_stream_orphan {
+	struct archive_entry *entry;
+	char *target;
+};
+
+struct v2c_stream {
+	struct v2c_stream_orphan *orphans;
+	size_t orphans_len, orphans_capacity;
+};
+
+// left out by emit_tree, path has a leading /
+static bool stream_is_excluded(const char *path) {
+	// no way to store names like whiteouts in OCI, nor what is under them
+	return strstr(path, "/.wh.") || is_temporary_content(path);
+}
+
+/*
+ * Rewrite one entry of the tar_out stream the way emit_tree would
+ * have written it, false if it is left out or kept for
+ * stream_write_orphans.
+ */
+static bool stream_rewrite_entry(struct v2c_state *state,
+		struct v2c_stream *stream, struct archive_entry *entry) {
+	const char *name = stream_entry_name(archive_entry_pathname(entry));
+	char path[strlen(name) + 2];
+	path[0] = '/';
+	strcpy(&path[1], name);
+	if (stream_is_excluded(path)) {
+		return false;
+	}
+	archive_entry_copy_pathname(entry, &path[1]);
+
+	if (state->config.set_modification_epoch) {
+		if (archive_entry_atime_is_set(entry) &&
+				is_modified_by_v2c(archive_entry_atime(entry), state)) {
+			archive_entry_set_atime(entry,
+				state->config.source_date_epoch, 0);
+		}
+		if (archive_entry_mtime_is_set(entry) &&
+				is_modified_by_v2c(archive_entry_mtime(entry), state)) {
+			archive_entry_set_mtime(entry,
+				state->config.source_date_epoch, 0);
+		}
+		if (archive_entry_ctime_is_set(entry) &&
+				is_modified_by_v2c(archive_entry_ctime(entry), state)) {
+			archive_entry_set_ctime(entry,
+				state->config.source_date_epoch, 0);
+		}
+	}
+
+	const char *hardlink = archive_entry_hardlink(entry);
+	if (hardlink) {
+		const char *target = stream_entry_name(hardlink);
+		char target_path[strlen(target) + 2];
+		target_path[0] = '/';
+		strcpy(&target_path[1], target);
+		if (stream_is_excluded(target_path)) {
+			// the file itself is written once tar_out is done
+			if (stream->orphans_len == stream->orphans_capacity) {
+				stream->orphans_capacity = stream->orphans_capacity ?
+					stream->orphans_capacity * 2 : 16;
+				stream->orphans = realloc(stream->orphans,
+					stream->orphans_capacity *
+					sizeof(struct v2c_stream_orphan));
+				assert(stream->orphans);
+			}
+			struct v2c_stream_orphan *orphan =
+				&stream->orphans[stream->orphans_len++];
+			orphan->entry = archive_entry_clone(entry);
+			orphan->target = strdup(target_path);
+			assert(orphan->entry && orphan->target);
+			return false;
+		}
+		archive_entry_copy_hardlink(entry, &target_path[1]);
+	}
+	return true;
+}
+
+/*
+ * Of links whose first link was left out, the first kept one is written as
+ * the file itself, like linkify does for emit_tree, and the rest link to
+ * it. Contents are read from the appliance, tar_out has to be done by now.
+ */
+static int stream_write_orphans(struct v2c_state *state,
+		struct v2c_stream *stream) {
+	for (size_t i = 0; i < stream->orphans_len; i++) {
+		struct archive_entry *entry = stream->orphans[i].entry;
+		size_t first = 0;
+		while (strcmp(stream->orphans[first].target,
+				stream->orphans[i].target)) {
+			first++;
+		}
+		if (first != i) {
+			archive_entry_copy_hardlink(entry,
+				archive_entry_pathname(stream->orphans[first].entry));
+			if (archive_write_header(state->layer_archive, entry) <
+					ARCHIVE_WARN) {
+				return -EIO;
+			}
+			continue;
+		}
+
+		const char *name = archive_entry_pathname(entry);
+		char path[strlen(name) + 2];
+		path[0] = '/';
+		strcpy(&path[1], name);
+		struct guestfs_statns *stat = guestfs_lstatns(state->guestfs, path);
+		if (!stat) {
+			return -EIO;
+		}
+		int64_t size = stat->st_size;
+		guestfs_free_statns(stat);
+		if (!archive_entry_xattr_count(entry)) {
+			// tar may keep them with the first link only
+			struct guestfs_xattr_list *xattrs =
+				guestfs_lgetxattrs(state->guestfs, path);
+			if (!xattrs) {
+				return -EIO;
+			}
+			for (uint32_t j = 0; j < xattrs->len; j++) {
+				archive_entry_xattr_add_entry(entry,
+					xattrs->val[j].attrname, xattrs->val[j].attrval,
+					xattrs->val[j].attrval_len);
+			}
+			guestfs_free_xattr_list(xattrs);
+		}
+		archive_entry_set_hardlink(entry, NULL);
+		archive_entry_set_filetype(entry, AE_IFREG);
+		archive_entry_set_size(entry, size);
+		if (archive_write_header(state->layer_archive, entry) < ARCHIVE_WARN) {
+			return -EIO;
+		}
+		int res = dump_file_content(state, path, size);
+		if (res < 0) {
+			return res;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Without reuse every file goes into the layer, pull them as one tar_out
+ * stream instead of walking and reading file by file over RPC.
+ */
+static int stream_layer(struct v2c_state *state) {
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		return -errno;
+	}
+	struct tar_out_job job = {
+		.guestfs = state->guestfs,
+		.fd = fds[1],
+	};
+	pthread_t thread;
+	int res = -pthread_create(&thread, NULL, tar_out_run, &job);
+	if (res < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return res;
+	}
+
+	struct v2c_stream stream = {0};
+	struct archive *in = archive_read_new();
+	assert(in);
+	archive_read_support_format_tar(in);
+	struct archive_entry *entry;
+	res = archive_read_open_fd(in, fds[0], bufsz);
+	while (res >= ARCHIVE_WARN) {
+		res = archive_read_next_header(in, &entry);
+		if (res == ARCHIVE_EOF || res < ARCHIVE_WARN) {
+			break;
+		}
+		if (!stream_rewrite_entry(state, &stream, entry)) {
+			continue;
+		}
+		res = archive_write_header(state->layer_archive, entry);
+		if (res < ARCHIVE_WARN) {
+			break;
+		}
+		const void *buf;
+		size_t len;
+		int64_t offset;
+		while ((res = archive_read_data_block(in, &buf, &len, &offset)) ==
+				ARCHIVE_OK) {
+			if (archive_write_data(state->layer_archive, buf, len) < 0) {
+				res = ARCHIVE_FATAL;
+				break;
+			}
+		}
+		if (res == ARCHIVE_EOF) {
+			res = ARCHIVE_OK;
+		}
+	}
+	if (res != ARCHIVE_EOF) {
+		fprintf(stderr, "Failed to stream rootfs: %s\n",
+			archive_error_string(in) ? archive_error_string(in) :
+			archive_error_string(state->layer_archive));
+	}
+	archive_read_free(in);
+
+	// let tar_out run to completion if we stopped early
+	char drain[4096];
+	while (read(fds[0], drain, sizeof(drain)) > 0);
+	close(fds[0]);
+	pthread_join(thread, NULL);
+
+	if (job.res < 0) {
+		fprintf(stderr, "tar_out failed\n");
+		res = ARCHIVE_FATAL;
+	}
+	res = res == ARCHIVE_EOF ? stream_write_orphans(state, &stream) : -EIO;
+	for (size_t i = 0; i < stream.orphans_len; i++) {
+		archive_entry_free(stream.orphans[i].entry);
+		free(stream.orphans[i].target);
+	}
+	free(stream.orphans);
+	return res;
+}
+
+// btrfs snapshots are only told apart by walking, see cvirt_mtree_tree_from_guestfs
+static bool has_btrfs_mounts(struct v2c_state *state, char **mounts) {
+	bool res = false;
+	for (int index = 0; mounts[index]; index += 2) {
+		char *type = guestfs_vfs_type(state->guestfs, mounts[index + 1]);
+		if (type && !strcmp(type, "btrfs")) {
+			res = true;
+		}
+		free(type);
+	}
+	return res;
+}
+
+struct v2c_split_build {
+	const struct v2c_state *state;
+	struct v2c_split *split;
+	struct cvirt_oci_layer **layers; // by index of split->layers
+	int threads; // compression threads of each layer
+	pthread_mutex_t lock;
+	int next;
+	int res;
+};
+
+struct v2c_split_worker {
+	struct v2c_split_build *build;
+	guestfs_h *guestfs;
+	pthread_t thread;
+	bool started;
+};
+
+// write one layer of split, like the single layer of main
+static int split_build_layer(struct v2c_split_build *build, guestfs_h *guestfs,
+		int index) {
+	struct v2c_state state = *build->state;
+	state.guestfs = guestfs;
+	state.prefetched = NULL;
+	state.pipeline = NULL;
+	state.content_buf = NULL;
+
+	struct cvirt_oci_layer *layer = cvirt_oci_layer_new(state.config.compression,
+		state.config.compression_level, build->threads);
+	if (!layer) {
+		perror("cvirt_oci_layer_new");
+		return -EIO;
+	}
+	state.layer_archive = cvirt_oci_layer_get_libarchive(layer);
+	state.layer_entry = archive_entry_new();
+	assert(state.layer_entry);
+	state.layer_link_resolver = archive_entry_linkresolver_new();
+	assert(state.layer_link_resolver);
+	archive_entry_linkresolver_set_strategy(state.layer_link_resolver,
+		archive_format(state.layer_archive));
+
+	if (state.config.prefetch_depth) {
+		state.pipeline = pipeline_start(state.layer_archive,
+			state.config.prefetch_depth, state.config.prefetch_memory);
+	}
+	emit_plan(&state, build->split->layers[index], "/");
+	int res = 0;
+	if (state.pipeline) {
+		res = pipeline_finish(state.pipeline);
+	}
+
+	archive_entry_linkresolver_free(state.layer_link_resolver);
+	archive_entry_free(state.layer_entry);
+	free(state.content_buf);
+	if (cvirt_oci_layer_close(layer) < 0 && !res) {
+		res = -EIO;
+	}
+	build->layers[index] = layer;
+	return res;
+}
+
+static void *split_worker_run(void *arg) {
+	struct v2c_split_worker *worker = arg;
+	struct v2c_split_build *build = worker->build;
+	while (true) {
+		pthread_mutex_lock(&build->lock);
+		// stop taking layers after a failure
+		int index = build->res ? build->split->layers_len : build->next++;
+		pthread_mutex_unlock(&build->lock);
+		if (index >= build->split->layers_len) {
+			break;
+		}
+		int res = split_build_layer(build, worker->guestfs, index);
+		if (res < 0) {
+			pthread_mutex_lock(&build->lock);
+			build->res = res;
+			pthread_mutex_unlock(&build->lock);
+		}
+	}
+	return NULL;
+}
+
+// regular files written by cleanup_fstab, other changes are only in the tree
+static const char *cleanup_files[] = {
+	"/etc/fstab",
+	NULL,
+};
+
+// the cleanups ran on the appliance of state only, copy what they wrote
+static int cleanup_copy(struct v2c_state *state, guestfs_h **pool, int len) {
+	for (int i = 0; cleanup_files[i]; i++) {
+		size_t size;
+		char *content = guestfs_read_file(state->guestfs, cleanup_files[i],
+			&size);
+		if (!content) {
+			continue;
+		}
+		for (int j = 0; j < len; j++) {
+			if (guestfs_write(pool[j], cleanup_files[i], content, size) < 0) {
+				free(content);
+				return -1;
+			}
+		}
+		free(content);
+	}
+	return 0;
+}
+
+/*
+ * Build layers of split concurrently, on the appliance of state and up to
+ * split_jobs - 1 more. Writes of the cleanups only live in the overlay of
+ * the appliance of state, and are copied to the others.
+ */
+static int split_build(struct v2c_state *state, struct v2c_split *split,
+		const char *image, struct cvirt_oci_layer **layers) {
+	int jobs = state->config.split_jobs < split->layers_len ?
+		state->config.split_jobs : split->layers_len;
+	guestfs_h **pool = NULL;
+	if (jobs > 1) {
+		pool = create_guestfs_pool_mount_first_linux(image, jobs - 1);
+		if (!pool) {
+			fprintf(stderr, "Warning: cannot launch more appliances, "
+				"building layers one at a time\n");
+			jobs = 1;
+		}
+	}
+	if (pool && cleanup_copy(state, pool, jobs - 1) < 0) {
+		fprintf(stderr, "Warning: cannot prepare more appliances, "
+			"building layers one at a time\n");
+		destroy_guestfs_pool(pool, jobs - 1);
+		pool = NULL;
+		jobs = 1;
+	}
+
+	struct v2c_split_build build = {
+		.state = state,
+		.split = split,
+		.layers = layers,
+		.threads = state->config.compression_threads / jobs,
+	};
+	if (build.threads < 1) {
+		build.threads = 1;
+	}
+	pthread_mutex_init(&build.lock, NULL);
+	struct v2c_split_worker *workers = calloc(jobs, sizeof(struct v2c_split_worker));
+	assert(workers);
+	for (int i = 0; i < jobs; i++) {
+		workers[i].build = &build;
+		workers[i].guestfs = i ? pool[i - 1] : state->guestfs;
+		if (i) {
+			// the others take its share if it cannot start
+			workers[i].started = !pthread_create(&workers[i].thread, NULL,
+				split_worker_run, &workers[i]);
+		}
+	}
+	split_worker_run(&workers[0]);
+	for (int i = 1; i < jobs; i++) {
+		if (workers[i].started) {
+			pthread_join(workers[i].thread, NULL);
+		}
+	}
+	free(workers);
+	pthread_mutex_destroy(&build.lock);
+	if (pool) {
+		destroy_guestfs_pool(pool, jobs - 1);
+	}
+	return build.res;
+}
+
+/*
+ * Write plan, or tree as a whole if NULL, as layers of up to
+ * split_layer_max each, and add them to the image.
+ */
+static int split_layers(struct v2c_state *state, struct v2c_plan *plan,
+		struct cvirt_mtree_entry *tree, const char *image,
+		struct cvirt_oci_image *oci_image, struct cvirt_oci_manifest *manifest,
+		struct cvirt_oci_config *config) {
+	struct v2c_split split = {
+		.max_size = state->config.split_layer_max,
+		.prefixes = state->config.split_prefixes ?
+			state->config.split_prefixes : default_split_prefixes,
+		.fresh = true,
+	};
+	struct v2c_split_frame root = {
+		.plan = plan ? plan : plan_from_tree(tree, "/"),
+	};
+	if (!plan) {
+		split_own(&split, root.plan);
+	}
+	split_walk(&split, &root, "/");
+	if (!split.layers_len) {
+		// root alone
+		split_node(&split, &root);
+	}
+	printf("Splitting layer into %d layers\n", split.layers_len);
+
+	struct cvirt_oci_layer **layers = calloc(split.layers_len + 1,
+		sizeof(struct cvirt_oci_layer *));
+	assert(layers);
+	int res = split_build(state, &split, image, layers);
+	for (int i = 0; i < split.layers_len; i++) {
+		if (!layers[i]) {
+			continue;
+		}
+		if (!res) {
+			struct cvirt_oci_blob *layer_blob = cvirt_oci_blob_from_layer(layers[i]);
+			cvirt_oci_config_add_layer(config, layers[i]);
+			cvirt_oci_manifest_add_layer(manifest, layer_blob);
+			cvirt_oci_image_add_blob(oci_image, layer_blob);
+			cvirt_oci_blob_destory(layer_blob);
+		}
+		cvirt_oci_layer_destroy(layers[i]);
+	}
+	free(layers);
+
+	for (int i = 0; i < split.owned_len; i++) {
+		free(split.owned[i]->remove);
+		free(split.owned[i]->emit);
+		free(split.owned[i]);
+	}
+	free(split.owned);
+	free(split.layers);
+	free(split.links);
+	free(split.scan.inodes);
+	return res;
+}
+
+// a prefix of layers of a --layer-reuse archive to put the new layer on
+struct v2c_reuse {
+	int fd;
+	const char *path;
+	struct cvirt_oci_r_manifest *manifest;
+	int len; // layers reused
+	struct cvirt_mtree_entry *tree; // after those layers, unless stale
+	bool stale; // tree has more layers applied since
+	int saved; // if stale, fd of tree saved before that, -1 if it failed
+	struct v2c_plan *plan; // NULL if stale
+	size_t size; // of the new layer, 0 if not needed
+};
+
+#define REUSE_FILE_TEMPLATE	"/v2c-reuse-XXXXXX"
+
+// apply layer index of manifest, the first one makes the tree
+static struct cvirt_mtree_entry *reuse_apply_layer(struct cvirt_mtree_entry *tree,
+		int fd, struct cvirt_oci_r_manifest *manifest, int index) {
+	struct cvirt_oci_r_layer *layer = cvirt_oci_r_layer_from_archive_blob(fd,
+		cvirt_oci_r_manifest_get_layer_digest(manifest, index),
+		cvirt_oci_r_manifest_get_layer_compression(manifest, index));
+	if (!layer) {
+		fprintf(stderr, "Cannot read layer %d to reuse\n", index);
+		exit(EXIT_FAILURE);
+	}
+	if (!tree) {
+		tree = cvirt_mtree_tree_from_oci_layer(layer, CVIRT_MTREE_TREE_ARENA);
+	} else if (cvirt_mtree_tree_oci_apply_layer(tree, layer, 0) < 0) {
+		tree = NULL;
+	}
+	if (!tree) {
+		fprintf(stderr, "Cannot apply layer %d to reuse\n", index);
+		exit(EXIT_FAILURE);
+	}
+	cvirt_oci_r_layer_destroy(layer);
+	cvirt_mtree_tree_sort(tree);
+	return tree;
+}
+
+// size of the new layer on top of tree, with plan to write it
+static size_t reuse_diff(struct cvirt_mtree_entry *tree, struct cvirt_mtree_entry *b,
+		struct v2c_plan **plan, size_t *baseline) {
+	assert(cvirt_mtree_tree_is_sorted(tree) && cvirt_mtree_tree_is_sorted(b));
+	struct v2c_plan_sizes sizes = {0};
+	size_t size = diff_layer(tree, b, "/", &sizes, plan);
+	// 2 blocks of end-of-archive indicator
+	*baseline = sizes.baseline + links_size(&sizes.baseline_links) +
+		2 * ustar_logical_record_size;
+	if (size) {
+		size += links_size(&sizes.reuse_links) + 2 * ustar_logical_record_size;
+	}
+	free(sizes.baseline_links.inodes);
+	free(sizes.reuse_links.inodes);
+	return size;
+}
+
+static void reuse_candidate(struct v2c_reuse *best, struct v2c_reuse *candidate) {
+	printf("Estimated layer size reusing %d layers of %s: %ld\n",
+		candidate->len, candidate->path, candidate->size);
+	if (best->tree && best->size <= candidate->size) {
+		if (candidate->plan) {
+			plan_destroy(candidate->plan);
+		}
+		return;
+	}
+	if (best->plan) {
+		plan_destroy(best->plan);
+	}
+	if (best->stale && best->saved >= 0) {
+		close(best->saved);
+	}
+	if (best->tree && best->tree != candidate->tree) {
+		// from an archive already walked
+		cvirt_mtree_tree_destroy(best->tree);
+	}
+	if (best->manifest && best->manifest != candidate->manifest) {
+		cvirt_oci_r_manifest_destroy(best->manifest);
+	}
+	*best = *candidate;
+}
+
+// snapshot of tree in an unlinked file, -1 on failure
+static int reuse_save(struct cvirt_mtree_entry *tree) {
+	char fd_path[32];
+	int fd = unlinked_file(REUSE_FILE_TEMPLATE, fd_path, sizeof(fd_path));
+	if (fd >= 0 && cvirt_mtree_tree_save(tree, fd) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/*
+ * Diff b against the tree after every prefix of layers of each
+ * --layer-reuse archive, applying one more layer at a time, and pick the
+ * smallest new layer. Trees of other prefixes are dropped on the way, the
+ * one picked is saved as a snapshot before layers are applied on top of
+ * it, and loaded back at the end instead of decompressing those layers
+ * again.
+ */
+static struct v2c_reuse reuse_pick(struct v2c_state *state,
+		struct cvirt_mtree_entry *b, size_t *baseline) {
+	struct v2c_reuse best = {0};
+	for (int n = 0; n < state->config.layer_reuse_len; n++) {
+		struct v2c_reuse candidate = {
+			.fd = state->config.layer_reuse_fds[n],
+			.path = state->config.layer_reuse_paths[n],
+		};
+		struct cvirt_oci_r_index *index =
+			cvirt_oci_r_index_from_archive(candidate.fd);
+		const char *manifest_digest =
+			cvirt_oci_r_index_get_native_manifest_digest(index);
+		candidate.manifest = cvirt_oci_r_manifest_from_archive_blob(candidate.fd,
+			manifest_digest);
+		int len = cvirt_oci_r_manifest_get_layers_length(candidate.manifest);
+
+		if (state->config.layer_reuse_snapshot) {
+			candidate.tree = cvirt_mtree_tree_load_mmap(
+				state->config.layer_reuse_snapshot);
+			if (!candidate.tree) {
+				exit(EXIT_FAILURE);
+			}
+			struct cvirt_oci_r_config *config =
+				cvirt_oci_r_config_from_archive_blob(candidate.fd,
+				cvirt_oci_r_manifest_get_config_digest(candidate.manifest));
+			if (!config || !cvirt_mtree_tree_is_oci_source(candidate.tree,
+					manifest_digest, config)) {
+				fprintf(stderr, "Snapshot %s is not of %s\n",
+					state->config.layer_reuse_snapshot, candidate.path);
+				exit(EXIT_FAILURE);
+			}
+			cvirt_oci_r_config_destroy(config);
+			cvirt_mtree_tree_sort(candidate.tree);
+			candidate.len = len;
+			candidate.size = reuse_diff(candidate.tree, b, &candidate.plan, baseline);
+			reuse_candidate(&best, &candidate);
+		} else {
+			for (int i = 0; i < len; i++) {
+				if (best.tree && best.tree == candidate.tree && !best.stale) {
+					// about to change under best
+					if (best.plan) {
+						plan_destroy(best.plan);
+						best.plan = NULL;
+					}
+					best.saved = reuse_save(best.tree);
+					best.stale = true;
+				}
+				candidate.tree = reuse_apply_layer(candidate.tree, candidate.fd,
+					candidate.manifest, i);
+				candidate.len = i + 1;
+				candidate.size = reuse_diff(candidate.tree, b,
+					&candidate.plan, baseline);
+				reuse_candidate(&best, &candidate);
+			}
+		}
+
+		if (candidate.tree && best.tree != candidate.tree) {
+			cvirt_mtree_tree_destroy(candidate.tree);
+		}
+		if (best.manifest != candidate.manifest) {
+			cvirt_oci_r_manifest_destroy(candidate.manifest);
+		}
+		cvirt_oci_r_index_destroy(index);
+	}
+
+	if (best.stale) {
+		cvirt_mtree_tree_destroy(best.tree);
+		best.tree = NULL;
+		if (best.saved >= 0) {
+			char fd_path[32];
+			snprintf(fd_path, sizeof(fd_path), "/dev/fd/%d", best.saved);
+			best.tree = cvirt_mtree_tree_load_mmap(fd_path);
+			close(best.saved);
+		}
+		if (best.tree) {
+			cvirt_mtree_tree_sort(best.tree);
+		} else {
+			for (int i = 0; i < best.len; i++) {
+				best.tree = reuse_apply_layer(best.tree, best.fd,
+					best.manifest, i);
+			}
+		}
+		best.size = reuse_diff(best.tree, b, &best.plan, baseline);
+		best.stale = false;
+	}
+	return best;
+}
+
+int main(int argc, char *argv[]) {
+	struct v2c_state state = {
+		.config =  {
+			.compression = CVIRT_OCI_LAYER_COMPRESSION_ZSTD,
+			.prefetch_depth = 1024,
+			.prefetch_memory = 256 * 1024 * 1024,
+			.compression_threads = sysconf(_SC_NPROCESSORS_ONLN),
+			.split_jobs = 2,
+		},
+	};
+	if (parse_options(&state, argc, argv) < 0 || argc - optind != 2 ||
+			(state.config.layer_reuse_snapshot && state.config.layer_reuse_len != 1)) {
+		fprintf(stderr, usage, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	char *source_date_epoch_env = getenv("SOURCE_DATE_EPOCH");
+	if (source_date_epoch_env) {
+		state.config.set_modification_epoch = true;
+		state.config.source_date_epoch = atoll(source_date_epoch_env);
+	}
+
+	state.modification_start = time(NULL);
+
+	char **succeeded_mounts;
+	state.guestfs = create_guestfs_mount_first_linux(argv[optind], &succeeded_mounts);
+	if (!state.guestfs) {
+		exit(EXIT_FAILURE);
+	}
+
+	// split layers are made later, each on its own
+	struct cvirt_oci_layer *layer = NULL;
+	if (!state.config.split_layer_max) {
+		layer = cvirt_oci_layer_new(state.config.compression,
+			state.config.compression_level, state.config.compression_threads);
+		if (!layer) {
+			perror("cvirt_oci_layer_new");
+			exit(EXIT_FAILURE);
+		}
+
+		state.layer_archive = cvirt_oci_layer_get_libarchive(layer);
+		state.layer_entry = archive_entry_new();
+		if (!state.layer_entry) {
+			perror("archive_entry_new");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	cleanup_fstab(&state, succeeded_mounts);
+
+	bool stream = !state.config.layer_reuse_len && !state.config.split_layer_max &&
+		(state.config.keep_btrfs_snapshots ||
+		!has_btrfs_mounts(&state, succeeded_mounts));
+
+	if (!state.config.disable_systemd_cleanup) {
+		cleanup_systemd(&state);
+	}
+
+	state.modification_end = time(NULL);
+
+	uint32_t flags = CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS |
+		CVIRT_MTREE_TREE_ARENA;
+	if (state.config.keep_btrfs_snapshots) {
+		flags ^= CVIRT_MTREE_TREE_GUESTFS_BTRFS_SKIP_SNAPSHOTS;
+	}
+	if (state.config.bulk_scan) {
+		flags |= CVIRT_MTREE_TREE_GUESTFS_BULK_SCAN;
+	}
+	struct cvirt_mtree_entry *guestfs_tree = NULL;
+	if (!stream) {
+		guestfs_tree = cvirt_mtree_tree_from_guestfs(state.guestfs, flags);
+		cvirt_mtree_tree_sort(guestfs_tree);
+
+		if (state.config.set_modification_epoch) {
+			timestamp_fixup(guestfs_tree, &state);
+		}
 	}
 
 	struct cvirt_oci_image *image = cvirt_oci_image_new(argv[optind + 1]);
@@ -646,58 +2479,24 @@ int main(int argc, char *argv[]) {
 	struct cvirt_oci_config *config = cvirt_oci_config_new();
 
 	struct cvirt_mtree_entry *reused_tree = NULL;
+	struct v2c_plan *plan = NULL;
 	size_t reused = 0;
-	if (state.config.layer_reuse_fd) {
-		state.layer_link_resolver = archive_entry_linkresolver_new();
-		archive_entry_linkresolver_set_strategy(state.layer_link_resolver,
-			archive_format(state.layer_archive));
-		size_t baseline = build_layer(NULL, guestfs_tree, "/", BUILD_LAYER_DRYRUN, &state) +
-			2 * ustar_logical_record_size; // 2 blocks of end-of-archive indicator
-		archive_entry_linkresolver_free(state.layer_link_resolver);
+	if (state.config.layer_reuse_len) {
+		size_t baseline = 0;
+		struct v2c_reuse best = reuse_pick(&state, guestfs_tree, &baseline);
 
-		struct cvirt_oci_r_index *index =
-			cvirt_oci_r_index_from_archive(state.config.layer_reuse_fd);
-		const char *manifest_digest =
-			cvirt_oci_r_index_get_native_manifest_digest(index);
-		struct cvirt_oci_r_manifest *from_manifest =
-			cvirt_oci_r_manifest_from_archive_blob(
-				state.config.layer_reuse_fd, manifest_digest);
-		int len = cvirt_oci_r_manifest_get_layers_length(from_manifest);
-
-		struct cvirt_mtree_entry *tree;
-
-		struct cvirt_oci_r_layer *layer = cvirt_oci_r_layer_from_archive_blob(
-			state.config.layer_reuse_fd,
-			cvirt_oci_r_manifest_get_layer_digest(from_manifest, 0),
-			cvirt_oci_r_manifest_get_layer_compression(from_manifest, 0));
-		tree = cvirt_mtree_tree_from_oci_layer(layer, 0);
-		for (int i = 1; i < len; i++) {
-			struct cvirt_oci_r_layer *layer = cvirt_oci_r_layer_from_archive_blob(
-				state.config.layer_reuse_fd,
-				cvirt_oci_r_manifest_get_layer_digest(from_manifest, i),
-				cvirt_oci_r_manifest_get_layer_compression(from_manifest, i));
-			cvirt_mtree_tree_oci_apply_layer(tree, layer, 0);
-		}
-
-		state.layer_link_resolver = archive_entry_linkresolver_new();
-		archive_entry_linkresolver_set_strategy(state.layer_link_resolver,
-			archive_format(state.layer_archive));
-		reused = build_layer(tree, guestfs_tree, "/", BUILD_LAYER_DRYRUN, &state);
-		if (reused) {
-			reused += 2 * ustar_logical_record_size;
-		}
-		archive_entry_linkresolver_free(state.layer_link_resolver);
-
-		printf("Estimated layer size without reuse: %ld, with reuse: %ld\n", baseline, reused);
-
-		if (reused < baseline) {
+		if (best.tree) {
+			printf("Estimated layer size without reuse: %ld, with reuse: %ld\n", baseline, best.size);
+		}
+
+		if (best.tree && best.size < baseline) {
 			struct cvirt_oci_r_config *from_config = cvirt_oci_r_config_from_archive_blob(
-				state.config.layer_reuse_fd, cvirt_oci_r_manifest_get_config_digest(from_manifest));
-			for (int i = 0; i < len; i++) {
+				best.fd, cvirt_oci_r_manifest_get_config_digest(best.manifest));
+			for (int i = 0; i < best.len; i++) {
 				struct cvirt_oci_layer * layer = cvirt_oci_layer_from_archive_blob(
-					state.config.layer_reuse_fd,
-					cvirt_oci_r_manifest_get_layer_digest(from_manifest, i),
-					cvirt_oci_r_manifest_get_layer_compression(from_manifest, i),
+					best.fd,
+					cvirt_oci_r_manifest_get_layer_digest(best.manifest, i),
+					cvirt_oci_r_manifest_get_layer_compression(best.manifest, i),
 					cvirt_oci_r_config_get_diff_id(from_config, i));
 				struct cvirt_oci_blob *layer_blob = cvirt_oci_blob_from_layer(layer);
 				cvirt_oci_config_add_layer(config, layer);
@@ -707,20 +2506,68 @@ int main(int argc, char *argv[]) {
 				cvirt_oci_layer_destroy(layer);
 			}
 			cvirt_oci_r_config_destroy(from_config);
-			reused_tree = tree;
+			reused_tree = best.tree;
+			plan = best.plan;
+			reused = best.size;
+		} else if (best.tree) {
+			if (best.plan) {
+				plan_destroy(best.plan);
+			}
+			cvirt_mtree_tree_destroy(best.tree);
 		}
+		if (best.manifest) {
+			cvirt_oci_r_manifest_destroy(best.manifest);
+		}
+		// reused layers are copied by now
+		for (int i = 0; i < state.config.layer_reuse_len; i++) {
+			cvirt_oci_r_archive_close(state.config.layer_reuse_fds[i]);
+		}
+		free(state.config.layer_reuse_fds);
+		free(state.config.layer_reuse_paths);
 	}
 
-	if (!reused_tree || reused) {
-		state.layer_link_resolver = archive_entry_linkresolver_new();
-		archive_entry_linkresolver_set_strategy(state.layer_link_resolver,
-			archive_format(state.layer_archive));
-
-		build_layer(reused_tree, guestfs_tree, "/", BUILD_LAYER_FULL, &state);
+	if (state.config.split_layer_max && (!reused_tree || reused)) {
+		if (split_layers(&state, reused_tree ? plan : NULL, guestfs_tree,
+				argv[optind], image, manifest, config) < 0) {
+			exit(EXIT_FAILURE);
+		}
+		if (plan) {
+			plan_destroy(plan);
+		}
 		cvirt_mtree_tree_destroy(guestfs_tree);
+	} else if (stream || !reused_tree || reused) {
+		if (stream) {
+			if (stream_layer(&state) < 0) {
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			state.layer_link_resolver = archive_entry_linkresolver_new();
+			archive_entry_linkresolver_set_strategy(state.layer_link_resolver,
+				archive_format(state.layer_archive));
+
+			if (state.config.prefetch_depth) {
+				state.pipeline = pipeline_start(state.layer_archive,
+					state.config.prefetch_depth, state.config.prefetch_memory);
+			}
+			if (reused_tree) {
+				emit_plan(&state, plan, "/");
+				plan_destroy(plan);
+			} else {
+				emit_tree(&state, guestfs_tree, "/");
+			}
+			cvirt_mtree_tree_destroy(guestfs_tree);
+			if (state.pipeline) {
+				int res = pipeline_finish(state.pipeline);
+				state.pipeline = NULL;
+				if (res < 0) {
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			archive_entry_linkresolver_free(state.layer_link_resolver);
+		}
 
 		archive_entry_free(state.layer_entry);
-		archive_entry_linkresolver_free(state.layer_link_resolver);
 		cvirt_oci_layer_close(layer);
 
 		struct cvirt_oci_blob *layer_blob = cvirt_oci_blob_from_layer(layer);
@@ -731,12 +2578,18 @@ int main(int argc, char *argv[]) {
 		cvirt_oci_layer_destroy(layer);
 	}
 
+	for (int i = 0; succeeded_mounts[i]; i++) {
+		free(succeeded_mounts[i]);
+	}
+	free(succeeded_mounts);
+
 	setup_config(&state, config);
 	cvirt_oci_config_close(config);
 
 	guestfs_umount_all(state.guestfs);
 	guestfs_shutdown(state.guestfs);
 	guestfs_close(state.guestfs);
+	free(state.content_buf);
 
 	struct cvirt_oci_blob *config_blob = cvirt_oci_blob_from_config(config);
 	cvirt_oci_manifest_set_config(manifest, config_blob);
@@ -0,0 +1,114 @@
+#include "utils.h"
+#include "compressor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const int threads[] = {1, 2, 7};
+#define THREADS_LEN	(sizeof(threads) / sizeof(*threads))
+
+static const char *gzip = "gzip", *zstd = "zstd";
+
+static ssize_t buf_write_cb(void *client_data, const void *buf, size_t len) {
+	test_buf_append(client_data, buf, len);
+	return len;
+}
+
+/*
+ * Compress in writes of varying sizes, differently for each threads, with
+ * frames ended every frame_size bytes for COMPRESSION_ZSTD_FRAMES.
+ */
+static void compress(enum compression compression, int threads,
+		const uint8_t *data, size_t len, size_t frame_size,
+		struct test_buf *out) {
+	struct compressor *compressor = compressor_open(compression, 6,
+		threads, out, buf_write_cb);
+	CHECK(compressor);
+	size_t written = 0, next_frame = frame_size;
+	for (size_t chunk = 1; written < len; chunk = chunk * 7 % 100003 + threads) {
+		if (chunk > len - written) {
+			chunk = len - written;
+		}
+		if (frame_size && written + chunk > next_frame) {
+			chunk = next_frame - written;
+		}
+		CHECK(!compressor_write(compressor, &data[written], chunk));
+		written += chunk;
+		if (frame_size && written == next_frame) {
+			CHECK(!compressor_end_frame(compressor));
+			next_frame += frame_size;
+		}
+	}
+	CHECK(!compressor_close(compressor));
+	compressor_free(compressor);
+}
+
+// through the reference implementation
+static void decompress(const char *program, const struct test_buf *in,
+		struct test_buf *out) {
+	char *path;
+	int fd = test_tmpfile(&path);
+	CHECK(write(fd, in->data, in->len) == (ssize_t)in->len);
+	close(fd);
+	char cmd[strlen(program) + strlen(path) + 16];
+	sprintf(cmd, "'%s' -dc < '%s'", program, path);
+	FILE *f = popen(cmd, "r");
+	CHECK(f);
+	uint8_t chunk[65536];
+	size_t len;
+	while ((len = fread(chunk, 1, sizeof(chunk), f))) {
+		test_buf_append(out, chunk, len);
+	}
+	CHECK(!pclose(f));
+	unlink(path);
+	free(path);
+}
+
+static void check_compression(enum compression compression,
+		const char *program, const uint8_t *data, size_t len,
+		size_t frame_size) {
+	struct test_buf outs[THREADS_LEN] = {0};
+	for (size_t i = 0; i < THREADS_LEN; i++) {
+		compress(compression, threads[i], data, len, frame_size, &outs[i]);
+		// frames only come with input
+		CHECK(outs[i].len || (compression == COMPRESSION_ZSTD_FRAMES && !len));
+		CHECK(outs[i].len == outs[0].len && (!outs[0].len ||
+			!memcmp(outs[i].data, outs[0].data, outs[0].len)));
+	}
+	struct test_buf decompressed = {0};
+	if (outs[0].len) {
+		decompress(program, &outs[0], &decompressed);
+	}
+	CHECK(decompressed.len == len);
+	CHECK(!len || !memcmp(decompressed.data, data, len));
+	free(decompressed.data);
+	for (size_t i = 0; i < THREADS_LEN; i++) {
+		free(outs[i].data);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc == 3) {
+		gzip = argv[1];
+		zstd = argv[2];
+	}
+
+	// over several gzip blocks and batches, and zstd jobs
+	size_t len = 16 * 1024 * 1024 + 12345;
+	uint8_t *data = malloc(len);
+	CHECK(data);
+	test_fill(data, len, 1);
+	size_t sizes[] = {0, 1, 4096, len};
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		check_compression(COMPRESSION_GZIP, gzip, data, sizes[i], 0);
+		check_compression(COMPRESSION_ZSTD, zstd, data, sizes[i], 0);
+		check_compression(COMPRESSION_ZSTD_FRAMES, zstd, data, sizes[i],
+			3 * 1024 * 1024);
+	}
+
+	free(data);
+	return 0;
+}
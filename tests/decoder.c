@@ -0,0 +1,239 @@
+#include "utils.h"
+#include "compressor.h"
+#include "oci-r/decoder.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zstd.h>
+
+#define MIB	(1024 * 1024)
+
+static const int threads[] = {1, 4, 16};
+#define THREADS_LEN	(sizeof(threads) / sizeof(*threads))
+
+// a multi-member or multi-frame blob, and where its parts start
+struct blob {
+	struct test_buf compressed;
+	struct test_buf plain;
+	size_t *starts;
+	size_t starts_len, starts_capacity;
+};
+
+static ssize_t buf_write_cb(void *client_data, const void *buf, size_t len) {
+	test_buf_append(client_data, buf, len);
+	return len;
+}
+
+static void blob_start_part(struct blob *blob) {
+	if (blob->starts_len == blob->starts_capacity) {
+		blob->starts_capacity = blob->starts_capacity ?
+			blob->starts_capacity * 2 : 64;
+		blob->starts = realloc(blob->starts,
+			blob->starts_capacity * sizeof(*blob->starts));
+		CHECK(blob->starts);
+	}
+	blob->starts[blob->starts_len++] = blob->compressed.len;
+}
+
+static void blob_free(struct blob *blob) {
+	free(blob->compressed.data);
+	free(blob->plain.data);
+	free(blob->starts);
+}
+
+// with compressor, for gzip a member, for zstd a frame of unknown size
+static void add_compressed(struct blob *blob, enum compression compression,
+		const uint8_t *data, size_t len) {
+	blob_start_part(blob);
+	struct compressor *compressor = compressor_open(compression, 6, 4,
+		&blob->compressed, buf_write_cb);
+	CHECK(compressor);
+	CHECK(!compressor_write(compressor, data, len));
+	CHECK(!compressor_close(compressor));
+	compressor_free(compressor);
+	test_buf_append(&blob->plain, data, len);
+}
+
+// zstd frame with its content size
+static void add_zstd_frame(struct blob *blob, const uint8_t *data, size_t len) {
+	blob_start_part(blob);
+	size_t bound = ZSTD_compressBound(len);
+	uint8_t *frame = malloc(bound);
+	CHECK(frame);
+	size_t res = ZSTD_compress(frame, bound, data, len, 3);
+	CHECK(!ZSTD_isError(res));
+	test_buf_append(&blob->compressed, frame, res);
+	free(frame);
+	test_buf_append(&blob->plain, data, len);
+}
+
+static void add_zstd_skippable(struct blob *blob, size_t len) {
+	blob_start_part(blob);
+	uint8_t header[8] = {0x50, 0x2a, 0x4d, 0x18};
+	for (int i = 0; i < 4; i++) {
+		header[4 + i] = len >> (i * 8);
+	}
+	test_buf_append(&blob->compressed, header, sizeof(header));
+	uint8_t payload[256];
+	CHECK(len <= sizeof(payload));
+	memset(payload, 0x28, len);
+	test_buf_append(&blob->compressed, payload, len);
+}
+
+static ssize_t decode(const uint8_t *src, size_t len,
+		enum cvirt_oci_r_layer_compression compression, int threads,
+		struct test_buf *out) {
+	struct layer_decoder *decoder = layer_decoder_new(src, len,
+		compression, threads);
+	CHECK(decoder);
+	const void *buf;
+	ssize_t res;
+	while ((res = layer_decoder_read(decoder, &buf)) > 0) {
+		test_buf_append(out, buf, res);
+	}
+	layer_decoder_destroy(decoder);
+	return res;
+}
+
+static void check_decodes(const struct blob *blob,
+		enum cvirt_oci_r_layer_compression compression) {
+	for (size_t i = 0; i < THREADS_LEN; i++) {
+		struct test_buf out = {0};
+		CHECK(!decode(blob->compressed.data, blob->compressed.len,
+			compression, threads[i], &out));
+		CHECK(out.len == blob->plain.len &&
+			!memcmp(out.data, blob->plain.data, out.len));
+		free(out.data);
+	}
+}
+
+// cut within parts, not between them where the blob is still valid
+static void check_truncated(const struct blob *blob,
+		enum cvirt_oci_r_layer_compression compression) {
+	for (size_t i = 0; i < blob->starts_len; i++) {
+		size_t end = i + 1 < blob->starts_len ?
+			blob->starts[i + 1] : blob->compressed.len;
+		size_t cuts[] = {
+			blob->starts[i] + (end - blob->starts[i]) / 2,
+			end - 1,
+		};
+		for (size_t j = 0; j < sizeof(cuts) / sizeof(*cuts); j++) {
+			struct test_buf out = {0};
+			CHECK(decode(blob->compressed.data, cuts[j], compression,
+				threads[i % THREADS_LEN], &out) < 0);
+			CHECK(out.len <= blob->plain.len &&
+				(!out.len || !memcmp(out.data, blob->plain.data, out.len)));
+			free(out.data);
+		}
+	}
+}
+
+// destroyed before, or while the decoder waits for room to output
+static void check_cancel(const struct blob *blob,
+		enum cvirt_oci_r_layer_compression compression) {
+	for (size_t i = 0; i < THREADS_LEN; i++) {
+		struct layer_decoder *decoder = layer_decoder_new(
+			blob->compressed.data, blob->compressed.len, compression,
+			threads[i]);
+		CHECK(decoder);
+		if (i) {
+			const void *buf;
+			CHECK(layer_decoder_read(decoder, &buf) > 0);
+		}
+		layer_decoder_destroy(decoder);
+	}
+}
+
+int main(void) {
+	size_t len = 48 * MIB;
+	uint8_t *data = malloc(len);
+	CHECK(data);
+	test_fill(data, len, 1);
+
+	struct blob gzip = {0};
+	add_compressed(&gzip, COMPRESSION_GZIP, data, 20 * MIB);
+	check_decodes(&gzip, CVIRT_OCI_R_LAYER_COMPRESSION_GZIP);
+	blob_free(&gzip);
+
+	/*
+	 * Members of all sizes, chained over jobs, with one too large for a
+	 * job at 16 threads, decoded on the decoder thread
+	 */
+	gzip = (struct blob){0};
+	size_t pos = 0;
+	size_t gzip_sizes[] = {0, 1, 100, 65536, MIB, 3 * MIB + 1, 20 * MIB};
+	for (int i = 0; i < 24; i++) {
+		size_t size = gzip_sizes[i * 5 % 7];
+		if (size == 20 * MIB && i != 12) {
+			size = 2 * MIB;
+		}
+		add_compressed(&gzip, COMPRESSION_GZIP, &data[pos], size);
+		pos = (pos + size) % (len - 20 * MIB);
+	}
+	check_decodes(&gzip, CVIRT_OCI_R_LAYER_COMPRESSION_GZIP);
+	test_quiet(true);
+	check_truncated(&gzip, CVIRT_OCI_R_LAYER_COMPRESSION_GZIP);
+	// a broken member in the middle
+	struct test_buf broken = {0};
+	test_buf_append(&broken, gzip.compressed.data, gzip.compressed.len);
+	broken.data[gzip.starts[10] + 20] ^= 0xff;
+	struct test_buf out = {0};
+	CHECK(decode(broken.data, broken.len,
+		CVIRT_OCI_R_LAYER_COMPRESSION_GZIP, 4, &out) < 0);
+	free(out.data);
+	free(broken.data);
+	test_quiet(false);
+	blob_free(&gzip);
+
+	/*
+	 * Frames with and without content sizes, small ones sharing jobs,
+	 * skippable ones, and one too large for a job
+	 */
+	struct blob zstd = {0};
+	pos = 0;
+	for (int i = 0; i < 64; i++) {
+		size_t size = i % 3 ? 4096 : 100;
+		add_zstd_frame(&zstd, &data[pos], size);
+		pos += size;
+	}
+	add_zstd_frame(&zstd, data, 0);
+	add_zstd_skippable(&zstd, 100);
+	for (int i = 0; i < 8; i++) {
+		add_zstd_frame(&zstd, &data[pos], 3 * MIB);
+		pos += 3 * MIB;
+	}
+	add_compressed(&zstd, COMPRESSION_ZSTD, &data[pos], 2 * MIB);
+	add_zstd_frame(&zstd, data, 20 * MIB);
+	add_zstd_skippable(&zstd, 0);
+	add_zstd_frame(&zstd, &data[pos], 5 * MIB);
+	check_decodes(&zstd, CVIRT_OCI_R_LAYER_COMPRESSION_ZSTD);
+	test_quiet(true);
+	check_truncated(&zstd, CVIRT_OCI_R_LAYER_COMPRESSION_ZSTD);
+	test_quiet(false);
+	blob_free(&zstd);
+	free(data);
+
+	// beyond what the decoder holds for the reader
+	len = 320 * MIB;
+	data = calloc(len, 1);
+	CHECK(data);
+	gzip = (struct blob){0};
+	add_compressed(&gzip, COMPRESSION_GZIP, data, len);
+	check_cancel(&gzip, CVIRT_OCI_R_LAYER_COMPRESSION_GZIP);
+	blob_free(&gzip);
+	gzip = (struct blob){0};
+	for (int i = 0; i < 40; i++) {
+		add_compressed(&gzip, COMPRESSION_GZIP, data, len / 40);
+	}
+	check_cancel(&gzip, CVIRT_OCI_R_LAYER_COMPRESSION_GZIP);
+	blob_free(&gzip);
+	zstd = (struct blob){0};
+	for (int i = 0; i < 320; i++) {
+		add_zstd_frame(&zstd, data, len / 320);
+	}
+	check_cancel(&zstd, CVIRT_OCI_R_LAYER_COMPRESSION_ZSTD);
+	blob_free(&zstd);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,434 @@
+#include "utils.h"
+#include "compressor.h"
+#include "oci-r/layer-index.h"
+
+#include <convirter/oci-r/index.h>
+#include <convirter/oci-r/layer.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#define MIB	(1024 * 1024)
+
+struct layer_entry {
+	const char *path;
+	mode_t type;
+	size_t size;
+	const char *link; // hardlink for AE_IFREG, target for AE_IFLNK
+	uint8_t *data;
+};
+
+// in tar order, over several checkpoints, with names sorting around "b/c/"
+static struct layer_entry entries[] = {
+	{"a", AE_IFDIR},
+	{"a/one", AE_IFREG, 100},
+	{"a/dup", AE_IFREG, 10},
+	{"big", AE_IFDIR},
+	{"big/f1", AE_IFREG, 7 * MIB},
+	{"big/f2", AE_IFREG, 7 * MIB},
+	{"b", AE_IFDIR},
+	{"b/c", AE_IFDIR},
+	{"b/c/d", AE_IFDIR},
+	{"b/c/d/e", AE_IFREG, 3 * MIB},
+	{"b/c-x", AE_IFREG, 5},
+	{"b/c.x", AE_IFREG, 6},
+	{"b/c0", AE_IFREG, 7},
+	{"big/f3", AE_IFREG, 7 * MIB},
+	{"a/dup", AE_IFREG, 20},
+	{"b/c/link", AE_IFREG, 0, "b/c/d/e"},
+	{"b/c/sym", AE_IFLNK, 0, "d/e"},
+	{"z", AE_IFDIR},
+	{"z/after", AE_IFREG, 1000},
+};
+#define ENTRIES_LEN	(sizeof(entries) / sizeof(*entries))
+
+// (path, entries expected as of key)
+static const char *paths[][2] = {
+	{"a", "a"},
+	{"big", "big"},
+	{"./big/f1", "big/f1"},
+	{"b", "b"},
+	{"/b/c/", "b/c"},
+	{"b/c/d/e", "b/c/d/e"},
+	{"b/c-x", "b/c-x"},
+	{"z/after", "z/after"},
+	{"/", ""},
+};
+
+static const char *missing[] = {"nope", "b/c/d/e/f", "c", "bi", "z/afte"};
+
+static ssize_t buf_write_cb(void *client_data, const void *buf, size_t len) {
+	test_buf_append(client_data, buf, len);
+	return len;
+}
+
+static void build_tar(struct test_buf *buf) {
+	struct archive *tar = test_tar_new(buf);
+	for (size_t i = 0; i < ENTRIES_LEN; i++) {
+		struct layer_entry *entry = &entries[i];
+		if (entry->type == AE_IFDIR) {
+			test_tar_dir(tar, entry->path);
+		} else if (entry->type == AE_IFLNK) {
+			test_tar_symlink(tar, entry->path, entry->link);
+		} else if (entry->link) {
+			test_tar_hardlink(tar, entry->path, entry->link);
+		} else {
+			entry->data = malloc(entry->size);
+			CHECK(entry->data);
+			test_fill(entry->data, entry->size, i);
+			test_tar_file(tar, entry->path, entry->data, entry->size);
+		}
+	}
+	test_tar_close(tar);
+}
+
+// zstd in frames of frame_size, so that they are the checkpoints
+static void compress(enum compression compression, const struct test_buf *in,
+		size_t frame_size, struct test_buf *out) {
+	struct compressor *compressor = compressor_open(compression, 6, 4, out,
+		buf_write_cb);
+	CHECK(compressor);
+	size_t chunk = frame_size ? frame_size : in->len;
+	for (size_t pos = 0; pos < in->len; pos += chunk) {
+		size_t len = in->len - pos > chunk ? chunk : in->len - pos;
+		CHECK(!compressor_write(compressor, &in->data[pos], len));
+		if (frame_size) {
+			CHECK(!compressor_end_frame(compressor));
+		}
+	}
+	CHECK(!compressor_close(compressor));
+	compressor_free(compressor);
+}
+
+static bool path_is_under(const char *path, const char *key) {
+	size_t len = strlen(key);
+	return !len || (!strncmp(path, key, len) && (!path[len] || path[len] == '/'));
+}
+
+static void check_data(struct archive *archive,
+		const struct layer_entry *expected) {
+	size_t pos = 0;
+	uint8_t buf[65536];
+	la_ssize_t len;
+	while ((len = archive_read_data(archive, buf, sizeof(buf))) > 0) {
+		CHECK(pos + len <= expected->size &&
+			!memcmp(buf, &expected->data[pos], len));
+		pos += len;
+	}
+	CHECK(!len && pos == expected->size);
+}
+
+// the archive of the layer has exactly the entries under key, in tar order
+static void check_entries(struct cvirt_oci_r_layer *layer, const char *key) {
+	struct archive *archive = cvirt_oci_r_layer_get_libarchive(layer);
+	struct archive_entry *entry;
+	size_t next = 0;
+	int res;
+	while ((res = archive_read_next_header(archive, &entry)) == ARCHIVE_OK) {
+		while (next < ENTRIES_LEN && !path_is_under(entries[next].path, key)) {
+			next++;
+		}
+		CHECK(next < ENTRIES_LEN);
+		const struct layer_entry *expected = &entries[next++];
+
+		const char *pathname = archive_entry_pathname(entry);
+		size_t len = strlen(pathname);
+		while (len && pathname[len - 1] == '/') {
+			len--;
+		}
+		CHECK(len == strlen(expected->path) &&
+			!strncmp(pathname, expected->path, len));
+		if (expected->type == AE_IFLNK) {
+			CHECK(archive_entry_filetype(entry) == AE_IFLNK);
+			CHECK(!strcmp(archive_entry_symlink(entry), expected->link));
+		} else if (expected->link) {
+			CHECK(archive_entry_hardlink(entry));
+			CHECK(!strcmp(archive_entry_hardlink(entry), expected->link));
+		} else {
+			CHECK(archive_entry_filetype(entry) == expected->type);
+			if (expected->type == AE_IFREG) {
+				check_data(archive, expected);
+			}
+		}
+	}
+	CHECK(res == ARCHIVE_EOF);
+	while (next < ENTRIES_LEN && !path_is_under(entries[next].path, key)) {
+		next++;
+	}
+	CHECK(next == ENTRIES_LEN);
+}
+
+static void check_open_path(int fd, const char *digest,
+		enum cvirt_oci_r_layer_compression compression, const char *dir,
+		uint64_t checkpoints_min) {
+	struct cvirt_oci_r_layer *layer = cvirt_oci_r_layer_from_archive_blob(fd,
+		digest, compression);
+	CHECK(layer);
+	CHECK(cvirt_oci_r_layer_open_path(layer, "a") == -EINVAL);
+	CHECK(!cvirt_oci_r_layer_use_index(layer, dir));
+
+	char path[strlen(dir) + strlen(digest) + 2];
+	sprintf(path, "%s/%s", dir, digest);
+	*strchr(&path[strlen(dir)], ':') = '-';
+	struct test_buf index = {0};
+	int index_fd = open(path, O_RDONLY | O_CLOEXEC);
+	CHECK(index_fd >= 0);
+	uint8_t chunk[65536];
+	ssize_t len;
+	while ((len = read(index_fd, chunk, sizeof(chunk))) > 0) {
+		test_buf_append(&index, chunk, len);
+	}
+	close(index_fd);
+	const struct layer_index_header *header = (void *)index.data;
+	CHECK(index.len >= sizeof(*header));
+	CHECK(header->checkpoints_count >= checkpoints_min);
+	CHECK(header->entries_count == ENTRIES_LEN);
+	free(index.data);
+
+	for (size_t i = 0; i < sizeof(paths) / sizeof(*paths); i++) {
+		CHECK(!cvirt_oci_r_layer_open_path(layer, paths[i][0]));
+		check_entries(layer, paths[i][1]);
+	}
+	// and back, in between and out of order
+	CHECK(!cvirt_oci_r_layer_rewind(layer));
+	check_entries(layer, "");
+	CHECK(!cvirt_oci_r_layer_open_path(layer, "z"));
+	check_entries(layer, "z");
+	CHECK(!cvirt_oci_r_layer_open_path(layer, "a"));
+	check_entries(layer, "a");
+	for (size_t i = 0; i < sizeof(missing) / sizeof(*missing); i++) {
+		CHECK(cvirt_oci_r_layer_open_path(layer, missing[i]) == -ENOENT);
+	}
+	CHECK(!cvirt_oci_r_layer_open_path(layer, "b"));
+	check_entries(layer, "b");
+	cvirt_oci_r_layer_destroy(layer);
+
+	// loaded as is by the next one
+	struct stat before, after;
+	CHECK(!stat(path, &before));
+	layer = cvirt_oci_r_layer_from_archive_blob(fd, digest, compression);
+	CHECK(layer);
+	CHECK(!cvirt_oci_r_layer_use_index(layer, dir));
+	CHECK(!stat(path, &after));
+	CHECK(before.st_ino == after.st_ino);
+	CHECK(!cvirt_oci_r_layer_open_path(layer, "b/c"));
+	check_entries(layer, "b/c");
+	cvirt_oci_r_layer_destroy(layer);
+}
+
+static bool loads(const char *path, const struct cvirt_oci_r_layer *layer,
+		const uint8_t *data, size_t len) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	CHECK(fd >= 0);
+	CHECK(write(fd, data, len) == (ssize_t)len);
+	close(fd);
+	struct layer_index *index = layer_index_load(path, layer);
+	if (!index) {
+		return false;
+	}
+	// whatever comes out, within the blob and the index
+	struct layer_index_reader *reader = layer_index_reader_new(layer, index,
+		"z/after");
+	if (reader) {
+		const void *buf;
+		while (layer_index_reader_read(reader, &buf) > 0);
+		layer_index_reader_destroy(reader);
+	}
+	layer_index_destroy(index);
+	return true;
+}
+
+enum corruption {
+	BAD_MAGIC,
+	BAD_VERSION,
+	BAD_BYTE_ORDER,
+	OTHER_COMPRESSION,
+	OTHER_BLOB_SIZE,
+	HUGE_CHECKPOINTS_COUNT,
+	NO_CHECKPOINTS,
+	MISALIGNED_ENTRIES,
+	WINDOWS_OUT_OF_FILE,
+	UNTERMINATED_STRINGS,
+	CHECKPOINT_OUT_OF_BLOB,
+	CHECKPOINT_BITS,
+	WINDOW_OUT_OF_WINDOWS,
+	CHECKPOINTS_UNSORTED,
+	PATH_OUT_OF_STRINGS,
+	ENTRY_ENDS_BEFORE_HEADER,
+	ENTRY_OUT_OF_TAR,
+	CORRUPTIONS,
+};
+
+static void corrupt(struct test_buf *index, enum corruption corruption) {
+	struct layer_index_header *header = (void *)index->data;
+	struct layer_index_checkpoint *checkpoints =
+		(void *)&index->data[header->checkpoints_offset];
+	struct layer_index_entry *entries =
+		(void *)&index->data[header->entries_offset];
+	switch (corruption) {
+	case BAD_MAGIC:
+		header->magic[0] ^= 1;
+		break;
+	case BAD_VERSION:
+		header->version++;
+		break;
+	case BAD_BYTE_ORDER:
+		header->byte_order = 0x04030201;
+		break;
+	case OTHER_COMPRESSION:
+		header->compression = CVIRT_OCI_R_LAYER_COMPRESSION_NONE;
+		break;
+	case OTHER_BLOB_SIZE:
+		header->blob_size++;
+		break;
+	case HUGE_CHECKPOINTS_COUNT:
+		header->checkpoints_count = UINT64_MAX / 2;
+		break;
+	case NO_CHECKPOINTS:
+		header->checkpoints_count = 0;
+		break;
+	case MISALIGNED_ENTRIES:
+		header->entries_offset += 4;
+		break;
+	case WINDOWS_OUT_OF_FILE:
+		header->windows_offset = index->len + 8;
+		break;
+	case UNTERMINATED_STRINGS:
+		index->data[header->strings_offset + header->strings_size - 1] = 'x';
+		break;
+	case CHECKPOINT_OUT_OF_BLOB:
+		checkpoints[1].in_offset = header->blob_size + 1;
+		break;
+	case CHECKPOINT_BITS:
+		checkpoints[1].bits = 8;
+		break;
+	case WINDOW_OUT_OF_WINDOWS:
+		checkpoints[1].window_offset = header->windows_size;
+		checkpoints[1].window_len = 1;
+		break;
+	case CHECKPOINTS_UNSORTED:
+		checkpoints[2].out_offset = checkpoints[1].out_offset - 1;
+		break;
+	case PATH_OUT_OF_STRINGS:
+		entries[1].path_offset = header->strings_size;
+		break;
+	case ENTRY_ENDS_BEFORE_HEADER:
+		entries[1].end_offset = entries[1].header_offset - 1;
+		break;
+	case ENTRY_OUT_OF_TAR:
+		entries[1].end_offset = header->tar_size + 1;
+		break;
+	case CORRUPTIONS:
+		break;
+	}
+}
+
+static void check_rejects(int fd, const char *dir) {
+	struct cvirt_oci_r_layer *layer = cvirt_oci_r_layer_from_archive_blob(fd,
+		"sha256:gzip", CVIRT_OCI_R_LAYER_COMPRESSION_GZIP);
+	CHECK(layer);
+	char path[strlen(dir) + 32];
+	sprintf(path, "%s/sha256-gzip", dir);
+	struct test_buf index = {0}, copy = {0};
+	int index_fd = open(path, O_RDONLY | O_CLOEXEC);
+	CHECK(index_fd >= 0);
+	uint8_t chunk[65536];
+	ssize_t len;
+	while ((len = read(index_fd, chunk, sizeof(chunk))) > 0) {
+		test_buf_append(&index, chunk, len);
+	}
+	close(index_fd);
+	const struct layer_index_header *header = (void *)index.data;
+	CHECK(header->checkpoints_count >= 3);
+
+	char broken[strlen(dir) + 32];
+	sprintf(broken, "%s/broken", dir);
+	CHECK(loads(broken, layer, index.data, index.len));
+	test_quiet(true);
+	// tables in full, the windows and strings sparsely
+	for (size_t len = 0; len < index.len;
+			len += len < header->windows_offset ? 1 : 61) {
+		CHECK(!loads(broken, layer, index.data, len));
+	}
+	for (int i = 0; i < CORRUPTIONS; i++) {
+		copy.len = 0;
+		test_buf_append(&copy, index.data, index.len);
+		corrupt(&copy, i);
+		CHECK(!loads(broken, layer, copy.data, copy.len));
+	}
+	// anything else either loads or not, but stays within the mapping
+	srand(1);
+	for (int i = 0; i < 200; i++) {
+		copy.len = 0;
+		test_buf_append(&copy, index.data, index.len);
+		size_t range = i % 2 ? copy.len : header->windows_offset;
+		for (int j = 1 + rand() % 4; j; j--) {
+			copy.data[rand() % range] ^= 1 << (rand() % 8);
+		}
+		loads(broken, layer, copy.data, copy.len);
+	}
+	test_quiet(false);
+	unlink(broken);
+	cvirt_oci_r_layer_destroy(layer);
+
+	// a broken index is rebuilt
+	copy.len = 0;
+	test_buf_append(&copy, index.data, index.len);
+	corrupt(&copy, CHECKPOINTS_UNSORTED);
+	index_fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+	CHECK(index_fd >= 0);
+	CHECK(write(index_fd, copy.data, copy.len) == (ssize_t)copy.len);
+	close(index_fd);
+	layer = cvirt_oci_r_layer_from_archive_blob(fd, "sha256:gzip",
+		CVIRT_OCI_R_LAYER_COMPRESSION_GZIP);
+	CHECK(layer);
+	CHECK(!cvirt_oci_r_layer_use_index(layer, dir));
+	CHECK(!cvirt_oci_r_layer_open_path(layer, "big/f2"));
+	check_entries(layer, "big/f2");
+	cvirt_oci_r_layer_destroy(layer);
+
+	free(index.data);
+	free(copy.data);
+}
+
+int main(void) {
+	const char *names[] = {"gzip", "zstd", "tar"};
+	struct test_buf tar = {0}, blobs[3] = {0};
+	build_tar(&tar);
+	CHECK(tar.len > 3 * LAYER_INDEX_SPAN);
+	compress(COMPRESSION_GZIP, &tar, 0, &blobs[0]);
+	compress(COMPRESSION_ZSTD_FRAMES, &tar, 4 * MIB, &blobs[1]);
+	blobs[2] = tar;
+	int fd = test_oci_archive(names, blobs, 3);
+
+	char *dir = test_tmpdir();
+	check_open_path(fd, "sha256:gzip", CVIRT_OCI_R_LAYER_COMPRESSION_GZIP,
+		dir, tar.len / LAYER_INDEX_SPAN);
+	check_open_path(fd, "sha256:zstd", CVIRT_OCI_R_LAYER_COMPRESSION_ZSTD,
+		dir, tar.len / (4 * MIB));
+	check_open_path(fd, "sha256:tar", CVIRT_OCI_R_LAYER_COMPRESSION_NONE,
+		dir, 0);
+	check_rejects(fd, dir);
+
+	for (size_t i = 0; i < 3; i++) {
+		char path[strlen(dir) + 32];
+		sprintf(path, "%s/sha256-%s", dir, names[i]);
+		unlink(path);
+		free(blobs[i].data);
+	}
+	rmdir(dir);
+	free(dir);
+	cvirt_oci_r_archive_close(fd);
+	for (size_t i = 0; i < ENTRIES_LEN; i++) {
+		free(entries[i].data);
+	}
+	return 0;
+}
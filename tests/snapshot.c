@@ -0,0 +1,407 @@
+#include "utils.h"
+#include "mtree/snapshot.h"
+
+#include <convirter/mtree/entry.h>
+#include <convirter/mtree/xattr.h>
+#include <convirter/oci-r/config.h>
+#include <convirter/oci-r/index.h>
+#include <convirter/oci-r/layer.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#define MANIFEST_DIGEST	"sha256:manifest"
+
+static void build_base_layer(struct test_buf *buf) {
+	struct archive *tar = test_tar_new(buf);
+	uint8_t data[4096];
+
+	test_tar_dir(tar, "etc");
+	test_tar_file(tar, "etc/a", "a\n", 2);
+	struct archive_entry *entry = archive_entry_new();
+	archive_entry_set_pathname(entry, "etc/b");
+	archive_entry_set_filetype(entry, AE_IFREG);
+	archive_entry_set_perm(entry, 0600);
+	archive_entry_set_uid(entry, 1000);
+	archive_entry_set_gid(entry, 100);
+	archive_entry_set_mtime(entry, 1700000000, 123456789);
+	archive_entry_xattr_add_entry(entry, "user.small", "1", 1);
+	// not interned, kept in tree memory
+	test_fill(data, 1000, 1);
+	archive_entry_xattr_add_entry(entry, "user.big", data, 1000);
+	archive_entry_set_size(entry, 3);
+	test_tar_write(tar, entry, "bb\n", 3);
+	archive_entry_free(entry);
+	test_tar_symlink(tar, "etc/l", "a");
+	test_tar_hardlink(tar, "etc/h", "etc/a");
+
+	test_tar_dir(tar, "dev");
+	entry = archive_entry_new();
+	archive_entry_set_pathname(entry, "dev/null");
+	archive_entry_set_filetype(entry, AE_IFCHR);
+	archive_entry_set_perm(entry, 0666);
+	archive_entry_set_rdev(entry, makedev(1, 3));
+	test_tar_write(tar, entry, NULL, 0);
+	archive_entry_free(entry);
+
+	test_tar_dir(tar, "usr");
+	test_tar_dir(tar, "usr/lib");
+	// out of order, for sorting to do something
+	for (int i = 39; i >= 0; i--) {
+		char path[32];
+		sprintf(path, "usr/lib/lib%02d.so", i);
+		test_fill(data, 100 * i, i);
+		test_tar_file(tar, path, data, 100 * i);
+	}
+	test_tar_dir(tar, "var");
+	test_tar_dir(tar, "var/empty");
+	test_tar_close(tar);
+}
+
+static void build_top_layer(struct test_buf *buf) {
+	struct archive *tar = test_tar_new(buf);
+	test_tar_file(tar, "usr/lib/.wh.lib07.so", NULL, 0);
+	test_tar_file(tar, "etc/c", "c\n", 2);
+	test_tar_hardlink(tar, "usr/lib/libc.so", "usr/lib/lib11.so");
+	test_tar_close(tar);
+}
+
+static struct cvirt_mtree_entry *tree_from_archive(int fd, uint32_t flags) {
+	struct cvirt_oci_r_layer *layer = cvirt_oci_r_layer_from_archive_blob(fd,
+		"sha256:base", CVIRT_OCI_R_LAYER_COMPRESSION_NONE);
+	CHECK(layer);
+	struct cvirt_mtree_entry *tree = cvirt_mtree_tree_from_oci_layer(layer,
+		flags);
+	CHECK(tree);
+	cvirt_oci_r_layer_destroy(layer);
+	layer = cvirt_oci_r_layer_from_archive_blob(fd, "sha256:top",
+		CVIRT_OCI_R_LAYER_COMPRESSION_NONE);
+	CHECK(layer);
+	CHECK(!cvirt_mtree_tree_oci_apply_layer(tree, layer, flags));
+	cvirt_oci_r_layer_destroy(layer);
+	cvirt_mtree_tree_sort(tree);
+	CHECK(tree->inode->children_len == 4);
+	CHECK(!strcmp(tree->inode->children[3].name, "var"));
+	return tree;
+}
+
+// inodes of a seen so far, with their counterpart in b, for hardlinks
+struct inode_pairs {
+	const struct cvirt_mtree_inode **a, **b;
+	size_t len;
+	size_t capacity;
+};
+
+static void check_inode_pair(struct inode_pairs *pairs,
+		const struct cvirt_mtree_inode *a, const struct cvirt_mtree_inode *b) {
+	for (size_t i = 0; i < pairs->len; i++) {
+		CHECK((pairs->a[i] == a) == (pairs->b[i] == b));
+	}
+	if (pairs->len == pairs->capacity) {
+		pairs->capacity = pairs->capacity ? pairs->capacity * 2 : 64;
+		pairs->a = realloc(pairs->a, pairs->capacity * sizeof(*pairs->a));
+		pairs->b = realloc(pairs->b, pairs->capacity * sizeof(*pairs->b));
+		CHECK(pairs->a && pairs->b);
+	}
+	pairs->a[pairs->len] = a;
+	pairs->b[pairs->len++] = b;
+}
+
+static bool timespec_equal(const struct timespec *a,
+		const struct timespec *b) {
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static void compare_entries(struct inode_pairs *pairs,
+		const struct cvirt_mtree_entry *a, const struct cvirt_mtree_entry *b) {
+	CHECK(!strcmp(a->name, b->name));
+	check_inode_pair(pairs, a->inode, b->inode);
+	const struct cvirt_mtree_stat *sa = &a->inode->stat, *sb = &b->inode->stat;
+	CHECK(sa->st_mode == sb->st_mode);
+	CHECK(sa->st_uid == sb->st_uid && sa->st_gid == sb->st_gid);
+	CHECK(sa->st_nlink == sb->st_nlink);
+	CHECK(sa->st_size == sb->st_size && sa->st_rdev == sb->st_rdev);
+	CHECK(timespec_equal(&sa->st_atim, &sb->st_atim));
+	CHECK(timespec_equal(&sa->st_mtim, &sb->st_mtim));
+	CHECK(timespec_equal(&sa->st_ctim, &sb->st_ctim));
+
+	CHECK(a->inode->xattrs_len == b->inode->xattrs_len);
+	for (unsigned int i = 0; i < a->inode->xattrs_len; i++) {
+		const struct cvirt_mtree_xattr *xa = &a->inode->xattrs[i],
+			*xb = &b->inode->xattrs[i];
+		CHECK(!strcmp(xa->name, xb->name));
+		CHECK(xa->len == xb->len && !memcmp(xa->value, xb->value, xa->len));
+	}
+
+	if (S_ISREG(sa->st_mode)) {
+		CHECK(!memcmp(a->inode->sha256sum, b->inode->sha256sum, 32));
+	} else if (S_ISLNK(sa->st_mode)) {
+		CHECK(!strcmp(a->inode->target, b->inode->target));
+	} else if (S_ISDIR(sa->st_mode)) {
+		CHECK(a->inode->children_len == b->inode->children_len);
+		for (unsigned int i = 0; i < a->inode->children_len; i++) {
+			compare_entries(pairs, &a->inode->children[i],
+				&b->inode->children[i]);
+		}
+	}
+}
+
+static void compare_trees(struct cvirt_mtree_entry *a,
+		struct cvirt_mtree_entry *b) {
+	struct inode_pairs pairs = {0};
+	compare_entries(&pairs, a, b);
+	free(pairs.a);
+	free(pairs.b);
+}
+
+static void read_file(const char *path, struct test_buf *buf) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	CHECK(fd >= 0);
+	buf->len = 0;
+	uint8_t chunk[65536];
+	ssize_t len;
+	while ((len = read(fd, chunk, sizeof(chunk))) > 0) {
+		test_buf_append(buf, chunk, len);
+	}
+	CHECK(!len);
+	close(fd);
+}
+
+static char *save(struct cvirt_mtree_entry *tree) {
+	char *path;
+	int fd = test_tmpfile(&path);
+	CHECK(!cvirt_mtree_tree_save(tree, fd));
+	close(fd);
+	return path;
+}
+
+static void check_round_trip(struct cvirt_mtree_entry *tree,
+		struct cvirt_oci_r_config *config) {
+	char *path = save(tree);
+	struct cvirt_mtree_entry *loaded = cvirt_mtree_tree_load_mmap(path);
+	CHECK(loaded);
+	CHECK(cvirt_mtree_tree_get_flags(loaded) ==
+		(cvirt_mtree_tree_get_flags(tree) | CVIRT_MTREE_TREE_ARENA));
+	CHECK(cvirt_mtree_tree_is_sorted(loaded));
+	CHECK(cvirt_mtree_tree_is_oci_source(loaded, MANIFEST_DIGEST, config));
+	CHECK(!cvirt_mtree_tree_is_oci_source(loaded, "sha256:other", config));
+	compare_trees(tree, loaded);
+
+	// and the loaded tree saves to the same bytes
+	if (cvirt_mtree_tree_get_flags(tree) & CVIRT_MTREE_TREE_ARENA) {
+		char *again = save(loaded);
+		struct test_buf a = {0}, b = {0};
+		read_file(path, &a);
+		read_file(again, &b);
+		CHECK(a.len == b.len && !memcmp(a.data, b.data, a.len));
+		free(a.data);
+		free(b.data);
+		unlink(again);
+		free(again);
+	}
+	cvirt_mtree_tree_destroy(loaded);
+	unlink(path);
+	free(path);
+}
+
+// touch everything a loaded tree points to
+static void walk(const struct cvirt_mtree_entry *entry, size_t *sum) {
+	*sum += strlen(entry->name);
+	const struct cvirt_mtree_inode *inode = entry->inode;
+	for (unsigned int i = 0; i < inode->xattrs_len; i++) {
+		*sum += strlen(inode->xattrs[i].name);
+		for (size_t j = 0; j < inode->xattrs[i].len; j++) {
+			*sum += inode->xattrs[i].value[j];
+		}
+	}
+	if (S_ISLNK(inode->stat.st_mode)) {
+		*sum += strlen(inode->target);
+	} else if (S_ISDIR(inode->stat.st_mode)) {
+		for (unsigned int i = 0; i < inode->children_len; i++) {
+			walk(&inode->children[i], sum);
+		}
+	}
+}
+
+static bool loads(const char *path, const uint8_t *data, size_t len) {
+	int fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+	CHECK(fd >= 0);
+	CHECK(write(fd, data, len) == (ssize_t)len);
+	close(fd);
+	struct cvirt_mtree_entry *tree = cvirt_mtree_tree_load_mmap(path);
+	if (!tree) {
+		return false;
+	}
+	size_t sum = 0;
+	walk(tree, &sum);
+	cvirt_mtree_tree_destroy(tree);
+	return true;
+}
+
+static int64_t find_inode(const struct test_buf *snapshot, mode_t type) {
+	const struct mtree_snapshot_header *header = (void *)snapshot->data;
+	const struct mtree_snapshot_inode *inodes =
+		(void *)&snapshot->data[header->inodes_offset];
+	for (uint64_t i = 0; i < header->inodes_count; i++) {
+		if ((inodes[i].mode & S_IFMT) == type) {
+			return i;
+		}
+	}
+	CHECK(!"no such inode");
+	return -1;
+}
+
+enum corruption {
+	BAD_MAGIC,
+	BAD_VERSION,
+	BAD_BYTE_ORDER,
+	HUGE_INODES_COUNT,
+	MISALIGNED_ENTRIES,
+	UNTERMINATED_STRINGS,
+	NAME_OUT_OF_STRINGS,
+	INODE_OUT_OF_TABLE,
+	ROOT_CHILDREN_START,
+	CHILDREN_OUT_OF_TABLE,
+	CHILDREN_BEFORE_PARENT,
+	TARGET_OUT_OF_STRINGS,
+	XATTR_OUT_OF_STRINGS,
+	SOURCE_OUT_OF_STRINGS,
+	CORRUPTIONS,
+};
+
+static void corrupt(struct test_buf *snapshot, enum corruption corruption) {
+	struct mtree_snapshot_header *header = (void *)snapshot->data;
+	struct mtree_snapshot_inode *inodes =
+		(void *)&snapshot->data[header->inodes_offset];
+	struct mtree_snapshot_xattr *xattrs =
+		(void *)&snapshot->data[header->xattrs_offset];
+	struct mtree_snapshot_entry *entries =
+		(void *)&snapshot->data[header->entries_offset];
+	switch (corruption) {
+	case BAD_MAGIC:
+		header->magic[0] ^= 1;
+		break;
+	case BAD_VERSION:
+		header->version++;
+		break;
+	case BAD_BYTE_ORDER:
+		header->byte_order = 0x04030201;
+		break;
+	case HUGE_INODES_COUNT:
+		header->inodes_count = UINT64_MAX / 2;
+		break;
+	case MISALIGNED_ENTRIES:
+		header->entries_offset += 4;
+		break;
+	case UNTERMINATED_STRINGS:
+		snapshot->data[header->strings_offset + header->strings_size - 1] = 'x';
+		break;
+	case NAME_OUT_OF_STRINGS:
+		entries[1].name_offset = header->strings_size;
+		break;
+	case INODE_OUT_OF_TABLE:
+		entries[1].inode = header->inodes_count;
+		break;
+	case ROOT_CHILDREN_START:
+		inodes[entries[0].inode].children_start = 0;
+		break;
+	case CHILDREN_OUT_OF_TABLE:
+		inodes[entries[0].inode].children_len = header->entries_count;
+		break;
+	case CHILDREN_BEFORE_PARENT:
+		// a directory listing itself, or what comes before it
+		entries[1].inode = entries[0].inode;
+		break;
+	case TARGET_OUT_OF_STRINGS:
+		inodes[find_inode(snapshot, S_IFLNK)].target_offset =
+			header->strings_size;
+		break;
+	case XATTR_OUT_OF_STRINGS:
+		CHECK(header->xattrs_count);
+		xattrs[0].value_offset = header->strings_size - 1;
+		xattrs[0].len = 2;
+		break;
+	case SOURCE_OUT_OF_STRINGS:
+		CHECK(header->source_offset != MTREE_SNAPSHOT_NO_SOURCE);
+		header->source_offset = header->strings_size;
+		break;
+	case CORRUPTIONS:
+		break;
+	}
+}
+
+static void check_rejects(struct cvirt_mtree_entry *tree) {
+	char *path = save(tree);
+	struct test_buf snapshot = {0}, copy = {0};
+	read_file(path, &snapshot);
+	CHECK(loads(path, snapshot.data, snapshot.len));
+
+	test_quiet(true);
+	for (size_t len = 0; len < snapshot.len; len++) {
+		CHECK(!loads(path, snapshot.data, len));
+	}
+	for (int i = 0; i < CORRUPTIONS; i++) {
+		copy.len = 0;
+		test_buf_append(&copy, snapshot.data, snapshot.len);
+		corrupt(&copy, i);
+		CHECK(!loads(path, copy.data, copy.len));
+	}
+	// anything else either loads or not, but stays within the mapping
+	srand(1);
+	for (int i = 0; i < 2000; i++) {
+		copy.len = 0;
+		test_buf_append(&copy, snapshot.data, snapshot.len);
+		for (int j = 1 + rand() % 4; j; j--) {
+			copy.data[rand() % copy.len] ^= 1 << (rand() % 8);
+		}
+		loads(path, copy.data, copy.len);
+	}
+	test_quiet(false);
+
+	free(snapshot.data);
+	free(copy.data);
+	unlink(path);
+	free(path);
+}
+
+int main(void) {
+	const char *names[] = {"base", "top", "config"};
+	struct test_buf blobs[3] = {0};
+	build_base_layer(&blobs[0]);
+	build_top_layer(&blobs[1]);
+	const char *config_json = "{\"rootfs\":{\"type\":\"layers\","
+		"\"diff_ids\":[\"sha256:base\",\"sha256:top\"]}}";
+	test_buf_append(&blobs[2], config_json, strlen(config_json));
+	int fd = test_oci_archive(names, blobs, 3);
+	struct cvirt_oci_r_config *config =
+		cvirt_oci_r_config_from_archive_blob(fd, "sha256:config");
+	CHECK(config);
+
+	uint32_t flags[] = {
+		CVIRT_MTREE_TREE_CHECKSUM,
+		CVIRT_MTREE_TREE_CHECKSUM | CVIRT_MTREE_TREE_ARENA,
+	};
+	for (int i = 0; i < 2; i++) {
+		struct cvirt_mtree_entry *tree = tree_from_archive(fd, flags[i]);
+		cvirt_mtree_tree_set_oci_source(tree, MANIFEST_DIGEST, config);
+		check_round_trip(tree, config);
+		if (flags[i] & CVIRT_MTREE_TREE_ARENA) {
+			check_rejects(tree);
+		}
+		cvirt_mtree_tree_destroy(tree);
+	}
+
+	cvirt_oci_r_config_destroy(config);
+	cvirt_oci_r_archive_close(fd);
+	for (int i = 0; i < 3; i++) {
+		free(blobs[i].data);
+	}
+	return 0;
+}
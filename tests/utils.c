@@ -0,0 +1,193 @@
+#include "utils.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#define TMPFILE_TEMPLATE	"/cvirt-test-XXXXXX"
+
+static int saved_stderr = -1;
+
+void test_fail(const char *file, int line, const char *cond) {
+	test_quiet(false);
+	fprintf(stderr, "%s:%d: check failed: %s\n", file, line, cond);
+	exit(EXIT_FAILURE);
+}
+
+void test_quiet(bool quiet) {
+	if (quiet && saved_stderr < 0) {
+		fflush(stderr);
+		saved_stderr = dup(STDERR_FILENO);
+		int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		CHECK(saved_stderr >= 0 && fd >= 0);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	} else if (!quiet && saved_stderr >= 0) {
+		fflush(stderr);
+		dup2(saved_stderr, STDERR_FILENO);
+		close(saved_stderr);
+		saved_stderr = -1;
+	}
+}
+
+void test_buf_append(struct test_buf *buf, const void *data, size_t len) {
+	if (!len) {
+		return;
+	}
+	if (buf->len + len > buf->capacity) {
+		size_t capacity = buf->capacity ? buf->capacity : 4096;
+		while (buf->len + len > capacity) {
+			capacity *= 2;
+		}
+		buf->data = realloc(buf->data, capacity);
+		CHECK(buf->data);
+		buf->capacity = capacity;
+	}
+	memcpy(&buf->data[buf->len], data, len);
+	buf->len += len;
+}
+
+void test_fill(uint8_t *dst, size_t len, uint32_t seed) {
+	static const char alphabet[] = "abcdefghijklmnop \n";
+	uint32_t x = seed * 2654435761u + 1;
+	for (size_t i = 0; i < len; i++) {
+		// xorshift32
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		dst[i] = alphabet[x % (sizeof(alphabet) - 1)];
+	}
+}
+
+// TMPFILE_TEMPLATE in TMPDIR
+static char *tmp_template(void) {
+	const char *tmpdir = getenv("TMPDIR");
+	if (!tmpdir) {
+		tmpdir = "/tmp";
+	}
+	char *path = malloc(strlen(tmpdir) + strlen(TMPFILE_TEMPLATE) + 1);
+	CHECK(path);
+	strcpy(path, tmpdir);
+	strcat(path, TMPFILE_TEMPLATE);
+	return path;
+}
+
+int test_tmpfile(char **path) {
+	*path = tmp_template();
+	int fd = mkstemp(*path);
+	CHECK(fd >= 0);
+	return fd;
+}
+
+char *test_tmpdir(void) {
+	char *path = tmp_template();
+	CHECK(mkdtemp(path));
+	return path;
+}
+
+static la_ssize_t tar_write_cb(struct archive *archive, void *client_data,
+		const void *buf, size_t len) {
+	test_buf_append(client_data, buf, len);
+	return len;
+}
+
+struct archive *test_tar_new(struct test_buf *buf) {
+	struct archive *tar = archive_write_new();
+	CHECK(tar);
+	CHECK(archive_write_set_format_pax_restricted(tar) == ARCHIVE_OK);
+	CHECK(archive_write_set_format_option(tar, "pax", "xattrheader",
+		"LIBARCHIVE") == ARCHIVE_OK);
+	archive_write_set_bytes_in_last_block(tar, 1);
+	CHECK(archive_write_open(tar, buf, NULL, tar_write_cb, NULL) ==
+		ARCHIVE_OK);
+	return tar;
+}
+
+void test_tar_write(struct archive *tar, struct archive_entry *entry,
+		const void *data, size_t len) {
+	if (!archive_entry_mtime_is_set(entry)) {
+		archive_entry_set_mtime(entry, 1700000000, 0);
+	}
+	CHECK(archive_write_header(tar, entry) == ARCHIVE_OK);
+	if (len) {
+		CHECK(archive_write_data(tar, data, len) == (la_ssize_t)len);
+	}
+}
+
+static struct archive_entry *tar_entry(const char *path, mode_t type,
+		mode_t perm) {
+	struct archive_entry *entry = archive_entry_new();
+	CHECK(entry);
+	archive_entry_set_pathname(entry, path);
+	archive_entry_set_filetype(entry, type);
+	archive_entry_set_perm(entry, perm);
+	return entry;
+}
+
+void test_tar_dir(struct archive *tar, const char *path) {
+	struct archive_entry *entry = tar_entry(path, AE_IFDIR, 0755);
+	test_tar_write(tar, entry, NULL, 0);
+	archive_entry_free(entry);
+}
+
+void test_tar_file(struct archive *tar, const char *path, const void *data,
+		size_t len) {
+	struct archive_entry *entry = tar_entry(path, AE_IFREG, 0644);
+	archive_entry_set_size(entry, len);
+	test_tar_write(tar, entry, data, len);
+	archive_entry_free(entry);
+}
+
+void test_tar_symlink(struct archive *tar, const char *path,
+		const char *target) {
+	struct archive_entry *entry = tar_entry(path, AE_IFLNK, 0777);
+	archive_entry_set_symlink(entry, target);
+	test_tar_write(tar, entry, NULL, 0);
+	archive_entry_free(entry);
+}
+
+void test_tar_hardlink(struct archive *tar, const char *path,
+		const char *target) {
+	struct archive_entry *entry = tar_entry(path, AE_IFREG, 0644);
+	archive_entry_set_hardlink(entry, target);
+	test_tar_write(tar, entry, NULL, 0);
+	archive_entry_free(entry);
+}
+
+void test_tar_close(struct archive *tar) {
+	CHECK(archive_write_close(tar) == ARCHIVE_OK);
+	archive_write_free(tar);
+}
+
+int test_oci_archive(const char **names, const struct test_buf *blobs,
+		int len) {
+	char *path;
+	int fd = test_tmpfile(&path);
+	struct archive *archive = archive_write_new();
+	CHECK(archive);
+	CHECK(archive_write_set_format_pax_restricted(archive) == ARCHIVE_OK);
+	CHECK(archive_write_open_fd(archive, fd) == ARCHIVE_OK);
+	for (int i = 0; i < len; i++) {
+		char name[strlen("blobs/sha256/") + strlen(names[i]) + 1];
+		strcpy(name, "blobs/sha256/");
+		strcat(name, names[i]);
+		struct archive_entry *entry = tar_entry(name, AE_IFREG, 0644);
+		archive_entry_set_size(entry, blobs[i].len);
+		test_tar_write(archive, entry, blobs[i].data, blobs[i].len);
+		archive_entry_free(entry);
+	}
+	CHECK(archive_write_close(archive) == ARCHIVE_OK);
+	archive_write_free(archive);
+	close(fd);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	CHECK(fd >= 0);
+	unlink(path);
+	free(path);
+	return fd;
+}
@@ -0,0 +1,65 @@
+#ifndef TESTS_UTILS_H
+#define TESTS_UTILS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct archive;
+struct archive_entry;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		test_fail(__FILE__, __LINE__, #cond); \
+	} \
+} while (0)
+
+void test_fail(const char *file, int line, const char *cond);
+
+// stderr of the code under test to /dev/null, for expected failures
+void test_quiet(bool quiet);
+
+struct test_buf {
+	uint8_t *data;
+	size_t len;
+	size_t capacity;
+};
+
+void test_buf_append(struct test_buf *buf, const void *data, size_t len);
+
+// deterministic bytes for seed, compressible but not trivially
+void test_fill(uint8_t *dst, size_t len, uint32_t seed);
+
+// empty file in TMPDIR, path is to be unlinked and freed by the caller
+int test_tmpfile(char **path);
+
+// empty directory in TMPDIR, to be removed and freed by the caller
+char *test_tmpdir(void);
+
+// pax tar into buf, entries are written in the order added
+struct archive *test_tar_new(struct test_buf *buf);
+
+void test_tar_write(struct archive *tar, struct archive_entry *entry,
+	const void *data, size_t len);
+
+void test_tar_dir(struct archive *tar, const char *path);
+
+void test_tar_file(struct archive *tar, const char *path, const void *data,
+	size_t len);
+
+void test_tar_symlink(struct archive *tar, const char *path,
+	const char *target);
+
+void test_tar_hardlink(struct archive *tar, const char *path,
+	const char *target);
+
+void test_tar_close(struct archive *tar);
+
+/*
+ * oci-archive with blobs as blobs/sha256/<names[i]>, so readable with
+ * digests sha256:<names[i]>. Returns a read-only fd of it, already unlinked.
+ */
+int test_oci_archive(const char **names, const struct test_buf *blobs,
+	int len);
+
+#endif
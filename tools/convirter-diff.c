@@ -21,19 +21,26 @@ static const char usage[] = "\
 Usage: %s [OPTION]... INPUT1 INPUT2\n\
 Compare file tree\n\
 \n\
+      --bulk-scan      List disk-image at once and stat in large batches\n\
       --ignore-c2v     Ignore special path generated by c2v\n\
+  -j, --jobs=N         Walk disk-images with N appliances in parallel\n\
       --skip-checksum  Do not compare checksum on regular files\n\
 \n\
-INPUTs are in FORMAT:FILE, where FORMAT is either disk-image or oci-archive\n";
+INPUTs are in FORMAT:FILE, where FORMAT is either disk-image, oci-archive or\n\
+snapshot\n";
 
 static const struct option long_options[] = {
 	{"ignore-c2v",		no_argument,	NULL,	1},
 	{"skip-checksum",	no_argument,	NULL,	2},
+	{"jobs",		required_argument,	NULL,	'j'},
+	{"bulk-scan",		no_argument,	NULL,	3},
 	{0},
 };
 
 static bool ignore_c2v = false;
 static bool skip_checksum = false;
+static int jobs = 1;
+static bool bulk_scan = false;
 
 static const char *mode_type_string(mode_t mode) {
 	switch (mode & S_IFMT) {
@@ -55,7 +62,8 @@ static const char *mode_type_string(mode_t mode) {
 	return "unknown";
 }
 
-static bool compare_stat(struct stat *a, struct stat *b, const char *path) {
+static bool compare_stat(struct cvirt_mtree_stat *a, struct cvirt_mtree_stat *b,
+		const char *path) {
 	if ((a->st_mode & S_IFMT) != (b->st_mode & S_IFMT)) {
 		printf("File a/%s is a %s while file b/%s is a %s\n", path,
 			mode_type_string(a->st_mode), path, mode_type_string(b->st_mode));
@@ -213,16 +221,14 @@ static bool diff_tree(const struct cvirt_mtree_entry *a, const struct cvirt_mtre
 static struct cvirt_mtree_entry *get_tree_from_arg(const char *arg, uint32_t flags) {
 	struct cvirt_mtree_entry *tree;
 	if (!strncmp(arg, "disk-image:", 11)) {
-		guestfs_h *guestfs = create_guestfs_mount_first_linux(&arg[11], NULL);
+		guestfs_h **guestfs = create_guestfs_pool_mount_first_linux(&arg[11], jobs);
 		if (!guestfs) {
 			exit(2);
 		}
 
-		tree = cvirt_mtree_tree_from_guestfs(guestfs, flags);
+		tree = cvirt_mtree_tree_from_guestfs_pool(guestfs, jobs, flags);
 
-		guestfs_umount_all(guestfs);
-		guestfs_shutdown(guestfs);
-		guestfs_close(guestfs);
+		destroy_guestfs_pool(guestfs, jobs);
 	} else if (!strncmp(arg, "oci-archive:", 12)) {
 		int fd = open(&arg[12], O_RDONLY | O_CLOEXEC);
 		if (fd < 0) {
@@ -249,7 +255,17 @@ static struct cvirt_mtree_entry *get_tree_from_arg(const char *arg, uint32_t fla
 		}
 		cvirt_oci_r_manifest_destroy(manifest);
 		cvirt_oci_r_index_destroy(index);
-		close(fd);
+		cvirt_oci_r_archive_close(fd);
+	} else if (!strncmp(arg, "snapshot:", 9)) {
+		tree = cvirt_mtree_tree_load_mmap(&arg[9]);
+		if (!tree) {
+			exit(2);
+		}
+		if ((flags & CVIRT_MTREE_TREE_CHECKSUM) &&
+				!(cvirt_mtree_tree_get_flags(tree) & CVIRT_MTREE_TREE_CHECKSUM)) {
+			fprintf(stderr, "Snapshot has no checksum, try --skip-checksum\n");
+			exit(2);
+		}
 	} else {
 		fprintf(stderr, "Unrecognized input: %s\n", arg);
 		exit(2);
@@ -259,7 +275,7 @@ static struct cvirt_mtree_entry *get_tree_from_arg(const char *arg, uint32_t fla
 
 int main(int argc, char *argv[]) {
 	int opt;
-	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
 		switch (opt) {
 		case '?':
 			fprintf(stderr, usage, argv[0]);
@@ -270,6 +286,16 @@ int main(int argc, char *argv[]) {
 		case 2:
 			skip_checksum = true;
 			break;
+		case 3:
+			bulk_scan = true;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				fprintf(stderr, usage, argv[0]);
+				exit(2);
+			}
+			break;
 		}
 	}
 
@@ -278,7 +304,10 @@ int main(int argc, char *argv[]) {
 		exit(2);
 	}
 
-	uint32_t flags = skip_checksum ? 0 : CVIRT_MTREE_TREE_CHECKSUM;
+	uint32_t flags = CVIRT_MTREE_TREE_ARENA |
+		CVIRT_MTREE_TREE_GUESTFS_CHECKSUM_IN_APPLIANCE |
+		(skip_checksum ? 0 : CVIRT_MTREE_TREE_CHECKSUM) |
+		(bulk_scan ? CVIRT_MTREE_TREE_GUESTFS_BULK_SCAN : 0);
 	struct cvirt_mtree_entry *a = get_tree_from_arg(argv[optind], flags);
 	struct cvirt_mtree_entry *b = get_tree_from_arg(argv[optind + 1], flags);
 	bool differs = diff_tree(a, b, "");
@@ -1,4 +1,5 @@
 #include <convirter/mtree/entry.h>
+#include <convirter/oci-r/config.h>
 #include <convirter/oci-r/index.h>
 #include <convirter/oci-r/layer.h>
 #include <convirter/oci-r/manifest.h>
@@ -20,19 +21,29 @@ static const char usage[] = "\
 Usage: %s [OPTION]... INPUT\n\
 Print file tree from INPUT\n\
 \n\
+      --bulk-scan      List disk-image at once and stat in large batches\n\
       --ignore-c2v     Ignore special path generated by c2v\n\
+  -j, --jobs=N         Walk disk-image with N appliances in parallel\n\
       --skip-checksum  Do not print checksum on regular files\n\
+      --save-snapshot=FILE  Also save the file tree as mtree snapshot FILE\n\
 \n\
-INPUT is in FORMAT:FILE, where FORMAT is either disk-image or oci-archive\n";
+INPUT is in FORMAT:FILE, where FORMAT is either disk-image, oci-archive or\n\
+snapshot\n";
 
 static const struct option long_options[] = {
 	{"ignore-c2v",		no_argument,	NULL,	1},
 	{"skip-checksum",	no_argument,	NULL,	2},
+	{"save-snapshot",	required_argument,	NULL,	3},
+	{"jobs",		required_argument,	NULL,	'j'},
+	{"bulk-scan",		no_argument,	NULL,	4},
 	{0},
 };
 
 static bool ignore_c2v = false;
 static bool skip_checksum = false;
+static const char *save_snapshot = NULL;
+static int jobs = 1;
+static bool bulk_scan = false;
 static time_t print_time;
 
 static void print_mode(mode_t mode) {
@@ -75,7 +86,7 @@ static void print_mode(mode_t mode) {
 	fputs(str, stdout);
 }
 
-static void print_stat(const struct stat *st) {
+static void print_stat(const struct cvirt_mtree_stat *st) {
 	print_mode(st->st_mode);
 	printf(" %d %d ", st->st_uid, st->st_gid);
 	if (S_ISBLK(st->st_mode) || S_ISCHR(st->st_mode)) {
@@ -122,7 +133,7 @@ int main(int argc, char *argv[]) {
 	struct cvirt_mtree_entry *tree;
 
 	int opt;
-	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
 		switch (opt) {
 		case '?':
 			fprintf(stderr, usage, argv[0]);
@@ -133,6 +144,19 @@ int main(int argc, char *argv[]) {
 		case 2:
 			skip_checksum = true;
 			break;
+		case 3:
+			save_snapshot = optarg;
+			break;
+		case 4:
+			bulk_scan = true;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				fprintf(stderr, usage, argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		}
 	}
 
@@ -141,18 +165,20 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
-	uint32_t flags = skip_checksum ? 0 : CVIRT_MTREE_TREE_CHECKSUM;
+	uint32_t flags = CVIRT_MTREE_TREE_ARENA |
+		CVIRT_MTREE_TREE_GUESTFS_CHECKSUM_IN_APPLIANCE |
+		(skip_checksum ? 0 : CVIRT_MTREE_TREE_CHECKSUM) |
+		(bulk_scan ? CVIRT_MTREE_TREE_GUESTFS_BULK_SCAN : 0);
 	if (!strncmp(argv[optind], "disk-image:", 11)) {
-		guestfs_h *guestfs = create_guestfs_mount_first_linux(&argv[optind][11], NULL);
+		guestfs_h **guestfs = create_guestfs_pool_mount_first_linux(
+			&argv[optind][11], jobs);
 		if (!guestfs) {
 			exit(EXIT_FAILURE);
 		}
 
-		tree = cvirt_mtree_tree_from_guestfs(guestfs, flags);
+		tree = cvirt_mtree_tree_from_guestfs_pool(guestfs, jobs, flags);
 
-		guestfs_umount_all(guestfs);
-		guestfs_shutdown(guestfs);
-		guestfs_close(guestfs);
+		destroy_guestfs_pool(guestfs, jobs);
 	} else if (!strncmp(argv[optind], "oci-archive:", 12)) {
 		int fd = open(&argv[optind][12], O_RDONLY | O_CLOEXEC);
 		if (fd < 0) {
@@ -177,15 +203,45 @@ int main(int argc, char *argv[]) {
 			cvirt_mtree_tree_oci_apply_layer(tree, layer, flags);
 			cvirt_oci_r_layer_destroy(layer);
 		}
+		struct cvirt_oci_r_config *config = cvirt_oci_r_config_from_archive_blob(
+			fd, cvirt_oci_r_manifest_get_config_digest(manifest));
+		if (config) {
+			cvirt_mtree_tree_set_oci_source(tree, manifest_digest, config);
+			cvirt_oci_r_config_destroy(config);
+		}
 		cvirt_oci_r_manifest_destroy(manifest);
 		cvirt_oci_r_index_destroy(index);
-		close(fd);
+		cvirt_oci_r_archive_close(fd);
+	} else if (!strncmp(argv[optind], "snapshot:", 9)) {
+		tree = cvirt_mtree_tree_load_mmap(&argv[optind][9]);
+		if (!tree) {
+			exit(EXIT_FAILURE);
+		}
+		if (!skip_checksum && !(cvirt_mtree_tree_get_flags(tree) &
+				CVIRT_MTREE_TREE_CHECKSUM)) {
+			fprintf(stderr, "Snapshot has no checksum, try --skip-checksum\n");
+			exit(EXIT_FAILURE);
+		}
 	} else {
 		fprintf(stderr, "Unrecognized input: %s\n", argv[optind]);
 		fprintf(stderr, usage, argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
+	if (save_snapshot) {
+		int fd = open(save_snapshot, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "Failed to create snapshot: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		int res = cvirt_mtree_tree_save(tree, fd);
+		close(fd);
+		if (res < 0) {
+			fprintf(stderr, "Failed to write snapshot: %s\n", strerror(-res));
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	print_time = time(NULL);
 	print_tree(tree, 0);
 	cvirt_mtree_tree_destroy(tree);
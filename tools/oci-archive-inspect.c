@@ -4,15 +4,22 @@
 #include <convirter/oci-r/index.h>
 #include <convirter/oci-r/layer.h>
 #include <convirter/oci-r/manifest.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 
 int main(int argc, char *argv[]) {
-	if (argc != 2) {
+	// with PATH, only entries at and below it, through an index kept next
+	// to the archive
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: %s ARCHIVE [PATH]\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
+	char index_dir[strlen(argv[1]) + 14];
+	sprintf(index_dir, "%s.cvirt-index", argv[1]);
 	int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
 	assert(fd != -1);
 	struct cvirt_oci_r_index *index = cvirt_oci_r_index_from_archive(fd);
@@ -31,6 +38,21 @@ int main(int argc, char *argv[]) {
 		struct cvirt_oci_r_layer *layer =
 			cvirt_oci_r_layer_from_archive_blob(fd, layer_digest,
 			cvirt_oci_r_manifest_get_layer_compression(manifest, i));
+		if (argc == 3) {
+			int res = cvirt_oci_r_layer_use_index(layer, index_dir);
+			if (res < 0) {
+				fprintf(stderr, "Failed to index layer: %s\n", strerror(-res));
+				exit(EXIT_FAILURE);
+			}
+			res = cvirt_oci_r_layer_open_path(layer, argv[2]);
+			if (res == -ENOENT) {
+				cvirt_oci_r_layer_destroy(layer);
+				continue;
+			} else if (res < 0) {
+				fprintf(stderr, "Failed to open %s: %s\n", argv[2], strerror(-res));
+				exit(EXIT_FAILURE);
+			}
+		}
 		struct archive *archive = cvirt_oci_r_layer_get_libarchive(layer);
 		struct archive_entry *entry;
 		while (archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
@@ -40,6 +62,6 @@ int main(int argc, char *argv[]) {
 	}
 	cvirt_oci_r_manifest_destroy(manifest);
 	cvirt_oci_r_index_destroy(index);
-	close(fd);
+	cvirt_oci_r_archive_close(fd);
 	return 0;
 }